@@ -140,6 +140,26 @@ static int dump__cfg_chunk_process(FILE *db_fd, uint32_t length)
 }
 
 
+static int dump__journal_chunk_process(FILE *db_fd, uint32_t length)
+{
+	struct PF_journal chunk;
+
+	memset(&chunk, 0, sizeof(struct PF_journal));
+
+	if(persist__chunk_journal_read_v6(db_fd, &chunk)){
+		fprintf(stderr, "Error: Corrupt persistent database.");
+		fclose(db_fd);
+		return 1;
+	}
+
+	if(do_print) printf("DB_CHUNK_JOURNAL:\n");
+	if(do_print) printf("\tLength: %d\n", length);
+	if(do_print) printf("\tGeneration: %" PRIu64 "\n", chunk.generation);
+
+	return 0;
+}
+
+
 static int dump__client_chunk_process(FILE *db_fd, uint32_t length)
 {
 	struct P_client chunk;
@@ -460,6 +480,10 @@ int main(int argc, char *argv[])
 					if(dump__client_chunk_process(fd, length)) return 1;
 					break;
 
+				case DB_CHUNK_JOURNAL:
+					if(dump__journal_chunk_process(fd, length)) return 1;
+					break;
+
 				default:
 					fprintf(stderr, "Warning: Unsupported chunk \"%d\" in persistent database file. Ignoring.\n", chunk);
 					if(fseek(fd, length, SEEK_CUR) < 0){
@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "memory_mosq.h"
 #include "misc_mosq.h"
 #include "mosquitto_broker_internal.h"
 #include "mosquitto_internal.h"
@@ -32,11 +33,26 @@ int db__message_store(const struct mosquitto *source, struct mosquitto_msg_store
 	return 0;
 }
 
+struct mosquitto_msg_store *db__msg_store_alloc(void)
+{
+	return mosquitto__calloc(1, sizeof(struct mosquitto_msg_store));
+}
+
+struct mosquitto_client_msg *db__client_msg_alloc(void)
+{
+	return mosquitto__calloc(1, sizeof(struct mosquitto_client_msg));
+}
+
 void db__msg_store_ref_inc(struct mosquitto_msg_store *store)
 {
 	UNUSED(store);
 }
 
+void db__msg_store_ref_dec(struct mosquitto_msg_store **store)
+{
+	UNUSED(store);
+}
+
 int handle__packet(struct mosquitto *context)
 {
 	UNUSED(context);
@@ -93,6 +109,14 @@ ssize_t net__write(struct mosquitto *mosq, const void *buf, size_t count)
 	return 0;
 }
 
+ssize_t net__writev(struct mosquitto *mosq, const struct iovec *iov, int iovcnt)
+{
+	UNUSED(mosq);
+	UNUSED(iov);
+	UNUSED(iovcnt);
+	return 0;
+}
+
 int retain__store(const char *topic, struct mosquitto_msg_store *stored, char **split_topics)
 {
 	UNUSED(topic);
@@ -139,9 +163,83 @@ void db__msg_add_to_queued_stats(struct mosquitto_msg_data *msg_data, struct mos
 	UNUSED(msg);
 }
 
+void db__message_expiry_add(struct mosquitto *context, time_t expiry)
+{
+	UNUSED(context);
+	UNUSED(expiry);
+}
+
 int session_expiry__add_from_persistence(struct mosquitto *context, time_t expiry_time)
 {
 	UNUSED(context);
 	UNUSED(expiry_time);
 	return 0;
 }
+
+void session_expiry__remove(struct mosquitto *context)
+{
+	UNUSED(context);
+}
+
+int sub__remove(struct mosquitto *context, const char *sub, uint8_t *reason)
+{
+	UNUSED(context);
+	UNUSED(sub);
+	UNUSED(reason);
+	return 0;
+}
+
+int sub__clean_session(struct mosquitto *context)
+{
+	UNUSED(context);
+	return 0;
+}
+
+int db__messages_delete(struct mosquitto *context, bool force_free)
+{
+	UNUSED(context);
+	UNUSED(force_free);
+	return 0;
+}
+
+void context__add_to_disused(struct mosquitto *context)
+{
+	UNUSED(context);
+}
+
+void db__msg_store_compact(void)
+{
+}
+
+int db__message_update_persisted(struct mosquitto *context, enum mosquitto_msg_direction dir, uint16_t mid, dbid_t store_id, enum mosquitto_msg_state state, uint8_t dup)
+{
+	UNUSED(context);
+	UNUSED(dir);
+	UNUSED(mid);
+	UNUSED(store_id);
+	UNUSED(state);
+	UNUSED(dup);
+	return 0;
+}
+
+int db__message_remove_persisted(struct mosquitto *context, enum mosquitto_msg_direction dir, uint16_t mid, dbid_t store_id)
+{
+	UNUSED(context);
+	UNUSED(dir);
+	UNUSED(mid);
+	UNUSED(store_id);
+	return 0;
+}
+
+int persist__journal_open(uint64_t generation, bool append)
+{
+	UNUSED(generation);
+	UNUSED(append);
+	return 0;
+}
+
+int persist__backup(bool shutdown)
+{
+	UNUSED(shutdown);
+	return 0;
+}
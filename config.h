@@ -60,6 +60,10 @@
 #  if defined(WITH_TLS_PSK) && !defined(OPENSSL_NO_PSK)
 #    define FINAL_WITH_TLS_PSK
 #  endif
+#  include <openssl/opensslv.h>
+#  if defined(__linux__) && !defined(OPENSSL_NO_KTLS) && OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined(LIBRESSL_VERSION_NUMBER)
+#    define FINAL_WITH_TLS_KTLS
+#  endif
 #endif
 
 
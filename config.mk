@@ -98,6 +98,11 @@ WITH_SHARED_LIBRARIES:=yes
 # Build with epoll support.
 WITH_EPOLL:=yes
 
+# Build with io_uring support. The broker uses io_uring for socket events and
+# reads if the running kernel supports it, and falls back to epoll or poll
+# otherwise. Linux only, requires kernel headers from 5.19 or later.
+WITH_IO_URING:=no
+
 # Build with bundled uthash.h
 WITH_BUNDLED_DEPS:=yes
 
@@ -361,6 +366,13 @@ endif
 ifeq ($(WITH_EPOLL),yes)
 	ifeq ($(UNAME),Linux)
 		BROKER_CPPFLAGS:=$(BROKER_CPPFLAGS) -DWITH_EPOLL
+		BROKER_LDADD:=$(BROKER_LDADD) -lpthread
+	endif
+endif
+
+ifeq ($(WITH_IO_URING),yes)
+	ifeq ($(UNAME),Linux)
+		BROKER_CPPFLAGS:=$(BROKER_CPPFLAGS) -DWITH_IO_URING
 	endif
 endif
 
@@ -90,6 +90,17 @@ struct mosquitto_evt_reload {
 	void *future2[4];
 };
 
+/* Verdicts that an ACL check for MOSQ_ACL_SUBSCRIBE can give in
+ * `read_verdict`, for MOSQ_ACL_READ checks on every topic that matches the
+ * subscription. For shared subscriptions this is the filter after
+ * "$share/<name>/". */
+enum mosquitto_acl_verdict {
+	MOSQ_ACL_VERDICT_UNKNOWN = 0, /* Each message must be checked */
+	MOSQ_ACL_VERDICT_ALLOW = 1, /* Reads will always be allowed */
+	MOSQ_ACL_VERDICT_DENY = 2, /* Reads will always be denied */
+	MOSQ_ACL_VERDICT_DEFER = 3, /* Reads will always be deferred */
+};
+
 /* Data for the MOSQ_EVT_ACL_CHECK event */
 struct mosquitto_evt_acl_check {
 	void *future;
@@ -101,6 +112,17 @@ struct mosquitto_evt_acl_check {
 	uint32_t payloadlen;
 	uint8_t qos;
 	bool retain;
+	/* Set to true by the plugin if its result depends only on the client,
+	 * topic and access type, so the broker may cache it when
+	 * acl_cache_size is set. */
+	bool cacheable;
+	/* For MOSQ_ACL_SUBSCRIBE checks, may be set to one of
+	 * enum mosquitto_acl_verdict by the plugin. When a verdict other than
+	 * MOSQ_ACL_VERDICT_UNKNOWN is known for the subscription, the broker uses
+	 * it instead of checking each message delivered to the subscription,
+	 * until the client's username changes, it is kicked, or the configuration
+	 * is reloaded. */
+	uint8_t read_verdict;
 	void *future2[4];
 };
 
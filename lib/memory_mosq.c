@@ -18,6 +18,7 @@ Contributors:
 
 #include "config.h"
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -37,6 +38,26 @@ Contributors:
 #ifdef REAL_WITH_MEMORY_TRACKING
 static unsigned long memcount = 0;
 static unsigned long max_memcount = 0;
+
+#  if defined(WITH_BROKER) && defined(WITH_EPOLL)
+/* The broker I/O threads allocate packet memory, so the counters must be
+ * updated atomically. */
+#    define MEMCOUNT_ADD(A) __atomic_add_fetch(&memcount, (A), __ATOMIC_RELAXED)
+#    define MEMCOUNT_SUB(A) __atomic_sub_fetch(&memcount, (A), __ATOMIC_RELAXED)
+#  else
+#    define MEMCOUNT_ADD(A) (memcount += (A))
+#    define MEMCOUNT_SUB(A) (memcount -= (A))
+#  endif
+
+static void memcount__add(size_t size)
+{
+	unsigned long count;
+
+	count = MEMCOUNT_ADD(size);
+	if(count > max_memcount){
+		max_memcount = count;
+	}
+}
 #endif
 
 #ifdef WITH_BROKER
@@ -59,10 +80,7 @@ void *mosquitto__calloc(size_t nmemb, size_t size)
 
 #ifdef REAL_WITH_MEMORY_TRACKING
 	if(mem){
-		memcount += malloc_usable_size(mem);
-		if(memcount > max_memcount){
-			max_memcount = memcount;
-		}
+		memcount__add(malloc_usable_size(mem));
 	}
 #endif
 
@@ -75,7 +93,7 @@ void mosquitto__free(void *mem)
 	if(!mem){
 		return;
 	}
-	memcount -= malloc_usable_size(mem);
+	MEMCOUNT_SUB(malloc_usable_size(mem));
 #endif
 	free(mem);
 }
@@ -94,10 +112,7 @@ void *mosquitto__malloc(size_t size)
 
 #ifdef REAL_WITH_MEMORY_TRACKING
 	if(mem){
-		memcount += malloc_usable_size(mem);
-		if(memcount > max_memcount){
-			max_memcount = memcount;
-		}
+		memcount__add(malloc_usable_size(mem));
 	}
 #endif
 
@@ -124,17 +139,14 @@ void *mosquitto__realloc(void *ptr, size_t size)
 		return NULL;
 	}
 	if(ptr){
-		memcount -= malloc_usable_size(ptr);
+		MEMCOUNT_SUB(malloc_usable_size(ptr));
 	}
 #endif
 	mem = realloc(ptr, size);
 
 #ifdef REAL_WITH_MEMORY_TRACKING
 	if(mem){
-		memcount += malloc_usable_size(mem);
-		if(memcount > max_memcount){
-			max_memcount = memcount;
-		}
+		memcount__add(malloc_usable_size(mem));
 	}
 #endif
 
@@ -153,12 +165,285 @@ char *mosquitto__strdup(const char *s)
 
 #ifdef REAL_WITH_MEMORY_TRACKING
 	if(str){
-		memcount += malloc_usable_size(str);
-		if(memcount > max_memcount){
-			max_memcount = memcount;
-		}
+		memcount__add(malloc_usable_size(str));
 	}
 #endif
 
 	return str;
 }
+
+#ifdef WITH_BROKER
+/* Object pools
+ *
+ * The broker allocates a message store entry, a client message per subscriber
+ * and a packet with its buffer for almost every message it routes, then frees
+ * them again shortly after. Over time the mix of short and long lived
+ * allocations fragments the heap and the memory use of the process grows.
+ *
+ * The objects of a pool are carved out of slabs of POOL_SLAB_SIZE bytes, so
+ * objects of the same type are kept together and most allocations just take
+ * the first item from a free list. Each object is preceded by a pointer to its
+ * slab, so freeing does not need to know the pool. Once every object in a slab
+ * is free the slab is returned to the heap, unless it is the only slab with
+ * free objects, in which case it is kept to avoid repeatedly allocating and
+ * freeing a slab when the pool is close to a slab boundary.
+ *
+ * Buffers are allocated from pools of size classes up to POOL_BUF_MAX bytes.
+ * Larger buffers come straight from the heap, with a NULL slab pointer.
+ */
+#define POOL_SLAB_SIZE 16384
+#define POOL_BUF_MIN 16
+#define POOL_BUF_MAX 2048
+
+struct mosquitto__slab {
+	struct mosquitto__slab *prev, *next;
+	struct mosquitto__pool *pool;
+	void *free_list;
+	unsigned int used;
+};
+
+static struct mosquitto__pool *pool_list = NULL;
+static struct mosquitto__pool *pool_list_last = NULL;
+
+static struct mosquitto__pool buf_pools[] = {
+	MOSQUITTO__POOL_INIT("buf16", 16),
+	MOSQUITTO__POOL_INIT("buf32", 32),
+	MOSQUITTO__POOL_INIT("buf64", 64),
+	MOSQUITTO__POOL_INIT("buf128", 128),
+	MOSQUITTO__POOL_INIT("buf256", 256),
+	MOSQUITTO__POOL_INIT("buf512", 512),
+	MOSQUITTO__POOL_INIT("buf1024", 1024),
+	MOSQUITTO__POOL_INIT("buf2048", 2048),
+};
+
+
+static size_t pool__stride(const struct mosquitto__pool *pool)
+{
+	size_t size;
+
+	size = pool->size;
+	if(size < sizeof(void *)){
+		size = sizeof(void *);
+	}
+	size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+	/* Room for the slab pointer */
+	return size + sizeof(struct mosquitto__slab *);
+}
+
+
+static void pool__register(struct mosquitto__pool *pool)
+{
+	size_t stride;
+
+	stride = pool__stride(pool);
+	if(sizeof(struct mosquitto__slab) + stride > POOL_SLAB_SIZE){
+		pool->slab_objects = 1;
+	}else{
+		pool->slab_objects = (unsigned int)((POOL_SLAB_SIZE - sizeof(struct mosquitto__slab)) / stride);
+	}
+
+	pool->next = NULL;
+	if(pool_list_last){
+		pool_list_last->next = pool;
+	}else{
+		pool_list = pool;
+	}
+	pool_list_last = pool;
+	pool->registered = true;
+}
+
+
+static void pool__slab_unlink(struct mosquitto__pool *pool, struct mosquitto__slab *slab)
+{
+	if(slab->prev){
+		slab->prev->next = slab->next;
+	}else{
+		pool->slabs = slab->next;
+	}
+	if(slab->next){
+		slab->next->prev = slab->prev;
+	}
+	slab->prev = NULL;
+	slab->next = NULL;
+}
+
+
+static void pool__slab_link(struct mosquitto__pool *pool, struct mosquitto__slab *slab)
+{
+	slab->prev = NULL;
+	slab->next = pool->slabs;
+	if(pool->slabs){
+		pool->slabs->prev = slab;
+	}
+	pool->slabs = slab;
+}
+
+
+static struct mosquitto__slab *pool__slab_new(struct mosquitto__pool *pool)
+{
+	struct mosquitto__slab *slab;
+	size_t stride;
+	uint8_t *item;
+	unsigned int i;
+
+	stride = pool__stride(pool);
+	slab = mosquitto__malloc(sizeof(struct mosquitto__slab) + stride*pool->slab_objects);
+	if(slab == NULL){
+		return NULL;
+	}
+	slab->pool = pool;
+	slab->used = 0;
+	slab->free_list = NULL;
+
+	/* Build the free list backwards, so objects are handed out in address
+	 * order. */
+	item = (uint8_t *)slab + sizeof(struct mosquitto__slab) + stride*pool->slab_objects;
+	for(i=0; i<pool->slab_objects; i++){
+		item -= stride;
+		*(struct mosquitto__slab **)item = slab;
+		*(void **)(item + sizeof(struct mosquitto__slab *)) = slab->free_list;
+		slab->free_list = item + sizeof(struct mosquitto__slab *);
+	}
+
+	pool__slab_link(pool, slab);
+	pool->slab_count++;
+
+	return slab;
+}
+
+
+static void *pool__alloc(struct mosquitto__pool *pool)
+{
+	struct mosquitto__slab *slab;
+	void *mem;
+
+	if(pool->registered == false){
+		pool__register(pool);
+	}
+
+	slab = pool->slabs;
+	if(slab == NULL){
+		slab = pool__slab_new(pool);
+		if(slab == NULL){
+			return NULL;
+		}
+	}
+
+	mem = slab->free_list;
+	slab->free_list = *(void **)mem;
+	slab->used++;
+	if(slab->free_list == NULL){
+		/* Full slabs aren't linked anywhere until an object is freed */
+		pool__slab_unlink(pool, slab);
+	}
+	pool->used++;
+
+	return mem;
+}
+
+
+void *mosquitto__pool_calloc(struct mosquitto__pool *pool)
+{
+	void *mem;
+
+	mem = pool__alloc(pool);
+	if(mem){
+		memset(mem, 0, pool->size);
+	}
+	return mem;
+}
+
+
+void mosquitto__pool_free(void *mem)
+{
+	struct mosquitto__slab *slab;
+	struct mosquitto__pool *pool;
+
+	if(mem == NULL){
+		return;
+	}
+
+	slab = *(struct mosquitto__slab **)((uint8_t *)mem - sizeof(struct mosquitto__slab *));
+	pool = slab->pool;
+
+	if(slab->free_list == NULL){
+		pool__slab_link(pool, slab);
+	}
+	*(void **)mem = slab->free_list;
+	slab->free_list = mem;
+	slab->used--;
+	pool->used--;
+
+	if(slab->used == 0 && (slab->prev || slab->next)){
+		pool__slab_unlink(pool, slab);
+		pool->slab_count--;
+		mosquitto__free(slab);
+	}
+}
+
+
+void *mosquitto__buf_malloc(size_t size)
+{
+	struct mosquitto__slab **mem;
+	size_t i;
+
+	if(size <= POOL_BUF_MAX){
+		for(i=0; i<sizeof(buf_pools)/sizeof(buf_pools[0]); i++){
+			if(size <= buf_pools[i].size){
+				return pool__alloc(&buf_pools[i]);
+			}
+		}
+	}
+
+	mem = mosquitto__malloc(sizeof(struct mosquitto__slab *) + size);
+	if(mem == NULL){
+		return NULL;
+	}
+	mem[0] = NULL;
+	return &mem[1];
+}
+
+
+void mosquitto__buf_free(void *mem)
+{
+	struct mosquitto__slab **slab;
+
+	if(mem == NULL){
+		return;
+	}
+
+	slab = (struct mosquitto__slab **)((uint8_t *)mem - sizeof(struct mosquitto__slab *));
+	if(*slab){
+		mosquitto__pool_free(mem);
+	}else{
+		mosquitto__free(slab);
+	}
+}
+
+
+struct mosquitto__pool *mosquitto__pool_first(void)
+{
+	return pool_list;
+}
+
+
+/* Free the slabs that have no objects in use. Any slab still in use at this
+ * point has been leaked by its owner. */
+void mosquitto__pool_cleanup(void)
+{
+	struct mosquitto__pool *pool;
+	struct mosquitto__slab *slab, *slab_next;
+
+	for(pool=pool_list; pool; pool=pool->next){
+		for(slab=pool->slabs; slab; slab=slab_next){
+			slab_next = slab->next;
+			if(slab->used == 0){
+				pool__slab_unlink(pool, slab);
+				pool->slab_count--;
+				mosquitto__free(slab);
+			}
+		}
+	}
+}
+#endif
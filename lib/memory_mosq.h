@@ -19,6 +19,7 @@ Contributors:
 #ifndef MEMORY_MOSQ_H
 #define MEMORY_MOSQ_H
 
+#include <stdbool.h>
 #include <stdio.h>
 #include <sys/types.h>
 
@@ -40,6 +41,30 @@ char *mosquitto__strdup(const char *s);
 
 #ifdef WITH_BROKER
 void memory__set_limit(size_t lim);
+
+struct mosquitto__slab;
+
+/* A pool of same sized objects, allocated from slabs. Pools are not thread
+ * safe, so must only be used from the main thread. Declare pools with
+ * MOSQUITTO__POOL_INIT, they register themselves on first use. */
+struct mosquitto__pool {
+	struct mosquitto__pool *next;
+	struct mosquitto__slab *slabs; /* Slabs with free objects */
+	const char *name;
+	size_t size;
+	unsigned int slab_objects;
+	unsigned long used;
+	unsigned long slab_count;
+	bool registered;
+};
+#define MOSQUITTO__POOL_INIT(name, size) {NULL, NULL, (name), (size), 0, 0, 0, false}
+
+void *mosquitto__pool_calloc(struct mosquitto__pool *pool);
+void mosquitto__pool_free(void *mem);
+void *mosquitto__buf_malloc(size_t size);
+void mosquitto__buf_free(void *mem);
+struct mosquitto__pool *mosquitto__pool_first(void);
+void mosquitto__pool_cleanup(void);
 #endif
 
 #endif
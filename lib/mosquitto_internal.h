@@ -141,15 +141,30 @@ struct mosquitto__alias{
 	uint16_t alias;
 };
 
-struct session_expiry_list {
-	struct mosquitto *context;
-	struct session_expiry_list *prev;
-	struct session_expiry_list *next;
+#ifdef WITH_BROKER
+/* See src/timers.c */
+struct mosquitto__timer {
+	struct mosquitto__timer *next;
+	struct mosquitto__timer *prev;
+	time_t expiry;
+	void (*callback)(struct mosquitto__timer *timer);
+	void *userdata;
 };
+#endif
 
 struct mosquitto__packet{
 	uint8_t *payload;
 	struct mosquitto__packet *next;
+#ifdef WITH_BROKER
+	/* For outgoing PUBLISH packets, the application message can be sent
+	 * straight from the message store rather than being copied into payload.
+	 * In this case payload holds the first packet_length-body_len bytes of
+	 * the packet, and the packet holds a reference to body_store. */
+	struct mosquitto_msg_store *body_store;
+	uint32_t body_len;
+	/* payload was allocated with mosquitto__buf_malloc() */
+	bool payload_pooled;
+#endif
 	uint32_t remaining_mult;
 	uint32_t remaining_length;
 	uint32_t packet_length;
@@ -178,12 +193,6 @@ enum mosquitto__keyform {
 };
 #endif
 
-struct will_delay_list {
-	struct mosquitto *context;
-	struct will_delay_list *prev;
-	struct will_delay_list *next;
-};
-
 struct mosquitto_msg_data{
 #ifdef WITH_BROKER
 	struct mosquitto_client_msg *inflight;
@@ -237,7 +246,6 @@ struct mosquitto {
 	struct mosquitto__packet *out_packet;
 	struct mosquitto_message_all *will;
 	struct mosquitto__alias *aliases;
-	struct will_delay_list *will_delay_entry;
 	int alias_count;
 	int out_packet_count;
 	uint32_t will_delay_interval;
@@ -266,6 +274,9 @@ struct mosquitto {
 	bool tls_ocsp_required;
 	bool tls_use_os_certs;
 	enum mosquitto__keyform tls_keyform;
+#ifdef WITH_BROKER
+	bool ktls_send; /* The kernel encrypts outgoing data, see net__tls_ktls_check() */
+#endif
 #endif
 	bool want_write;
 #if defined(WITH_THREADING) && !defined(WITH_BROKER)
@@ -285,15 +296,23 @@ struct mosquitto {
 	bool in_by_id;
 	bool is_dropping;
 	bool is_bridge;
+	bool acl_patterns_compiled; /* acl_patterns is up to date, even if empty */
 	struct mosquitto__bridge *bridge;
 	struct mosquitto_msg_data msgs_in;
 	struct mosquitto_msg_data msgs_out;
 	struct mosquitto__acl_user *acl_list;
+	struct mosquitto__acl_trie *acl_patterns; /* Pattern ACLs with %c and %u substituted */
+	struct mosquitto__acl_cache *acl_cache; /* ACL decisions, by topic */
+	struct mosquitto__acl_cache *acl_cache_lru; /* Most recently used first */
+	int acl_cache_count;
+	uint32_t acl_generation; /* Changes whenever cached ACL decisions are flushed */
 	struct mosquitto__listener *listener;
 	struct mosquitto__packet *out_packet_last;
 	struct mosquitto__client_sub **subs;
+	struct mosquitto__retain_cursor *retain_cursors;
 	char *auth_method;
 	int sub_count;
+	uint32_t dest_id; /* Small integer id, unique among current contexts */
 #  ifndef WITH_EPOLL
 	int pollfd_index;
 #  endif
@@ -351,12 +370,29 @@ struct mosquitto {
 	UT_hash_handle hh_id;
 	UT_hash_handle hh_sock;
 	struct mosquitto *for_free_next;
-	struct session_expiry_list *expiry_list_item;
+	struct mosquitto__timer session_expiry_timer;
+	struct mosquitto__timer will_delay_timer;
+	struct mosquitto__timer msg_expiry_timer;
 	uint16_t remote_port;
 #  ifndef WITH_OLD_KEEPALIVE
 	struct mosquitto *keepalive_next;
 	struct mosquitto *keepalive_prev;
 #  endif
+#  ifdef WITH_EPOLL
+	/* Only used when io_threads is set, see src/io_threads.c */
+	struct mosquitto__packet *io_packets;
+	struct mosquitto__packet *io_packets_last;
+	uint64_t io_bytes;
+	int io_rc;
+	int io_errno;
+	bool io_read;
+	bool io_progress;
+	/* Only used when tls_handshake_threads is set, see src/tls_handshake.c */
+	struct mosquitto__tls_handshake *tls_handshake;
+#  endif
+#  ifdef WITH_IO_URING
+	uint32_t uring_slot; /* See src/mux_io_uring.c */
+#  endif
 #endif
 	uint32_t events;
 };
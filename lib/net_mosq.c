@@ -250,6 +250,12 @@ int net__socket_close(struct mosquitto *mosq)
 			if(mosq_found){
 				HASH_DELETE(hh_sock, db.contexts_by_sock, mosq_found);
 			}
+#  ifdef WITH_IO_URING
+			/* io_uring holds its own reference to the socket until any
+			 * requests for it have been cancelled, so closing it isn't
+			 * enough to remove it from the event loop. */
+			mux__delete(mosq);
+#  endif
 #endif
 			rc = COMPAT_CLOSE(mosq->sock);
 			mosq->sock = INVALID_SOCKET;
@@ -1015,7 +1021,13 @@ ssize_t net__write(struct mosquitto *mosq, const void *buf, size_t count)
 
 	errno = 0;
 #ifdef WITH_TLS
-	if(mosq->ssl){
+	if(mosq->ssl
+#  ifdef WITH_BROKER
+			/* With kTLS, plain writes are encrypted by the kernel */
+			&& !mosq->ktls_send
+#  endif
+			){
+
 		ERR_clear_error();
 		mosq->want_write = false;
 		ret = SSL_write(mosq->ssl, buf, (int)count);
@@ -1035,6 +1047,37 @@ ssize_t net__write(struct mosquitto *mosq, const void *buf, size_t count)
 }
 
 
+#ifndef WIN32
+/* Write several buffers with a single call. TLS has no equivalent unless kTLS
+ * is in use, so only the first buffer is written in that case and the caller
+ * must cope with a short write, as it would for net__write(). */
+ssize_t net__writev(struct mosquitto *mosq, const struct iovec *iov, int iovcnt)
+{
+	struct msghdr msg;
+
+	assert(mosq);
+
+#ifdef WITH_TLS
+	if(mosq->ssl
+#  ifdef WITH_BROKER
+			&& !mosq->ktls_send
+#  endif
+			){
+
+		return net__write(mosq, iov[0].iov_base, iov[0].iov_len);
+	}
+#endif
+
+	errno = 0;
+	memset(&msg, 0, sizeof(struct msghdr));
+	msg.msg_iov = (struct iovec *)iov;
+	msg.msg_iovlen = (size_t)iovcnt;
+
+	return sendmsg(mosq->sock, &msg, MSG_NOSIGNAL);
+}
+#endif
+
+
 int net__socket_nonblock(mosq_sock_t *sock)
 {
 #ifndef WIN32
@@ -20,6 +20,7 @@ Contributors:
 
 #ifndef WIN32
 #  include <sys/socket.h>
+#  include <sys/uio.h>
 #  include <unistd.h>
 #else
 #  include <winsock2.h>
@@ -79,6 +80,9 @@ bool net__is_connected(struct mosquitto *mosq);
 
 ssize_t net__read(struct mosquitto *mosq, void *buf, size_t count);
 ssize_t net__write(struct mosquitto *mosq, const void *buf, size_t count);
+#ifndef WIN32
+ssize_t net__writev(struct mosquitto *mosq, const struct iovec *iov, int iovcnt);
+#endif
 
 #ifdef WITH_TLS
 void net__print_ssl_error(struct mosquitto *mosq);
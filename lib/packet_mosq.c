@@ -47,10 +47,37 @@ Contributors:
 #  define G_PUB_MSGS_SENT_INC(A)
 #endif
 
+#ifdef WITH_BROKER
+static struct mosquitto__pool packet_pool = MOSQUITTO__POOL_INIT("packet", sizeof(struct mosquitto__packet));
+#endif
+
+/* Allocate an outgoing packet. Free it with packet__free() once it has been
+ * cleaned up. */
+struct mosquitto__packet *packet__new(void)
+{
+#ifdef WITH_BROKER
+	return mosquitto__pool_calloc(&packet_pool);
+#else
+	return mosquitto__calloc(1, sizeof(struct mosquitto__packet));
+#endif
+}
+
+
+void packet__free(struct mosquitto__packet *packet)
+{
+#ifdef WITH_BROKER
+	mosquitto__pool_free(packet);
+#else
+	mosquitto__free(packet);
+#endif
+}
+
+
 int packet__alloc(struct mosquitto__packet *packet)
 {
 	uint8_t remaining_bytes[5], byte;
 	uint32_t remaining_length;
+	uint32_t alloc_len;
 	int i;
 
 	assert(packet);
@@ -70,12 +97,22 @@ int packet__alloc(struct mosquitto__packet *packet)
 	}while(remaining_length > 0 && packet->remaining_count < 5);
 	if(packet->remaining_count == 5) return MOSQ_ERR_PAYLOAD_SIZE;
 	packet->packet_length = packet->remaining_length + 1 + (uint8_t)packet->remaining_count;
+	alloc_len = packet->packet_length;
+#ifdef WITH_BROKER
+	/* A shared body is not part of the buffer */
+	alloc_len -= packet->body_len;
+#endif
 #ifdef WITH_WEBSOCKETS
-	packet->payload = mosquitto__malloc(sizeof(uint8_t)*packet->packet_length + LWS_PRE);
-#else
-	packet->payload = mosquitto__malloc(sizeof(uint8_t)*packet->packet_length);
+	alloc_len += LWS_PRE;
 #endif
+#ifdef WITH_BROKER
+	packet->payload = mosquitto__buf_malloc(sizeof(uint8_t)*alloc_len);
+	if(!packet->payload) return MOSQ_ERR_NOMEM;
+	packet->payload_pooled = true;
+#else
+	packet->payload = mosquitto__malloc(sizeof(uint8_t)*alloc_len);
 	if(!packet->payload) return MOSQ_ERR_NOMEM;
+#endif
 
 	packet->payload[0] = packet->command;
 	for(i=0; i<packet->remaining_count; i++){
@@ -95,10 +132,26 @@ void packet__cleanup(struct mosquitto__packet *packet)
 	packet->remaining_count = 0;
 	packet->remaining_mult = 1;
 	packet->remaining_length = 0;
+#ifdef WITH_BROKER
+	if(packet->payload_pooled){
+		mosquitto__buf_free(packet->payload);
+		packet->payload_pooled = false;
+	}else{
+		mosquitto__free(packet->payload);
+	}
+#else
 	mosquitto__free(packet->payload);
+#endif
 	packet->payload = NULL;
 	packet->to_process = 0;
 	packet->pos = 0;
+#ifdef WITH_BROKER
+	if(packet->body_store){
+		db__msg_store_ref_dec(&packet->body_store);
+		packet->body_store = NULL;
+	}
+	packet->body_len = 0;
+#endif
 }
 
 
@@ -120,7 +173,7 @@ void packet__cleanup_all_no_locks(struct mosquitto *mosq)
 		}
 
 		packet__cleanup(packet);
-		mosquitto__free(packet);
+		packet__free(packet);
 	}
 	mosq->out_packet_count = 0;
 
@@ -156,7 +209,7 @@ int packet__queue(struct mosquitto *mosq, struct mosquitto__packet *packet)
 #ifdef WITH_BROKER
 	if(db.config->max_queued_messages > 0 && mosq->out_packet_count >= db.config->max_queued_messages){
 		packet__cleanup(packet);
-		mosquitto__free(packet);
+		packet__free(packet);
 		if(mosq->is_dropping == false){
 			mosq->is_dropping = true;
 			log__printf(NULL, MOSQ_LOG_NOTICE,
@@ -179,7 +232,12 @@ int packet__queue(struct mosquitto *mosq, struct mosquitto__packet *packet)
 #ifdef WITH_BROKER
 #  ifdef WITH_WEBSOCKETS
 	if(mosq->wsi){
-		lws_callback_on_writable(mosq->wsi);
+		/* The whole queue is written when the socket is writable, so only
+		 * the first packet needs to ask for that. */
+		if(!mosq->ws_want_write){
+			mosq->ws_want_write = true;
+			lws_callback_on_writable(mosq->wsi);
+		}
 		return MOSQ_ERR_SUCCESS;
 	}else{
 		return packet__write(mosq);
@@ -224,6 +282,94 @@ int packet__check_oversize(struct mosquitto *mosq, uint32_t remaining_length)
 }
 
 
+#if defined(WITH_BROKER) && !defined(WIN32)
+/* Limits on how much of the outgoing queue is sent with a single call. */
+#  define PACKET_WRITE_IOV_MAX 64
+#  define PACKET_WRITE_BYTES_MAX 262144
+
+/* Add the unsent part of a packet to an iovec array, returning the number of
+ * entries used. */
+static int packet__write_iov(struct mosquitto__packet *packet, struct iovec *iov, size_t *bytes)
+{
+	uint32_t head_len;
+
+	head_len = packet->packet_length - packet->body_len;
+	*bytes += packet->to_process;
+	if(packet->pos < head_len){
+		iov[0].iov_base = &(packet->payload[packet->pos]);
+		iov[0].iov_len = head_len - packet->pos;
+		if(packet->body_len){
+			iov[1].iov_base = packet->body_store->payload;
+			iov[1].iov_len = packet->body_len;
+			return 2;
+		}
+		return 1;
+	}else{
+		iov[0].iov_base = &((uint8_t *)packet->body_store->payload)[packet->pos - head_len];
+		iov[0].iov_len = packet->to_process;
+		return 1;
+	}
+}
+#endif
+
+
+/* Write as much of the current packet as possible. For plain TCP connections
+ * in the broker, and TLS connections using kTLS, the packets queued behind it
+ * are sent in the same call, so a client with a long queue doesn't need a
+ * syscall per packet. */
+static ssize_t packet__write_data(struct mosquitto *mosq, struct mosquitto__packet *packet)
+{
+#if defined(WITH_BROKER) && !defined(WIN32)
+	struct iovec iov[PACKET_WRITE_IOV_MAX];
+	int iovcnt;
+	size_t bytes = 0;
+
+#  ifdef WITH_TLS
+	if(mosq->ssl == NULL || mosq->ktls_send)
+#  endif
+	{
+		iovcnt = packet__write_iov(packet, iov, &bytes);
+		packet = mosq->out_packet;
+		while(packet && iovcnt+2 <= PACKET_WRITE_IOV_MAX && bytes < PACKET_WRITE_BYTES_MAX){
+			iovcnt += packet__write_iov(packet, &iov[iovcnt], &bytes);
+			packet = packet->next;
+		}
+		if(iovcnt == 1){
+			return net__write(mosq, iov[0].iov_base, iov[0].iov_len);
+		}else{
+			return net__writev(mosq, iov, iovcnt);
+		}
+	}
+#  ifdef WITH_TLS
+	/* TLS packets are never sent with a shared body without kTLS */
+	return net__write(mosq, &(packet->payload[packet->pos]), packet->to_process);
+#  endif
+#else
+	return net__write(mosq, &(packet->payload[packet->pos]), packet->to_process);
+#endif
+}
+
+
+/* Mark data as sent, starting with the current packet and continuing along
+ * the queue. */
+static void packet__write_advance(struct mosquitto *mosq, struct mosquitto__packet *packet, uint32_t len)
+{
+	uint32_t count;
+
+	while(len > 0 && packet){
+		count = len < packet->to_process ? len : packet->to_process;
+		packet->to_process -= count;
+		packet->pos += count;
+		len -= count;
+		if(packet == mosq->current_out_packet){
+			packet = mosq->out_packet;
+		}else{
+			packet = packet->next;
+		}
+	}
+}
+
+
 int packet__write(struct mosquitto *mosq)
 {
 	ssize_t write_length;
@@ -261,11 +407,10 @@ int packet__write(struct mosquitto *mosq)
 		packet = mosq->current_out_packet;
 
 		while(packet->to_process > 0){
-			write_length = net__write(mosq, &(packet->payload[packet->pos]), packet->to_process);
+			write_length = packet__write_data(mosq, packet);
 			if(write_length > 0){
 				G_BYTES_SENT_INC(write_length);
-				packet->to_process -= (uint32_t)write_length;
-				packet->pos += (uint32_t)write_length;
+				packet__write_advance(mosq, packet, (uint32_t)write_length);
 			}else{
 #ifdef WIN32
 				errno = WSAGetLastError();
@@ -318,7 +463,7 @@ int packet__write(struct mosquitto *mosq)
 		}else if(((packet->command)&0xF0) == CMD_DISCONNECT){
 			do_client_disconnect(mosq, MOSQ_ERR_SUCCESS, NULL);
 			packet__cleanup(packet);
-			mosquitto__free(packet);
+			packet__free(packet);
 			return MOSQ_ERR_SUCCESS;
 #endif
 		}else if(((packet->command)&0xF0) == CMD_PUBLISH){
@@ -338,7 +483,7 @@ int packet__write(struct mosquitto *mosq)
 		COMPAT_pthread_mutex_unlock(&mosq->out_packet_mutex);
 
 		packet__cleanup(packet);
-		mosquitto__free(packet);
+		packet__free(packet);
 
 #ifdef WITH_BROKER
 		mosq->next_msg_out = db.now_s + mosq->keepalive;
@@ -358,89 +503,147 @@ int packet__write(struct mosquitto *mosq)
 }
 
 
-int packet__read(struct mosquitto *mosq)
+/* Size of the buffer that incoming data is read into before being split into
+ * packets. */
+#define PACKET_READ_BUF_SIZE 4096
+/* Maximum number of reads carried out in one call to packet__read(), to keep
+ * other clients responsive. Anything left will be reported as readable
+ * again. */
+#define PACKET_READ_MAX_READS 16
+
+
+/* Update last_msg_in time if more than 1000 bytes of the current packet are
+ * left to receive. Helps when receiving large messages.
+ * This is an arbitrary limit, but with some consideration.
+ * If a client can't send 1000 bytes in a second it
+ * probably shouldn't be using a 1 second keep alive. */
+/* Data read by an I/O thread is only split into packets here. Checks that
+ * depend on earlier packets from the same client having been handled, and
+ * anything that would write to the client, are left to io_threads__handle()
+ * on the main loop. */
+#if defined(WITH_BROKER) && defined(WITH_EPOLL)
+#  define PACKET_READ_DEFERRED(mosq) ((mosq)->io_read)
+#else
+#  define PACKET_READ_DEFERRED(mosq) false
+#endif
+
+
+static void packet__read_progress(struct mosquitto *mosq)
 {
-	uint8_t byte;
-	ssize_t read_length;
-	int rc = 0;
-	enum mosquitto_client_state state;
+	if(mosq->in_packet.to_process > 1000){
+#ifdef WITH_BROKER
+		keepalive__update(mosq);
+#else
+		COMPAT_pthread_mutex_lock(&mosq->msgtime_mutex);
+		mosq->last_msg_in = mosquitto_time();
+		COMPAT_pthread_mutex_unlock(&mosq->msgtime_mutex);
+#endif
+	}
+}
 
-	if(!mosq){
-		return MOSQ_ERR_INVAL;
+
+static int packet__read_error(struct mosquitto *mosq, ssize_t read_length)
+{
+	if(read_length == 0){
+		return MOSQ_ERR_CONN_LOST; /* EOF */
 	}
-	if(mosq->sock == INVALID_SOCKET){
-		return MOSQ_ERR_NO_CONN;
+#ifdef WIN32
+	errno = WSAGetLastError();
+#endif
+	if(errno == EAGAIN || errno == COMPAT_EWOULDBLOCK){
+		packet__read_progress(mosq);
+		return MOSQ_ERR_SUCCESS;
+	}else{
+		switch(errno){
+			case COMPAT_ECONNRESET:
+				return MOSQ_ERR_CONN_LOST;
+			case COMPAT_EINTR:
+				return MOSQ_ERR_SUCCESS;
+			default:
+				return MOSQ_ERR_ERRNO;
+		}
 	}
+}
 
-	state = mosquitto__get_state(mosq);
-	if(state == mosq_cs_connect_pending){
-		return MOSQ_ERR_SUCCESS;
+
+/* All data for in_packet has been read, so handle it and reset in_packet
+ * ready for the next packet. */
+static int packet__read_complete(struct mosquitto *mosq)
+{
+	int rc;
+
+#if defined(WITH_BROKER) && defined(WITH_EPOLL)
+	if(PACKET_READ_DEFERRED(mosq)){
+		return io_threads__packet_complete(mosq);
+	}
+#endif
+	mosq->in_packet.pos = 0;
+#ifdef WITH_BROKER
+	G_MSGS_RECEIVED_INC(1);
+	if(((mosq->in_packet.command)&0xF0) == CMD_PUBLISH){
+		G_PUB_MSGS_RECEIVED_INC(1);
 	}
+#endif
+	rc = handle__packet(mosq);
 
-	/* This gets called if pselect() indicates that there is network data
-	 * available - ie. at least one byte.  What we do depends on what data we
-	 * already have.
-	 * If we've not got a command, attempt to read one and save it. This should
-	 * always work because it's only a single byte.
-	 * Then try to read the remaining length. This may fail because it is may
-	 * be more than one byte - will need to save data pending next read if it
-	 * does fail.
-	 * Then try to read the remaining payload, where 'payload' here means the
-	 * combined variable header and actual payload. This is the most likely to
-	 * fail due to longer length, so save current data and current position.
-	 * After all data is read, send to mosquitto__handle_packet() to deal with.
-	 * Finally, free the memory and reset everything to starting conditions.
-	 */
-	if(!mosq->in_packet.command){
-		read_length = net__read(mosq, &byte, 1);
-		if(read_length == 1){
+	/* Free data and reset values */
+	packet__cleanup(&mosq->in_packet);
+
+#ifdef WITH_BROKER
+	keepalive__update(mosq);
+#else
+	COMPAT_pthread_mutex_lock(&mosq->msgtime_mutex);
+	mosq->last_msg_in = mosquitto_time();
+	COMPAT_pthread_mutex_unlock(&mosq->msgtime_mutex);
+#endif
+	return rc;
+}
+
+
+/* Split the data in buf into packets, handling each packet as soon as it is
+ * complete. Whatever is left of a packet that is only partly in buf is kept
+ * in in_packet, ready for the next read. */
+static int packet__read_frame(struct mosquitto *mosq, const uint8_t *buf, size_t len)
+{
+	size_t pos = 0;
+	size_t n;
+	uint8_t byte;
+	int rc;
+
+	while(pos < len){
+		if(!mosq->in_packet.command){
+			byte = buf[pos];
+			pos++;
 			mosq->in_packet.command = byte;
 #ifdef WITH_BROKER
-			G_BYTES_RECEIVED_INC(1);
 			/* Clients must send CONNECT as their first command. */
-			if(!(mosq->bridge) && state == mosq_cs_new && (byte&0xF0) != CMD_CONNECT){
+			if(!PACKET_READ_DEFERRED(mosq) && !(mosq->bridge) && mosquitto__get_state(mosq) == mosq_cs_new && (byte&0xF0) != CMD_CONNECT){
 				return MOSQ_ERR_PROTOCOL;
 			}else if((byte&0xF0) == CMD_RESERVED){
-				if(mosq->protocol == mosq_p_mqtt5){
+				if(mosq->protocol == mosq_p_mqtt5 && !PACKET_READ_DEFERRED(mosq)){
 					send__disconnect(mosq, MQTT_RC_PROTOCOL_ERROR, NULL);
 				}
 				return MOSQ_ERR_PROTOCOL;
 			}
 #endif
-		}else{
-			if(read_length == 0){
-				return MOSQ_ERR_CONN_LOST; /* EOF */
-			}
-#ifdef WIN32
-			errno = WSAGetLastError();
-#endif
-			if(errno == EAGAIN || errno == COMPAT_EWOULDBLOCK){
-				return MOSQ_ERR_SUCCESS;
-			}else{
-				switch(errno){
-					case COMPAT_ECONNRESET:
-						return MOSQ_ERR_CONN_LOST;
-					case COMPAT_EINTR:
-						return MOSQ_ERR_SUCCESS;
-					default:
-						return MOSQ_ERR_ERRNO;
-				}
-			}
 		}
-	}
-	/* remaining_count is the number of bytes that the remaining_length
-	 * parameter occupied in this incoming packet. We don't use it here as such
-	 * (it is used when allocating an outgoing packet), but we must be able to
-	 * determine whether all of the remaining_length parameter has been read.
-	 * remaining_count has three states here:
-	 *   0 means that we haven't read any remaining_length bytes
-	 *   <0 means we have read some remaining_length bytes but haven't finished
-	 *   >0 means we have finished reading the remaining_length bytes.
-	 */
-	if(mosq->in_packet.remaining_count <= 0){
-		do{
-			read_length = net__read(mosq, &byte, 1);
-			if(read_length == 1){
+		/* remaining_count is the number of bytes that the remaining_length
+		 * parameter occupied in this incoming packet. We don't use it here as such
+		 * (it is used when allocating an outgoing packet), but we must be able to
+		 * determine whether all of the remaining_length parameter has been read.
+		 * remaining_count has three states here:
+		 *   0 means that we haven't read any remaining_length bytes
+		 *   <0 means we have read some remaining_length bytes but haven't finished
+		 *   >0 means we have finished reading the remaining_length bytes.
+		 */
+		if(mosq->in_packet.remaining_count <= 0){
+			do{
+				if(pos == len){
+					return MOSQ_ERR_SUCCESS;
+				}
+				byte = buf[pos];
+				pos++;
+
 				mosq->in_packet.remaining_count--;
 				/* Max 4 bytes length for remaining length as defined by protocol.
 				 * Anything more likely means a broken/malicious client.
@@ -449,141 +652,171 @@ int packet__read(struct mosquitto *mosq)
 					return MOSQ_ERR_MALFORMED_PACKET;
 				}
 
-				G_BYTES_RECEIVED_INC(1);
 				mosq->in_packet.remaining_length += (byte & 127) * mosq->in_packet.remaining_mult;
 				mosq->in_packet.remaining_mult *= 128;
-			}else{
-				if(read_length == 0){
-					return MOSQ_ERR_CONN_LOST; /* EOF */
-				}
-#ifdef WIN32
-				errno = WSAGetLastError();
-#endif
-				if(errno == EAGAIN || errno == COMPAT_EWOULDBLOCK){
-					return MOSQ_ERR_SUCCESS;
-				}else{
-					switch(errno){
-						case COMPAT_ECONNRESET:
-							return MOSQ_ERR_CONN_LOST;
-						case COMPAT_EINTR:
-							return MOSQ_ERR_SUCCESS;
-						default:
-							return MOSQ_ERR_ERRNO;
-					}
-				}
-			}
-		}while((byte & 128) != 0);
-		/* We have finished reading remaining_length, so make remaining_count
-		 * positive. */
-		mosq->in_packet.remaining_count = (int8_t)(mosq->in_packet.remaining_count * -1);
+			}while((byte & 128) != 0);
+			/* We have finished reading remaining_length, so make remaining_count
+			 * positive. */
+			mosq->in_packet.remaining_count = (int8_t)(mosq->in_packet.remaining_count * -1);
 
 #ifdef WITH_BROKER
-		switch(mosq->in_packet.command & 0xF0){
-			case CMD_CONNECT:
-				if(mosq->in_packet.remaining_length > 100000){ /* Arbitrary limit, make configurable */
-					return MOSQ_ERR_MALFORMED_PACKET;
-				}
-				break;
-
-			case CMD_PUBACK:
-			case CMD_PUBREC:
-			case CMD_PUBREL:
-			case CMD_PUBCOMP:
-			case CMD_UNSUBACK:
-				if(mosq->protocol != mosq_p_mqtt5 && mosq->in_packet.remaining_length != 2){
-					return MOSQ_ERR_MALFORMED_PACKET;
-				}
-				break;
+			switch(mosq->in_packet.command & 0xF0){
+				case CMD_CONNECT:
+					if(mosq->in_packet.remaining_length > 100000){ /* Arbitrary limit, make configurable */
+						return MOSQ_ERR_MALFORMED_PACKET;
+					}
+					break;
+
+				case CMD_PUBACK:
+				case CMD_PUBREC:
+				case CMD_PUBREL:
+				case CMD_PUBCOMP:
+				case CMD_UNSUBACK:
+					if(!PACKET_READ_DEFERRED(mosq) && mosq->protocol != mosq_p_mqtt5 && mosq->in_packet.remaining_length != 2){
+						return MOSQ_ERR_MALFORMED_PACKET;
+					}
+					break;
 
-			case CMD_PINGREQ:
-			case CMD_PINGRESP:
-				if(mosq->in_packet.remaining_length != 0){
-					return MOSQ_ERR_MALFORMED_PACKET;
-				}
-				break;
+				case CMD_PINGREQ:
+				case CMD_PINGRESP:
+					if(mosq->in_packet.remaining_length != 0){
+						return MOSQ_ERR_MALFORMED_PACKET;
+					}
+					break;
 
-			case CMD_DISCONNECT:
-				if(mosq->protocol != mosq_p_mqtt5 && mosq->in_packet.remaining_length != 0){
-					return MOSQ_ERR_MALFORMED_PACKET;
-				}
-				break;
-		}
+				case CMD_DISCONNECT:
+					if(!PACKET_READ_DEFERRED(mosq) && mosq->protocol != mosq_p_mqtt5 && mosq->in_packet.remaining_length != 0){
+						return MOSQ_ERR_MALFORMED_PACKET;
+					}
+					break;
+			}
 
-		if(db.config->max_packet_size > 0 && mosq->in_packet.remaining_length+1 > db.config->max_packet_size){
-			if(mosq->protocol == mosq_p_mqtt5){
-				send__disconnect(mosq, MQTT_RC_PACKET_TOO_LARGE, NULL);
+			if(db.config->max_packet_size > 0 && mosq->in_packet.remaining_length+1 > db.config->max_packet_size){
+				if(mosq->protocol == mosq_p_mqtt5 && !PACKET_READ_DEFERRED(mosq)){
+					send__disconnect(mosq, MQTT_RC_PACKET_TOO_LARGE, NULL);
+				}
+				return MOSQ_ERR_OVERSIZE_PACKET;
 			}
-			return MOSQ_ERR_OVERSIZE_PACKET;
-		}
 #else
-		/* FIXME - client case for incoming message received from broker too large */
+			/* FIXME - client case for incoming message received from broker too large */
 #endif
-		if(mosq->in_packet.remaining_length > 0){
-			mosq->in_packet.payload = mosquitto__malloc(mosq->in_packet.remaining_length*sizeof(uint8_t));
-			if(!mosq->in_packet.payload){
-				return MOSQ_ERR_NOMEM;
+			if(mosq->in_packet.remaining_length > 0){
+				mosq->in_packet.payload = mosquitto__malloc(mosq->in_packet.remaining_length*sizeof(uint8_t));
+				if(!mosq->in_packet.payload){
+					return MOSQ_ERR_NOMEM;
+				}
+				mosq->in_packet.to_process = mosq->in_packet.remaining_length;
 			}
-			mosq->in_packet.to_process = mosq->in_packet.remaining_length;
 		}
-	}
-	while(mosq->in_packet.to_process>0){
-		read_length = net__read(mosq, &(mosq->in_packet.payload[mosq->in_packet.pos]), mosq->in_packet.to_process);
-		if(read_length > 0){
-			G_BYTES_RECEIVED_INC(read_length);
-			mosq->in_packet.to_process -= (uint32_t)read_length;
-			mosq->in_packet.pos += (uint32_t)read_length;
-		}else{
-#ifdef WIN32
-			errno = WSAGetLastError();
-#endif
-			if(errno == EAGAIN || errno == COMPAT_EWOULDBLOCK){
-				if(mosq->in_packet.to_process > 1000){
-					/* Update last_msg_in time if more than 1000 bytes left to
-					 * receive. Helps when receiving large messages.
-					 * This is an arbitrary limit, but with some consideration.
-					 * If a client can't send 1000 bytes in a second it
-					 * probably shouldn't be using a 1 second keep alive. */
-#ifdef WITH_BROKER
-					keepalive__update(mosq);
-#else
-					COMPAT_pthread_mutex_lock(&mosq->msgtime_mutex);
-					mosq->last_msg_in = mosquitto_time();
-					COMPAT_pthread_mutex_unlock(&mosq->msgtime_mutex);
-#endif
-				}
+		if(mosq->in_packet.to_process > 0){
+			n = len - pos;
+			if(n > mosq->in_packet.to_process){
+				n = mosq->in_packet.to_process;
+			}
+			memcpy(&(mosq->in_packet.payload[mosq->in_packet.pos]), &buf[pos], n);
+			mosq->in_packet.pos += (uint32_t)n;
+			mosq->in_packet.to_process -= (uint32_t)n;
+			pos += n;
+			if(mosq->in_packet.to_process > 0){
 				return MOSQ_ERR_SUCCESS;
-			}else{
-				switch(errno){
-					case COMPAT_ECONNRESET:
-						return MOSQ_ERR_CONN_LOST;
-					case COMPAT_EINTR:
-						return MOSQ_ERR_SUCCESS;
-					default:
-						return MOSQ_ERR_ERRNO;
-				}
 			}
 		}
+
+		rc = packet__read_complete(mosq);
+		if(rc || mosq->sock == INVALID_SOCKET){
+			/* Anything else in buf is discarded along with the connection. */
+			return rc;
+		}
 	}
+	return MOSQ_ERR_SUCCESS;
+}
 
-	/* All data for this packet is read. */
-	mosq->in_packet.pos = 0;
-#ifdef WITH_BROKER
-	G_MSGS_RECEIVED_INC(1);
-	if(((mosq->in_packet.command)&0xF0) == CMD_PUBLISH){
-		G_PUB_MSGS_RECEIVED_INC(1);
+
+/* Handle incoming data that has already been read from the network by the
+ * caller, rather than by packet__read(). */
+int packet__read_data(struct mosquitto *mosq, const uint8_t *buf, size_t len)
+{
+	int rc;
+
+	if(!mosq || !buf){
+		return MOSQ_ERR_INVAL;
+	}
+	if(mosq->sock == INVALID_SOCKET){
+		return MOSQ_ERR_NO_CONN;
+	}
+	if(PACKET_READ_DEFERRED(mosq)){
+		/* The I/O thread keeps its own count of bytes and progress */
+		return packet__read_frame(mosq, buf, len);
 	}
-#endif
-	rc = handle__packet(mosq);
 
-	/* Free data and reset values */
-	packet__cleanup(&mosq->in_packet);
+	G_BYTES_RECEIVED_INC(len);
+	rc = packet__read_frame(mosq, buf, len);
+	if(rc || mosq->sock == INVALID_SOCKET){
+		return rc;
+	}
+	packet__read_progress(mosq);
+	return MOSQ_ERR_SUCCESS;
+}
 
-#ifdef WITH_BROKER
-	keepalive__update(mosq);
-#else
-	COMPAT_pthread_mutex_lock(&mosq->msgtime_mutex);
-	mosq->last_msg_in = mosquitto_time();
-	COMPAT_pthread_mutex_unlock(&mosq->msgtime_mutex);
-#endif
-	return rc;
+
+int packet__read(struct mosquitto *mosq)
+{
+	uint8_t buf[PACKET_READ_BUF_SIZE];
+	ssize_t read_length;
+	bool direct;
+	int i;
+	int rc;
+
+	if(!mosq){
+		return MOSQ_ERR_INVAL;
+	}
+	if(mosq->sock == INVALID_SOCKET){
+		return MOSQ_ERR_NO_CONN;
+	}
+
+	if(mosquitto__get_state(mosq) == mosq_cs_connect_pending){
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	/* This gets called if pselect() indicates that there is network data
+	 * available - ie. at least one byte.
+	 * Read as much as is available into buf, then split it into packets and
+	 * send each complete packet to handle__packet() to deal with. A packet
+	 * that is only partly read is kept in in_packet until the rest of it
+	 * arrives, so buf is always empty when we return.
+	 * Large payloads are read straight into in_packet rather than via buf.
+	 */
+	for(i=0; i<PACKET_READ_MAX_READS; i++){
+		direct = (mosq->in_packet.remaining_count > 0 && mosq->in_packet.to_process >= PACKET_READ_BUF_SIZE);
+		if(direct){
+			read_length = net__read(mosq, &(mosq->in_packet.payload[mosq->in_packet.pos]), mosq->in_packet.to_process);
+		}else{
+			read_length = net__read(mosq, buf, PACKET_READ_BUF_SIZE);
+		}
+		if(read_length <= 0){
+			return packet__read_error(mosq, read_length);
+		}
+		G_BYTES_RECEIVED_INC(read_length);
+
+		if(direct){
+			mosq->in_packet.to_process -= (uint32_t)read_length;
+			mosq->in_packet.pos += (uint32_t)read_length;
+			if(mosq->in_packet.to_process == 0){
+				rc = packet__read_complete(mosq);
+			}else{
+				rc = MOSQ_ERR_SUCCESS;
+			}
+		}else{
+			rc = packet__read_frame(mosq, buf, (size_t)read_length);
+		}
+		if(rc || mosq->sock == INVALID_SOCKET){
+			return rc;
+		}
+		if(!direct && read_length < PACKET_READ_BUF_SIZE){
+			/* Short read, there is nothing else waiting. */
+			break;
+		}
+	}
+	packet__read_progress(mosq);
+	return MOSQ_ERR_SUCCESS;
 }
@@ -21,6 +21,8 @@ Contributors:
 #include "mosquitto_internal.h"
 #include "mosquitto.h"
 
+struct mosquitto__packet *packet__new(void);
+void packet__free(struct mosquitto__packet *packet);
 int packet__alloc(struct mosquitto__packet *packet);
 void packet__cleanup(struct mosquitto__packet *packet);
 void packet__cleanup_all(struct mosquitto *mosq);
@@ -48,5 +50,6 @@ unsigned int packet__varint_bytes(uint32_t word);
 
 int packet__write(struct mosquitto *mosq);
 int packet__read(struct mosquitto *mosq);
+int packet__read_data(struct mosquitto *mosq, const uint8_t *buf, size_t len);
 
 #endif
@@ -32,6 +32,9 @@ int send__pingresp(struct mosquitto *mosq);
 int send__puback(struct mosquitto *mosq, uint16_t mid, uint8_t reason_code, const mosquitto_property *properties);
 int send__pubcomp(struct mosquitto *mosq, uint16_t mid, const mosquitto_property *properties);
 int send__publish(struct mosquitto *mosq, uint16_t mid, const char *topic, uint32_t payloadlen, const void *payload, uint8_t qos, bool retain, bool dup, const mosquitto_property *cmsg_props, const mosquitto_property *store_props, uint32_t expiry_interval);
+#ifdef WITH_BROKER
+int send__publish_store(struct mosquitto *mosq, uint16_t mid, struct mosquitto_msg_store *stored, uint8_t qos, bool retain, bool dup, const mosquitto_property *cmsg_props, uint32_t expiry_interval);
+#endif
 int send__pubrec(struct mosquitto *mosq, uint16_t mid, uint8_t reason_code, const mosquitto_property *properties);
 int send__pubrel(struct mosquitto *mosq, uint16_t mid, const mosquitto_property *properties);
 int send__subscribe(struct mosquitto *mosq, int *mid, int topic_count, char *const *const topic, int topic_qos, const mosquitto_property *properties);
@@ -38,8 +38,18 @@ Contributors:
 #include "property_mosq.h"
 #include "send_mosq.h"
 
+#ifdef WITH_BROKER
+/* Payloads smaller than this are copied into the packet, because this is
+ * cheaper than sending from a second buffer. */
+#  define PUBLISH_SHARED_BODY_MIN 1024
+#else
+struct mosquitto_msg_store;
+#endif
 
-int send__publish(struct mosquitto *mosq, uint16_t mid, const char *topic, uint32_t payloadlen, const void *payload, uint8_t qos, bool retain, bool dup, const mosquitto_property *cmsg_props, const mosquitto_property *store_props, uint32_t expiry_interval)
+static int send__real_publish_internal(struct mosquitto *mosq, uint16_t mid, const char *topic, uint32_t payloadlen, const void *payload, struct mosquitto_msg_store *stored, uint8_t qos, bool retain, bool dup, const mosquitto_property *cmsg_props, const mosquitto_property *store_props, uint32_t expiry_interval);
+
+
+static int send__publish_internal(struct mosquitto *mosq, uint16_t mid, const char *topic, uint32_t payloadlen, const void *payload, struct mosquitto_msg_store *stored, uint8_t qos, bool retain, bool dup, const mosquitto_property *cmsg_props, const mosquitto_property *store_props, uint32_t expiry_interval)
 {
 #ifdef WITH_BROKER
 	size_t len;
@@ -116,7 +126,7 @@ int send__publish(struct mosquitto *mosq, uint16_t mid, const char *topic, uint3
 					}
 					log__printf(NULL, MOSQ_LOG_DEBUG, "Sending PUBLISH to %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", SAFE_PRINT(mosq->id), dup, qos, retain, mid, mapped_topic, (long)payloadlen);
 					G_PUB_BYTES_SENT_INC(payloadlen);
-					rc =  send__real_publish(mosq, mid, mapped_topic, payloadlen, payload, qos, retain, dup, cmsg_props, store_props, expiry_interval);
+					rc = send__real_publish_internal(mosq, mid, mapped_topic, payloadlen, payload, stored, qos, retain, dup, cmsg_props, store_props, expiry_interval);
 					mosquitto__free(mapped_topic);
 					return rc;
 				}
@@ -130,11 +140,34 @@ int send__publish(struct mosquitto *mosq, uint16_t mid, const char *topic, uint3
 	log__printf(mosq, MOSQ_LOG_DEBUG, "Client %s sending PUBLISH (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", SAFE_PRINT(mosq->id), dup, qos, retain, mid, topic, (long)payloadlen);
 #endif
 
-	return send__real_publish(mosq, mid, topic, payloadlen, payload, qos, retain, dup, cmsg_props, store_props, expiry_interval);
+	return send__real_publish_internal(mosq, mid, topic, payloadlen, payload, stored, qos, retain, dup, cmsg_props, store_props, expiry_interval);
 }
 
 
+int send__publish(struct mosquitto *mosq, uint16_t mid, const char *topic, uint32_t payloadlen, const void *payload, uint8_t qos, bool retain, bool dup, const mosquitto_property *cmsg_props, const mosquitto_property *store_props, uint32_t expiry_interval)
+{
+	return send__publish_internal(mosq, mid, topic, payloadlen, payload, NULL, qos, retain, dup, cmsg_props, store_props, expiry_interval);
+}
+
+
+#ifdef WITH_BROKER
+/* Send a message from the message store. Large payloads are not copied, the
+ * packet keeps a reference to the store instead, so the same payload can be
+ * sent to any number of subscribers without being duplicated. */
+int send__publish_store(struct mosquitto *mosq, uint16_t mid, struct mosquitto_msg_store *stored, uint8_t qos, bool retain, bool dup, const mosquitto_property *cmsg_props, uint32_t expiry_interval)
+{
+	return send__publish_internal(mosq, mid, stored->topic, stored->payloadlen, stored->payload, stored, qos, retain, dup, cmsg_props, stored->properties, expiry_interval);
+}
+#endif
+
+
 int send__real_publish(struct mosquitto *mosq, uint16_t mid, const char *topic, uint32_t payloadlen, const void *payload, uint8_t qos, bool retain, bool dup, const mosquitto_property *cmsg_props, const mosquitto_property *store_props, uint32_t expiry_interval)
+{
+	return send__real_publish_internal(mosq, mid, topic, payloadlen, payload, NULL, qos, retain, dup, cmsg_props, store_props, expiry_interval);
+}
+
+
+static int send__real_publish_internal(struct mosquitto *mosq, uint16_t mid, const char *topic, uint32_t payloadlen, const void *payload, struct mosquitto_msg_store *stored, uint8_t qos, bool retain, bool dup, const mosquitto_property *cmsg_props, const mosquitto_property *store_props, uint32_t expiry_interval)
 {
 	struct mosquitto__packet *packet = NULL;
 	unsigned int packetlen;
@@ -182,15 +215,35 @@ int send__real_publish(struct mosquitto *mosq, uint16_t mid, const char *topic,
 		return MOSQ_ERR_OVERSIZE_PACKET;
 	}
 
-	packet = mosquitto__calloc(1, sizeof(struct mosquitto__packet));
+	packet = packet__new();
 	if(!packet) return MOSQ_ERR_NOMEM;
 
 	packet->mid = mid;
 	packet->command = (uint8_t)(CMD_PUBLISH | (uint8_t)((dup&0x1)<<3) | (uint8_t)(qos<<1) | retain);
 	packet->remaining_length = packetlen;
+#ifdef WITH_BROKER
+	if(stored && payloadlen >= PUBLISH_SHARED_BODY_MIN
+#  ifdef WITH_TLS
+			/* Avoid splitting the packet over two TLS records, unless the
+			 * kernel is building the records with kTLS */
+			&& (mosq->ssl == NULL || mosq->ktls_send)
+#  endif
+#  ifdef WITH_WEBSOCKETS
+			&& mosq->wsi == NULL /* libwebsockets needs the whole packet in one buffer */
+#  endif
+			){
+
+		packet->body_store = stored;
+		packet->body_len = payloadlen;
+		db__msg_store_ref_inc(stored);
+	}
+#else
+	UNUSED(stored);
+#endif
 	rc = packet__alloc(packet);
 	if(rc){
-		mosquitto__free(packet);
+		packet__cleanup(packet);
+		packet__free(packet);
 		return rc;
 	}
 	/* Variable header (topic string) */
@@ -213,7 +266,11 @@ int send__real_publish(struct mosquitto *mosq, uint16_t mid, const char *topic,
 	}
 
 	/* Payload */
+#ifdef WITH_BROKER
+	if(payloadlen && packet->body_store == NULL){
+#else
 	if(payloadlen){
+#endif
 		packet__write_bytes(packet, payload, payloadlen);
 	}
 
@@ -86,3 +86,29 @@ time_t mosquitto_time(void)
 #endif
 }
 
+
+uint64_t mosquitto_time_ms(void)
+{
+#ifdef WIN32
+	return GetTickCount64();
+#elif _POSIX_TIMERS>0 && defined(_POSIX_MONOTONIC_CLOCK)
+	struct timespec tp;
+
+	if (clock_gettime(time_clock, &tp) == 0)
+		return (uint64_t)tp.tv_sec*1000 + (uint64_t)tp.tv_nsec/1000000;
+
+	return 0;
+#elif defined(__APPLE__)
+	static mach_timebase_info_data_t tb;
+	uint64_t ticks;
+
+	ticks = mach_absolute_time();
+
+	if(tb.denom == 0){
+		mach_timebase_info(&tb);
+	}
+	return ticks*tb.numer/tb.denom/1000000;
+#else
+	return (uint64_t)time(NULL)*1000;
+#endif
+}
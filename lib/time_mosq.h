@@ -19,7 +19,10 @@ Contributors:
 #ifndef TIME_MOSQ_H
 #define TIME_MOSQ_H
 
+#include <stdint.h>
+
 void mosquitto_time_init(void);
 time_t mosquitto_time(void);
+uint64_t mosquitto_time_ms(void);
 
 #endif
@@ -18,6 +18,8 @@ Contributors:
 
 #include "config.h"
 
+#include <string.h>
+
 #include "dynamic_security.h"
 #include "mosquitto.h"
 #include "mosquitto_broker.h"
@@ -25,61 +27,276 @@ Contributors:
 
 typedef int (*MOSQ_FUNC_acl_check)(struct mosquitto_evt_acl_check *, struct dynsec__rolelist *);
 
-/* FIXME - CACHE! */
+/* A note on the compiled publish ACLs.
+ *
+ * Publish checks are made for every message, so rather than walking every
+ * ACL of every role of a client and its groups, the publish ACLs that apply
+ * to a client are compiled into a trie of topic levels. Each ACL is given a
+ * rank from its position in the order the checks would otherwise be made in,
+ * and a lookup takes the matching ACL with the lowest rank, which is the same
+ * as the first match in that order.
+ *
+ * The trie for a client is built when it is first needed, and thrown away
+ * whenever something that it was built from changes. Only the clients
+ * affected by a change need to be rebuilt.
+ */
+
+struct dynsec__acl_trie{
+	UT_hash_handle hh;
+	struct dynsec__acl_trie *children;
+	char *level;
+	int rank; /* -1 if no ACL ends at this level */
+	bool allow;
+};
+
 
 /* ################################################################
  * #
- * # ACL check - publish broker to client
+ * # ACL index
  * #
  * ################################################################ */
 
-static int acl_check_publish_c_recv(struct mosquitto_evt_acl_check *ed, struct dynsec__rolelist *base_rolelist)
+static void acl_trie__free(struct dynsec__acl_trie **base_trie)
+{
+	struct dynsec__acl_trie *node, *node_tmp = NULL;
+
+	HASH_ITER(hh, *base_trie, node, node_tmp){
+		HASH_DELETE(hh, *base_trie, node);
+		acl_trie__free(&node->children);
+		mosquitto_free(node->level);
+		mosquitto_free(node);
+	}
+}
+
+
+static int acl_trie__add(struct dynsec__acl_trie **base_trie, const char *topic, bool allow, int rank)
+{
+	struct dynsec__acl_trie *node = NULL;
+	const char *start, *end;
+	size_t len;
+
+	if(mosquitto_sub_topic_check(topic) != MOSQ_ERR_SUCCESS){
+		/* Invalid ACL topics never match anything */
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	start = topic;
+	while(1){
+		end = strchr(start, '/');
+		if(end){
+			len = (size_t)(end - start);
+		}else{
+			len = strlen(start);
+		}
+
+		HASH_FIND(hh, *base_trie, start, len, node);
+		if(node == NULL){
+			node = mosquitto_calloc(1, sizeof(struct dynsec__acl_trie));
+			if(node == NULL) return MOSQ_ERR_NOMEM;
+			node->level = mosquitto_malloc(len+1);
+			if(node->level == NULL){
+				mosquitto_free(node);
+				return MOSQ_ERR_NOMEM;
+			}
+			memcpy(node->level, start, len);
+			node->level[len] = '\0';
+			node->rank = -1;
+			HASH_ADD_KEYPTR(hh, *base_trie, node->level, len, node);
+		}
+		if(end == NULL) break;
+
+		base_trie = &node->children;
+		start = end + 1;
+	}
+
+	/* ACLs are added in check order, so an existing ACL for the same topic
+	 * always takes precedence. */
+	if(node->rank == -1){
+		node->rank = rank;
+		node->allow = allow;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static void acl_trie__best(struct dynsec__acl_trie *node, struct dynsec__acl_trie **best)
+{
+	if(node && node->rank != -1){
+		if(*best == NULL || node->rank < (*best)->rank){
+			*best = node;
+		}
+	}
+}
+
+
+static void acl_trie__search(struct dynsec__acl_trie *base_trie, const char *topic, bool first, struct dynsec__acl_trie **best);
+
+static void acl_trie__step(struct dynsec__acl_trie *node, const char *end, struct dynsec__acl_trie **best)
+{
+	struct dynsec__acl_trie *multi;
+
+	if(node == NULL) return;
+
+	if(end){
+		acl_trie__search(node->children, end + 1, false, best);
+	}else{
+		acl_trie__best(node, best);
+		/* "a/#" also matches "a" */
+		HASH_FIND(hh, node->children, "#", 1, multi);
+		acl_trie__best(multi, best);
+	}
+}
+
+
+static void acl_trie__search(struct dynsec__acl_trie *base_trie, const char *topic, bool first, struct dynsec__acl_trie **best)
+{
+	struct dynsec__acl_trie *node;
+	const char *end;
+	size_t len;
+	bool wildcards;
+
+	if(base_trie == NULL) return;
+
+	/* Wildcards at the start of an ACL never match topics starting with $ */
+	wildcards = (first == false || topic[0] != '$');
+
+	if(wildcards){
+		HASH_FIND(hh, base_trie, "#", 1, node);
+		acl_trie__best(node, best);
+	}
+
+	end = strchr(topic, '/');
+	if(end){
+		len = (size_t)(end - topic);
+	}else{
+		len = strlen(topic);
+	}
+
+	HASH_FIND(hh, base_trie, topic, len, node);
+	acl_trie__step(node, end, best);
+
+	if(wildcards){
+		HASH_FIND(hh, base_trie, "+", 1, node);
+		acl_trie__step(node, end, best);
+	}
+}
+
+
+static int acl_index__add_rolelist(struct dynsec__acl_index *acl_index, struct dynsec__rolelist *base_rolelist, int *rank)
 {
 	struct dynsec__rolelist *rolelist, *rolelist_tmp = NULL;
 	struct dynsec__acl *acl, *acl_tmp = NULL;
-	bool result;
+	int rc;
 
 	HASH_ITER(hh, base_rolelist, rolelist, rolelist_tmp){
+		HASH_ITER(hh, rolelist->role->acls.publish_c_send, acl, acl_tmp){
+			rc = acl_trie__add(&acl_index->publish_c_send, acl->topic, acl->allow, (*rank)++);
+			if(rc) return rc;
+		}
 		HASH_ITER(hh, rolelist->role->acls.publish_c_recv, acl, acl_tmp){
-			mosquitto_topic_matches_sub(acl->topic, ed->topic, &result);
-			if(result){
-				if(acl->allow){
-					return MOSQ_ERR_SUCCESS;
-				}else{
-					return MOSQ_ERR_ACL_DENIED;
-				}
-			}
+			rc = acl_trie__add(&acl_index->publish_c_recv, acl->topic, acl->allow, (*rank)++);
+			if(rc) return rc;
 		}
 	}
-	return MOSQ_ERR_NOT_FOUND;
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static int acl_index__build(struct dynsec__acl_index *acl_index, struct dynsec__rolelist *base_rolelist, struct dynsec__grouplist *base_grouplist)
+{
+	struct dynsec__grouplist *grouplist, *grouplist_tmp = NULL;
+	int rank = 0;
+	int rc;
+
+	/* Same order as acl_check(): client roles, then group roles */
+	rc = acl_index__add_rolelist(acl_index, base_rolelist, &rank);
+	if(rc == MOSQ_ERR_SUCCESS){
+		HASH_ITER(hh, base_grouplist, grouplist, grouplist_tmp){
+			rc = acl_index__add_rolelist(acl_index, grouplist->group->rolelist, &rank);
+			if(rc) break;
+		}
+	}
+	if(rc){
+		dynsec__acl_index_free(acl_index);
+		return rc;
+	}
+
+	acl_index->valid = true;
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+void dynsec__acl_index_free(struct dynsec__acl_index *acl_index)
+{
+	acl_trie__free(&acl_index->publish_c_send);
+	acl_trie__free(&acl_index->publish_c_recv);
+	acl_index->valid = false;
+}
+
+
+void dynsec__acl_invalidate_client(struct dynsec__client *client)
+{
+	dynsec__acl_index_free(&client->acl_index);
+}
+
+
+void dynsec__acl_invalidate_group(struct dynsec__group *group)
+{
+	struct dynsec__clientlist *clientlist, *clientlist_tmp = NULL;
+
+	dynsec__acl_index_free(&group->acl_index);
+
+	HASH_ITER(hh, group->clientlist, clientlist, clientlist_tmp){
+		dynsec__acl_invalidate_client(clientlist->client);
+	}
+}
+
+
+void dynsec__acl_invalidate_role(struct dynsec__role *role)
+{
+	struct dynsec__clientlist *clientlist, *clientlist_tmp = NULL;
+	struct dynsec__grouplist *grouplist, *grouplist_tmp = NULL;
+
+	HASH_ITER(hh, role->clientlist, clientlist, clientlist_tmp){
+		dynsec__acl_invalidate_client(clientlist->client);
+	}
+	HASH_ITER(hh, role->grouplist, grouplist, grouplist_tmp){
+		dynsec__acl_invalidate_group(grouplist->group);
+	}
 }
 
 
 /* ################################################################
  * #
- * # ACL check - publish client to broker
+ * # ACL check - publish
  * #
  * ################################################################ */
 
-static int acl_check_publish_c_send(struct mosquitto_evt_acl_check *ed, struct dynsec__rolelist *base_rolelist)
+static int acl_check_publish(struct mosquitto_evt_acl_check *ed, struct dynsec__acl_index *acl_index, struct dynsec__rolelist *base_rolelist, struct dynsec__grouplist *base_grouplist)
 {
-	struct dynsec__rolelist *rolelist, *rolelist_tmp = NULL;
-	struct dynsec__acl *acl, *acl_tmp = NULL;
-	bool result;
+	struct dynsec__acl_trie *best = NULL;
+	int rc;
 
-	HASH_ITER(hh, base_rolelist, rolelist, rolelist_tmp){
-		HASH_ITER(hh, rolelist->role->acls.publish_c_send, acl, acl_tmp){
-			mosquitto_topic_matches_sub(acl->topic, ed->topic, &result);
-			if(result){
-				if(acl->allow){
-					return MOSQ_ERR_SUCCESS;
-				}else{
-					return MOSQ_ERR_ACL_DENIED;
-				}
-			}
-		}
+	if(acl_index->valid == false){
+		rc = acl_index__build(acl_index, base_rolelist, base_grouplist);
+		if(rc) return rc;
+	}
+
+	if(ed->access == MOSQ_ACL_WRITE){
+		/* Client to broker */
+		acl_trie__search(acl_index->publish_c_send, ed->topic, true, &best);
+	}else{
+		/* Broker to client */
+		acl_trie__search(acl_index->publish_c_recv, ed->topic, true, &best);
+	}
+
+	if(best == NULL){
+		return MOSQ_ERR_NOT_FOUND;
+	}else if(best->allow){
+		return MOSQ_ERR_SUCCESS;
+	}else{
+		return MOSQ_ERR_ACL_DENIED;
 	}
-	return MOSQ_ERR_NOT_FOUND;
 }
 
 
@@ -176,21 +393,33 @@ static int acl_check(struct mosquitto_evt_acl_check *ed, MOSQ_FUNC_acl_check che
 		client = dynsec_clients__find(username);
 		if(client == NULL) return MOSQ_ERR_PLUGIN_DEFER;
 
-		/* Client roles */
-		rc = check(ed, client->rolelist);
-		if(rc != MOSQ_ERR_NOT_FOUND){
-			return rc;
-		}
-
-		HASH_ITER(hh, client->grouplist, grouplist, grouplist_tmp){
-			rc = check(ed, grouplist->group->rolelist);
+		if(check == NULL){
+			/* Publish checks use the compiled client and group roles */
+			rc = acl_check_publish(ed, &client->acl_index, client->rolelist, client->grouplist);
+			if(rc != MOSQ_ERR_NOT_FOUND){
+				return rc;
+			}
+		}else{
+			/* Client roles */
+			rc = check(ed, client->rolelist);
 			if(rc != MOSQ_ERR_NOT_FOUND){
 				return rc;
 			}
+
+			HASH_ITER(hh, client->grouplist, grouplist, grouplist_tmp){
+				rc = check(ed, grouplist->group->rolelist);
+				if(rc != MOSQ_ERR_NOT_FOUND){
+					return rc;
+				}
+			}
 		}
 	}else if(dynsec_anonymous_group){
 		/* If we have a group for anonymous users, use that for checking. */
-		rc = check(ed, dynsec_anonymous_group->rolelist);
+		if(check == NULL){
+			rc = acl_check_publish(ed, &dynsec_anonymous_group->acl_index, dynsec_anonymous_group->rolelist, NULL);
+		}else{
+			rc = check(ed, dynsec_anonymous_group->rolelist);
+		}
 		if(rc != MOSQ_ERR_NOT_FOUND){
 			return rc;
 		}
@@ -241,10 +470,10 @@ int dynsec__acl_check_callback(int event, void *event_data, void *userdata)
 			return acl_check(event_data, acl_check_unsubscribe, default_access.unsubscribe);
 			break;
 		case MOSQ_ACL_WRITE: /* Client to broker */
-			return acl_check(event_data, acl_check_publish_c_send, default_access.publish_c_send);
+			return acl_check(event_data, NULL, default_access.publish_c_send);
 			break;
 		case MOSQ_ACL_READ:
-			return acl_check(event_data, acl_check_publish_c_recv, default_access.publish_c_recv);
+			return acl_check(event_data, NULL, default_access.publish_c_recv);
 			break;
 		default:
 			return MOSQ_ERR_PLUGIN_DEFER;
@@ -73,11 +73,23 @@ struct dynsec__rolelist{
 	int priority;
 };
 
+struct dynsec__acl_trie;
+
+/* The publish ACLs of all roles that apply to a client or group, compiled in
+ * priority order into a topic trie. Built when first needed and thrown away
+ * when any of the roles, or the roles or groups they come from, change. */
+struct dynsec__acl_index{
+	struct dynsec__acl_trie *publish_c_send;
+	struct dynsec__acl_trie *publish_c_recv;
+	bool valid;
+};
+
 struct dynsec__client{
 	UT_hash_handle hh;
 	struct mosquitto_pw pw;
 	struct dynsec__rolelist *rolelist;
 	struct dynsec__grouplist *grouplist;
+	struct dynsec__acl_index acl_index;
 	char *username;
 	char *clientid;
 	char *text_name;
@@ -89,6 +101,7 @@ struct dynsec__group{
 	UT_hash_handle hh;
 	struct dynsec__rolelist *rolelist;
 	struct dynsec__clientlist *clientlist;
+	struct dynsec__acl_index acl_index;
 	char *groupname;
 	char *text_name;
 	char *text_description;
@@ -138,6 +151,7 @@ extern struct dynsec__acl_default_access default_access;
  * ################################################################ */
 
 void dynsec__config_save(void);
+void dynsec__config_flush(void);
 int dynsec__handle_control(cJSON *j_responses, struct mosquitto *context, cJSON *commands);
 void dynsec__command_reply(cJSON *j_responses, struct mosquitto *context, const char *command, const char *error, const char *correlation_data);
 
@@ -149,6 +163,10 @@ void dynsec__command_reply(cJSON *j_responses, struct mosquitto *context, const
  * ################################################################ */
 
 int dynsec__acl_check_callback(int event, void *event_data, void *userdata);
+void dynsec__acl_index_free(struct dynsec__acl_index *acl_index);
+void dynsec__acl_invalidate_client(struct dynsec__client *client);
+void dynsec__acl_invalidate_group(struct dynsec__group *group);
+void dynsec__acl_invalidate_role(struct dynsec__role *role);
 bool sub_acl_check(const char *acl, const char *sub);
 
 
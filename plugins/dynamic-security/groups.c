@@ -65,6 +65,8 @@ static struct dynsec__group *local_groups = NULL;
 
 static void group__kick_all(struct dynsec__group *group)
 {
+	dynsec__acl_invalidate_group(group);
+
 	if(group == dynsec_anonymous_group){
 		mosquitto_kick_client_by_username(NULL, false);
 	}
@@ -106,6 +108,7 @@ static void group__free_item(struct dynsec__group *group)
 	mosquitto_free(group->text_description);
 	mosquitto_free(group->groupname);
 	dynsec_rolelist__cleanup(&group->rolelist);
+	dynsec__acl_index_free(&group->acl_index);
 	mosquitto_free(group);
 }
 
@@ -532,6 +535,7 @@ int dynsec_groups__add_client(const char *username, const char *groupname, int p
 		dynsec_clientlist__remove(&group->clientlist, client);
 		return rc;
 	}
+	dynsec__acl_invalidate_client(client);
 
 	if(update_config){
 		dynsec__config_save();
@@ -600,6 +604,7 @@ static int dynsec__remove_all_clients_from_group(struct dynsec__group *group)
 	HASH_ITER(hh, group->clientlist, clientlist, clientlist_tmp){
 		/* Remove client stored group reference */
 		dynsec_grouplist__remove(&clientlist->client->grouplist, group);
+		dynsec__acl_invalidate_client(clientlist->client);
 
 		HASH_DELETE(hh, group->clientlist, clientlist);
 		mosquitto_free(clientlist);
@@ -636,6 +641,7 @@ int dynsec_groups__remove_client(const char *username, const char *groupname, bo
 
 	dynsec_clientlist__remove(&group->clientlist, client);
 	dynsec_grouplist__remove(&client->grouplist, group);
+	dynsec__acl_invalidate_client(client);
 
 	if(update_config){
 		dynsec__config_save();
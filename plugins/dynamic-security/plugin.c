@@ -20,10 +20,12 @@ Contributors:
 
 #include <cjson/cJSON.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
 
 #ifndef WIN32
 #  include <strings.h>
@@ -39,6 +41,9 @@ Contributors:
 
 static mosquitto_plugin_id_t *plg_id = NULL;
 static char *config_file = NULL;
+static bool config_dirty = false;
+static int save_interval = 0;
+static time_t save_due = 0;
 struct dynsec__acl_default_access default_access = {false, false, false, false};
 
 #ifdef WIN32
@@ -316,6 +321,11 @@ static int dynsec_control_callback(int event, void *event_data, void *userdata)
 	dynsec__handle_control(j_responses, ed->client, commands);
 	cJSON_Delete(tree);
 
+	/* All of the commands in a single message are saved together */
+	if(save_interval == 0){
+		dynsec__config_flush();
+	}
+
 	send_response(j_response_tree);
 
 	return MOSQ_ERR_SUCCESS;
@@ -580,7 +590,19 @@ static int dynsec__config_load(void)
 }
 
 
+/* Changes are not written straight away, so that a batch of commands, or with
+ * save_interval set all of the commands in that time, result in a single
+ * write of the config file. */
 void dynsec__config_save(void)
+{
+	if(config_dirty == false){
+		config_dirty = true;
+		save_due = time(NULL) + save_interval;
+	}
+}
+
+
+static void dynsec__config_write(void)
 {
 	cJSON *tree;
 	size_t file_path_len;
@@ -589,6 +611,8 @@ void dynsec__config_save(void)
 	size_t json_str_len;
 	char *json_str;
 
+	config_dirty = false;
+
 	tree = cJSON_CreateObject();
 	if(tree == NULL) return;
 
@@ -640,6 +664,27 @@ void dynsec__config_save(void)
 }
 
 
+void dynsec__config_flush(void)
+{
+	if(config_dirty){
+		dynsec__config_write();
+	}
+}
+
+
+static int dynsec__tick_callback(int event, void *event_data, void *userdata)
+{
+	UNUSED(event);
+	UNUSED(event_data);
+	UNUSED(userdata);
+
+	if(config_dirty && time(NULL) >= save_due){
+		dynsec__config_write();
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
 int mosquitto_plugin_init(mosquitto_plugin_id_t *identifier, void **user_data, struct mosquitto_opt *options, int option_count)
 {
 	int i;
@@ -649,11 +694,26 @@ int mosquitto_plugin_init(mosquitto_plugin_id_t *identifier, void **user_data, s
 
 	for(i=0; i<option_count; i++){
 		if(!strcasecmp(options[i].key, "config_file")){
+			mosquitto_free(config_file);
 			config_file = mosquitto_strdup(options[i].value);
 			if(config_file == NULL){
 				return MOSQ_ERR_NOMEM;
 			}
-			break;
+		}else if(!strcasecmp(options[i].key, "save_interval")){
+			char *endptr = NULL;
+			long interval;
+
+			errno = 0;
+			interval = strtol(options[i].value, &endptr, 10);
+			if(errno || endptr == options[i].value || *endptr != '\0'
+					|| interval < 0 || interval > INT_MAX){
+
+				mosquitto_log_printf(MOSQ_LOG_ERR, "Error: Invalid save_interval value (%s).", options[i].value);
+				mosquitto_free(config_file);
+				config_file = NULL;
+				return MOSQ_ERR_INVAL;
+			}
+			save_interval = (int)interval;
 		}
 	}
 	if(config_file == NULL){
@@ -699,6 +759,18 @@ int mosquitto_plugin_init(mosquitto_plugin_id_t *identifier, void **user_data, s
 		goto error;
 	}
 
+	if(save_interval > 0){
+		/* Only ask for ticks when they are needed, they stop the broker
+		 * from sleeping for long. */
+		rc = mosquitto_callback_register(plg_id, MOSQ_EVT_TICK, dynsec__tick_callback, NULL, NULL);
+		if(rc == MOSQ_ERR_NOMEM){
+			mosquitto_log_printf(MOSQ_LOG_ERR, "Error: Out of memory.");
+			goto error;
+		}else if(rc != MOSQ_ERR_SUCCESS){
+			goto error;
+		}
+	}
+
 	return MOSQ_ERR_SUCCESS;
 error:
 	mosquitto_free(config_file);
@@ -716,6 +788,11 @@ int mosquitto_plugin_cleanup(void *user_data, struct mosquitto_opt *options, int
 		mosquitto_callback_unregister(plg_id, MOSQ_EVT_CONTROL, dynsec_control_callback, "$CONTROL/dynamic-security/v1");
 		mosquitto_callback_unregister(plg_id, MOSQ_EVT_BASIC_AUTH, dynsec_auth__basic_auth_callback, NULL);
 		mosquitto_callback_unregister(plg_id, MOSQ_EVT_ACL_CHECK, dynsec__acl_check_callback, NULL);
+		if(save_interval > 0){
+			mosquitto_callback_unregister(plg_id, MOSQ_EVT_TICK, dynsec__tick_callback, NULL);
+		}
+		/* Don't lose any changes that haven't been written yet */
+		dynsec__config_flush();
 	}
 	dynsec_groups__cleanup();
 	dynsec_clients__cleanup();
@@ -88,6 +88,7 @@ int dynsec_rolelist__client_remove(struct dynsec__client *client, struct dynsec_
 
 	rc = dynsec_rolelist__remove_role(&client->rolelist, role);
 	if(rc) return rc;
+	dynsec__acl_invalidate_client(client);
 
 	HASH_FIND(hh, role->clientlist, client->username, strlen(client->username), found_clientlist);
 	if(found_clientlist){
@@ -104,6 +105,7 @@ void dynsec_rolelist__group_remove(struct dynsec__group *group, struct dynsec__r
 {
 	dynsec_rolelist__remove_role(&group->rolelist, role);
 	dynsec_grouplist__remove(&role->grouplist, group);
+	dynsec__acl_invalidate_group(group);
 }
 
 
@@ -140,6 +142,7 @@ int dynsec_rolelist__client_add(struct dynsec__client *client, struct dynsec__ro
 
 	rc = dynsec_rolelist__add(&client->rolelist, role, priority);
 	if(rc) return rc;
+	dynsec__acl_invalidate_client(client);
 
 	HASH_FIND(hh, client->rolelist, role->rolename, strlen(role->rolename), rolelist);
 	if(rolelist == NULL){
@@ -157,6 +160,7 @@ int dynsec_rolelist__group_add(struct dynsec__group *group, struct dynsec__role
 
 	rc = dynsec_rolelist__add(&group->rolelist, role, priority);
 	if(rc) return rc;
+	dynsec__acl_invalidate_group(group);
 
 	return dynsec_grouplist__add(&role->grouplist, group, priority);
 }
@@ -121,6 +121,8 @@ static void role__kick_all(struct dynsec__role *role)
 {
 	struct dynsec__grouplist *grouplist, *grouplist_tmp = NULL;
 
+	dynsec__acl_invalidate_role(role);
+
 	dynsec_clientlist__kick_all(role->clientlist);
 
 	HASH_ITER(hh, role->grouplist, grouplist, grouplist_tmp){
@@ -909,6 +911,7 @@ int dynsec_roles__process_modify(cJSON *j_responses, struct mosquitto *context,
 		role->acls.subscribe_pattern = tmp_subscribe_pattern;
 		role->acls.unsubscribe_literal = tmp_unsubscribe_literal;
 		role->acls.unsubscribe_pattern = tmp_unsubscribe_pattern;
+		dynsec__acl_invalidate_role(role);
 	}
 
 	dynsec__config_save();
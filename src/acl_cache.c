@@ -0,0 +1,160 @@
+/*
+Copyright (c) 2026 Contributors to the Eclipse Foundation
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License 2.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   https://www.eclipse.org/legal/epl-2.0/
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+SPDX-License-Identifier: EPL-2.0 OR BSD-3-Clause
+
+Contributors:
+   Eclipse Mosquitto contributors - initial implementation and documentation.
+*/
+
+/* A note on the ACL decision cache.
+ *
+ * Every message delivered to a client needs an ACL check, which runs all of
+ * the ACL plugins in turn. With many subscribers to the same topics the same
+ * check for the same client is repeated for every message.
+ *
+ * Each client has its own cache, mapping a topic to the access types that
+ * have been checked for it and whether they were allowed. A result is only
+ * cached if every plugin that was asked marked it as cacheable, meaning it
+ * depends only on the client, the topic and the access type, and not on the
+ * payload or anything else in the message. Plugin callbacks do this by
+ * setting `cacheable` in the event data. The default ACL file checker always
+ * does.
+ *
+ * The cache for a client is flushed when its username is changed by a
+ * plugin, and when it is kicked by a plugin, which is what plugins do when
+ * the access a client has changes. The caches for all clients are flushed
+ * when the configuration is reloaded. Flushing the cache also invalidates the
+ * read verdicts stored with the client's subscriptions, by changing
+ * context->acl_generation.
+ *
+ * The number of topics cached for each client is limited by acl_cache_size,
+ * with the least recently used topic being evicted when the cache is full.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "mosquitto_broker_internal.h"
+#include "memory_mosq.h"
+#include "sys_tree.h"
+
+#include "utlist.h"
+
+struct mosquitto__acl_cache {
+	UT_hash_handle hh;
+	struct mosquitto__acl_cache *prev, *next;
+	uint8_t known; /* Access types with a cached result */
+	uint8_t allowed; /* Access types that were allowed */
+	char topic[];
+};
+
+
+static void acl__cache_entry_free(struct mosquitto *context, struct mosquitto__acl_cache *entry)
+{
+	HASH_DELETE(hh, context->acl_cache, entry);
+	DL_DELETE(context->acl_cache_lru, entry);
+	context->acl_cache_count--;
+	mosquitto__free(entry);
+}
+
+
+bool acl__cache_lookup(struct mosquitto *context, const char *topic, int access, int *rc)
+{
+	struct mosquitto__acl_cache *entry;
+
+	if(db.config->acl_cache_size <= 0){
+		return false;
+	}
+
+	HASH_FIND(hh, context->acl_cache, topic, strlen(topic), entry);
+	if(entry == NULL || (entry->known & access) == 0){
+		G_ACL_CACHE_MISSES_INC();
+		return false;
+	}
+	G_ACL_CACHE_HITS_INC();
+
+	if(entry != context->acl_cache_lru){
+		DL_DELETE(context->acl_cache_lru, entry);
+		DL_PREPEND(context->acl_cache_lru, entry);
+	}
+	if(entry->allowed & access){
+		*rc = MOSQ_ERR_SUCCESS;
+	}else{
+		*rc = MOSQ_ERR_ACL_DENIED;
+	}
+	return true;
+}
+
+
+void acl__cache_add(struct mosquitto *context, const char *topic, int access, int rc)
+{
+	struct mosquitto__acl_cache *entry;
+	size_t topic_len;
+
+	if(db.config->acl_cache_size <= 0){
+		return;
+	}
+	if(rc != MOSQ_ERR_SUCCESS && rc != MOSQ_ERR_ACL_DENIED){
+		/* Errors are not decisions */
+		return;
+	}
+
+	topic_len = strlen(topic);
+	HASH_FIND(hh, context->acl_cache, topic, topic_len, entry);
+	if(entry == NULL){
+		if(context->acl_cache_count >= db.config->acl_cache_size){
+			/* The tail of the list is the least recently used entry */
+			acl__cache_entry_free(context, context->acl_cache_lru->prev);
+		}
+
+		entry = mosquitto__calloc(1, sizeof(struct mosquitto__acl_cache) + topic_len + 1);
+		if(entry == NULL){
+			return;
+		}
+		memcpy(entry->topic, topic, topic_len);
+		entry->topic[topic_len] = '\0';
+
+		HASH_ADD_KEYPTR(hh, context->acl_cache, entry->topic, topic_len, entry);
+		DL_PREPEND(context->acl_cache_lru, entry);
+		context->acl_cache_count++;
+	}
+
+	entry->known |= (uint8_t)access;
+	if(rc == MOSQ_ERR_SUCCESS){
+		entry->allowed |= (uint8_t)access;
+	}else{
+		entry->allowed &= (uint8_t)~access;
+	}
+}
+
+
+void acl__cache_flush(struct mosquitto *context)
+{
+	/* Read verdicts stored with subscriptions are no longer valid */
+	context->acl_generation++;
+
+	while(context->acl_cache_lru){
+		acl__cache_entry_free(context, context->acl_cache_lru);
+	}
+}
+
+
+void acl__cache_flush_all(void)
+{
+	struct mosquitto *context, *ctxt_tmp;
+
+	HASH_ITER(hh_id, db.contexts_by_id, context, ctxt_tmp){
+		acl__cache_flush(context);
+	}
+}
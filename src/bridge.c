@@ -128,7 +128,7 @@ int bridge__new(struct mosquitto__bridge *bridge)
 	new_context->protocol = bridge->protocol_version;
 	if(!bridge->clean_start_local){
 		new_context->session_expiry_interval = UINT32_MAX;
-		if(new_context->expiry_list_item){
+		if(session_expiry__is_pending(new_context)){
 			/* We've restored from persistence and been added to the session
 			 * expiry list, even though we should never be expired */
 			session_expiry__remove(new_context);
@@ -644,14 +644,14 @@ void bridge__packet_cleanup(struct mosquitto *context)
 
 	if(context->current_out_packet){
 		packet__cleanup(context->current_out_packet);
-		mosquitto__free(context->current_out_packet);
+		packet__free(context->current_out_packet);
 		context->current_out_packet = NULL;
 	}
 	while(context->out_packet){
 		packet__cleanup(context->out_packet);
 		packet = context->out_packet;
 		context->out_packet = context->out_packet->next;
-		mosquitto__free(packet);
+		packet__free(packet);
 	}
 	context->out_packet = NULL;
 	context->out_packet_last = NULL;
@@ -735,6 +735,10 @@ void bridge_check(void)
 	int rc;
 	int err;
 
+	if(db.bridge_count > 0){
+		/* Bridges are checked once a second */
+		loop__update_next_event(1000);
+	}
 	if(db.now_s <= last_check) return;
 
 	for(i=0; i<db.bridge_count; i++){
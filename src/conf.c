@@ -155,6 +155,7 @@ static void config__init_reload(struct mosquitto__config *config)
 
 	config->autosave_interval = 1800;
 	config->autosave_on_changes = false;
+	config->autosave_background = false;
 	mosquitto__free(config->clientid_prefixes);
 	config->connection_messages = true;
 	config->clientid_prefixes = NULL;
@@ -191,6 +192,8 @@ static void config__init_reload(struct mosquitto__config *config)
 	config->max_packet_size = 0;
 	config->max_inflight_messages = 20;
 	config->max_queued_messages = 1000;
+	config->accept_batch_size = 64;
+	config->acl_cache_size = 0;
 	config->max_inflight_bytes = 0;
 	config->max_queued_bytes = 0;
 	config->persistence = false;
@@ -198,10 +201,11 @@ static void config__init_reload(struct mosquitto__config *config)
 	config->persistence_location = NULL;
 	mosquitto__free(config->persistence_file);
 	config->persistence_file = NULL;
+	config->persistence_journal = false;
 	config->persistent_client_expiration = 0;
 	config->queue_qos0_messages = false;
 	config->retain_available = true;
-	config->retain_expiry_interval = 0;
+	config->retain_delivery_batch_size = 1000;
 	config->set_tcp_nodelay = false;
 	config->sys_interval = 10;
 	config->upgrade_outgoing_qos = false;
@@ -285,6 +289,8 @@ void config__cleanup(struct mosquitto__config *config)
 			mosquitto__free(config->listeners[i].psk_hint);
 			mosquitto__free(config->listeners[i].crlfile);
 			mosquitto__free(config->listeners[i].dhparamfile);
+			mosquitto__free(config->listeners[i].tls_ticket_key_file);
+			mosquitto__free(config->listeners[i].tls_ticket_keys);
 			mosquitto__free(config->listeners[i].tls_version);
 			mosquitto__free(config->listeners[i].tls_engine);
 			mosquitto__free(config->listeners[i].tls_engine_kpass_sha1);
@@ -434,6 +440,10 @@ int config__parse_args(struct mosquitto__config *config, int argc, char *argv[])
 			|| config->default_listener.ciphers
 			|| config->default_listener.ciphers_tls13
 			|| config->default_listener.dhparamfile
+			|| config->default_listener.tls_ticket_key_file
+			|| config->default_listener.tls_session_cache_size != -1
+			|| config->default_listener.tls_session_tickets != true
+			|| config->default_listener.tls_ktls != false
 			|| config->default_listener.psk_hint
 			|| config->default_listener.require_certificate
 			|| config->default_listener.crlfile
@@ -444,6 +454,7 @@ int config__parse_args(struct mosquitto__config *config, int argc, char *argv[])
 			|| config->default_listener.host
 			|| config->default_listener.port
 			|| config->default_listener.max_connections != -1
+			|| config->default_listener.reuse_port_sockets != 1
 			|| config->default_listener.max_qos != 2
 			|| config->default_listener.mount_point
 			|| config->default_listener.protocol != mp_mqtt
@@ -478,6 +489,7 @@ int config__parse_args(struct mosquitto__config *config, int argc, char *argv[])
 		}
 		config->listeners[config->listener_count-1].bind_interface = config->default_listener.bind_interface;
 		config->listeners[config->listener_count-1].max_connections = config->default_listener.max_connections;
+		config->listeners[config->listener_count-1].reuse_port_sockets = config->default_listener.reuse_port_sockets;
 		config->listeners[config->listener_count-1].protocol = config->default_listener.protocol;
 		config->listeners[config->listener_count-1].socket_domain = config->default_listener.socket_domain;
 		config->listeners[config->listener_count-1].socks = NULL;
@@ -498,6 +510,10 @@ int config__parse_args(struct mosquitto__config *config, int argc, char *argv[])
 		config->listeners[config->listener_count-1].ciphers = config->default_listener.ciphers;
 		config->listeners[config->listener_count-1].ciphers_tls13 = config->default_listener.ciphers_tls13;
 		config->listeners[config->listener_count-1].dhparamfile = config->default_listener.dhparamfile;
+		config->listeners[config->listener_count-1].tls_ticket_key_file = config->default_listener.tls_ticket_key_file;
+		config->listeners[config->listener_count-1].tls_session_cache_size = config->default_listener.tls_session_cache_size;
+		config->listeners[config->listener_count-1].tls_session_tickets = config->default_listener.tls_session_tickets;
+		config->listeners[config->listener_count-1].tls_ktls = config->default_listener.tls_ktls;
 		config->listeners[config->listener_count-1].psk_hint = config->default_listener.psk_hint;
 		config->listeners[config->listener_count-1].require_certificate = config->default_listener.require_certificate;
 		config->listeners[config->listener_count-1].ssl_ctx = NULL;
@@ -551,6 +567,7 @@ static void config__copy(struct mosquitto__config *src, struct mosquitto__config
 
 	dest->autosave_interval = src->autosave_interval;
 	dest->autosave_on_changes = src->autosave_on_changes;
+	dest->autosave_background = src->autosave_background;
 
 	mosquitto__free(dest->clientid_prefixes);
 	dest->clientid_prefixes = src->clientid_prefixes;
@@ -580,6 +597,8 @@ static void config__copy(struct mosquitto__config *src, struct mosquitto__config
 	mosquitto__free(dest->persistence_filepath);
 	dest->persistence_filepath = src->persistence_filepath;
 
+	dest->persistence_journal = src->persistence_journal;
+
 	dest->persistent_client_expiration = src->persistent_client_expiration;
 
 
@@ -763,7 +782,19 @@ static int config__read_file_core(struct mosquitto__config *config, bool reload,
 			}
 			token = strtok_r((*buf), " ", &saveptr);
 			if(token){
-				if(!strcmp(token, "acl_file")){
+				if(!strcmp(token, "accept_batch_size")){
+					if(conf__parse_int(&token, "accept_batch_size", &config->accept_batch_size, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->accept_batch_size < 1){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid accept_batch_size value (%d).", config->accept_batch_size);
+						return MOSQ_ERR_INVAL;
+					}
+				}else if(!strcmp(token, "acl_cache_size")){
+					if(conf__parse_int(&token, "acl_cache_size", &config->acl_cache_size, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->acl_cache_size < 0){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid acl_cache_size value (%d).", config->acl_cache_size);
+						return MOSQ_ERR_INVAL;
+					}
+				}else if(!strcmp(token, "acl_file")){
 					conf__set_cur_security_options(config, cur_listener, &cur_security_options);
 					if(reload){
 						mosquitto__free(cur_security_options->acl_file);
@@ -918,6 +949,13 @@ static int config__read_file_core(struct mosquitto__config *config, bool reload,
 					if(config->autosave_interval < 0) config->autosave_interval = 0;
 				}else if(!strcmp(token, "autosave_on_changes")){
 					if(conf__parse_bool(&token, "autosave_on_changes", &config->autosave_on_changes, saveptr)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "autosave_background")){
+					if(conf__parse_bool(&token, "autosave_background", &config->autosave_background, saveptr)) return MOSQ_ERR_INVAL;
+#ifdef WIN32
+					if(config->autosave_background){
+						log__printf(NULL, MOSQ_LOG_WARNING, "Warning: autosave_background is not available on Windows, saves will be made in the foreground.");
+					}
+#endif
 				}else if(!strcmp(token, "bind_address")){
 					log__printf(NULL, MOSQ_LOG_NOTICE, "The 'bind_address' option is now deprecated and will be removed in a future version. The behaviour will default to true.");
 					config->local_only = false;
@@ -1353,6 +1391,19 @@ static int config__read_file_core(struct mosquitto__config *config, bool reload,
 						mosquitto__free(files);
 						if(rc) return rc; /* This returns if config__read_file() fails above */
 					}
+				}else if(!strcmp(token, "io_threads")){
+					if(reload) continue; /* Not valid for reloading. */
+					if(conf__parse_int(&token, "io_threads", &config->io_threads, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->io_threads < 0 || config->io_threads > 1024){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid io_threads value (%d).", config->io_threads);
+						return MOSQ_ERR_INVAL;
+					}
+#ifndef WITH_EPOLL
+					if(config->io_threads > 0){
+						log__printf(NULL, MOSQ_LOG_WARNING, "Warning: io_threads is only supported when compiled with epoll support.");
+						config->io_threads = 0;
+					}
+#endif
 				}else if(!strcmp(token, "keepalive_interval")){
 #ifdef WITH_BRIDGE
 					if(reload) continue; /* FIXME */
@@ -1785,6 +1836,8 @@ static int config__read_file_core(struct mosquitto__config *config, bool reload,
 					if(conf__parse_bool(&token, token, &config->persistence, saveptr)) return MOSQ_ERR_INVAL;
 				}else if(!strcmp(token, "persistence_file")){
 					if(conf__parse_string(&token, "persistence_file", &config->persistence_file, saveptr)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "persistence_journal")){
+					if(conf__parse_bool(&token, "persistence_journal", &config->persistence_journal, saveptr)) return MOSQ_ERR_INVAL;
 				}else if(!strcmp(token, "persistence_location")){
 					if(conf__parse_string(&token, "persistence_location", &config->persistence_location, saveptr)) return MOSQ_ERR_INVAL;
 				}else if(!strcmp(token, "persistent_client_expiration")){
@@ -1918,11 +1971,29 @@ static int config__read_file_core(struct mosquitto__config *config, bool reload,
 #endif
 				}else if(!strcmp(token, "retain_available")){
 					if(conf__parse_bool(&token, token, &config->retain_available, saveptr)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "retain_delivery_batch_size")){
+					if(conf__parse_int(&token, "retain_delivery_batch_size", &config->retain_delivery_batch_size, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->retain_delivery_batch_size < 0){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid retain_delivery_batch_size value (%d).", config->retain_delivery_batch_size);
+						return MOSQ_ERR_INVAL;
+					}
 				}else if(!strcmp(token, "retain_expiry_interval")){
-					if(conf__parse_int(&token, token, &config->retain_expiry_interval, saveptr)) return MOSQ_ERR_INVAL;
-					config->retain_expiry_interval *= 60;
+					log__printf(NULL, MOSQ_LOG_NOTICE, "The 'retain_expiry_interval' option is now deprecated and will be removed in a future version. Expired retained messages are always removed when they expire.");
 				}else if(!strcmp(token, "retry_interval")){
 					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: The retry_interval option is no longer available.");
+				}else if(!strcmp(token, "reuse_port_sockets")){
+					if(reload) continue; /* Listeners not valid for reloading. */
+					if(conf__parse_int(&token, "reuse_port_sockets", &cur_listener->reuse_port_sockets, saveptr)) return MOSQ_ERR_INVAL;
+					if(cur_listener->reuse_port_sockets < 1 || cur_listener->reuse_port_sockets > 64){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid reuse_port_sockets value (%d).", cur_listener->reuse_port_sockets);
+						return MOSQ_ERR_INVAL;
+					}
+#ifndef SO_REUSEPORT
+					if(cur_listener->reuse_port_sockets > 1){
+						log__printf(NULL, MOSQ_LOG_WARNING, "Warning: reuse_port_sockets is not supported on this platform.");
+						cur_listener->reuse_port_sockets = 1;
+					}
+#endif
 				}else if(!strcmp(token, "round_robin")){
 #ifdef WITH_BRIDGE
 					if(reload) continue; /* FIXME */
@@ -1981,6 +2052,13 @@ static int config__read_file_core(struct mosquitto__config *config, bool reload,
 						log__printf(NULL, MOSQ_LOG_ERR, "Error: Empty socket_domain value in configuration.");
 						return MOSQ_ERR_INVAL;
 					}
+				}else if(!strcmp(token, "subscription_cache_size")){
+					if(reload) continue; /* Not valid for reloading. */
+					if(conf__parse_int(&token, "subscription_cache_size", &config->subscription_cache_size, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->subscription_cache_size < 0){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid subscription_cache_size value (%d).", config->subscription_cache_size);
+						return MOSQ_ERR_INVAL;
+					}
 				}else if(!strcmp(token, "sys_interval")){
 					if(conf__parse_int(&token, "sys_interval", &config->sys_interval, saveptr)) return MOSQ_ERR_INVAL;
 					if(config->sys_interval < 0 || config->sys_interval > 65535){
@@ -2021,6 +2099,19 @@ static int config__read_file_core(struct mosquitto__config *config, bool reload,
 					mosquitto__free(kpass_sha);
 #else
 					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: TLS support not available.");
+#endif
+				}else if(!strcmp(token, "tls_handshake_threads")){
+					if(reload) continue; /* Not valid for reloading. */
+					if(conf__parse_int(&token, "tls_handshake_threads", &config->tls_handshake_threads, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->tls_handshake_threads < 0 || config->tls_handshake_threads > 1024){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid tls_handshake_threads value (%d).", config->tls_handshake_threads);
+						return MOSQ_ERR_INVAL;
+					}
+#if !defined(WITH_EPOLL) || !defined(WITH_TLS)
+					if(config->tls_handshake_threads > 0){
+						log__printf(NULL, MOSQ_LOG_WARNING, "Warning: tls_handshake_threads is only supported when compiled with epoll and TLS support.");
+						config->tls_handshake_threads = 0;
+					}
 #endif
 				}else if(!strcmp(token, "tls_keyform")){
 #ifdef WITH_TLS
@@ -2032,6 +2123,44 @@ static int config__read_file_core(struct mosquitto__config *config, bool reload,
 					mosquitto__free(keyform);
 #else
 					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: TLS support not available.");
+#endif
+				}else if(!strcmp(token, "tls_ktls")){
+#ifdef WITH_TLS
+					if(reload) continue; /* Listeners not valid for reloading. */
+					if(conf__parse_bool(&token, "tls_ktls", &cur_listener->tls_ktls, saveptr)) return MOSQ_ERR_INVAL;
+#  ifndef FINAL_WITH_TLS_KTLS
+					if(cur_listener->tls_ktls){
+						log__printf(NULL, MOSQ_LOG_WARNING, "Warning: tls_ktls is only supported on Linux with OpenSSL 3.0 or later built with kTLS support.");
+						cur_listener->tls_ktls = false;
+					}
+#  endif
+#else
+					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: TLS support not available.");
+#endif
+				}else if(!strcmp(token, "tls_session_cache_size")){
+#ifdef WITH_TLS
+					if(reload) continue; /* Listeners not valid for reloading. */
+					if(conf__parse_int(&token, "tls_session_cache_size", &cur_listener->tls_session_cache_size, saveptr)) return MOSQ_ERR_INVAL;
+					if(cur_listener->tls_session_cache_size < 0){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid tls_session_cache_size value (%d).", cur_listener->tls_session_cache_size);
+						return MOSQ_ERR_INVAL;
+					}
+#else
+					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: TLS support not available.");
+#endif
+				}else if(!strcmp(token, "tls_session_tickets")){
+#ifdef WITH_TLS
+					if(reload) continue; /* Listeners not valid for reloading. */
+					if(conf__parse_bool(&token, "tls_session_tickets", &cur_listener->tls_session_tickets, saveptr)) return MOSQ_ERR_INVAL;
+#else
+					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: TLS support not available.");
+#endif
+				}else if(!strcmp(token, "tls_ticket_key_file")){
+#ifdef WITH_TLS
+					if(reload) continue; /* Listeners not valid for reloading. */
+					if(conf__parse_string(&token, "tls_ticket_key_file", &cur_listener->tls_ticket_key_file, saveptr)) return MOSQ_ERR_INVAL;
+#else
+					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: TLS support not available.");
 #endif
 				}else if(!strcmp(token, "tls_version")){
 #if defined(WITH_TLS)
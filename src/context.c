@@ -90,6 +90,7 @@ struct mosquitto *context__init(mosq_sock_t sock)
 #ifdef WITH_TLS
 	context->ssl = NULL;
 #endif
+	context->dest_id = db__dest_id_get();
 
 	if((int)context->sock >= 0){
 		HASH_ADD(hh_sock, db.contexts_by_sock, sock, sizeof(context->sock), context);
@@ -105,14 +106,14 @@ static void context__cleanup_out_packets(struct mosquitto *context)
 
 	if(context->current_out_packet){
 		packet__cleanup(context->current_out_packet);
-		mosquitto__free(context->current_out_packet);
+		packet__free(context->current_out_packet);
 		context->current_out_packet = NULL;
 	}
 	while(context->out_packet){
 		packet__cleanup(context->out_packet);
 		packet = context->out_packet;
 		context->out_packet = context->out_packet->next;
-		mosquitto__free(packet);
+		packet__free(packet);
 	}
 	context->out_packet_count = 0;
 }
@@ -147,6 +148,8 @@ void context__cleanup(struct mosquitto *context, bool force_free)
 
 	mosquitto__free(context->username);
 	context->username = NULL;
+	acl__free_acls(context);
+	acl__cache_flush(context);
 
 	mosquitto__free(context->password);
 	context->password = NULL;
@@ -154,6 +157,7 @@ void context__cleanup(struct mosquitto *context, bool force_free)
 	net__socket_close(context);
 	if(force_free){
 		sub__clean_session(context);
+		retain__cursors_free(context);
 	}
 	db__messages_delete(context, force_free);
 
@@ -177,6 +181,9 @@ void context__cleanup(struct mosquitto *context, bool force_free)
 	}
 #endif
 	if(force_free){
+		session_expiry__remove(context);
+		will_delay__remove(context);
+		db__dest_id_release(context->dest_id);
 		mosquitto__free(context);
 	}
 }
@@ -236,6 +243,11 @@ void context__disconnect(struct mosquitto *context)
 			}
 		}else{
 			session_expiry__add(context);
+			/* Inflight messages can expire now the client has gone */
+			db__message_expiry_update(context);
+#ifdef WITH_PERSISTENCE
+			persist__journal_client(context);
+#endif
 		}
 	}
 	keepalive__remove(context);
@@ -248,6 +260,10 @@ void context__add_to_disused(struct mosquitto *context)
 
 	mosquitto__set_state(context, mosq_cs_disused);
 
+#ifdef WITH_PERSISTENCE
+	/* The session has ended */
+	persist__journal_client_remove(context);
+#endif
 	if(context->id){
 		context__remove_from_by_id(context);
 		mosquitto__free(context->id);
@@ -29,6 +29,16 @@ Contributors:
 #include "time_mosq.h"
 #include "util_mosq.h"
 
+static struct mosquitto__pool msg_store_pool = MOSQUITTO__POOL_INIT("msg_store", sizeof(struct mosquitto_msg_store));
+static struct mosquitto__pool client_msg_pool = MOSQUITTO__POOL_INIT("client_msg", sizeof(struct mosquitto_client_msg));
+
+/* Released dest_ids, reused before new ids are handed out so that ids stay
+ * dense and the dest_bits bitmaps stay small. */
+static uint32_t *free_dest_ids = NULL;
+static size_t free_dest_id_count = 0;
+static size_t free_dest_id_max = 0;
+static uint32_t next_dest_id = 0;
+
 /**
  * Is this context ready to take more in flight messages right now?
  * @param context the client context of interest
@@ -235,7 +245,6 @@ static void subhier_clean(struct mosquitto__subhier **subhier)
 			leaf = nextleaf;
 		}
 		subhier_clean(&peer->children);
-		mosquitto__free(peer->topic);
 
 		HASH_DELETE(hh, *subhier, peer);
 		mosquitto__free(peer);
@@ -244,11 +253,112 @@ static void subhier_clean(struct mosquitto__subhier **subhier)
 
 int db__close(void)
 {
+	sub__cache_clean();
 	subhier_clean(&db.normal_subs);
 	subhier_clean(&db.shared_subs);
 	retain__clean(&db.retains);
 	db__msg_store_clean();
 
+	mosquitto__free(free_dest_ids);
+	free_dest_ids = NULL;
+	free_dest_id_count = 0;
+	free_dest_id_max = 0;
+	next_dest_id = 0;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+uint32_t db__dest_id_get(void)
+{
+	if(free_dest_id_count > 0){
+		free_dest_id_count--;
+		return free_dest_ids[free_dest_id_count];
+	}
+	return next_dest_id++;
+}
+
+
+void db__dest_id_release(uint32_t dest_id)
+{
+	uint32_t *ids;
+	size_t max;
+
+	if(free_dest_id_count == free_dest_id_max){
+		max = free_dest_id_max ? free_dest_id_max*2 : 64;
+		ids = mosquitto__realloc(free_dest_ids, sizeof(uint32_t)*max);
+		if(ids == NULL){
+			/* The id is lost, which is harmless */
+			return;
+		}
+		free_dest_ids = ids;
+		free_dest_id_max = max;
+	}
+	free_dest_ids[free_dest_id_count] = dest_id;
+	free_dest_id_count++;
+}
+
+
+/* Has this message already been queued for the client with this dest_id? */
+static bool db__msg_store_dest_check(const struct mosquitto_msg_store *stored, uint32_t dest_id)
+{
+	uint32_t word = dest_id/64;
+
+	if(stored->dest_bits == NULL || word < stored->dest_base || word - stored->dest_base >= stored->dest_words){
+		return false;
+	}
+	return (stored->dest_bits[word - stored->dest_base] & ((uint64_t)1 << (dest_id%64))) != 0;
+}
+
+
+/* Record that this message has been queued for the client with this dest_id.
+ * The bitmap only covers the range of ids it has seen, so a message sent to a
+ * single client only needs a single word. */
+static int db__msg_store_dest_add(struct mosquitto_msg_store *stored, uint32_t dest_id)
+{
+	uint32_t word = dest_id/64;
+	uint32_t words, max_words;
+	uint64_t *bits;
+
+	if(stored->dest_bits == NULL){
+		stored->dest_bits = mosquitto__calloc(1, sizeof(uint64_t));
+		if(stored->dest_bits == NULL){
+			return MOSQ_ERR_NOMEM;
+		}
+		stored->dest_base = word;
+		stored->dest_words = 1;
+	}else if(word < stored->dest_base){
+		words = stored->dest_base + stored->dest_words - word;
+		bits = mosquitto__calloc(words, sizeof(uint64_t));
+		if(bits == NULL){
+			return MOSQ_ERR_NOMEM;
+		}
+		memcpy(&bits[stored->dest_base - word], stored->dest_bits, sizeof(uint64_t)*stored->dest_words);
+		mosquitto__free(stored->dest_bits);
+		stored->dest_bits = bits;
+		stored->dest_base = word;
+		stored->dest_words = words;
+	}else if(word - stored->dest_base >= stored->dest_words){
+		/* Grow geometrically when fanning out to many clients, but never
+		 * beyond the highest id in use. */
+		words = word - stored->dest_base + 1;
+		max_words = next_dest_id/64 + 1 - stored->dest_base;
+		if(words < stored->dest_words*2){
+			words = stored->dest_words*2;
+			if(words > max_words){
+				words = max_words;
+			}
+		}
+		bits = mosquitto__realloc(stored->dest_bits, sizeof(uint64_t)*words);
+		if(bits == NULL){
+			return MOSQ_ERR_NOMEM;
+		}
+		memset(&bits[stored->dest_words], 0, sizeof(uint64_t)*(words - stored->dest_words));
+		stored->dest_bits = bits;
+		stored->dest_words = words;
+	}
+	stored->dest_bits[word - stored->dest_base] |= (uint64_t)1 << (dest_id%64);
+
 	return MOSQ_ERR_SUCCESS;
 }
 
@@ -264,22 +374,27 @@ void db__msg_store_add(struct mosquitto_msg_store *store)
 }
 
 
-void db__msg_store_free(struct mosquitto_msg_store *store)
+struct mosquitto_msg_store *db__msg_store_alloc(void)
+{
+	return mosquitto__pool_calloc(&msg_store_pool);
+}
+
+
+struct mosquitto_client_msg *db__client_msg_alloc(void)
 {
-	int i;
+	return mosquitto__pool_calloc(&client_msg_pool);
+}
+
 
+void db__msg_store_free(struct mosquitto_msg_store *store)
+{
 	mosquitto__free(store->source_id);
 	mosquitto__free(store->source_username);
-	if(store->dest_ids){
-		for(i=0; i<store->dest_id_count; i++){
-			mosquitto__free(store->dest_ids[i]);
-		}
-		mosquitto__free(store->dest_ids);
-	}
+	mosquitto__free(store->dest_bits);
 	mosquitto__free(store->topic);
 	mosquitto_property_free_all(&store->properties);
 	mosquitto__free(store->payload);
-	mosquitto__free(store);
+	mosquitto__pool_free(store);
 }
 
 void db__msg_store_remove(struct mosquitto_msg_store *store)
@@ -298,6 +413,9 @@ void db__msg_store_remove(struct mosquitto_msg_store *store)
 	db.msg_store_count--;
 	db.msg_store_bytes -= store->payloadlen;
 
+#ifdef WITH_PERSISTENCE
+	persist__journal_msg_store_remove(store);
+#endif
 	db__msg_store_free(store);
 }
 
@@ -344,12 +462,17 @@ void db__msg_store_compact(void)
 }
 
 
-static void db__message_remove_from_inflight(struct mosquitto_msg_data *msg_data, struct mosquitto_client_msg *item)
+static void db__message_remove_from_inflight(struct mosquitto *context, struct mosquitto_msg_data *msg_data, struct mosquitto_client_msg *item)
 {
 	if(!msg_data || !item){
 		return;
 	}
 
+#ifdef WITH_PERSISTENCE
+	persist__journal_client_msg_remove(context, item);
+#else
+	UNUSED(context);
+#endif
 	DL_DELETE(msg_data->inflight, item);
 	if(item->store){
 		db__msg_remove_from_inflight_stats(msg_data, item);
@@ -357,23 +480,28 @@ static void db__message_remove_from_inflight(struct mosquitto_msg_data *msg_data
 	}
 
 	mosquitto_property_free_all(&item->properties);
-	mosquitto__free(item);
+	mosquitto__pool_free(item);
 }
 
 
-static void db__message_remove_from_queued(struct mosquitto_msg_data *msg_data, struct mosquitto_client_msg *item)
+static void db__message_remove_from_queued(struct mosquitto *context, struct mosquitto_msg_data *msg_data, struct mosquitto_client_msg *item)
 {
 	if(!msg_data || !item){
 		return;
 	}
 
+#ifdef WITH_PERSISTENCE
+	persist__journal_client_msg_remove(context, item);
+#else
+	UNUSED(context);
+#endif
 	DL_DELETE(msg_data->queued, item);
 	if(item->store){
 		db__msg_store_ref_dec(&item->store);
 	}
 
 	mosquitto_property_free_all(&item->properties);
-	mosquitto__free(item);
+	mosquitto__pool_free(item);
 }
 
 
@@ -408,7 +536,7 @@ int db__message_delete_outgoing(struct mosquitto *context, uint16_t mid, enum mo
 			}else if(qos == 2 && tail->state != expect_state){
 				return MOSQ_ERR_PROTOCOL;
 			}
-			db__message_remove_from_inflight(&context->msgs_out, tail);
+			db__message_remove_from_inflight(context, &context->msgs_out, tail);
 			break;
 		}
 	}
@@ -445,8 +573,6 @@ int db__message_insert(struct mosquitto *context, uint16_t mid, enum mosquitto_m
 	struct mosquitto_msg_data *msg_data;
 	enum mosquitto_msg_state state = mosq_ms_invalid;
 	int rc = 0;
-	int i;
-	char **dest_ids;
 
 	assert(stored);
 	if(!context) return MOSQ_ERR_INVAL;
@@ -467,15 +593,12 @@ int db__message_insert(struct mosquitto *context, uint16_t mid, enum mosquitto_m
 	 */
 	if(context->protocol != mosq_p_mqtt5
 			&& db.config->allow_duplicate_messages == false
-			&& dir == mosq_md_out && retain == false && stored->dest_ids){
+			&& dir == mosq_md_out && retain == false
+			&& db__msg_store_dest_check(stored, context->dest_id)){
 
-		for(i=0; i<stored->dest_id_count; i++){
-			if(stored->dest_ids[i] && !strcmp(stored->dest_ids[i], context->id)){
-				/* We have already sent this message to this client. */
-				mosquitto_property_free_all(&properties);
-				return MOSQ_ERR_SUCCESS;
-			}
-		}
+		/* We have already sent this message to this client. */
+		mosquitto_property_free_all(&properties);
+		return MOSQ_ERR_SUCCESS;
 	}
 	if(context->sock == INVALID_SOCKET){
 		/* Client is not connected only queue messages with QoS>0. */
@@ -556,7 +679,7 @@ int db__message_insert(struct mosquitto *context, uint16_t mid, enum mosquitto_m
 	}
 #endif
 
-	msg = mosquitto__calloc(1, sizeof(struct mosquitto_client_msg));
+	msg = db__client_msg_alloc();
 	if(!msg) return MOSQ_ERR_NOMEM;
 	msg->prev = NULL;
 	msg->next = NULL;
@@ -582,6 +705,12 @@ int db__message_insert(struct mosquitto *context, uint16_t mid, enum mosquitto_m
 		DL_APPEND(msg_data->inflight, msg);
 		db__msg_add_to_inflight_stats(msg_data, msg);
 	}
+	if(stored->message_expiry_time && (state == mosq_ms_queued || context->sock == INVALID_SOCKET)){
+		db__message_expiry_add(context, stored->message_expiry_time);
+	}
+#ifdef WITH_PERSISTENCE
+	persist__journal_client_msg(context, msg);
+#endif
 
 	if(db.config->allow_duplicate_messages == false && dir == mosq_md_out && retain == false){
 		/* Record which client ids this message has been sent to so we can avoid duplicates.
@@ -591,15 +720,7 @@ int db__message_insert(struct mosquitto *context, uint16_t mid, enum mosquitto_m
 		 * multiple times for overlapping subscriptions, although this is only the
 		 * case for SUBSCRIPTION with multiple subs in so is a minor concern.
 		 */
-		dest_ids = mosquitto__realloc(stored->dest_ids, sizeof(char *)*(size_t)(stored->dest_id_count+1));
-		if(dest_ids){
-			stored->dest_ids = dest_ids;
-			stored->dest_id_count++;
-			stored->dest_ids[stored->dest_id_count-1] = mosquitto__strdup(context->id);
-			if(!stored->dest_ids[stored->dest_id_count-1]){
-				return MOSQ_ERR_NOMEM;
-			}
-		}else{
+		if(db__msg_store_dest_add(stored, context->dest_id)){
 			return MOSQ_ERR_NOMEM;
 		}
 	}
@@ -639,6 +760,9 @@ int db__message_update_outgoing(struct mosquitto *context, uint16_t mid, enum mo
 			}
 			tail->state = state;
 			tail->timestamp = db.now_s;
+#ifdef WITH_PERSISTENCE
+			persist__journal_client_msg_update(context, tail);
+#endif
 			return MOSQ_ERR_SUCCESS;
 		}
 	}
@@ -654,7 +778,7 @@ static void db__messages_delete_list(struct mosquitto_client_msg **head)
 		DL_DELETE(*head, tail);
 		db__msg_store_ref_dec(&tail->store);
 		mosquitto_property_free_all(&tail->properties);
-		mosquitto__free(tail);
+		mosquitto__pool_free(tail);
 	}
 	*head = NULL;
 }
@@ -691,10 +815,81 @@ int db__messages_delete(struct mosquitto *context, bool force_free)
 		context->msgs_out.queued_count = 0;
 		context->msgs_out.queued_count12 = 0;
 	}
+	db__message_expiry_update(context);
 
 	return MOSQ_ERR_SUCCESS;
 }
 
+#ifdef WITH_PERSISTENCE
+static struct mosquitto_client_msg *db__message_find_persisted(struct mosquitto_client_msg *head, uint16_t mid, dbid_t store_id)
+{
+	struct mosquitto_client_msg *msg;
+
+	DL_FOREACH(head, msg){
+		if(msg->mid == mid && msg->store && msg->store->db_id == store_id){
+			return msg;
+		}
+	}
+	return NULL;
+}
+
+
+/* Used when restoring the persistence journal, which identifies client
+ * messages by their mid and message store id. */
+int db__message_update_persisted(struct mosquitto *context, enum mosquitto_msg_direction dir, uint16_t mid, dbid_t store_id, enum mosquitto_msg_state state, uint8_t dup)
+{
+	struct mosquitto_msg_data *msg_data;
+	struct mosquitto_client_msg *msg;
+
+	if(dir == mosq_md_out){
+		msg_data = &context->msgs_out;
+	}else{
+		msg_data = &context->msgs_in;
+	}
+
+	msg = db__message_find_persisted(msg_data->inflight, mid, store_id);
+	if(msg == NULL){
+		msg = db__message_find_persisted(msg_data->queued, mid, store_id);
+	}
+	if(msg == NULL){
+		return MOSQ_ERR_NOT_FOUND;
+	}
+	msg->state = state;
+	msg->dup = dup;
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+int db__message_remove_persisted(struct mosquitto *context, enum mosquitto_msg_direction dir, uint16_t mid, dbid_t store_id)
+{
+	struct mosquitto_msg_data *msg_data;
+	struct mosquitto_client_msg *msg;
+
+	if(dir == mosq_md_out){
+		msg_data = &context->msgs_out;
+	}else{
+		msg_data = &context->msgs_in;
+	}
+
+	msg = db__message_find_persisted(msg_data->inflight, mid, store_id);
+	if(msg){
+		if(msg->qos > 0){
+			msg_data->inflight_quota++;
+		}
+		db__message_remove_from_inflight(context, msg_data, msg);
+		return MOSQ_ERR_SUCCESS;
+	}
+	msg = db__message_find_persisted(msg_data->queued, mid, store_id);
+	if(msg){
+		db__msg_remove_from_queued_stats(msg_data, msg);
+		db__message_remove_from_queued(context, msg_data, msg);
+		return MOSQ_ERR_SUCCESS;
+	}
+	return MOSQ_ERR_NOT_FOUND;
+}
+#endif
+
+
 int db__messages_easy_queue(struct mosquitto *context, const char *topic, uint8_t qos, uint32_t payloadlen, const void *payload, int retain, uint32_t message_expiry_interval, mosquitto_property **properties)
 {
 	struct mosquitto_msg_store *stored;
@@ -703,7 +898,7 @@ int db__messages_easy_queue(struct mosquitto *context, const char *topic, uint8_
 
 	if(!topic) return MOSQ_ERR_INVAL;
 
-	stored = mosquitto__calloc(1, sizeof(struct mosquitto_msg_store));
+	stored = db__msg_store_alloc();
 	if(stored == NULL) return MOSQ_ERR_NOMEM;
 
 	stored->topic = mosquitto__strdup(topic);
@@ -785,8 +980,9 @@ int db__message_store(const struct mosquitto *source, struct mosquitto_msg_store
 		stored->message_expiry_time = 0;
 	}
 
-	stored->dest_ids = NULL;
-	stored->dest_id_count = 0;
+	stored->dest_bits = NULL;
+	stored->dest_base = 0;
+	stored->dest_words = 0;
 	db.msg_store_count++;
 	db.msg_store_bytes += stored->payloadlen;
 
@@ -916,7 +1112,7 @@ static int db__message_reconnect_reset_incoming(struct mosquitto *context)
 		if(msg->qos != 2){
 			/* Anything <QoS 2 can be completely retried by the client at
 			 * no harm. */
-			db__message_remove_from_inflight(&context->msgs_in, msg);
+			db__message_remove_from_inflight(context, &context->msgs_in, msg);
 		}else{
 			/* Message state can be preserved here because it should match
 			 * whatever the client has got. */
@@ -974,7 +1170,7 @@ int db__message_remove_incoming(struct mosquitto* context, uint16_t mid)
 			if(tail->store->qos != 2){
 				return MOSQ_ERR_PROTOCOL;
 			}
-			db__message_remove_from_inflight(&context->msgs_in, tail);
+			db__message_remove_from_inflight(context, &context->msgs_in, tail);
 			return MOSQ_ERR_SUCCESS;
 		}
 	}
@@ -1008,12 +1204,12 @@ int db__message_release_incoming(struct mosquitto *context, uint16_t mid)
 			 * keep resending it. That means we don't send it to other
 			 * clients. */
 			if(topic == NULL){
-				db__message_remove_from_inflight(&context->msgs_in, tail);
+				db__message_remove_from_inflight(context, &context->msgs_in, tail);
 				deleted = true;
 			}else{
 				rc = sub__messages_queue(source_id, topic, 2, retain, &tail->store);
 				if(rc == MOSQ_ERR_SUCCESS || rc == MOSQ_ERR_NO_SUBSCRIBERS){
-					db__message_remove_from_inflight(&context->msgs_in, tail);
+					db__message_remove_from_inflight(context, &context->msgs_in, tail);
 					deleted = true;
 				}else{
 					return 1;
@@ -1043,6 +1239,82 @@ int db__message_release_incoming(struct mosquitto *context, uint16_t mid)
 }
 
 
+static void db__message_expiry_timer(struct mosquitto__timer *timer)
+{
+	struct mosquitto *context = timer->userdata;
+	struct mosquitto_client_msg *msg, *tmp;
+
+	if(context->sock == INVALID_SOCKET){
+		db__expire_all_messages(context);
+	}else{
+		/* Inflight messages have already been sent, so only the queues are
+		 * checked for connected clients. */
+		DL_FOREACH_SAFE(context->msgs_out.queued, msg, tmp){
+			if(msg->store->message_expiry_time && db.now_real_s > msg->store->message_expiry_time){
+				db__message_remove_from_queued(context, &context->msgs_out, msg);
+			}
+		}
+		DL_FOREACH_SAFE(context->msgs_in.queued, msg, tmp){
+			if(msg->store->message_expiry_time && db.now_real_s > msg->store->message_expiry_time){
+				db__message_remove_from_queued(context, &context->msgs_in, msg);
+			}
+		}
+		db__message_expiry_update(context);
+	}
+}
+
+
+/* Make sure the message expiry timer for a client fires no later than
+ * expiry. */
+void db__message_expiry_add(struct mosquitto *context, time_t expiry)
+{
+	if(context->msg_expiry_timer.next == NULL || expiry < context->msg_expiry_timer.expiry){
+		context->msg_expiry_timer.callback = db__message_expiry_timer;
+		context->msg_expiry_timer.userdata = context;
+		timers__add(&context->msg_expiry_timer, expiry);
+	}
+}
+
+
+static time_t db__message_expiry_first(struct mosquitto_client_msg *head, time_t first)
+{
+	struct mosquitto_client_msg *msg;
+
+	DL_FOREACH(head, msg){
+		if(msg->store->message_expiry_time
+				&& (first == 0 || msg->store->message_expiry_time < first)){
+
+			first = msg->store->message_expiry_time;
+		}
+	}
+	return first;
+}
+
+
+/* Set the message expiry timer for a client to the first of its messages
+ * that can expire, or remove it if there are none. Inflight messages can only
+ * expire when the client is not connected. */
+void db__message_expiry_update(struct mosquitto *context)
+{
+	time_t first = 0;
+
+	if(context->sock == INVALID_SOCKET){
+		first = db__message_expiry_first(context->msgs_out.inflight, first);
+		first = db__message_expiry_first(context->msgs_in.inflight, first);
+	}
+	first = db__message_expiry_first(context->msgs_out.queued, first);
+	first = db__message_expiry_first(context->msgs_in.queued, first);
+
+	if(first){
+		context->msg_expiry_timer.callback = db__message_expiry_timer;
+		context->msg_expiry_timer.userdata = context;
+		timers__add(&context->msg_expiry_timer, first);
+	}else{
+		timers__remove(&context->msg_expiry_timer);
+	}
+}
+
+
 void db__expire_all_messages(struct mosquitto *context)
 {
 	struct mosquitto_client_msg *msg, *tmp;
@@ -1052,12 +1324,12 @@ void db__expire_all_messages(struct mosquitto *context)
 			if(msg->qos > 0){
 				util__increment_send_quota(context);
 			}
-			db__message_remove_from_inflight(&context->msgs_out, msg);
+			db__message_remove_from_inflight(context, &context->msgs_out, msg);
 		}
 	}
 	DL_FOREACH_SAFE(context->msgs_out.queued, msg, tmp){
 		if(msg->store->message_expiry_time && db.now_real_s > msg->store->message_expiry_time){
-			db__message_remove_from_queued(&context->msgs_out, msg);
+			db__message_remove_from_queued(context, &context->msgs_out, msg);
 		}
 	}
 	DL_FOREACH_SAFE(context->msgs_in.inflight, msg, tmp){
@@ -1065,28 +1337,26 @@ void db__expire_all_messages(struct mosquitto *context)
 			if(msg->qos > 0){
 				util__increment_receive_quota(context);
 			}
-			db__message_remove_from_inflight(&context->msgs_in, msg);
+			db__message_remove_from_inflight(context, &context->msgs_in, msg);
 		}
 	}
 	DL_FOREACH_SAFE(context->msgs_in.queued, msg, tmp){
 		if(msg->store->message_expiry_time && db.now_real_s > msg->store->message_expiry_time){
-			db__message_remove_from_queued(&context->msgs_in, msg);
+			db__message_remove_from_queued(context, &context->msgs_in, msg);
 		}
 	}
+	db__message_expiry_update(context);
 }
 
 
 static int db__message_write_inflight_out_single(struct mosquitto *context, struct mosquitto_client_msg *msg)
 {
-	mosquitto_property *cmsg_props = NULL, *store_props = NULL;
+	mosquitto_property *cmsg_props = NULL;
 	int rc;
 	uint16_t mid;
 	int retries;
 	int retain;
-	const char *topic;
 	uint8_t qos;
-	uint32_t payloadlen;
-	const void *payload;
 	uint32_t expiry_interval;
 
 	expiry_interval = 0;
@@ -1096,7 +1366,7 @@ static int db__message_write_inflight_out_single(struct mosquitto *context, stru
 			if(msg->direction == mosq_md_out && msg->qos > 0){
 				util__increment_send_quota(context);
 			}
-			db__message_remove_from_inflight(&context->msgs_out, msg);
+			db__message_remove_from_inflight(context, &context->msgs_out, msg);
 			return MOSQ_ERR_SUCCESS;
 		}else{
 			expiry_interval = (uint32_t)(msg->store->message_expiry_time - db.now_real_s);
@@ -1105,44 +1375,40 @@ static int db__message_write_inflight_out_single(struct mosquitto *context, stru
 	mid = msg->mid;
 	retries = msg->dup;
 	retain = msg->retain;
-	topic = msg->store->topic;
 	qos = (uint8_t)msg->qos;
-	payloadlen = msg->store->payloadlen;
-	payload = msg->store->payload;
 	cmsg_props = msg->properties;
-	store_props = msg->store->properties;
 
 	switch(msg->state){
 		case mosq_ms_publish_qos0:
-			rc = send__publish(context, mid, topic, payloadlen, payload, qos, retain, retries, cmsg_props, store_props, expiry_interval);
+			rc = send__publish_store(context, mid, msg->store, qos, retain, retries, cmsg_props, expiry_interval);
 			if(rc == MOSQ_ERR_SUCCESS || rc == MOSQ_ERR_OVERSIZE_PACKET){
-				db__message_remove_from_inflight(&context->msgs_out, msg);
+				db__message_remove_from_inflight(context, &context->msgs_out, msg);
 			}else{
 				return rc;
 			}
 			break;
 
 		case mosq_ms_publish_qos1:
-			rc = send__publish(context, mid, topic, payloadlen, payload, qos, retain, retries, cmsg_props, store_props, expiry_interval);
+			rc = send__publish_store(context, mid, msg->store, qos, retain, retries, cmsg_props, expiry_interval);
 			if(rc == MOSQ_ERR_SUCCESS){
 				msg->timestamp = db.now_s;
 				msg->dup = 1; /* Any retry attempts are a duplicate. */
 				msg->state = mosq_ms_wait_for_puback;
 			}else if(rc == MOSQ_ERR_OVERSIZE_PACKET){
-				db__message_remove_from_inflight(&context->msgs_out, msg);
+				db__message_remove_from_inflight(context, &context->msgs_out, msg);
 			}else{
 				return rc;
 			}
 			break;
 
 		case mosq_ms_publish_qos2:
-			rc = send__publish(context, mid, topic, payloadlen, payload, qos, retain, retries, cmsg_props, store_props, expiry_interval);
+			rc = send__publish_store(context, mid, msg->store, qos, retain, retries, cmsg_props, expiry_interval);
 			if(rc == MOSQ_ERR_SUCCESS){
 				msg->timestamp = db.now_s;
 				msg->dup = 1; /* Any retry attempts are a duplicate. */
 				msg->state = mosq_ms_wait_for_pubrec;
 			}else if(rc == MOSQ_ERR_OVERSIZE_PACKET){
-				db__message_remove_from_inflight(&context->msgs_out, msg);
+				db__message_remove_from_inflight(context, &context->msgs_out, msg);
 			}else{
 				return rc;
 			}
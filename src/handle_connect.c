@@ -98,10 +98,13 @@ static void connection_check_acl(struct mosquitto *context, struct mosquitto_cli
 							   msg_tail->store->payloadlen, msg_tail->store->payload,
 							   msg_tail->store->qos, msg_tail->store->retain, access) != MOSQ_ERR_SUCCESS){
 
+#ifdef WITH_PERSISTENCE
+			persist__journal_client_msg_remove(context, msg_tail);
+#endif
 			DL_DELETE((*head), msg_tail);
 			db__msg_store_ref_dec(&msg_tail->store);
 			mosquitto_property_free_all(&msg_tail->properties);
-			mosquitto__free(msg_tail);
+			mosquitto__pool_free(msg_tail);
 		}
 	}
 }
@@ -163,6 +166,7 @@ int connect__on_authorised(struct mosquitto *context, void *auth_data_out, uint1
 			context->sub_count = found_context->sub_count;
 			found_context->sub_count = 0;
 			context->last_mid = found_context->last_mid;
+			retain__cursors_move(found_context, context);
 
 			for(i=0; i<context->sub_count; i++){
 				if(context->subs[i]){
@@ -170,6 +174,8 @@ int connect__on_authorised(struct mosquitto *context, void *auth_data_out, uint1
 					while(leaf){
 						if(leaf->context == found_context){
 							leaf->context = context;
+							/* The new connection may have different access */
+							leaf->read_verdict = MOSQ_ACL_VERDICT_UNKNOWN;
 						}
 						leaf = leaf->next;
 					}
@@ -179,6 +185,7 @@ int connect__on_authorised(struct mosquitto *context, void *auth_data_out, uint1
 						while(leaf){
 							if(leaf->context == found_context){
 								leaf->context = context;
+								leaf->read_verdict = MOSQ_ACL_VERDICT_UNKNOWN;
 							}
 							leaf = leaf->next;
 						}
@@ -200,8 +207,15 @@ int connect__on_authorised(struct mosquitto *context, void *auth_data_out, uint1
 
 		session_expiry__remove(found_context);
 		will_delay__remove(found_context);
+		db__message_expiry_update(found_context);
 		will__clear(found_context);
 
+#ifdef WITH_PERSISTENCE
+		if(context->clean_start == true || found_context->session_expiry_interval == 0){
+			/* The old session is not being carried over */
+			persist__journal_client_remove(found_context);
+		}
+#endif
 		found_context->clean_start = true;
 		found_context->session_expiry_interval = 0;
 		mosquitto__set_state(found_context, mosq_cs_duplicate);
@@ -262,6 +276,7 @@ int connect__on_authorised(struct mosquitto *context, void *auth_data_out, uint1
 #ifdef WITH_PERSISTENCE
 	if(!context->clean_start){
 		db.persistence_changes++;
+		persist__journal_client(context);
 	}
 #endif
 	context->max_qos = context->listener->max_qos;
@@ -468,6 +483,11 @@ int handle__connect(struct mosquitto *context)
 		goto handle_connect_error;
 	}
 
+#ifdef FINAL_WITH_TLS_KTLS
+	/* The TLS handshake is always complete by the time CONNECT arrives. */
+	net__tls_ktls_check(context);
+#endif
+
 	/* Read protocol name as length then bytes rather than with read_string
 	 * because the length is fixed and we can check that. Removes the need
 	 * for another malloc as well. */
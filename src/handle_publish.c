@@ -57,7 +57,7 @@ int handle__publish(struct mosquitto *context)
 		return MOSQ_ERR_PROTOCOL;
 	}
 
-	msg = mosquitto__calloc(1, sizeof(struct mosquitto_msg_store));
+	msg = db__msg_store_alloc();
 	if(msg == NULL){
 		return MOSQ_ERR_NOMEM;
 	}
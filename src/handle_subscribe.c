@@ -46,6 +46,7 @@ int handle__subscribe(struct mosquitto *context)
 	char *sub_mount;
 	mosquitto_property *properties = NULL;
 	bool allowed;
+	uint8_t read_verdict;
 
 	if(!context) return MOSQ_ERR_INVAL;
 
@@ -174,7 +175,7 @@ int handle__subscribe(struct mosquitto *context)
 		log__printf(NULL, MOSQ_LOG_DEBUG, "\t%s (QoS %d)", sub, qos);
 
 		allowed = true;
-		rc2 = mosquitto_acl_check(context, sub, 0, NULL, qos, false, MOSQ_ACL_SUBSCRIBE);
+		rc2 = acl__check_subscribe(context, sub, qos, &read_verdict);
 		switch(rc2){
 			case MOSQ_ERR_SUCCESS:
 				break;
@@ -193,7 +194,7 @@ int handle__subscribe(struct mosquitto *context)
 		}
 
 		if(allowed){
-			rc2 = sub__add(context, sub, qos, subscription_identifier, subscription_options);
+			rc2 = sub__add_with_verdict(context, sub, qos, subscription_identifier, subscription_options, read_verdict);
 			if(rc2 > 0){
 				mosquitto__free(sub);
 				mosquitto__free(payload);
@@ -130,6 +130,7 @@ int handle__unsubscribe(struct mosquitto *context)
 		log__printf(NULL, MOSQ_LOG_DEBUG, "\t%s", sub);
 		if(allowed){
 			rc = sub__remove(context, sub, &reason);
+			retain__cursors_remove(context, sub);
 		}else{
 			rc = MOSQ_ERR_SUCCESS;
 		}
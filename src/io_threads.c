@@ -0,0 +1,511 @@
+/*
+Copyright (c) 2026 Contributors to the Eclipse Foundation
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License 2.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   https://www.eclipse.org/legal/epl-2.0/
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+SPDX-License-Identifier: EPL-2.0 OR BSD-3-Clause
+
+Contributors:
+   Eclipse Mosquitto contributors - initial implementation and documentation.
+*/
+
+#include "config.h"
+
+#ifdef WITH_EPOLL
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mosquitto_broker_internal.h"
+#include "memory_mosq.h"
+#include "mqtt_protocol.h"
+#include "packet_mosq.h"
+#include "send_mosq.h"
+#include "sys_tree.h"
+#include "util_mosq.h"
+
+/* I/O threads
+ *
+ * With `io_threads` set to a value greater than zero, the broker starts that
+ * many additional threads to share the cost of reading from client sockets.
+ *
+ * The main loop still waits for events on all sockets. When it has a large
+ * enough batch of plain TCP clients with data waiting, it hands the batch to
+ * the I/O threads and takes a share of the batch itself. Each client is read
+ * with as few recv() calls as possible and the data split into complete MQTT
+ * packets by packet__read_data(), which queues each packet on the client
+ * rather than handling it. Once every thread has finished, the main loop
+ * handles the packets in the order the events were reported, exactly as if
+ * it had read them itself. All broker state - sessions, subscriptions, retained messages,
+ * persistence and plugins - is only ever touched by the main loop, as are all
+ * socket writes.
+ *
+ * The main loop is blocked whilst the I/O threads are working, so the threads
+ * may safely read the client state, and nothing needs to be done to protect
+ * against clients being disconnected or freed.
+ *
+ * TLS, websockets and bridge connections are always read by the main loop.
+ */
+
+#define IO_THREAD_BUF_SIZE 65536
+/* Maximum number of bytes read from a single client in one batch, to keep
+ * other clients responsive. Anything left will be reported by epoll again. */
+#define IO_THREAD_READ_BUDGET (4*IO_THREAD_BUF_SIZE)
+#define IO_THREAD_MAX_BATCH 1000
+
+struct mosquitto__io_thread{
+	pthread_t thread;
+	uint8_t *buf;
+	int index;
+};
+
+static struct mosquitto__io_thread *io_threads = NULL;
+static int io_thread_count = 0;
+static uint8_t *main_buf = NULL;
+
+static pthread_mutex_t io_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_start_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t io_done_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int io_generation = 0;
+static int io_remaining = 0;
+static bool io_running = false;
+
+static struct mosquitto *io_batch[IO_THREAD_MAX_BATCH];
+static int io_batch_count = 0;
+static bool io_batch_read = false;
+
+
+static void io_thread__packets_free(struct mosquitto *context)
+{
+	struct mosquitto__packet *packet;
+
+	while(context->io_packets){
+		packet = context->io_packets;
+		context->io_packets = packet->next;
+		packet__cleanup(packet);
+		mosquitto__free(packet);
+	}
+	context->io_packets_last = NULL;
+}
+
+
+/* Move the now complete in_packet onto the list of packets waiting to be
+ * handled by the main loop. This is called by packet__read_data() in place of
+ * handling the packet, for clients being read by an I/O thread. */
+int io_threads__packet_complete(struct mosquitto *context)
+{
+	struct mosquitto__packet *packet;
+
+	packet = mosquitto__malloc(sizeof(struct mosquitto__packet));
+	if(!packet) return MOSQ_ERR_NOMEM;
+
+	memcpy(packet, &context->in_packet, sizeof(struct mosquitto__packet));
+	packet->pos = 0;
+	packet->next = NULL;
+
+	if(context->io_packets_last){
+		context->io_packets_last->next = packet;
+	}else{
+		context->io_packets = packet;
+	}
+	context->io_packets_last = packet;
+
+	memset(&context->in_packet, 0, sizeof(struct mosquitto__packet));
+	context->in_packet.remaining_mult = 1;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static void io_thread__read(struct mosquitto *context, uint8_t *buf)
+{
+	struct mosquitto__packet *in = &context->in_packet;
+	size_t total = 0;
+	ssize_t len;
+	bool direct;
+	int rc;
+
+	while(total < IO_THREAD_READ_BUDGET){
+		/* Large payloads are read straight into place rather than via the
+		 * thread buffer. */
+		direct = (in->remaining_count > 0 && in->to_process >= IO_THREAD_BUF_SIZE);
+		if(direct){
+			len = read(context->sock, &in->payload[in->pos], in->to_process);
+		}else{
+			len = read(context->sock, buf, IO_THREAD_BUF_SIZE);
+		}
+		if(len == 0){
+			context->io_rc = MOSQ_ERR_CONN_LOST; /* EOF */
+			return;
+		}else if(len < 0){
+			if(errno == EAGAIN || errno == COMPAT_EWOULDBLOCK){
+				break;
+			}else if(errno == COMPAT_EINTR){
+				continue;
+			}else if(errno == COMPAT_ECONNRESET){
+				context->io_rc = MOSQ_ERR_CONN_LOST;
+			}else{
+				context->io_rc = MOSQ_ERR_ERRNO;
+				context->io_errno = errno;
+			}
+			return;
+		}
+
+		context->io_bytes += (uint64_t)len;
+		total += (size_t)len;
+		if(direct){
+			in->pos += (uint32_t)len;
+			in->to_process -= (uint32_t)len;
+			if(in->to_process == 0){
+				rc = io_threads__packet_complete(context);
+			}else{
+				rc = MOSQ_ERR_SUCCESS;
+			}
+		}else{
+			rc = packet__read_data(context, buf, (size_t)len);
+		}
+		if(rc){
+			context->io_rc = rc;
+			return;
+		}
+		if(!direct && len < IO_THREAD_BUF_SIZE){
+			/* Short read, the socket has been drained. */
+			break;
+		}
+	}
+	if(in->to_process > 1000){
+		/* See the equivalent check in packet__read() */
+		context->io_progress = true;
+	}
+}
+
+
+/* Read from this thread's share of the batch. Index 0 is the main loop. */
+static void io_thread__read_batch(int index, uint8_t *buf)
+{
+	int i;
+
+	for(i=index; i<io_batch_count; i+=io_thread_count+1){
+		io_thread__read(io_batch[i], buf);
+	}
+}
+
+
+static void *io_thread__main(void *arg)
+{
+	struct mosquitto__io_thread *thread = arg;
+	unsigned int generation = 0;
+
+	while(1){
+		pthread_mutex_lock(&io_mutex);
+		while(io_running && io_generation == generation){
+			pthread_cond_wait(&io_start_cond, &io_mutex);
+		}
+		if(!io_running){
+			pthread_mutex_unlock(&io_mutex);
+			break;
+		}
+		generation = io_generation;
+		pthread_mutex_unlock(&io_mutex);
+
+		io_thread__read_batch(thread->index, thread->buf);
+
+		pthread_mutex_lock(&io_mutex);
+		io_remaining--;
+		if(io_remaining == 0){
+			pthread_cond_signal(&io_done_cond);
+		}
+		pthread_mutex_unlock(&io_mutex);
+	}
+
+	return NULL;
+}
+
+
+int io_threads__init(void)
+{
+	sigset_t sigblock, origsig;
+	int i;
+	int rc;
+
+	if(db.config->io_threads <= 0){
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	main_buf = mosquitto__malloc(IO_THREAD_BUF_SIZE);
+	io_threads = mosquitto__calloc((size_t)db.config->io_threads, sizeof(struct mosquitto__io_thread));
+	if(!main_buf || !io_threads){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		io_threads__cleanup();
+		return MOSQ_ERR_NOMEM;
+	}
+
+	io_running = true;
+	/* Signals must always be delivered to the main thread. */
+	sigfillset(&sigblock);
+	pthread_sigmask(SIG_SETMASK, &sigblock, &origsig);
+	for(i=0; i<db.config->io_threads; i++){
+		io_threads[i].index = i+1;
+		io_threads[i].buf = mosquitto__malloc(IO_THREAD_BUF_SIZE);
+		if(!io_threads[i].buf){
+			pthread_sigmask(SIG_SETMASK, &origsig, NULL);
+			log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+			io_threads__cleanup();
+			return MOSQ_ERR_NOMEM;
+		}
+		rc = pthread_create(&io_threads[i].thread, NULL, io_thread__main, &io_threads[i]);
+		if(rc){
+			mosquitto__free(io_threads[i].buf);
+			io_threads[i].buf = NULL;
+			pthread_sigmask(SIG_SETMASK, &origsig, NULL);
+			log__printf(NULL, MOSQ_LOG_ERR, "Error starting I/O thread: %s", strerror(rc));
+			io_threads__cleanup();
+			return MOSQ_ERR_UNKNOWN;
+		}
+		io_thread_count++;
+	}
+	pthread_sigmask(SIG_SETMASK, &origsig, NULL);
+
+	log__printf(NULL, MOSQ_LOG_INFO, "Started %d I/O thread%s.", io_thread_count, io_thread_count==1?"":"s");
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+void io_threads__cleanup(void)
+{
+	int i;
+
+	pthread_mutex_lock(&io_mutex);
+	io_running = false;
+	pthread_cond_broadcast(&io_start_cond);
+	pthread_mutex_unlock(&io_mutex);
+
+	for(i=0; i<io_thread_count; i++){
+		pthread_join(io_threads[i].thread, NULL);
+		mosquitto__free(io_threads[i].buf);
+	}
+	io_thread_count = 0;
+	mosquitto__free(io_threads);
+	io_threads = NULL;
+	mosquitto__free(main_buf);
+	main_buf = NULL;
+}
+
+
+bool io_threads__active(void)
+{
+	return io_thread_count > 0;
+}
+
+
+/* Add a client with data waiting to the current batch, if it can be read by
+ * an I/O thread. */
+void io_threads__queue(struct mosquitto *context)
+{
+	if(io_thread_count == 0
+			|| io_batch_count == IO_THREAD_MAX_BATCH
+			|| context->sock == INVALID_SOCKET
+			|| context->bridge
+#ifdef WITH_TLS
+			|| context->ssl
+#endif
+#ifdef WITH_WEBSOCKETS
+			|| context->wsi
+#endif
+			){
+
+		return;
+	}
+
+	io_batch[io_batch_count] = context;
+	io_batch_count++;
+}
+
+
+/* Read from all clients in the current batch. If the batch is too small to be
+ * worth waking the threads, the clients are left to be read by the main loop
+ * in the usual way. */
+void io_threads__read(void)
+{
+	int i;
+
+	if(io_batch_count < io_thread_count*2){
+		io_batch_count = 0;
+		return;
+	}
+
+	for(i=0; i<io_batch_count; i++){
+		io_batch[i]->io_read = true;
+	}
+
+	pthread_mutex_lock(&io_mutex);
+	io_remaining = io_thread_count;
+	io_generation++;
+	pthread_cond_broadcast(&io_start_cond);
+	pthread_mutex_unlock(&io_mutex);
+
+	io_thread__read_batch(0, main_buf);
+
+	pthread_mutex_lock(&io_mutex);
+	while(io_remaining > 0){
+		pthread_cond_wait(&io_done_cond, &io_mutex);
+	}
+	pthread_mutex_unlock(&io_mutex);
+
+	io_batch_read = true;
+}
+
+
+/* Clean up after the main loop has finished handling the current batch. This
+ * discards packets from clients that were disconnected before their packets
+ * could be handled. */
+void io_threads__finish(void)
+{
+	int i;
+
+	if(io_batch_read){
+		for(i=0; i<io_batch_count; i++){
+			if(io_batch[i]->io_read){
+				io_batch[i]->io_read = false;
+				io_thread__packets_free(io_batch[i]);
+				io_batch[i]->io_bytes = 0;
+				io_batch[i]->io_rc = MOSQ_ERR_SUCCESS;
+				io_batch[i]->io_progress = false;
+			}
+		}
+		io_batch_read = false;
+	}
+	io_batch_count = 0;
+}
+
+
+/* Checks that packet__read() carries out that depend on earlier packets from
+ * the same client having been handled. */
+static int io_thread__check_packet(struct mosquitto *context, struct mosquitto__packet *packet)
+{
+	/* Clients must send CONNECT as their first command. */
+	if(mosquitto__get_state(context) == mosq_cs_new && (packet->command&0xF0) != CMD_CONNECT){
+		return MOSQ_ERR_PROTOCOL;
+	}
+
+	switch(packet->command & 0xF0){
+		case CMD_PUBACK:
+		case CMD_PUBREC:
+		case CMD_PUBREL:
+		case CMD_PUBCOMP:
+		case CMD_UNSUBACK:
+			if(context->protocol != mosq_p_mqtt5 && packet->remaining_length != 2){
+				return MOSQ_ERR_MALFORMED_PACKET;
+			}
+			break;
+
+		case CMD_PINGREQ:
+		case CMD_PINGRESP:
+			if(packet->remaining_length != 0){
+				return MOSQ_ERR_MALFORMED_PACKET;
+			}
+			break;
+
+		case CMD_DISCONNECT:
+			if(context->protocol != mosq_p_mqtt5 && packet->remaining_length != 0){
+				return MOSQ_ERR_MALFORMED_PACKET;
+			}
+			break;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static int io_thread__handle_packet(struct mosquitto *context, struct mosquitto__packet *packet)
+{
+	struct mosquitto__packet partial;
+	int rc;
+
+	rc = io_thread__check_packet(context, packet);
+	if(rc) return rc;
+
+	/* in_packet holds any partially read packet, so put it to one side whilst
+	 * this packet is handled. */
+	memcpy(&partial, &context->in_packet, sizeof(struct mosquitto__packet));
+	memcpy(&context->in_packet, packet, sizeof(struct mosquitto__packet));
+
+	G_MSGS_RECEIVED_INC(1);
+	if(((context->in_packet.command)&0xF0) == CMD_PUBLISH){
+		G_PUB_MSGS_RECEIVED_INC(1);
+	}
+	rc = handle__packet(context);
+
+	memcpy(packet, &context->in_packet, sizeof(struct mosquitto__packet));
+	memcpy(&context->in_packet, &partial, sizeof(struct mosquitto__packet));
+
+	keepalive__update(context);
+
+	return rc;
+}
+
+
+/* Handle the packets read from a client by an I/O thread. This takes the
+ * place of packet__read() for clients in the current batch, and returns in
+ * the same way. */
+int io_threads__handle(struct mosquitto *context)
+{
+	struct mosquitto__packet *packet;
+	int rc = MOSQ_ERR_SUCCESS;
+
+	context->io_read = false;
+
+	G_BYTES_RECEIVED_INC(context->io_bytes);
+	context->io_bytes = 0;
+
+	while(context->io_packets){
+		packet = context->io_packets;
+		context->io_packets = packet->next;
+		if(context->io_packets == NULL){
+			context->io_packets_last = NULL;
+		}
+
+		if(rc == MOSQ_ERR_SUCCESS && context->sock != INVALID_SOCKET){
+			rc = io_thread__handle_packet(context, packet);
+		}
+		packet__cleanup(packet);
+		mosquitto__free(packet);
+	}
+	if(rc){
+		context->io_rc = MOSQ_ERR_SUCCESS;
+		context->io_progress = false;
+		return rc;
+	}
+
+	if(context->io_rc){
+		rc = context->io_rc;
+		context->io_rc = MOSQ_ERR_SUCCESS;
+		context->io_progress = false;
+		if(rc == MOSQ_ERR_ERRNO){
+			errno = context->io_errno;
+		}else if(context->protocol == mosq_p_mqtt5 && context->sock != INVALID_SOCKET){
+			if(rc == MOSQ_ERR_OVERSIZE_PACKET){
+				send__disconnect(context, MQTT_RC_PACKET_TOO_LARGE, NULL);
+			}else if(rc == MOSQ_ERR_PROTOCOL){
+				send__disconnect(context, MQTT_RC_PROTOCOL_ERROR, NULL);
+			}
+		}
+		return rc;
+	}
+	if(context->io_progress){
+		context->io_progress = false;
+		keepalive__update(context);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+#endif
@@ -52,6 +52,12 @@ Contributors:
  * a lower max_keepalive value. A value as low as 600 still gives a 10 minute
  * keepalive and reduces the memory for the ring buffer to 7208 bytes.
  *
+ * The main loop is told when the first non-empty entry after the current time
+ * is due, so it does not need to wake up at all while no client is close to
+ * expiring. keepalive_first is the earliest time that any client could expire;
+ * it can be too early if clients have been moved on since, in which case the
+ * ring buffer is searched for the real first entry when that time passes.
+ *
  * *NOTE* It is likely that the old check routine will be removed in the
  * future, and max_keepalive set to a sensible default value. If this is a
  * problem for you please get in touch.
@@ -61,6 +67,8 @@ static time_t last_keepalive_check = 0;
 #ifndef WITH_OLD_KEEPALIVE
 static int keepalive_list_max = 0;
 static struct mosquitto **keepalive_list = NULL;
+static int keepalive_count = 0;
+static time_t keepalive_first = 0;
 #endif
 
 #ifndef WITH_OLD_KEEPALIVE
@@ -76,6 +84,8 @@ int keepalive__init(void)
 	struct mosquitto *context, *ctxt_tmp;
 
 	last_keepalive_check = db.now_s;
+	keepalive_count = 0;
+	keepalive_first = 0;
 	if(db.config->max_keepalive <= 0){
 		keepalive_list_max = (UINT16_MAX * 3)/2 + 1;
 	}else{
@@ -116,6 +126,10 @@ int keepalive__add(struct mosquitto *context)
 #endif
 
 	DL_APPEND2(keepalive_list[calc_index(context)], context, keepalive_prev, keepalive_next);
+	keepalive_count++;
+	if(keepalive_count == 1 || context->last_msg_in + context->keepalive*3/2 < keepalive_first){
+		keepalive_first = context->last_msg_in + context->keepalive*3/2;
+	}
 #else
 	UNUSED(context);
 #endif
@@ -128,11 +142,19 @@ void keepalive__check(void)
 {
 	struct mosquitto *context, *ctxt_tmp;
 
+	if(db.now_s - last_keepalive_check > keepalive_list_max){
+		last_keepalive_check = db.now_s - keepalive_list_max;
+	}
 	for(time_t i=last_keepalive_check; i<db.now_s; i++){
 		int idx = (int)(i % keepalive_list_max);
 		if(keepalive_list[idx]){
 			DL_FOREACH_SAFE2(keepalive_list[idx], context, ctxt_tmp, keepalive_next){
-				if(net__is_connected(context)){
+				/* The loop may not have woken for a while, in which case the
+				 * entries checked can wrap round to clients that are not due
+				 * until later. */
+				if(net__is_connected(context)
+						&& context->last_msg_in + context->keepalive*3/2 < db.now_s){
+
 					/* Client has exceeded keepalive*1.5 */
 					do_disconnect(context, MOSQ_ERR_KEEPALIVE);
 				}
@@ -141,6 +163,19 @@ void keepalive__check(void)
 	}
 
 	last_keepalive_check = db.now_s;
+
+	if(keepalive_count > 0){
+		if(keepalive_first < db.now_s){
+			for(time_t i=db.now_s; i<db.now_s+keepalive_list_max; i++){
+				if(keepalive_list[i % keepalive_list_max]){
+					keepalive_first = i;
+					break;
+				}
+			}
+		}
+		/* Clients in an entry are expired once the clock has passed it */
+		loop__update_next_event_at(keepalive_first + 1);
+	}
 }
 #else
 void keepalive__check(void)
@@ -188,6 +223,7 @@ int keepalive__remove(struct mosquitto *context)
 		DL_DELETE2(keepalive_list[idx], context, keepalive_prev, keepalive_next);
 		context->keepalive_next = NULL;
 		context->keepalive_prev = NULL;
+		keepalive_count--;
 	}
 #else
 	UNUSED(context);
@@ -61,20 +61,16 @@ extern bool flag_db_backup;
 extern bool flag_tree_print;
 extern int run;
 
-#if defined(WITH_WEBSOCKETS) && LWS_LIBRARY_VERSION_NUMBER == 3002000
-void lws__sul_callback(struct lws_sorted_usec_list *l)
-{
-}
-
-static struct lws_sorted_usec_list sul;
-#endif
+/* The longest the main loop will wait for network events when nothing else
+ * needs doing. */
+#define LOOP_MAX_WAIT_MS 60000
 
 static int single_publish(struct mosquitto *context, struct mosquitto_message_v5 *msg, uint32_t message_expiry)
 {
 	struct mosquitto_msg_store *stored;
 	uint16_t mid;
 
-	stored = mosquitto__calloc(1, sizeof(struct mosquitto_msg_store));
+	stored = db__msg_store_alloc();
 	if(stored == NULL) return MOSQ_ERR_NOMEM;
 
 	stored->topic = msg->topic;
@@ -160,6 +156,27 @@ static void queue_plugin_msgs(void)
 }
 
 
+/* Bring forward the time at which the main loop next needs to wake up, if
+ * new_ms is sooner than anything else has asked for. */
+void loop__update_next_event(time_t new_ms)
+{
+	if(new_ms < 0){
+		new_ms = 0;
+	}
+	if(new_ms < db.next_event_ms){
+		db.next_event_ms = (int)new_ms;
+	}
+}
+
+
+/* As loop__update_next_event(), for a point in time measured by
+ * mosquitto_time(). */
+void loop__update_next_event_at(time_t when_s)
+{
+	loop__update_next_event((time_t)((int64_t)when_s*1000 - (int64_t)mosquitto_time_ms()));
+}
+
+
 int mosquitto_main_loop(struct mosquitto__listener_sock *listensock, int listensock_count)
 {
 #ifdef WITH_SYS_TREE
@@ -167,19 +184,13 @@ int mosquitto_main_loop(struct mosquitto__listener_sock *listensock, int listens
 #endif
 #ifdef WITH_PERSISTENCE
 	time_t last_backup = mosquitto_time();
-#endif
-#ifdef WITH_WEBSOCKETS
-	int i;
 #endif
 	int rc;
 
 
-#if defined(WITH_WEBSOCKETS) && LWS_LIBRARY_VERSION_NUMBER == 3002000
-	memset(&sul, 0, sizeof(struct lws_sorted_usec_list));
-#endif
-
 	db.now_s = mosquitto_time();
 	db.now_real_s = time(NULL);
+	db.next_event_ms = LOOP_MAX_WAIT_MS;
 
 #ifdef WITH_BRIDGE
 	rc = bridge__register_local_connections();
@@ -187,7 +198,6 @@ int mosquitto_main_loop(struct mosquitto__listener_sock *listensock, int listens
 #endif
 
 	while(run){
-		retain__expire();
 		queue_plugin_msgs();
 		context__free_disused();
 #ifdef WITH_SYS_TREE
@@ -201,31 +211,41 @@ int mosquitto_main_loop(struct mosquitto__listener_sock *listensock, int listens
 #ifdef WITH_BRIDGE
 		bridge_check();
 #endif
+		retain__cursors_process();
 
+#ifdef WITH_PERSISTENCE
+		persist__journal_flush();
+#endif
+		timers__update_next_event();
+#ifdef WITH_WEBSOCKETS
+		websockets__update_next_event();
+#endif
 		rc = mux__handle(listensock, listensock_count);
 		if(rc) return rc;
+		db.next_event_ms = LOOP_MAX_WAIT_MS;
 
-		session_expiry__check();
-		will_delay__check();
+		timers__check();
 #ifdef WITH_PERSISTENCE
+		persist__background_check();
 		if(db.config->persistence && db.config->autosave_interval){
 			if(db.config->autosave_on_changes){
 				if(db.persistence_changes >= db.config->autosave_interval){
-					persist__backup(false);
+					persist__autosave();
 					db.persistence_changes = 0;
 				}
 			}else{
 				if(last_backup + db.config->autosave_interval < db.now_s){
-					persist__backup(false);
+					persist__autosave();
 					last_backup = db.now_s;
 				}
+				loop__update_next_event_at(last_backup + db.config->autosave_interval + 1);
 			}
 		}
 #endif
 
 #ifdef WITH_PERSISTENCE
 		if(flag_db_backup){
-			persist__backup(false);
+			persist__background_save();
 			flag_db_backup = false;
 		}
 #endif
@@ -251,23 +271,7 @@ int mosquitto_main_loop(struct mosquitto__listener_sock *listensock, int listens
 #endif
 		}
 #ifdef WITH_WEBSOCKETS
-		for(i=0; i<db.config->listener_count; i++){
-			/* Extremely hacky, should be using the lws provided external poll
-			 * interface, but their interface has changed recently and ours
-			 * will soon, so for now websockets clients are second class
-			 * citizens. */
-			if(db.config->listeners[i].ws_context){
-#if LWS_LIBRARY_VERSION_NUMBER > 3002000
-				lws_service(db.config->listeners[i].ws_context, -1);
-#elif LWS_LIBRARY_VERSION_NUMBER == 3002000
-				lws_sul_schedule(db.config->listeners[i].ws_context, 0, &sul, lws__sul_callback, 10);
-				lws_service(db.config->listeners[i].ws_context, 0);
-#else
-				lws_service(db.config->listeners[i].ws_context, 0);
-#endif
-
-			}
-		}
+		websockets__service();
 #endif
 		plugin__handle_tick();
 	}
@@ -184,7 +184,12 @@ void listener__set_defaults(struct mosquitto__listener *listener)
 	listener->protocol = mp_mqtt;
 	listener->max_connections = -1;
 	listener->max_qos = 2;
+	listener->reuse_port_sockets = 1;
 	listener->max_topic_alias = 10;
+#ifdef WITH_TLS
+	listener->tls_session_cache_size = -1;
+	listener->tls_session_tickets = true;
+#endif
 }
 
 
@@ -195,6 +200,9 @@ void listeners__reload_all_certificates(void)
 	int rc;
 	struct mosquitto__listener *listener;
 
+#ifdef WITH_EPOLL
+	tls_handshake__reload_lock();
+#endif
 	for(i=0; i<db.config->listener_count; i++){
 		listener = &db.config->listeners[i];
 		if(listener->ssl_ctx && listener->certfile && listener->keyfile){
@@ -204,7 +212,14 @@ void listeners__reload_all_certificates(void)
 						listener->certfile, listener->keyfile);
 			}
 		}
+		if(listener->ssl_ctx && listener->tls_session_tickets && listener->tls_ticket_key_file){
+			/* Allows the ticket keys to be rotated */
+			net__tls_load_ticket_keys(listener);
+		}
 	}
+#ifdef WITH_EPOLL
+	tls_handshake__reload_unlock();
+#endif
 #endif
 }
 
@@ -230,6 +245,7 @@ static int listeners__start_single_mqtt(struct mosquitto__listener *listener)
 		}
 		listensock[listensock_index].sock = listener->socks[i];
 		listensock[listensock_index].listener = listener;
+		listensock[listensock_index].accept_deferred_ms = 0;
 #ifdef WITH_EPOLL
 		listensock[listensock_index].ident = id_listener;
 #endif
@@ -269,6 +285,7 @@ void listeners__add_websockets(struct lws_context *ws_context, mosq_sock_t fd)
 
 	listensock[listensock_index].sock = fd;
 	listensock[listensock_index].listener = listener;
+	listensock[listensock_index].accept_deferred_ms = 0;
 #ifdef WITH_EPOLL
 	listensock[listensock_index].ident = id_listener_ws;
 #endif
@@ -405,6 +422,9 @@ static void listeners__stop(void)
 		}
 #endif
 	}
+#if defined(WITH_WEBSOCKETS) && defined(WITH_EPOLL)
+	websockets__cleanup();
+#endif
 
 	for(i=0; i<listensock_count; i++){
 		if(listensock[i].sock != INVALID_SOCKET){
@@ -636,6 +656,7 @@ int main(int argc, char *argv[])
 	log__close(&config);
 	config__cleanup(db.config);
 	net__broker_cleanup();
+	mosquitto__pool_cleanup();
 
 	return rc;
 }
@@ -191,6 +191,8 @@ enum struct_ident{
 	id_listener = 1,
 	id_client = 2,
 	id_listener_ws = 3,
+	id_tls_handshake = 4,
+	id_ws_pollfd = 5,
 };
 #endif
 
@@ -202,6 +204,7 @@ struct mosquitto__listener {
 	char *mount_point;
 	mosq_sock_t *socks;
 	int sock_count;
+	int reuse_port_sockets;
 	int client_count;
 	enum mosquitto_protocol protocol;
 	int socket_domain;
@@ -222,6 +225,13 @@ struct mosquitto__listener {
 	char *crlfile;
 	char *tls_version;
 	char *dhparamfile;
+	char *tls_ticket_key_file;
+	unsigned char *tls_ticket_keys;
+	int tls_ticket_key_count;
+	int tls_session_cache_size;
+	bool tls_session_tickets;
+	bool tls_ktls;
+	bool tls_ktls_fallback_logged;
 	bool use_identity_as_username;
 	bool use_subject_as_username;
 	bool require_certificate;
@@ -247,6 +257,7 @@ struct mosquitto__listener_sock{
 #endif
 	mosq_sock_t sock;
 	struct mosquitto__listener *listener;
+	uint64_t accept_deferred_ms; /* When connections were first left waiting, or 0. */
 };
 
 typedef struct mosquitto_plugin_id_t{
@@ -254,9 +265,12 @@ typedef struct mosquitto_plugin_id_t{
 } mosquitto_plugin_id_t;
 
 struct mosquitto__config {
+	int accept_batch_size;
+	int acl_cache_size;
 	bool allow_duplicate_messages;
 	int autosave_interval;
 	bool autosave_on_changes;
+	bool autosave_background;
 	bool check_retain_source;
 	char *clientid_prefixes;
 	bool connection_messages;
@@ -266,6 +280,7 @@ struct mosquitto__config {
 	struct mosquitto__listener default_listener;
 	struct mosquitto__listener *listeners;
 	int listener_count;
+	int io_threads;
 	bool local_only;
 	unsigned int log_dest;
 	int log_facility;
@@ -286,14 +301,17 @@ struct mosquitto__config {
 	char *persistence_location;
 	char *persistence_file;
 	char *persistence_filepath;
+	bool persistence_journal;
 	time_t persistent_client_expiration;
 	char *pid_file;
 	bool queue_qos0_messages;
 	bool per_listener_settings;
 	bool retain_available;
-	int retain_expiry_interval;
+	int retain_delivery_batch_size;
 	bool set_tcp_nodelay;
+	int subscription_cache_size;
 	int sys_interval;
+	int tls_handshake_threads;
 	bool upgrade_outgoing_qos;
 	char *user;
 #ifdef WITH_WEBSOCKETS
@@ -313,7 +331,9 @@ struct mosquitto__subleaf {
 	struct mosquitto__subleaf *next;
 	struct mosquitto *context;
 	uint32_t identifier;
+	uint32_t acl_generation; /* context->acl_generation when read_verdict was found */
 	uint8_t qos;
+	uint8_t read_verdict; /* enum mosquitto_acl_verdict, for reads from this subscription */
 	bool no_local;
 	bool retain_as_published;
 };
@@ -329,10 +349,13 @@ struct mosquitto__subhier {
 	UT_hash_handle hh;
 	struct mosquitto__subhier *parent;
 	struct mosquitto__subhier *children;
+	struct mosquitto__subhier *child_plus; /* The "+" entry in children, if any */
+	struct mosquitto__subhier *child_hash; /* The "#" entry in children, if any */
 	struct mosquitto__subleaf *subs;
 	struct mosquitto__subshared *shared;
-	char *topic;
+	struct mosquitto__subcache_ref *cache_refs; /* Match cache entries that refer to this node */
 	uint16_t topic_len;
+	char topic[];
 };
 
 struct mosquitto__client_sub {
@@ -352,7 +375,9 @@ struct mosquitto__retainhier {
 	struct mosquitto__retainhier *parent;
 	struct mosquitto__retainhier *children;
 	struct mosquitto_msg_store *retained;
+	struct mosquitto__timer *expiry_timer; /* Only for messages with an expiry interval */
 	char *topic;
+	int cursor_count; /* Number of retain cursors that are using this entry */
 	uint16_t topic_len;
 };
 
@@ -369,8 +394,9 @@ struct mosquitto_msg_store{
 	char *source_id;
 	char *source_username;
 	struct mosquitto__listener *source_listener;
-	char **dest_ids;
-	int dest_id_count;
+	uint64_t *dest_bits; /* Bitmap of the dest_id of each client this has been queued for */
+	uint32_t dest_base; /* Index of the first word of dest_bits */
+	uint32_t dest_words;
 	int ref_count;
 	char* topic;
 	mosquitto_property *properties;
@@ -382,6 +408,7 @@ struct mosquitto_msg_store{
 	uint16_t mid;
 	uint8_t qos;
 	bool retain;
+	bool journaled;
 };
 
 struct mosquitto_client_msg{
@@ -396,6 +423,7 @@ struct mosquitto_client_msg{
 	enum mosquitto_msg_direction direction;
 	enum mosquitto_msg_state state;
 	uint8_t dup;
+	bool journaled;
 };
 
 
@@ -421,10 +449,22 @@ struct mosquitto__acl{
 	int ccount;
 };
 
+/* ACL topics, compiled into a tree with one entry per topic level, so
+ * checking a topic against all of the ACLs is a single walk of the tree. */
+struct mosquitto__acl_trie{
+	UT_hash_handle hh;
+	struct mosquitto__acl_trie *children;
+	char *topic;
+	int access; /* Access allowed by the ACLs that end at this level */
+	uint16_t topic_len;
+	bool deny; /* An ACL that denies access ends at this level */
+};
+
 struct mosquitto__acl_user{
 	struct mosquitto__acl_user *next;
 	char *username;
 	struct mosquitto__acl *acl;
+	struct mosquitto__acl_trie *acl_trie;
 };
 
 
@@ -446,6 +486,7 @@ struct mosquitto_db{
 	struct mosquitto__subhier *normal_subs;
 	struct mosquitto__subhier *shared_subs;
 	struct mosquitto__retainhier *retains;
+	struct mosquitto__retain_cursor *retain_cursors;
 	struct mosquitto *contexts_by_id;
 	struct mosquitto *contexts_by_sock;
 	struct mosquitto *contexts_for_free;
@@ -477,6 +518,7 @@ struct mosquitto_db{
 	int epollfd;
 #endif
 	struct mosquitto_message_v5 *plugin_msgs;
+	int next_event_ms; /* How long the main loop can wait for network events */
 };
 
 enum mosquitto__bridge_direction{
@@ -582,6 +624,8 @@ extern struct mosquitto_db db;
  * Main functions
  * ============================================================ */
 int mosquitto_main_loop(struct mosquitto__listener_sock *listensock, int listensock_count);
+void loop__update_next_event(time_t new_ms);
+void loop__update_next_event_at(time_t when_s);
 
 /* ============================================================
  * Config functions
@@ -614,11 +658,19 @@ int send__auth(struct mosquitto *context, uint8_t reason_code, const void *auth_
  * ============================================================ */
 void net__broker_init(void);
 void net__broker_cleanup(void);
-struct mosquitto *net__socket_accept(struct mosquitto__listener_sock *listensock);
+void net__socket_accept_batch(struct mosquitto__listener_sock *listensock);
+#ifdef __linux__
+unsigned long net__socket_listen_queued(struct mosquitto__listener *listener);
+unsigned long net__socket_listen_overflows(void);
+#endif
 int net__socket_listen(struct mosquitto__listener *listener);
 int net__socket_get_address(mosq_sock_t sock, char *buf, size_t len, uint16_t *remote_address);
 int net__tls_load_verify(struct mosquitto__listener *listener);
 int net__tls_server_ctx(struct mosquitto__listener *listener);
+int net__tls_load_ticket_keys(struct mosquitto__listener *listener);
+#ifdef FINAL_WITH_TLS_KTLS
+void net__tls_ktls_check(struct mosquitto *context);
+#endif
 int net__load_certificates(struct mosquitto__listener *listener);
 
 /* ============================================================
@@ -641,6 +693,29 @@ int db__close(void);
 #ifdef WITH_PERSISTENCE
 int persist__backup(bool shutdown);
 int persist__restore(void);
+int persist__autosave(void);
+int persist__background_save(void);
+void persist__background_check(void);
+void persist__background_stop(void);
+int persist__journal_open(uint64_t generation, bool append);
+void persist__journal_close(void);
+void persist__journal_remove(void);
+uint64_t persist__journal_generation(void);
+bool persist__journal_active(void);
+int persist__journal_mark(uint64_t generation, long *offset);
+void persist__journal_compact(long offset);
+void persist__journal_flush(void);
+void persist__journal_msg_store_remove(struct mosquitto_msg_store *stored);
+void persist__journal_client(struct mosquitto *context);
+void persist__journal_client_remove(struct mosquitto *context);
+void persist__journal_client_msg(struct mosquitto *context, struct mosquitto_client_msg *cmsg);
+void persist__journal_client_msg_update(struct mosquitto *context, struct mosquitto_client_msg *cmsg);
+void persist__journal_client_msg_remove(struct mosquitto *context, struct mosquitto_client_msg *cmsg);
+void persist__journal_sub(struct mosquitto *context, const char *sub, uint8_t qos, uint32_t identifier, int options);
+void persist__journal_sub_remove(struct mosquitto *context, const char *sub);
+void persist__journal_retain(struct mosquitto_msg_store *stored);
+int db__message_update_persisted(struct mosquitto *context, enum mosquitto_msg_direction dir, uint16_t mid, dbid_t store_id, enum mosquitto_msg_state state, uint8_t dup);
+int db__message_remove_persisted(struct mosquitto *context, enum mosquitto_msg_direction dir, uint16_t mid, dbid_t store_id);
 #endif
 /* Return the number of in-flight messages in count. */
 int db__message_count(int *count);
@@ -654,6 +729,8 @@ int db__messages_delete(struct mosquitto *context, bool force_free);
 int db__messages_easy_queue(struct mosquitto *context, const char *topic, uint8_t qos, uint32_t payloadlen, const void *payload, int retain, uint32_t message_expiry_interval, mosquitto_property **properties);
 int db__message_store(const struct mosquitto *source, struct mosquitto_msg_store *stored, uint32_t message_expiry_interval, dbid_t store_id, enum mosquitto_msg_origin origin);
 int db__message_store_find(struct mosquitto *context, uint16_t mid, struct mosquitto_client_msg **client_msg);
+struct mosquitto_msg_store *db__msg_store_alloc(void);
+struct mosquitto_client_msg *db__client_msg_alloc(void);
 void db__msg_store_add(struct mosquitto_msg_store *store);
 void db__msg_store_remove(struct mosquitto_msg_store *store);
 void db__msg_store_ref_inc(struct mosquitto_msg_store *store);
@@ -662,6 +739,8 @@ void db__msg_store_clean(void);
 void db__msg_store_compact(void);
 void db__msg_store_free(struct mosquitto_msg_store *store);
 int db__message_reconnect_reset(struct mosquitto *context);
+uint32_t db__dest_id_get(void);
+void db__dest_id_release(uint32_t dest_id);
 bool db__ready_for_flight(struct mosquitto *context, enum mosquitto_msg_direction dir, int qos);
 bool db__ready_for_queue(struct mosquitto *context, int qos, struct mosquitto_msg_data *msg_data);
 void sys_tree__init(void);
@@ -673,11 +752,14 @@ int db__message_write_queued_in(struct mosquitto *context);
 void db__msg_add_to_inflight_stats(struct mosquitto_msg_data *msg_data, struct mosquitto_client_msg *msg);
 void db__msg_add_to_queued_stats(struct mosquitto_msg_data *msg_data, struct mosquitto_client_msg *msg);
 void db__expire_all_messages(struct mosquitto *context);
+void db__message_expiry_add(struct mosquitto *context, time_t expiry);
+void db__message_expiry_update(struct mosquitto *context);
 
 /* ============================================================
  * Subscription functions
  * ============================================================ */
 int sub__add(struct mosquitto *context, const char *sub, uint8_t qos, uint32_t identifier, int options);
+int sub__add_with_verdict(struct mosquitto *context, const char *sub, uint8_t qos, uint32_t identifier, int options, uint8_t read_verdict);
 struct mosquitto__subhier *sub__add_hier_entry(struct mosquitto__subhier *parent, struct mosquitto__subhier **sibling, const char *topic, uint16_t len);
 int sub__remove(struct mosquitto *context, const char *sub, uint8_t *reason);
 void sub__tree_print(struct mosquitto__subhier *root, int level);
@@ -686,6 +768,16 @@ int sub__messages_queue(const char *source_id, const char *topic, uint8_t qos, i
 int sub__topic_tokenise(const char *subtopic, char **local_sub, char ***topics, const char **sharename);
 void sub__topic_tokens_free(struct sub__token *tokens);
 
+/* ============================================================
+ * Subscription match cache functions
+ * ============================================================ */
+bool sub__cache_lookup(const char *topic, size_t topic_len, struct mosquitto__subhier ***hiers, int *hier_count);
+void sub__cache_record(struct mosquitto__subhier *hier);
+void sub__cache_record_end(const char *topic, size_t topic_len, bool complete);
+void sub__cache_hier_remove(struct mosquitto__subhier *hier);
+int sub__cache_hier_add(struct mosquitto__subhier *hier);
+void sub__cache_clean(void);
+
 /* ============================================================
  * Context functions
  * ============================================================ */
@@ -751,6 +843,32 @@ int mux__wait(void);
 int mux__handle(struct mosquitto__listener_sock *listensock, int listensock_count);
 int mux__cleanup(void);
 
+/* ============================================================
+ * I/O thread related functions
+ * ============================================================ */
+#ifdef WITH_EPOLL
+int io_threads__init(void);
+void io_threads__cleanup(void);
+bool io_threads__active(void);
+void io_threads__queue(struct mosquitto *context);
+void io_threads__read(void);
+void io_threads__finish(void);
+int io_threads__handle(struct mosquitto *context);
+int io_threads__packet_complete(struct mosquitto *context);
+#endif
+
+/* ============================================================
+ * TLS handshake thread related functions
+ * ============================================================ */
+#if defined(WITH_EPOLL) && defined(WITH_TLS)
+int tls_handshake__init(void);
+void tls_handshake__cleanup(void);
+bool tls_handshake__start(struct mosquitto *context);
+void tls_handshake__handle(void);
+void tls_handshake__reload_lock(void);
+void tls_handshake__reload_unlock(void);
+#endif
+
 /* ============================================================
  * Listener related functions
  * ============================================================ */
@@ -793,12 +911,21 @@ int retain__init(void);
 void retain__clean(struct mosquitto__retainhier **retainhier);
 int retain__queue(struct mosquitto *context, const char *sub, uint8_t sub_qos, uint32_t subscription_identifier);
 int retain__store(const char *topic, struct mosquitto_msg_store *stored, char **split_topics);
-void retain__expire(void);
+void retain__cursors_process(void);
+void retain__cursors_remove(struct mosquitto *context, const char *sub);
+void retain__cursors_move(struct mosquitto *from, struct mosquitto *to);
+void retain__cursors_free(struct mosquitto *context);
+void retain__source_clear(void);
 
 /* ============================================================
  * Security related functions
  * ============================================================ */
 int acl__find_acls(struct mosquitto *context);
+void acl__free_acls(struct mosquitto *context);
+bool acl__cache_lookup(struct mosquitto *context, const char *topic, int access, int *rc);
+void acl__cache_add(struct mosquitto *context, const char *topic, int access, int rc);
+void acl__cache_flush(struct mosquitto *context);
+void acl__cache_flush_all(void);
 int mosquitto_security_module_init(void);
 int mosquitto_security_module_cleanup(void);
 
@@ -806,6 +933,7 @@ int mosquitto_security_init(bool reload);
 int mosquitto_security_apply(void);
 int mosquitto_security_cleanup(bool reload);
 int mosquitto_acl_check(struct mosquitto *context, const char *topic, uint32_t payloadlen, void* payload, uint8_t qos, bool retain, int access);
+int acl__check_subscribe(struct mosquitto *context, const char *sub, uint8_t qos, uint8_t *read_verdict);
 int mosquitto_unpwd_check(struct mosquitto *context);
 int mosquitto_psk_key_get(struct mosquitto *context, const char *hint, const char *identity, char *key, int max_key_len);
 
@@ -825,8 +953,8 @@ void unpwd__free_item(struct mosquitto__unpwd **unpwd, struct mosquitto__unpwd *
 int session_expiry__add(struct mosquitto *context);
 int session_expiry__add_from_persistence(struct mosquitto *context, time_t expiry_time);
 void session_expiry__remove(struct mosquitto *context);
+bool session_expiry__is_pending(struct mosquitto *context);
 void session_expiry__remove_all(void);
-void session_expiry__check(void);
 void session_expiry__send_all(void);
 
 /* ============================================================
@@ -855,14 +983,30 @@ DWORD WINAPI SigThreadProc(void* data);
  * ============================================================ */
 #ifdef WITH_WEBSOCKETS
 void mosq_websockets_init(struct mosquitto__listener *listener, const struct mosquitto__config *conf);
+void websockets__update_next_event(void);
+void websockets__service(void);
+#  ifdef WITH_EPOLL
+struct mosquitto__ws_pollfd;
+void websockets__listener_handle(struct mosquitto__listener_sock *listensock, uint32_t events);
+void websockets__pollfd_handle(struct mosquitto__ws_pollfd *ws_pollfd, uint32_t events);
+void websockets__cleanup(void);
+#  endif
 #endif
 void do_disconnect(struct mosquitto *context, int reason);
 
+/* ============================================================
+ * Timers
+ * ============================================================ */
+void timers__init(void);
+void timers__add(struct mosquitto__timer *timer, time_t expiry);
+void timers__remove(struct mosquitto__timer *timer);
+void timers__check(void);
+void timers__update_next_event(void);
+
 /* ============================================================
  * Will delay
  * ============================================================ */
 int will_delay__add(struct mosquitto *context);
-void will_delay__check(void);
 void will_delay__send_all(void);
 void will_delay__remove(struct mosquitto *mosq);
 
@@ -17,10 +17,95 @@ Contributors:
    Tatsuzo Osawa - Add epoll.
 */
 
+#include <stdlib.h>
+
 #include "mux.h"
 
+#ifdef WITH_IO_URING
+static bool use_io_uring = false;
+#endif
+
+#ifndef WIN32
+/* The signals we handle are blocked except whilst waiting for events. A
+ * signal that arrived whilst the main loop was busy is still pending, so
+ * deliver it before waiting again. Returns true if there was one, in which
+ * case the caller should not wait, so the signal is acted on straight away. */
+bool mux__deliver_signals(const sigset_t *sigblock, const sigset_t *sigorig)
+{
+	sigset_t pending;
+
+	if(sigpending(&pending) == 0
+			&& (sigismember(&pending, SIGINT) == 1
+				|| sigismember(&pending, SIGTERM) == 1
+				|| sigismember(&pending, SIGUSR1) == 1
+				|| sigismember(&pending, SIGUSR2) == 1
+				|| sigismember(&pending, SIGHUP) == 1)){
+
+		sigprocmask(SIG_SETMASK, sigorig, NULL);
+		sigprocmask(SIG_BLOCK, sigblock, NULL);
+		return true;
+	}
+	return false;
+}
+#endif
+
+/* The MOSQUITTO_IO_URING environment variable chooses whether io_uring is
+ * used. Returns -1 if it isn't set, so io_uring is used when possible, 0 if
+ * io_uring must not be used, or 1 if it must be, which lets the tests be run
+ * against each event loop. */
+static int mux__io_uring_env(void)
+{
+	const char *env;
+
+	env = getenv("MOSQUITTO_IO_URING");
+	if(env == NULL || env[0] == '\0'){
+		return -1;
+	}
+	return atoi(env) != 0;
+}
+
+#if defined(WITH_IO_URING) && defined(WITH_WEBSOCKETS)
+static bool mux__have_websockets(void)
+{
+	int i;
+
+	for(i=0; i<db.config->listener_count; i++){
+		if(db.config->listeners[i].ws_context){
+			return true;
+		}
+	}
+	return false;
+}
+#endif
+
 int mux__init(struct mosquitto__listener_sock *listensock, int listensock_count)
 {
+	int io_uring_env = mux__io_uring_env();
+
+#ifdef WITH_IO_URING
+	/* The I/O threads, TLS handshake threads and websockets sockets are
+	 * driven by epoll, so io_uring is only used when they aren't. */
+	if(io_uring_env != 0
+			&& db.config->io_threads <= 0 && db.config->tls_handshake_threads <= 0
+#  ifdef WITH_WEBSOCKETS
+			&& !mux__have_websockets()
+#  endif
+			){
+		if(mux_io_uring__init(listensock, listensock_count) == MOSQ_ERR_SUCCESS){
+			use_io_uring = true;
+			return MOSQ_ERR_SUCCESS;
+		}
+		if(io_uring_env == 1){
+			log__printf(NULL, MOSQ_LOG_ERR, "Error: io_uring is required by MOSQUITTO_IO_URING but could not be used.");
+			return MOSQ_ERR_NOT_SUPPORTED;
+		}
+	}
+#else
+	if(io_uring_env == 1){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: io_uring is required by MOSQUITTO_IO_URING but support is not compiled in.");
+		return MOSQ_ERR_NOT_SUPPORTED;
+	}
+#endif
 #ifdef WITH_EPOLL
 	return mux_epoll__init(listensock, listensock_count);
 #else
@@ -30,6 +115,9 @@ int mux__init(struct mosquitto__listener_sock *listensock, int listensock_count)
 
 int mux__add_out(struct mosquitto *context)
 {
+#ifdef WITH_IO_URING
+	if(use_io_uring) return mux_io_uring__add_out(context);
+#endif
 #ifdef WITH_EPOLL
 	return mux_epoll__add_out(context);
 #else
@@ -40,6 +128,9 @@ int mux__add_out(struct mosquitto *context)
 
 int mux__remove_out(struct mosquitto *context)
 {
+#ifdef WITH_IO_URING
+	if(use_io_uring) return mux_io_uring__remove_out(context);
+#endif
 #ifdef WITH_EPOLL
 	return mux_epoll__remove_out(context);
 #else
@@ -50,6 +141,9 @@ int mux__remove_out(struct mosquitto *context)
 
 int mux__add_in(struct mosquitto *context)
 {
+#ifdef WITH_IO_URING
+	if(use_io_uring) return mux_io_uring__add_in(context);
+#endif
 #ifdef WITH_EPOLL
 	return mux_epoll__add_in(context);
 #else
@@ -60,6 +154,9 @@ int mux__add_in(struct mosquitto *context)
 
 int mux__delete(struct mosquitto *context)
 {
+#ifdef WITH_IO_URING
+	if(use_io_uring) return mux_io_uring__delete(context);
+#endif
 #ifdef WITH_EPOLL
 	return mux_epoll__delete(context);
 #else
@@ -70,6 +167,9 @@ int mux__delete(struct mosquitto *context)
 
 int mux__handle(struct mosquitto__listener_sock *listensock, int listensock_count)
 {
+#ifdef WITH_IO_URING
+	if(use_io_uring) return mux_io_uring__handle(listensock, listensock_count);
+#endif
 #ifdef WITH_EPOLL
 	UNUSED(listensock);
 	UNUSED(listensock_count);
@@ -82,6 +182,12 @@ int mux__handle(struct mosquitto__listener_sock *listensock, int listensock_coun
 
 int mux__cleanup(void)
 {
+#ifdef WITH_IO_URING
+	if(use_io_uring){
+		use_io_uring = false;
+		return mux_io_uring__cleanup();
+	}
+#endif
 #ifdef WITH_EPOLL
 	return mux_epoll__cleanup();
 #else
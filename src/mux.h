@@ -19,8 +19,16 @@ Contributors:
 #ifndef MUX_H
 #define MUX_H
 
+#ifndef WIN32
+#  include <signal.h>
+#endif
+
 #include "mosquitto_broker_internal.h"
 
+#ifndef WIN32
+bool mux__deliver_signals(const sigset_t *sigblock, const sigset_t *sigorig);
+#endif
+
 int mux_epoll__init(struct mosquitto__listener_sock *listensock, int listensock_count);
 int mux_epoll__add_out(struct mosquitto *context);
 int mux_epoll__remove_out(struct mosquitto *context);
@@ -29,6 +37,16 @@ int mux_epoll__delete(struct mosquitto *context);
 int mux_epoll__handle(void);
 int mux_epoll__cleanup(void);
 
+#ifdef WITH_IO_URING
+int mux_io_uring__init(struct mosquitto__listener_sock *listensock, int listensock_count);
+int mux_io_uring__add_out(struct mosquitto *context);
+int mux_io_uring__remove_out(struct mosquitto *context);
+int mux_io_uring__add_in(struct mosquitto *context);
+int mux_io_uring__delete(struct mosquitto *context);
+int mux_io_uring__handle(struct mosquitto__listener_sock *listensock, int listensock_count);
+int mux_io_uring__cleanup(void);
+#endif
+
 int mux_poll__init(struct mosquitto__listener_sock *listensock, int listensock_count);
 int mux_poll__add_out(struct mosquitto *context);
 int mux_poll__remove_out(struct mosquitto *context);
@@ -67,12 +67,14 @@ Contributors:
 static void loop_handle_reads_writes(struct mosquitto *context, uint32_t events);
 
 static sigset_t my_sigblock;
+static sigset_t my_sigorig;
 static struct epoll_event ep_events[MAX_EVENTS];
 
 int mux_epoll__init(struct mosquitto__listener_sock *listensock, int listensock_count)
 {
 	struct epoll_event ev;
 	int i;
+	int rc;
 
 #ifndef WIN32
 	sigemptyset(&my_sigblock);
@@ -102,7 +104,17 @@ int mux_epoll__init(struct mosquitto__listener_sock *listensock, int listensock_
 		}
 	}
 
-	return MOSQ_ERR_SUCCESS;
+	/* The signals we handle are only delivered whilst waiting for events, so
+	 * one that arrives just before the wait still interrupts it. */
+	sigprocmask(SIG_BLOCK, &my_sigblock, &my_sigorig);
+
+	rc = io_threads__init();
+#ifdef WITH_TLS
+	if(rc == MOSQ_ERR_SUCCESS){
+		rc = tls_handshake__init();
+	}
+#endif
+	return rc;
 }
 
 int mux_epoll__add_out(struct mosquitto *context)
@@ -178,15 +190,15 @@ int mux_epoll__handle(void)
 {
 	int i;
 	struct epoll_event ev;
-	sigset_t origsig;
 	struct mosquitto *context;
 	struct mosquitto__listener_sock *listensock;
 	int event_count;
 
 	memset(&ev, 0, sizeof(struct epoll_event));
-	sigprocmask(SIG_SETMASK, &my_sigblock, &origsig);
-	event_count = epoll_wait(db.epollfd, ep_events, MAX_EVENTS, 100);
-	sigprocmask(SIG_SETMASK, &origsig, NULL);
+	if(mux__deliver_signals(&my_sigblock, &my_sigorig)){
+		return MOSQ_ERR_SUCCESS;
+	}
+	event_count = epoll_pwait(db.epollfd, ep_events, MAX_EVENTS, db.next_event_ms, &my_sigorig);
 
 	db.now_s = mosquitto_time();
 	db.now_real_s = time(NULL);
@@ -200,6 +212,15 @@ int mux_epoll__handle(void)
 	case 0:
 		break;
 	default:
+		if(io_threads__active()){
+			for(i=0; i<event_count; i++){
+				context = ep_events[i].data.ptr;
+				if(context->ident == id_client && (ep_events[i].events & EPOLLIN)){
+					io_threads__queue(context);
+				}
+			}
+			io_threads__read();
+		}
 		for(i=0; i<event_count; i++){
 			context = ep_events[i].data.ptr;
 			if(context->ident == id_client){
@@ -208,18 +229,21 @@ int mux_epoll__handle(void)
 				listensock = ep_events[i].data.ptr;
 
 				if (ep_events[i].events & (EPOLLIN | EPOLLPRI)){
-					while((context = net__socket_accept(listensock)) != NULL){
-						context->events = EPOLLIN;
-						mux__add_in(context);
-					}
+					net__socket_accept_batch(listensock);
 				}
 #ifdef WITH_WEBSOCKETS
 			}else if(context->ident == id_listener_ws){
-				/* Nothing needs to happen here, because we always call lws_service in the loop.
-				 * The important point is we've been woken up for this listener. */
+				websockets__listener_handle(ep_events[i].data.ptr, ep_events[i].events);
+			}else if(context->ident == id_ws_pollfd){
+				websockets__pollfd_handle(ep_events[i].data.ptr, ep_events[i].events);
+#endif
+#ifdef WITH_TLS
+			}else if(context->ident == id_tls_handshake){
+				tls_handshake__handle();
 #endif
 			}
 		}
+		io_threads__finish();
 	}
 	return MOSQ_ERR_SUCCESS;
 }
@@ -227,8 +251,13 @@ int mux_epoll__handle(void)
 
 int mux_epoll__cleanup(void)
 {
+	io_threads__cleanup();
+#ifdef WITH_TLS
+	tls_handshake__cleanup();
+#endif
 	(void)close(db.epollfd);
 	db.epollfd = 0;
+	sigprocmask(SIG_SETMASK, &my_sigorig, NULL);
 	return MOSQ_ERR_SUCCESS;
 }
 
@@ -290,13 +319,22 @@ static void loop_handle_reads_writes(struct mosquitto *context, uint32_t events)
 #endif
 			){
 
-		do{
-			rc = packet__read(context);
+		if(context->io_read){
+			/* Already read by the I/O threads */
+			rc = io_threads__handle(context);
 			if(rc){
 				do_disconnect(context, rc);
 				return;
 			}
-		}while(SSL_DATA_PENDING(context));
+		}else{
+			do{
+				rc = packet__read(context);
+				if(rc){
+					do_disconnect(context, rc);
+					return;
+				}
+			}while(SSL_DATA_PENDING(context));
+		}
 	}else{
 		if(events & (EPOLLERR | EPOLLHUP)){
 			do_disconnect(context, MOSQ_ERR_CONN_LOST);
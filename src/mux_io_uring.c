@@ -0,0 +1,1017 @@
+/*
+Copyright (c) 2026 Contributors to the Eclipse Foundation
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License 2.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   https://www.eclipse.org/legal/epl-2.0/
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+SPDX-License-Identifier: EPL-2.0 OR BSD-3-Clause
+
+Contributors:
+   Eclipse Mosquitto contributors - initial implementation and documentation.
+*/
+
+#include "config.h"
+
+#ifdef WITH_IO_URING
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef WITH_WEBSOCKETS
+#  include <libwebsockets.h>
+#endif
+
+#include "mosquitto_broker_internal.h"
+#include "memory_mosq.h"
+#include "mux.h"
+#include "packet_mosq.h"
+#include "send_mosq.h"
+#include "sys_tree.h"
+#include "time_mosq.h"
+#include "util_mosq.h"
+
+/* io_uring event loop
+ *
+ * This is used in place of mux_epoll.c/mux_poll.c when the broker is built
+ * with WITH_IO_URING and the running kernel supports io_uring. The system
+ * calls are made directly, so liburing is not required.
+ *
+ * Plain TCP clients are read with a multishot recv, so the kernel reads data
+ * as it arrives into buffers taken from a ring shared by all clients. Each
+ * completion is split into packets with packet__read_data() and the buffer is
+ * handed straight back to the ring, so reading costs no system calls at all.
+ *
+ * Listeners are not given requests of their own. A request holds a reference
+ * to its socket until it completes, and after the broker exits the kernel
+ * tears the ring down in the background, so a listening socket could stay
+ * open long enough for a broker restarted straight away to fail to bind.
+ * Instead the listeners are added to an epoll instance, which does not keep
+ * them open, and a single poll request on the ring waits for that. Ready
+ * listeners are then handled by net__socket_accept_batch() as with epoll.
+ *
+ * TLS, websockets and bridge connections are read in the same way as with
+ * epoll, but readiness is reported by single shot poll requests on the ring
+ * rather than by epoll_wait().
+ *
+ * Waiting for writability is also a single shot poll request, armed only when
+ * a write could not complete. Requests are queued during a loop iteration and
+ * submitted in one go together with the wait for events, so there is a single
+ * io_uring_enter() call per loop iteration.
+ *
+ * Writes are still carried out directly by packet__write(), rather than as
+ * send requests on the ring. A send request would need the queued packets to
+ * stay allocated until the kernel had finished with them, which a client
+ * being disconnected or a packet being dropped from the queue cannot
+ * guarantee without reference counting every packet. packet__write() already
+ * sends as much of the queue as possible with a single writev(), so a
+ * connection with a long queue costs one system call per loop iteration
+ * either way, and TLS, kTLS and websockets connections could not use send
+ * requests at all.
+ *
+ * Each client has a slot in a table, and the slot index and a generation
+ * count identify its requests. Completions for a slot that has since been
+ * freed or reused are recognised and ignored, so a client can be freed
+ * without waiting for its outstanding requests to be cancelled.
+ */
+
+/* The rings count towards the locked memory limit of the user the broker runs
+ * as, which is shared with every other broker running as that user. A full
+ * submission queue is submitted early, so this needn't be large. */
+#define URING_SQ_ENTRIES 1024
+#define URING_CQ_ENTRIES (4*URING_SQ_ENTRIES)
+/* Must be a power of two */
+#define URING_BUF_COUNT 1024
+#define URING_BUF_SIZE 4096
+#define URING_BUF_GROUP 0
+#define URING_LISTEN_EVENTS 64
+
+enum mux_io_uring__op{
+	uring_op_cancel = 0,
+	uring_op_listener = 1,
+	uring_op_recv = 2,
+	uring_op_poll_in = 3,
+	uring_op_poll_out = 4,
+};
+
+#define URING_GEN_MASK 0xFFFFFF
+#define URING_DATA(op, gen, index) (((uint64_t)(op)<<56) | ((uint64_t)((gen)&URING_GEN_MASK)<<32) | (uint64_t)(index))
+
+struct mux_io_uring__slot{
+	struct mosquitto *context;
+	uint32_t gen;
+	uint32_t next_free;
+	bool want_in;
+	bool use_recv;
+	bool in_armed;
+	bool out_armed;
+	bool pending;
+};
+
+struct mux_io_uring__ring{
+	int fd;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned sq_local_tail;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	size_t sq_ring_len;
+	void *cq_ring;
+	size_t cq_ring_len;
+	size_t sqes_len;
+	struct io_uring_buf_ring *buf_ring;
+	size_t buf_ring_len;
+	uint8_t *bufs;
+	int listen_fd;
+	bool use_recv;
+};
+
+static void loop_handle_reads_writes(struct mosquitto *context, uint32_t events);
+
+static sigset_t my_sigblock;
+static sigset_t my_sigorig;
+static struct mux_io_uring__ring uring;
+
+/* Slot 0 is never used, so a context with uring_slot == 0 has no slot. */
+static struct mux_io_uring__slot *slots = NULL;
+static uint32_t slot_count = 0;
+static uint32_t slot_free = 0;
+
+/* Slots with requests that need arming before the next wait. */
+static uint32_t *pending = NULL;
+static uint32_t pending_count = 0;
+
+
+static int uring__setup(unsigned entries, struct io_uring_params *params)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+
+static int uring__enter(unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz)
+{
+	return (int)syscall(__NR_io_uring_enter, uring.fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+
+static int uring__register(unsigned opcode, void *arg, unsigned nr_args)
+{
+	return (int)syscall(__NR_io_uring_register, uring.fd, opcode, arg, nr_args);
+}
+
+
+static int uring__submit(unsigned min_complete, unsigned flags, void *arg, size_t argsz)
+{
+	unsigned to_submit;
+
+	__atomic_store_n(uring.sq_tail, uring.sq_local_tail, __ATOMIC_RELEASE);
+	to_submit = uring.sq_local_tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE);
+	return uring__enter(to_submit, min_complete, flags, arg, argsz);
+}
+
+
+static struct io_uring_sqe *uring__get_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+	unsigned head;
+
+	head = __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE);
+	if(uring.sq_local_tail - head >= uring.sq_entries){
+		/* Full, so submit what we have without waiting for anything. */
+		uring__submit(0, 0, NULL, 0);
+		head = __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE);
+		if(uring.sq_local_tail - head >= uring.sq_entries){
+			return NULL;
+		}
+	}
+	sqe = &uring.sqes[uring.sq_local_tail & uring.sq_mask];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	uring.sq_local_tail++;
+
+	return sqe;
+}
+
+
+static int uring__prep_poll(int fd, uint32_t events, uint64_t user_data)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring__get_sqe();
+	if(!sqe) return MOSQ_ERR_NOMEM;
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	/* The kernel expects the two halves swapped on big endian systems */
+	events = (events << 16) | (events >> 16);
+#endif
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = events;
+	sqe->user_data = user_data;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static int uring__prep_recv(int fd, uint64_t user_data)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring__get_sqe();
+	if(!sqe) return MOSQ_ERR_NOMEM;
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUF_GROUP;
+	sqe->user_data = user_data;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static int uring__prep_cancel(uint64_t target)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring__get_sqe();
+	if(!sqe) return MOSQ_ERR_NOMEM;
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = target;
+	sqe->user_data = URING_DATA(uring_op_cancel, 0, 0);
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Give a receive buffer back to the kernel. */
+static void uring__buf_recycle(uint16_t bid)
+{
+	struct io_uring_buf *buf;
+	uint16_t tail;
+
+	tail = uring.buf_ring->tail;
+	buf = &uring.buf_ring->bufs[tail & (URING_BUF_COUNT-1)];
+	buf->addr = (uint64_t)(uintptr_t)&uring.bufs[(size_t)bid*URING_BUF_SIZE];
+	buf->len = URING_BUF_SIZE;
+	buf->bid = bid;
+	__atomic_store_n(&uring.buf_ring->tail, (uint16_t)(tail+1), __ATOMIC_RELEASE);
+}
+
+
+static int uring__bufs_init(void)
+{
+	struct io_uring_buf_reg reg;
+	uint16_t i;
+
+	uring.buf_ring_len = URING_BUF_COUNT*sizeof(struct io_uring_buf);
+	uring.buf_ring = mmap(NULL, uring.buf_ring_len, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if(uring.buf_ring == MAP_FAILED){
+		uring.buf_ring = NULL;
+		return MOSQ_ERR_NOMEM;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)uring.buf_ring;
+	reg.ring_entries = URING_BUF_COUNT;
+	reg.bgid = URING_BUF_GROUP;
+	if(uring__register(IORING_REGISTER_PBUF_RING, &reg, 1) < 0){
+		munmap(uring.buf_ring, uring.buf_ring_len);
+		uring.buf_ring = NULL;
+		return MOSQ_ERR_NOT_SUPPORTED;
+	}
+
+	uring.bufs = mosquitto__malloc((size_t)URING_BUF_COUNT*URING_BUF_SIZE);
+	if(!uring.bufs){
+		return MOSQ_ERR_NOMEM;
+	}
+	for(i=0; i<URING_BUF_COUNT; i++){
+		uring__buf_recycle(i);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static int uring__ring_init(void)
+{
+	struct io_uring_params params;
+	unsigned *sq_array;
+	unsigned i;
+
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+	params.cq_entries = URING_CQ_ENTRIES;
+	uring.fd = uring__setup(URING_SQ_ENTRIES, &params);
+	if(uring.fd < 0 && errno == EINVAL){
+		/* Older kernel */
+		memset(&params, 0, sizeof(params));
+		params.flags = IORING_SETUP_CQSIZE;
+		params.cq_entries = URING_CQ_ENTRIES;
+		uring.fd = uring__setup(URING_SQ_ENTRIES, &params);
+	}
+	if(uring.fd < 0){
+		return MOSQ_ERR_ERRNO;
+	}
+	if(!(params.features & IORING_FEAT_SINGLE_MMAP)
+			|| !(params.features & IORING_FEAT_NODROP)
+			|| !(params.features & IORING_FEAT_EXT_ARG)){
+
+		errno = ENOSYS;
+		return MOSQ_ERR_ERRNO;
+	}
+
+	uring.sq_ring_len = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+	uring.cq_ring_len = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+	if(uring.cq_ring_len > uring.sq_ring_len){
+		uring.sq_ring_len = uring.cq_ring_len;
+	}
+	uring.sq_ring = mmap(NULL, uring.sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+	if(uring.sq_ring == MAP_FAILED){
+		uring.sq_ring = NULL;
+		return MOSQ_ERR_ERRNO;
+	}
+	/* With IORING_FEAT_SINGLE_MMAP the completion ring shares the mapping */
+	uring.cq_ring = uring.sq_ring;
+
+	uring.sqes_len = params.sq_entries*sizeof(struct io_uring_sqe);
+	uring.sqes = mmap(NULL, uring.sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+	if(uring.sqes == MAP_FAILED){
+		uring.sqes = NULL;
+		return MOSQ_ERR_ERRNO;
+	}
+
+	uring.sq_head = (unsigned *)((uint8_t *)uring.sq_ring + params.sq_off.head);
+	uring.sq_tail = (unsigned *)((uint8_t *)uring.sq_ring + params.sq_off.tail);
+	uring.sq_mask = *(unsigned *)((uint8_t *)uring.sq_ring + params.sq_off.ring_mask);
+	uring.sq_entries = *(unsigned *)((uint8_t *)uring.sq_ring + params.sq_off.ring_entries);
+	sq_array = (unsigned *)((uint8_t *)uring.sq_ring + params.sq_off.array);
+	for(i=0; i<uring.sq_entries; i++){
+		sq_array[i] = i;
+	}
+	uring.sq_local_tail = *uring.sq_tail;
+
+	uring.cq_head = (unsigned *)((uint8_t *)uring.cq_ring + params.cq_off.head);
+	uring.cq_tail = (unsigned *)((uint8_t *)uring.cq_ring + params.cq_off.tail);
+	uring.cq_mask = *(unsigned *)((uint8_t *)uring.cq_ring + params.cq_off.ring_mask);
+	uring.cqes = (struct io_uring_cqe *)((uint8_t *)uring.cq_ring + params.cq_off.cqes);
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static void uring__ring_cleanup(void)
+{
+	if(uring.sqes){
+		munmap(uring.sqes, uring.sqes_len);
+	}
+	if(uring.sq_ring){
+		munmap(uring.sq_ring, uring.sq_ring_len);
+	}
+	if(uring.fd >= 0){
+		/* Closing the ring cancels everything still outstanding, so this must
+		 * happen before the receive buffers are freed. */
+		close(uring.fd);
+	}
+	if(uring.buf_ring){
+		munmap(uring.buf_ring, uring.buf_ring_len);
+	}
+	if(uring.listen_fd >= 0){
+		close(uring.listen_fd);
+	}
+	mosquitto__free(uring.bufs);
+	memset(&uring, 0, sizeof(uring));
+	uring.fd = -1;
+	uring.listen_fd = -1;
+}
+
+
+static struct mux_io_uring__slot *uring__slot_find(struct mosquitto *context)
+{
+	if(context->uring_slot == 0
+			|| context->uring_slot >= slot_count
+			|| slots[context->uring_slot].context != context){
+
+		return NULL;
+	}
+	return &slots[context->uring_slot];
+}
+
+
+static struct mux_io_uring__slot *uring__slot_alloc(struct mosquitto *context)
+{
+	struct mux_io_uring__slot *slots_new;
+	uint32_t *pending_new;
+	uint32_t count_new;
+	uint32_t i;
+	struct mux_io_uring__slot *slot;
+
+	if(slot_free == 0){
+		count_new = slot_count < 1024 ? 1024 : slot_count*2;
+		slots_new = mosquitto__realloc(slots, count_new*sizeof(struct mux_io_uring__slot));
+		if(!slots_new) return NULL;
+		slots = slots_new;
+		pending_new = mosquitto__realloc(pending, count_new*sizeof(uint32_t));
+		if(!pending_new) return NULL;
+		pending = pending_new;
+
+		memset(&slots[slot_count], 0, (count_new-slot_count)*sizeof(struct mux_io_uring__slot));
+		for(i=count_new-1; i>=slot_count && i>0; i--){
+			slots[i].next_free = slot_free;
+			slot_free = i;
+		}
+		slot_count = count_new;
+	}
+
+	slot = &slots[slot_free];
+	context->uring_slot = slot_free;
+	slot_free = slot->next_free;
+
+	/* The pending flag is left alone, because the slot may still be on the
+	 * pending list from its previous use. */
+	slot->context = context;
+	slot->next_free = 0;
+	slot->want_in = false;
+	slot->use_recv = false;
+	slot->in_armed = false;
+	slot->out_armed = false;
+
+	return slot;
+}
+
+
+static void uring__slot_release(struct mux_io_uring__slot *slot)
+{
+	uint32_t index = (uint32_t)(slot - slots);
+
+	slot->context->uring_slot = 0;
+	slot->context = NULL;
+	slot->gen++;
+	slot->next_free = slot_free;
+	slot_free = index;
+}
+
+
+/* Arrange for the requests this slot needs to be armed before the next
+ * wait. */
+static void uring__slot_queue(struct mux_io_uring__slot *slot)
+{
+	if(!slot->pending){
+		slot->pending = true;
+		pending[pending_count] = (uint32_t)(slot - slots);
+		pending_count++;
+	}
+}
+
+
+static void uring__arm_pending(void)
+{
+	struct mux_io_uring__slot *slot;
+	struct mosquitto *context;
+	uint32_t index;
+	uint32_t i;
+	int rc;
+
+	for(i=0; i<pending_count; i++){
+		index = pending[i];
+		slot = &slots[index];
+		slot->pending = false;
+		context = slot->context;
+		if(!context || context->sock == INVALID_SOCKET){
+			continue;
+		}
+
+		if(slot->want_in && !slot->in_armed){
+			if(slot->use_recv){
+				rc = uring__prep_recv(context->sock, URING_DATA(uring_op_recv, slot->gen, index));
+			}else{
+				rc = uring__prep_poll(context->sock, POLLIN, URING_DATA(uring_op_poll_in, slot->gen, index));
+			}
+			if(rc == MOSQ_ERR_SUCCESS){
+				slot->in_armed = true;
+			}
+		}
+		if((context->events & POLLOUT) && !slot->out_armed){
+			rc = uring__prep_poll(context->sock, POLLOUT, URING_DATA(uring_op_poll_out, slot->gen, index));
+			if(rc == MOSQ_ERR_SUCCESS){
+				slot->out_armed = true;
+			}
+		}
+		if(!slot->in_armed && slot->want_in){
+			log__printf(NULL, MOSQ_LOG_ERR, "Error in io_uring: Unable to queue request for client %s.", context->id);
+		}
+	}
+	pending_count = 0;
+}
+
+
+static int uring__listeners_init(struct mosquitto__listener_sock *listensock, int listensock_count)
+{
+	struct epoll_event ev;
+	int i;
+
+	uring.listen_fd = epoll_create1(EPOLL_CLOEXEC);
+	if(uring.listen_fd < 0){
+		return MOSQ_ERR_ERRNO;
+	}
+	for(i=0; i<listensock_count; i++){
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u32 = (uint32_t)i;
+		if(epoll_ctl(uring.listen_fd, EPOLL_CTL_ADD, listensock[i].sock, &ev) < 0){
+			return MOSQ_ERR_ERRNO;
+		}
+	}
+	return uring__prep_poll(uring.listen_fd, POLLIN, URING_DATA(uring_op_listener, 0, 0));
+}
+
+
+int mux_io_uring__init(struct mosquitto__listener_sock *listensock, int listensock_count)
+{
+	int rc;
+
+#ifndef WIN32
+	sigemptyset(&my_sigblock);
+	sigaddset(&my_sigblock, SIGINT);
+	sigaddset(&my_sigblock, SIGTERM);
+	sigaddset(&my_sigblock, SIGUSR1);
+	sigaddset(&my_sigblock, SIGUSR2);
+	sigaddset(&my_sigblock, SIGHUP);
+#endif
+
+	memset(&uring, 0, sizeof(uring));
+	uring.fd = -1;
+	uring.listen_fd = -1;
+
+	rc = uring__ring_init();
+	if(rc){
+		log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Unable to use io_uring: %s.", strerror(errno));
+		uring__ring_cleanup();
+		return rc;
+	}
+
+	rc = uring__bufs_init();
+	if(rc == MOSQ_ERR_SUCCESS){
+		uring.use_recv = true;
+	}else if(rc == MOSQ_ERR_NOT_SUPPORTED){
+		/* Provided buffer rings need Linux 5.19, without them clients are
+		 * read in the same way as with epoll. */
+		uring.use_recv = false;
+	}else{
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		uring__ring_cleanup();
+		return rc;
+	}
+
+	if(uring__listeners_init(listensock, listensock_count)){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error in io_uring initial registering.");
+		uring__ring_cleanup();
+		return MOSQ_ERR_UNKNOWN;
+	}
+
+	/* As with epoll, the signals we handle are only delivered whilst
+	 * waiting. */
+	sigprocmask(SIG_BLOCK, &my_sigblock, &my_sigorig);
+
+	log__printf(NULL, MOSQ_LOG_INFO, "Using io_uring for network events%s.", uring.use_recv?" and reads":"");
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+int mux_io_uring__add_out(struct mosquitto *context)
+{
+	struct mux_io_uring__slot *slot;
+
+	slot = uring__slot_find(context);
+	if(!slot){
+		slot = uring__slot_alloc(context);
+		if(!slot) return MOSQ_ERR_NOMEM;
+	}
+	if(!(context->events & POLLOUT)){
+		context->events = POLLIN | POLLOUT;
+		uring__slot_queue(slot);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+int mux_io_uring__remove_out(struct mosquitto *context)
+{
+	/* Nothing is cancelled here, any outstanding poll for POLLOUT is ignored
+	 * when it completes. That is far more likely to happen without a write
+	 * having to wait than it is for the socket to stay blocked. */
+	if(context->events & POLLOUT){
+		context->events = POLLIN;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+int mux_io_uring__add_in(struct mosquitto *context)
+{
+	struct mux_io_uring__slot *slot;
+
+	slot = uring__slot_find(context);
+	if(!slot){
+		slot = uring__slot_alloc(context);
+		if(!slot){
+			log__printf(NULL, MOSQ_LOG_ERR, "Error in io_uring accepting: Out of memory.");
+			return MOSQ_ERR_NOMEM;
+		}
+	}
+	slot->want_in = true;
+	if(!slot->in_armed){
+		slot->use_recv = uring.use_recv
+				&& context->bridge == NULL
+#ifdef WITH_TLS
+				&& context->ssl == NULL
+#endif
+#ifdef WITH_WEBSOCKETS
+				&& context->wsi == NULL
+#endif
+				;
+	}
+	context->events = POLLIN;
+	uring__slot_queue(slot);
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+int mux_io_uring__delete(struct mosquitto *context)
+{
+	struct mux_io_uring__slot *slot;
+	uint32_t index;
+
+	slot = uring__slot_find(context);
+	if(!slot){
+		return 0;
+	}
+	index = context->uring_slot;
+	if(slot->in_armed){
+		uring__prep_cancel(URING_DATA(slot->use_recv?uring_op_recv:uring_op_poll_in, slot->gen, index));
+	}
+	if(slot->out_armed){
+		uring__prep_cancel(URING_DATA(uring_op_poll_out, slot->gen, index));
+	}
+	uring__slot_release(slot);
+	return 0;
+}
+
+
+static void uring__handle_listeners(struct mosquitto__listener_sock *listensock, int listensock_count, int32_t res)
+{
+	struct epoll_event events[URING_LISTEN_EVENTS];
+	int event_count;
+	int i;
+	uint32_t index;
+
+	if(res == -ECANCELED){
+		return;
+	}
+	event_count = epoll_wait(uring.listen_fd, events, URING_LISTEN_EVENTS, 0);
+	for(i=0; i<event_count; i++){
+		index = events[i].data.u32;
+		if(index >= (uint32_t)listensock_count){
+			continue;
+		}
+#ifdef WITH_WEBSOCKETS
+		if(listensock[index].listener->ws_context){
+			/* Nothing needs to happen here, because we always call lws_service in the loop.
+			 * The important point is we've been woken up for this listener. */
+		}else
+#endif
+		{
+			net__socket_accept_batch(&listensock[index]);
+		}
+	}
+	uring__prep_poll(uring.listen_fd, POLLIN, URING_DATA(uring_op_listener, 0, 0));
+}
+
+
+static void uring__handle_recv(uint32_t index, uint32_t gen, int32_t res, uint32_t flags)
+{
+	struct mux_io_uring__slot *slot = NULL;
+	struct mosquitto *context = NULL;
+	uint16_t bid = 0;
+	int rc;
+
+	if(index < slot_count && slots[index].context && (slots[index].gen&URING_GEN_MASK) == gen){
+		slot = &slots[index];
+		context = slot->context;
+		if(!(flags & IORING_CQE_F_MORE)){
+			slot->in_armed = false;
+		}
+	}
+	if(flags & IORING_CQE_F_BUFFER){
+		bid = (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT);
+	}
+
+	if(context){
+		if(res > 0){
+			rc = packet__read_data(context, &uring.bufs[(size_t)bid*URING_BUF_SIZE], (size_t)res);
+			if(rc){
+				do_disconnect(context, rc);
+			}
+		}else if(res == 0){
+			do_disconnect(context, MOSQ_ERR_CONN_LOST); /* EOF */
+		}else if(res == -ENOBUFS || res == -EINTR || res == -EAGAIN){
+			/* Run out of receive buffers, the recv is armed again below */
+		}else if(res == -EINVAL){
+			/* Multishot recv needs Linux 6.0, fall back to polling. */
+			uring.use_recv = false;
+			slot->use_recv = false;
+		}else if(res != -ECANCELED){
+			errno = -res;
+			do_disconnect(context, res == -ECONNRESET ? MOSQ_ERR_CONN_LOST : MOSQ_ERR_ERRNO);
+		}
+	}
+	if(flags & IORING_CQE_F_BUFFER){
+		uring__buf_recycle(bid);
+	}
+
+	/* The slot may have been released, or the table reallocated, whilst
+	 * handling the data. */
+	if(context && context->uring_slot == index){
+		slot = &slots[index];
+		if(!slot->in_armed){
+			uring__slot_queue(slot);
+		}
+	}
+}
+
+
+static void uring__handle_poll(enum mux_io_uring__op op, uint32_t index, uint32_t gen, int32_t res)
+{
+	struct mux_io_uring__slot *slot;
+	struct mosquitto *context;
+	uint32_t events;
+
+	if(index >= slot_count || slots[index].context == NULL || (slots[index].gen&URING_GEN_MASK) != gen){
+		return;
+	}
+	slot = &slots[index];
+	context = slot->context;
+	if(op == uring_op_poll_in){
+		slot->in_armed = false;
+	}else{
+		slot->out_armed = false;
+	}
+	if(res == -ECANCELED){
+		return;
+	}
+
+	if(res < 0){
+		events = POLLERR;
+	}else{
+		events = (uint32_t)res;
+	}
+	if(op == uring_op_poll_out){
+		if(context->events & POLLOUT){
+			/* Errors are reported by the read side, which may still have
+			 * data to handle first. */
+			events &= POLLOUT;
+		}else{
+			/* No longer wanted */
+			events = 0;
+		}
+	}
+	if(events){
+		loop_handle_reads_writes(context, events);
+	}
+
+	if(context->uring_slot == index){
+		uring__slot_queue(&slots[index]);
+	}
+}
+
+
+int mux_io_uring__handle(struct mosquitto__listener_sock *listensock, int listensock_count)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	struct io_uring_cqe *cqe;
+	unsigned head, tail;
+	uint64_t user_data;
+	int32_t res;
+	uint32_t flags;
+	uint32_t index, gen;
+	enum mux_io_uring__op op;
+	int rc;
+
+	uring__arm_pending();
+
+	if(mux__deliver_signals(&my_sigblock, &my_sigorig)){
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	memset(&ts, 0, sizeof(ts));
+	ts.tv_sec = db.next_event_ms/1000;
+	ts.tv_nsec = (db.next_event_ms%1000)*1000000;
+	memset(&arg, 0, sizeof(arg));
+	arg.ts = (uint64_t)(uintptr_t)&ts;
+	arg.sigmask = (uint64_t)(uintptr_t)&my_sigorig;
+	arg.sigmask_sz = _NSIG/8;
+
+	rc = uring__submit(1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+	if(rc < 0 && errno != ETIME && errno != EINTR && errno != EBUSY){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error in io_uring waiting: %s.", strerror(errno));
+	}
+
+	db.now_s = mosquitto_time();
+	db.now_real_s = time(NULL);
+
+	head = *uring.cq_head;
+	tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+	while(head != tail){
+		cqe = &uring.cqes[head & uring.cq_mask];
+		user_data = cqe->user_data;
+		res = cqe->res;
+		flags = cqe->flags;
+		head++;
+		/* Release the entry before handling it, handling may submit more
+		 * requests. */
+		__atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+
+		op = (enum mux_io_uring__op)(user_data >> 56);
+		gen = (uint32_t)(user_data >> 32) & URING_GEN_MASK;
+		index = (uint32_t)(user_data & 0xFFFFFFFF);
+
+		switch(op){
+			case uring_op_listener:
+				uring__handle_listeners(listensock, listensock_count, res);
+				break;
+			case uring_op_recv:
+				uring__handle_recv(index, gen, res, flags);
+				break;
+			case uring_op_poll_in:
+			case uring_op_poll_out:
+				uring__handle_poll(op, index, gen, res);
+				break;
+			case uring_op_cancel:
+			default:
+				break;
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Cancel everything still outstanding and wait for it to finish. Requests
+ * hold their own references to sockets, and tearing down the ring once it is
+ * closed happens in the background, so without this client sockets could
+ * outlive the broker for a moment. */
+static void uring__cancel_all(void)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	unsigned head, tail;
+	uint64_t marker = URING_DATA(uring_op_cancel, 0, 1);
+	bool done = false;
+	int i;
+
+	sqe = uring__get_sqe();
+	if(!sqe) return;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+	sqe->user_data = marker;
+
+	memset(&arg, 0, sizeof(arg));
+	arg.ts = (uint64_t)(uintptr_t)&ts;
+	for(i=0; i<10 && !done; i++){
+		memset(&ts, 0, sizeof(ts));
+		ts.tv_nsec = 100000000;
+		uring__submit(1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+
+		head = *uring.cq_head;
+		tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+		while(head != tail){
+			cqe = &uring.cqes[head & uring.cq_mask];
+			if(cqe->user_data == marker){
+				done = true;
+			}
+			head++;
+		}
+		__atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+	}
+	/* Let the kernel finish freeing the cancelled requests */
+	uring__enter(0, 0, IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+
+int mux_io_uring__cleanup(void)
+{
+	if(uring.fd >= 0){
+		uring__cancel_all();
+		sigprocmask(SIG_SETMASK, &my_sigorig, NULL);
+	}
+	uring__ring_cleanup();
+	mosquitto__free(slots);
+	slots = NULL;
+	slot_count = 0;
+	slot_free = 0;
+	mosquitto__free(pending);
+	pending = NULL;
+	pending_count = 0;
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static void loop_handle_reads_writes(struct mosquitto *context, uint32_t events)
+{
+	int err;
+	socklen_t len;
+	int rc;
+
+	if(context->sock == INVALID_SOCKET){
+		return;
+	}
+
+#ifdef WITH_WEBSOCKETS
+	if(context->wsi){
+		struct lws_pollfd wspoll;
+		wspoll.fd = context->sock;
+		wspoll.events = (int16_t)context->events;
+		wspoll.revents = (int16_t)events;
+		lws_service_fd(lws_get_context(context->wsi), &wspoll);
+		return;
+	}
+#endif
+
+	if(events & POLLOUT
+#ifdef WITH_TLS
+			|| context->want_write
+			|| (context->ssl && context->state == mosq_cs_new)
+#endif
+			){
+
+		if(context->state == mosq_cs_connect_pending){
+			len = sizeof(int);
+			if(!getsockopt(context->sock, SOL_SOCKET, SO_ERROR, (char *)&err, &len)){
+				if(err == 0){
+					mosquitto__set_state(context, mosq_cs_new);
+#if defined(WITH_ADNS) && defined(WITH_BRIDGE)
+					if(context->bridge){
+						bridge__connect_step3(context);
+					}
+#endif
+				}
+			}else{
+				do_disconnect(context, MOSQ_ERR_CONN_LOST);
+				return;
+			}
+		}
+		rc = packet__write(context);
+		if(rc){
+			do_disconnect(context, rc);
+			return;
+		}
+	}
+
+	if(events & POLLIN
+#ifdef WITH_TLS
+			|| (context->ssl && context->state == mosq_cs_new)
+#endif
+			){
+
+		do{
+			rc = packet__read(context);
+			if(rc){
+				do_disconnect(context, rc);
+				return;
+			}
+		}while(SSL_DATA_PENDING(context));
+	}else{
+		if(events & (POLLERR | POLLHUP)){
+			do_disconnect(context, MOSQ_ERR_CONN_LOST);
+			return;
+		}
+	}
+}
+#endif
@@ -63,6 +63,9 @@ static size_t pollfd_max, pollfd_current_max;
 #ifndef WIN32
 static sigset_t my_sigblock;
 #endif
+#ifdef __linux__
+static sigset_t my_sigorig;
+#endif
 
 int mux_poll__init(struct mosquitto__listener_sock *listensock, int listensock_count)
 {
@@ -102,6 +105,12 @@ int mux_poll__init(struct mosquitto__listener_sock *listensock, int listensock_c
 	}
 
 	pollfd_current_max = pollfd_index-1;
+
+#ifdef __linux__
+	/* The signals we handle are only delivered whilst waiting for events, so
+	 * one that arrives just before the wait still interrupts it. */
+	sigprocmask(SIG_BLOCK, &my_sigblock, &my_sigorig);
+#endif
 	return MOSQ_ERR_SUCCESS;
 }
 
@@ -189,19 +198,31 @@ int mux_poll__delete(struct mosquitto *context)
 
 int mux_poll__handle(struct mosquitto__listener_sock *listensock, int listensock_count)
 {
-	struct mosquitto *context;
 	int i;
 	int fdcount;
-#ifndef WIN32
+#if defined(__linux__)
+	struct timespec ts;
+#elif !defined(WIN32)
 	sigset_t origsig;
 #endif
 
-#ifndef WIN32
+#if defined(__linux__)
+	ts.tv_sec = db.next_event_ms/1000;
+	ts.tv_nsec = (db.next_event_ms%1000)*1000000;
+	if(mux__deliver_signals(&my_sigblock, &my_sigorig)){
+		return MOSQ_ERR_SUCCESS;
+	}
+	fdcount = ppoll(pollfds, pollfd_current_max+1, &ts, &my_sigorig);
+#elif !defined(WIN32)
+	/* Signals that arrive just before the wait are not handled until it
+	 * finishes, so don't wait for too long. */
+	loop__update_next_event(100);
 	sigprocmask(SIG_SETMASK, &my_sigblock, &origsig);
-	fdcount = poll(pollfds, pollfd_current_max+1, 100);
+	fdcount = poll(pollfds, pollfd_current_max+1, db.next_event_ms);
 	sigprocmask(SIG_SETMASK, &origsig, NULL);
 #else
-	fdcount = WSAPoll(pollfds, pollfd_current_max+1, 100);
+	loop__update_next_event(100);
+	fdcount = WSAPoll(pollfds, pollfd_current_max+1, db.next_event_ms);
 #endif
 
 	db.now_s = mosquitto_time();
@@ -232,10 +253,7 @@ int mux_poll__handle(struct mosquitto__listener_sock *listensock, int listensock
 				}else
 #endif
 				{
-					while((context = net__socket_accept(&listensock[i])) != NULL){
-						context->pollfd_index = -1;
-						mux__add_in(context);
-					}
+					net__socket_accept_batch(&listensock[i]);
 				}
 			}
 		}
@@ -248,6 +266,9 @@ int mux_poll__cleanup(void)
 {
 	mosquitto__free(pollfds);
 	pollfds = NULL;
+#ifdef __linux__
+	sigprocmask(SIG_SETMASK, &my_sigorig, NULL);
+#endif
 
 	return MOSQ_ERR_SUCCESS;
 }
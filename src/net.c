@@ -34,6 +34,7 @@ Contributors:
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #ifdef WITH_WRAP
 #  include <tcpd.h>
@@ -57,13 +58,26 @@ Contributors:
 #include "memory_mosq.h"
 #include "misc_mosq.h"
 #include "net_mosq.h"
+#include "time_mosq.h"
 #include "util_mosq.h"
 
 #ifdef WITH_TLS
 #  include "tls_mosq.h"
 #  include <openssl/err.h>
+#  include <openssl/rand.h>
+#  if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#    include <openssl/core_names.h>
+#  else
+#    include <openssl/hmac.h>
+#  endif
 static int tls_ex_index_context = -1;
 static int tls_ex_index_listener = -1;
+
+/* Each session ticket key is a 16 byte name, a 32 byte HMAC secret and a 32
+ * byte AES key, the same layout as used by other servers, so a key can be
+ * made with `openssl rand 80`. */
+#define TLS_TICKET_KEY_NAME_LEN 16
+#define TLS_TICKET_KEY_LEN 80
 #endif
 
 #include "sys_tree.h"
@@ -108,9 +122,33 @@ static void net__print_error(unsigned int log, const char *format_str)
 }
 
 
-struct mosquitto *net__socket_accept(struct mosquitto__listener_sock *listensock)
+/* Accept a single connection from a listening socket, returning it already set
+ * to non-blocking. */
+static mosq_sock_t net__socket_accept_sock(mosq_sock_t listen_sock)
+{
+	mosq_sock_t new_sock;
+
+#ifdef __linux__
+	new_sock = accept4(listen_sock, NULL, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if(new_sock == INVALID_SOCKET){
+		return INVALID_SOCKET;
+	}
+#else
+	new_sock = accept(listen_sock, NULL, 0);
+	if(new_sock == INVALID_SOCKET){
+		return INVALID_SOCKET;
+	}
+	if(net__socket_nonblock(&new_sock)){
+		errno = EINVAL;
+		return INVALID_SOCKET;
+	}
+#endif
+	return new_sock;
+}
+
+
+static struct mosquitto *net__socket_accept_context(struct mosquitto__listener_sock *listensock, mosq_sock_t new_sock)
 {
-	mosq_sock_t new_sock = INVALID_SOCKET;
 	struct mosquitto *new_context;
 #ifdef WITH_TLS
 	BIO *bio;
@@ -123,39 +161,6 @@ struct mosquitto *net__socket_accept(struct mosquitto__listener_sock *listensock
 	char address[1024];
 #endif
 
-	new_sock = accept(listensock->sock, NULL, 0);
-	if(new_sock == INVALID_SOCKET){
-#ifdef WIN32
-		errno = WSAGetLastError();
-		if(errno == WSAEMFILE){
-#else
-		if(errno == EMFILE || errno == ENFILE){
-#endif
-			/* Close the spare socket, which means we should be able to accept
-			 * this connection. Accept it, then close it immediately and create
-			 * a new spare_sock. This prevents the situation of ever properly
-			 * running out of sockets.
-			 * It would be nice to send a "server not available" connack here,
-			 * but there are lots of reasons why this would be tricky (TLS
-			 * being the big one). */
-			COMPAT_CLOSE(spare_sock);
-			new_sock = accept(listensock->sock, NULL, 0);
-			if(new_sock != INVALID_SOCKET){
-				COMPAT_CLOSE(new_sock);
-			}
-			spare_sock = socket(AF_INET, SOCK_STREAM, 0);
-			log__printf(NULL, MOSQ_LOG_WARNING,
-					"Unable to accept new connection, system socket count has been exceeded. Try increasing \"ulimit -n\" or equivalent.");
-		}
-		return NULL;
-	}
-
-	G_SOCKET_CONNECTIONS_INC();
-
-	if(net__socket_nonblock(&new_sock)){
-		return NULL;
-	}
-
 #ifdef WITH_WRAP
 	/* Use tcpd / libwrap to determine whether a connection is allowed. */
 	request_init(&wrap_req, RQ_FILE, new_sock, RQ_DAEMON, "mosquitto", 0);
@@ -216,6 +221,17 @@ struct mosquitto *net__socket_accept(struct mosquitto__listener_sock *listensock
 		new_context->want_write = true;
 		bio = BIO_new_socket(new_sock, BIO_NOCLOSE);
 		SSL_set_bio(new_context->ssl, bio, bio);
+#ifdef WITH_EPOLL
+		if(tls_handshake__start(new_context)){
+			/* The handshake thread passes the connection back to the main
+			 * loop once the handshake is complete. */
+			if(db.config->connection_messages == true){
+				log__printf(NULL, MOSQ_LOG_NOTICE, "New connection from %s:%d on port %d.",
+						new_context->address, new_context->remote_port, new_context->listener->port);
+			}
+			return NULL;
+		}
+#endif
 		ERR_clear_error();
 		rc = SSL_accept(new_context->ssl);
 		if(rc != 1){
@@ -251,6 +267,125 @@ struct mosquitto *net__socket_accept(struct mosquitto__listener_sock *listensock
 	return new_context;
 }
 
+
+/* Accept the connections waiting on a listening socket and add them to the
+ * mux, until the listen queue is empty or accept_batch_size connections have
+ * been accepted. Anything left waiting is accepted on the next pass through
+ * the main loop, so a flood of new connections cannot starve existing
+ * clients. */
+void net__socket_accept_batch(struct mosquitto__listener_sock *listensock)
+{
+	mosq_sock_t new_sock;
+	struct mosquitto *new_context;
+	int count;
+	uint64_t latency;
+
+	for(count=0; count<db.config->accept_batch_size; count++){
+		new_sock = net__socket_accept_sock(listensock->sock);
+		if(new_sock == INVALID_SOCKET){
+#ifdef WIN32
+			errno = WSAGetLastError();
+			if(errno == WSAEMFILE){
+#else
+			if(errno == EMFILE || errno == ENFILE){
+#endif
+				/* Close the spare socket, which means we should be able to accept
+				 * this connection. Accept it, then close it immediately and create
+				 * a new spare_sock. This prevents the situation of ever properly
+				 * running out of sockets.
+				 * It would be nice to send a "server not available" connack here,
+				 * but there are lots of reasons why this would be tricky (TLS
+				 * being the big one). */
+				COMPAT_CLOSE(spare_sock);
+				new_sock = accept(listensock->sock, NULL, 0);
+				if(new_sock != INVALID_SOCKET){
+					COMPAT_CLOSE(new_sock);
+				}
+				spare_sock = socket(AF_INET, SOCK_STREAM, 0);
+				log__printf(NULL, MOSQ_LOG_WARNING,
+						"Unable to accept new connection, system socket count has been exceeded. Try increasing \"ulimit -n\" or equivalent.");
+			}
+			break;
+		}
+
+		G_SOCKET_CONNECTIONS_INC();
+
+		new_context = net__socket_accept_context(listensock, new_sock);
+		if(new_context){
+			mux__add_in(new_context);
+		}
+	}
+
+	if(count == db.config->accept_batch_size){
+		/* There may be more waiting, note when we started falling behind. */
+		G_ACCEPT_DEFERRED_INC();
+		if(listensock->accept_deferred_ms == 0){
+			listensock->accept_deferred_ms = mosquitto_time_ms();
+		}
+	}else if(listensock->accept_deferred_ms){
+		latency = mosquitto_time_ms() - listensock->accept_deferred_ms;
+		G_ACCEPT_LATENCY(latency);
+		listensock->accept_deferred_ms = 0;
+	}
+}
+
+
+#ifdef __linux__
+/* Returns the number of connections waiting to be accepted on all of the
+ * listening sockets of a listener. */
+unsigned long net__socket_listen_queued(struct mosquitto__listener *listener)
+{
+	struct tcp_info info;
+	socklen_t len;
+	unsigned long queued = 0;
+	int i;
+
+	for(i=0; i<listener->sock_count; i++){
+		len = sizeof(info);
+		if(getsockopt(listener->socks[i], IPPROTO_TCP, TCP_INFO, &info, &len) == 0
+				&& info.tcpi_state == TCP_LISTEN){
+
+			/* For listening sockets, this is the accept queue length. */
+			queued += info.tcpi_unacked;
+		}
+	}
+	return queued;
+}
+
+
+/* Returns the system wide count of connections dropped because a listen
+ * queue was full, or 0 if it is not available. */
+unsigned long net__socket_listen_overflows(void)
+{
+	FILE *fptr;
+	char names[4096], values[4096];
+	char *name, *value, *saveptr_n = NULL, *saveptr_v = NULL;
+	unsigned long overflows = 0;
+
+	fptr = fopen("/proc/net/netstat", "r");
+	if(!fptr) return 0;
+
+	while(fgets(names, sizeof(names), fptr) && fgets(values, sizeof(values), fptr)){
+		if(strncmp(names, "TcpExt:", strlen("TcpExt:"))){
+			continue;
+		}
+		name = strtok_r(names, " \n", &saveptr_n);
+		value = strtok_r(values, " \n", &saveptr_v);
+		while(name && value){
+			if(!strcmp(name, "ListenOverflows")){
+				overflows = strtoul(value, NULL, 10);
+				break;
+			}
+			name = strtok_r(NULL, " \n", &saveptr_n);
+			value = strtok_r(NULL, " \n", &saveptr_v);
+		}
+		break;
+	}
+	fclose(fptr);
+	return overflows;
+}
+#endif
+
 #ifdef WITH_TLS
 static int client_certificate_verify(int preverify_ok, X509_STORE_CTX *ctx)
 {
@@ -314,6 +449,167 @@ static unsigned int psk_server_callback(SSL *ssl, const char *identity, unsigned
 #endif
 
 #ifdef WITH_TLS
+int net__tls_load_ticket_keys(struct mosquitto__listener *listener)
+{
+	FILE *fptr;
+	long len;
+	unsigned char *keys;
+
+	fptr = mosquitto__fopen(listener->tls_ticket_key_file, "rb", true);
+	if(fptr == NULL){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: Unable to open tls_ticket_key_file \"%s\".", listener->tls_ticket_key_file);
+		return MOSQ_ERR_TLS;
+	}
+	if(fseek(fptr, 0, SEEK_END) < 0 || (len = ftell(fptr)) < 0 || fseek(fptr, 0, SEEK_SET) < 0){
+		fclose(fptr);
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: Unable to read tls_ticket_key_file \"%s\".", listener->tls_ticket_key_file);
+		return MOSQ_ERR_TLS;
+	}
+	if(len == 0 || len % TLS_TICKET_KEY_LEN != 0){
+		fclose(fptr);
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: tls_ticket_key_file \"%s\" must contain one or more %d byte keys.",
+				listener->tls_ticket_key_file, TLS_TICKET_KEY_LEN);
+		return MOSQ_ERR_TLS;
+	}
+
+	keys = mosquitto__malloc((size_t)len);
+	if(keys == NULL){
+		fclose(fptr);
+		return MOSQ_ERR_NOMEM;
+	}
+	if(fread(keys, 1, (size_t)len, fptr) != (size_t)len){
+		fclose(fptr);
+		mosquitto__free(keys);
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: Unable to read tls_ticket_key_file \"%s\".", listener->tls_ticket_key_file);
+		return MOSQ_ERR_TLS;
+	}
+	fclose(fptr);
+
+	/* Only replace the old keys once the new ones have been read, so a bad
+	 * file on reload leaves the existing keys in use. */
+	if(listener->tls_ticket_keys){
+		OPENSSL_cleanse(listener->tls_ticket_keys, (size_t)listener->tls_ticket_key_count*TLS_TICKET_KEY_LEN);
+		mosquitto__free(listener->tls_ticket_keys);
+	}
+	listener->tls_ticket_keys = keys;
+	listener->tls_ticket_key_count = (int)(len / TLS_TICKET_KEY_LEN);
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int tls_ticket_mac_init(EVP_MAC_CTX *mac_ctx, unsigned char *secret)
+{
+	OSSL_PARAM params[3];
+
+	params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, secret, 32);
+	params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char *)"sha256", 0);
+	params[2] = OSSL_PARAM_construct_end();
+
+	return EVP_MAC_CTX_set_params(mac_ctx, params);
+}
+
+static int tls_ticket_key_callback(SSL *ssl, unsigned char *key_name, unsigned char *iv, EVP_CIPHER_CTX *cipher_ctx, EVP_MAC_CTX *mac_ctx, int enc)
+#else
+static int tls_ticket_mac_init(HMAC_CTX *mac_ctx, unsigned char *secret)
+{
+	return HMAC_Init_ex(mac_ctx, secret, 32, EVP_sha256(), NULL);
+}
+
+static int tls_ticket_key_callback(SSL *ssl, unsigned char *key_name, unsigned char *iv, EVP_CIPHER_CTX *cipher_ctx, HMAC_CTX *mac_ctx, int enc)
+#endif
+{
+	struct mosquitto__listener *listener;
+	unsigned char *key;
+	int i;
+
+	listener = SSL_get_ex_data(ssl, tls_ex_index_listener);
+	if(listener == NULL || listener->tls_ticket_key_count == 0) return -1;
+
+	if(enc){
+		/* New tickets always use the first key */
+		key = listener->tls_ticket_keys;
+		memcpy(key_name, key, TLS_TICKET_KEY_NAME_LEN);
+		if(RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1
+				|| EVP_EncryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), NULL, &key[48], iv) != 1
+				|| tls_ticket_mac_init(mac_ctx, &key[16]) != 1){
+
+			return -1;
+		}
+		return 1;
+	}else{
+		for(i=0; i<listener->tls_ticket_key_count; i++){
+			key = &listener->tls_ticket_keys[i*TLS_TICKET_KEY_LEN];
+			if(!memcmp(key_name, key, TLS_TICKET_KEY_NAME_LEN)){
+				if(tls_ticket_mac_init(mac_ctx, &key[16]) != 1
+						|| EVP_DecryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), NULL, &key[48], iv) != 1){
+
+					return -1;
+				}
+				/* Tickets made with an older key are accepted, but replaced
+				 * with one made with the current key. */
+				return i == 0 ? 1 : 2;
+			}
+		}
+		/* Unknown key, so do a full handshake */
+		return 0;
+	}
+}
+
+
+static void tls_info_callback(const SSL *ssl, int where, int ret)
+{
+#ifdef WITH_EPOLL
+	struct mosquitto *context;
+#endif
+
+	UNUSED(ret);
+
+#ifdef WITH_EPOLL
+	context = SSL_get_ex_data(ssl, tls_ex_index_context);
+	if(context && context->tls_handshake){
+		/* Counted by the main loop once the handshake thread is done */
+		return;
+	}
+#endif
+	if(where & SSL_CB_HANDSHAKE_DONE){
+		if(SSL_session_reused((SSL *)ssl)){
+			G_TLS_HANDSHAKES_RESUMED_INC();
+		}else{
+			G_TLS_HANDSHAKES_FULL_INC();
+		}
+	}
+}
+
+
+#ifdef FINAL_WITH_TLS_KTLS
+/* Called once the handshake is complete. If the kernel has taken over
+ * encrypting outgoing data, the connection can be written to in the same way
+ * as a plain TCP connection. Incoming data is always read with SSL_read(),
+ * which uses kTLS itself if it is available. */
+void net__tls_ktls_check(struct mosquitto *context)
+{
+	struct mosquitto__listener *listener = context->listener;
+
+	if(context->ssl == NULL || listener == NULL || listener->tls_ktls == false){
+		return;
+	}
+
+	if(BIO_get_ktls_send(SSL_get_wbio(context->ssl))){
+		context->ktls_send = true;
+	}else if(listener->tls_ktls_fallback_logged == false){
+		/* The kernel doesn't support this cipher, or doesn't have TLS
+		 * support at all. OpenSSL carries on encrypting the data itself. */
+		listener->tls_ktls_fallback_logged = true;
+		log__printf(NULL, MOSQ_LOG_NOTICE,
+				"kTLS is not available for cipher %s on port %d, using OpenSSL instead. This will not be logged again for this listener.",
+				SSL_get_cipher_name(context->ssl), listener->port);
+	}
+}
+#endif
+
+
 int net__tls_server_ctx(struct mosquitto__listener *listener)
 {
 	char buf[256];
@@ -324,6 +620,12 @@ int net__tls_server_ctx(struct mosquitto__listener *listener)
 	if(listener->ssl_ctx){
 		SSL_CTX_free(listener->ssl_ctx);
 	}
+	if(tls_ex_index_context == -1){
+		tls_ex_index_context = SSL_get_ex_new_index(0, "client context", NULL, NULL, NULL);
+	}
+	if(tls_ex_index_listener == -1){
+		tls_ex_index_listener = SSL_get_ex_new_index(0, "listener", NULL, NULL, NULL);
+	}
 
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
 	listener->ssl_ctx = SSL_CTX_new(SSLv23_server_method());
@@ -398,6 +700,31 @@ int net__tls_server_ctx(struct mosquitto__listener *listener)
 	snprintf(buf, 256, "mosquitto-%d", listener->port);
 	SSL_CTX_set_session_id_context(listener->ssl_ctx, (unsigned char *)buf, (unsigned int)strlen(buf));
 
+	if(listener->tls_session_cache_size == 0){
+		SSL_CTX_set_session_cache_mode(listener->ssl_ctx, SSL_SESS_CACHE_OFF);
+	}else if(listener->tls_session_cache_size > 0){
+		SSL_CTX_sess_set_cache_size(listener->ssl_ctx, listener->tls_session_cache_size);
+	}
+	if(listener->tls_session_tickets == false){
+		SSL_CTX_set_options(listener->ssl_ctx, SSL_OP_NO_TICKET);
+	}else if(listener->tls_ticket_key_file){
+		/* Without a key file OpenSSL uses random keys, so tickets do not
+		 * survive a restart. */
+		rc = net__tls_load_ticket_keys(listener);
+		if(rc) return rc;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		SSL_CTX_set_tlsext_ticket_key_evp_cb(listener->ssl_ctx, tls_ticket_key_callback);
+#else
+		SSL_CTX_set_tlsext_ticket_key_cb(listener->ssl_ctx, tls_ticket_key_callback);
+#endif
+	}
+	SSL_CTX_set_info_callback(listener->ssl_ctx, tls_info_callback);
+#ifdef FINAL_WITH_TLS_KTLS
+	if(listener->tls_ktls){
+		SSL_CTX_set_options(listener->ssl_ctx, SSL_OP_ENABLE_KTLS);
+	}
+#endif
+
 	if(listener->ciphers){
 		rc = SSL_CTX_set_cipher_list(listener->ssl_ctx, listener->ciphers);
 		if(rc == 0){
@@ -697,14 +1024,30 @@ static int net__bind_interface(struct mosquitto__listener *listener, struct addr
 #endif
 
 
+/* Close all of the sockets opened so far for a listener, after an error. */
+static void net__socket_listen_close(struct mosquitto__listener *listener)
+{
+	int i;
+
+	for(i=0; i<listener->sock_count; i++){
+		COMPAT_CLOSE(listener->socks[i]);
+	}
+	mosquitto__free(listener->socks);
+	listener->socks = NULL;
+	listener->sock_count = 0;
+}
+
+
 static int net__socket_listen_tcp(struct mosquitto__listener *listener)
 {
 	mosq_sock_t sock = INVALID_SOCKET;
+	mosq_sock_t *socks;
 	struct addrinfo hints;
 	struct addrinfo *ainfo, *rp;
 	char service[10];
 	int rc;
 	int ss_opt = 1;
+	int i;
 #ifndef WIN32
 	bool interface_bound = false;
 #endif
@@ -732,90 +1075,110 @@ static int net__socket_listen_tcp(struct mosquitto__listener *listener)
 
 	for(rp = ainfo; rp; rp = rp->ai_next){
 		if(rp->ai_family == AF_INET){
-			log__printf(NULL, MOSQ_LOG_INFO, "Opening ipv4 listen socket on port %d.", ntohs(((struct sockaddr_in *)rp->ai_addr)->sin_port));
+			log__printf(NULL, MOSQ_LOG_INFO, "Opening ipv4 listen socket%s on port %d.",
+					listener->reuse_port_sockets > 1?"s":"", ntohs(((struct sockaddr_in *)rp->ai_addr)->sin_port));
 		}else if(rp->ai_family == AF_INET6){
-			log__printf(NULL, MOSQ_LOG_INFO, "Opening ipv6 listen socket on port %d.", ntohs(((struct sockaddr_in6 *)rp->ai_addr)->sin6_port));
+			log__printf(NULL, MOSQ_LOG_INFO, "Opening ipv6 listen socket%s on port %d.",
+					listener->reuse_port_sockets > 1?"s":"", ntohs(((struct sockaddr_in6 *)rp->ai_addr)->sin6_port));
 		}else{
 			continue;
 		}
 
-		sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-		if(sock == INVALID_SOCKET){
-			net__print_error(MOSQ_LOG_WARNING, "Warning: %s");
-			continue;
-		}
-		listener->sock_count++;
-		listener->socks = mosquitto__realloc(listener->socks, sizeof(mosq_sock_t)*(size_t)listener->sock_count);
-		if(!listener->socks){
-			log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-			freeaddrinfo(ainfo);
-			COMPAT_CLOSE(sock);
-			return MOSQ_ERR_NOMEM;
-		}
-		listener->socks[listener->sock_count-1] = sock;
+		for(i=0; i<listener->reuse_port_sockets; i++){
+			sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+			if(sock == INVALID_SOCKET){
+				net__print_error(MOSQ_LOG_WARNING, "Warning: %s");
+				break;
+			}
+			socks = mosquitto__realloc(listener->socks, sizeof(mosq_sock_t)*(size_t)(listener->sock_count+1));
+			if(!socks){
+				log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+				freeaddrinfo(ainfo);
+				COMPAT_CLOSE(sock);
+				net__socket_listen_close(listener);
+				return MOSQ_ERR_NOMEM;
+			}
+			listener->socks = socks;
+			listener->socks[listener->sock_count] = sock;
+			listener->sock_count++;
 
 #ifndef WIN32
-		ss_opt = 1;
-		/* Unimportant if this fails */
-		(void)setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &ss_opt, sizeof(ss_opt));
+			ss_opt = 1;
+			/* Unimportant if this fails */
+			(void)setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &ss_opt, sizeof(ss_opt));
+#endif
+#ifdef SO_REUSEPORT
+			if(listener->reuse_port_sockets > 1){
+				/* Each socket gets its own accept queue, and the kernel spreads
+				 * incoming connections between them. */
+				ss_opt = 1;
+				if(setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &ss_opt, sizeof(ss_opt))){
+					net__print_error(MOSQ_LOG_ERR, "Error: %s");
+					freeaddrinfo(ainfo);
+					net__socket_listen_close(listener);
+					return 1;
+				}
+			}
 #endif
 #ifdef IPV6_V6ONLY
-		ss_opt = 1;
-		(void)setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &ss_opt, sizeof(ss_opt));
+			ss_opt = 1;
+			(void)setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &ss_opt, sizeof(ss_opt));
 #endif
 
-		if(net__socket_nonblock(&sock)){
-			freeaddrinfo(ainfo);
-			mosquitto__free(listener->socks);
-			return 1;
-		}
+			if(net__socket_nonblock(&sock)){
+				/* sock has already been closed */
+				listener->sock_count--;
+				freeaddrinfo(ainfo);
+				net__socket_listen_close(listener);
+				return 1;
+			}
 
 #ifndef WIN32
-		if(listener->bind_interface){
-			/* It might be possible that an interface does not support all relevant sa_families.
-			 * We should successfully find at least one. */
-			rc = net__bind_interface(listener, rp);
-			if(rc){
-				COMPAT_CLOSE(sock);
-				listener->sock_count--;
-				if(rc == MOSQ_ERR_NOT_FOUND || rc == MOSQ_ERR_INVAL){
-					freeaddrinfo(ainfo);
-					return rc;
-				}else{
-					continue;
+			if(listener->bind_interface){
+				/* It might be possible that an interface does not support all relevant sa_families.
+				 * We should successfully find at least one. */
+				rc = net__bind_interface(listener, rp);
+				if(rc){
+					COMPAT_CLOSE(sock);
+					listener->sock_count--;
+					if(rc == MOSQ_ERR_NOT_FOUND || rc == MOSQ_ERR_INVAL){
+						freeaddrinfo(ainfo);
+						net__socket_listen_close(listener);
+						return rc;
+					}else{
+						break;
+					}
 				}
+				interface_bound = true;
 			}
-			interface_bound = true;
-		}
 #endif
 
-		if(bind(sock, rp->ai_addr, rp->ai_addrlen) == -1){
+			if(bind(sock, rp->ai_addr, rp->ai_addrlen) == -1){
 #if defined(__linux__)
-			if(errno == EACCES){
-				log__printf(NULL, MOSQ_LOG_ERR, "If you are trying to bind to a privileged port (<1024), try using setcap and do not start the broker as root:");
-				log__printf(NULL, MOSQ_LOG_ERR, "    sudo setcap 'CAP_NET_BIND_SERVICE=+ep /usr/sbin/mosquitto'");
-			}
+				if(errno == EACCES){
+					log__printf(NULL, MOSQ_LOG_ERR, "If you are trying to bind to a privileged port (<1024), try using setcap and do not start the broker as root:");
+					log__printf(NULL, MOSQ_LOG_ERR, "    sudo setcap 'CAP_NET_BIND_SERVICE=+ep /usr/sbin/mosquitto'");
+				}
 #endif
-			net__print_error(MOSQ_LOG_ERR, "Error: %s");
-			COMPAT_CLOSE(sock);
-			freeaddrinfo(ainfo);
-			mosquitto__free(listener->socks);
-			return 1;
-		}
+				net__print_error(MOSQ_LOG_ERR, "Error: %s");
+				freeaddrinfo(ainfo);
+				net__socket_listen_close(listener);
+				return 1;
+			}
 
-		if(listen(sock, 100) == -1){
-			net__print_error(MOSQ_LOG_ERR, "Error: %s");
-			freeaddrinfo(ainfo);
-			COMPAT_CLOSE(sock);
-			mosquitto__free(listener->socks);
-			return 1;
+			if(listen(sock, 100) == -1){
+				net__print_error(MOSQ_LOG_ERR, "Error: %s");
+				freeaddrinfo(ainfo);
+				net__socket_listen_close(listener);
+				return 1;
+			}
 		}
 	}
 	freeaddrinfo(ainfo);
 
 #ifndef WIN32
 	if(listener->bind_interface && !interface_bound){
-		mosquitto__free(listener->socks);
+		net__socket_listen_close(listener);
 		return 1;
 	}
 #endif
@@ -31,6 +31,13 @@ extern const unsigned char magic[15];
 #define DB_CHUNK_RETAIN 4
 #define DB_CHUNK_SUB 5
 #define DB_CHUNK_CLIENT 6
+/* Journal generation, and records that only appear in the journal */
+#define DB_CHUNK_JOURNAL 7
+#define DB_CHUNK_MSG_STORE_DEL 8
+#define DB_CHUNK_CLIENT_DEL 9
+#define DB_CHUNK_CLIENT_MSG_UPDATE 10
+#define DB_CHUNK_CLIENT_MSG_DEL 11
+#define DB_CHUNK_SUB_DEL 12
 /* End DB read/write */
 
 #define read_e(f, b, c) if(fread(b, 1, c, f) != c){ goto error; }
@@ -61,6 +68,10 @@ struct PF_cfg{
 	uint8_t dbid_size;
 };
 
+struct PF_journal{
+	uint64_t generation;
+};
+
 struct PF_client_v5{
 	int64_t session_expiry_time;
 	uint32_t session_expiry_interval;
@@ -145,6 +156,15 @@ struct P_retain{
 };
 
 
+struct PF_msg_store_del{
+	dbid_t store_id;
+};
+
+/* DB_CHUNK_CLIENT_DEL uses the client chunk, with only the client id set.
+ * DB_CHUNK_CLIENT_MSG_UPDATE and DB_CHUNK_CLIENT_MSG_DEL use the client msg
+ * chunk without properties. DB_CHUNK_SUB_DEL uses the sub chunk. */
+
+
 int persist__read_string_len(FILE *db_fptr, char **str, uint16_t len);
 int persist__read_string(FILE *db_fptr, char **str);
 
@@ -165,6 +185,8 @@ int persist__chunk_client_msg_read_v56(FILE *db_fptr, struct P_client_msg *chunk
 int persist__chunk_msg_store_read_v56(FILE *db_fptr, struct P_msg_store *chunk, uint32_t length);
 int persist__chunk_retain_read_v56(FILE *db_fptr, struct P_retain *chunk);
 int persist__chunk_sub_read_v56(FILE *db_fptr, struct P_sub *chunk);
+int persist__chunk_journal_read_v6(FILE *db_fptr, struct PF_journal *chunk);
+int persist__chunk_msg_store_del_read_v6(FILE *db_fptr, struct PF_msg_store_del *chunk);
 
 int persist__chunk_cfg_write_v6(FILE *db_fptr, struct PF_cfg *chunk);
 int persist__chunk_client_write_v6(FILE *db_fptr, struct P_client *chunk);
@@ -172,5 +194,17 @@ int persist__chunk_client_msg_write_v6(FILE *db_fptr, struct P_client_msg *chunk
 int persist__chunk_message_store_write_v6(FILE *db_fptr, struct P_msg_store *chunk);
 int persist__chunk_retain_write_v6(FILE *db_fptr, struct P_retain *chunk);
 int persist__chunk_sub_write_v6(FILE *db_fptr, struct P_sub *chunk);
+int persist__chunk_journal_write_v6(FILE *db_fptr, struct PF_journal *chunk);
+int persist__chunk_msg_store_del_write_v6(FILE *db_fptr, struct PF_msg_store_del *chunk);
+int persist__chunk_client_del_write_v6(FILE *db_fptr, struct P_client *chunk);
+int persist__chunk_client_msg_update_write_v6(FILE *db_fptr, struct P_client_msg *chunk);
+int persist__chunk_client_msg_del_write_v6(FILE *db_fptr, struct P_client_msg *chunk);
+int persist__chunk_sub_del_write_v6(FILE *db_fptr, struct P_sub *chunk);
+
+int persist__client_write(FILE *db_fptr, struct mosquitto *context);
+int persist__client_msg_write(FILE *db_fptr, struct mosquitto *context, struct mosquitto_client_msg *cmsg);
+int persist__msg_store_write(FILE *db_fptr, struct mosquitto_msg_store *stored);
+
+char *persist__journal_filepath(void);
 
 #endif
@@ -0,0 +1,555 @@
+/*
+Copyright (c) 2026 Contributors to the Eclipse Foundation
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License 2.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   https://www.eclipse.org/legal/epl-2.0/
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+SPDX-License-Identifier: EPL-2.0 OR BSD-3-Clause
+
+Contributors:
+   Eclipse Mosquitto contributors - initial implementation and documentation.
+*/
+
+/* A note on the persistence journal.
+ *
+ * persist__backup() writes the whole of the in-memory database to disk in one
+ * go, which blocks the broker for as long as that takes. With
+ * persistence_journal enabled, each change to the state that persist__backup()
+ * would save is also appended to <persistence_file>.journal as it happens,
+ * using the same chunks as the main file plus some chunks that describe
+ * removals. An autosave then only has to make sure the journal is on disk.
+ * Once the journal has grown larger than the main file, the autosave does a
+ * full save instead, which compacts the journal into the main file and starts
+ * a new, empty journal.
+ *
+ * The main file and the journal both carry a generation number, and the
+ * journal is only replayed on top of a main file with the same generation.
+ * This means a journal that was left behind by a crash between writing the
+ * main file and starting the new journal is ignored rather than being applied
+ * twice. A background save doesn't start a new journal, it appends a journal
+ * chunk with the new generation instead, and only the records after that
+ * chunk are replayed on top of the file it produces.
+ *
+ * Message stores and client messages are only written to the journal when they
+ * become part of the persistent state, and are marked as journaled so that the
+ * removal of something that was never written isn't recorded either. QoS 0
+ * messages that are sent straight away are not journaled, in the same way that
+ * they would rarely be caught by a full save.
+ */
+
+#include "config.h"
+
+#ifdef WITH_PERSISTENCE
+
+#ifndef WIN32
+#include <arpa/inet.h>
+#include <unistd.h>
+#endif
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "mosquitto_broker_internal.h"
+#include "memory_mosq.h"
+#include "misc_mosq.h"
+#include "mqtt_protocol.h"
+#include "persist.h"
+
+/* Don't bother compacting journals smaller than this. */
+#define JOURNAL_COMPACT_MIN (1024*1024)
+
+static FILE *journal_fptr = NULL;
+static uint64_t journal_generation = 0;
+static bool journal_dirty = false;
+static bool journal_failed = false;
+
+
+static FILE *persist__journal_fptr(void)
+{
+	if(journal_fptr == NULL || journal_failed){
+		return NULL;
+	}
+	journal_dirty = true;
+	return journal_fptr;
+}
+
+
+static void persist__journal_error(void)
+{
+	log__printf(NULL, MOSQ_LOG_ERR, "Error: Unable to write to persistence journal, a full save will be made at the next autosave.");
+	journal_failed = true;
+}
+
+
+static bool persist__journal_context_persists(struct mosquitto *context)
+{
+	if(context->id == NULL || context->id[0] == '\0'){
+		return false;
+	}
+#ifdef WITH_BRIDGE
+	if(context->bridge){
+		return context->bridge->clean_start_local == false;
+	}
+#endif
+	return context->clean_start == false;
+}
+
+
+int persist__journal_open(uint64_t generation, bool append)
+{
+	char *filepath;
+	uint32_t db_version_w = htonl(MOSQ_DB_VERSION);
+	uint32_t crc = 0;
+	struct PF_journal journal_chunk;
+
+	persist__journal_close();
+
+	filepath = persist__journal_filepath();
+	if(filepath == NULL){
+		return MOSQ_ERR_NOMEM;
+	}
+
+	if(append){
+		journal_fptr = mosquitto__fopen(filepath, "ab", true);
+	}else{
+#ifndef WIN32
+		/* See the note on hard links in persist__backup() */
+		if(unlink(filepath) != 0 && errno != ENOENT){
+			log__printf(NULL, MOSQ_LOG_ERR, "Error: Unable to remove %s.", filepath);
+			mosquitto__free(filepath);
+			return MOSQ_ERR_UNKNOWN;
+		}
+#endif
+		journal_fptr = mosquitto__fopen(filepath, "wb", true);
+	}
+	if(journal_fptr == NULL){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: Unable to open persistence journal %s: %s.", filepath, strerror(errno));
+		mosquitto__free(filepath);
+		return MOSQ_ERR_UNKNOWN;
+	}
+	mosquitto__free(filepath);
+
+	journal_generation = generation;
+	journal_failed = false;
+	journal_dirty = false;
+
+	if(append == false){
+		write_e(journal_fptr, magic, 15);
+		write_e(journal_fptr, &crc, sizeof(uint32_t));
+		write_e(journal_fptr, &db_version_w, sizeof(uint32_t));
+
+		memset(&journal_chunk, 0, sizeof(struct PF_journal));
+		journal_chunk.generation = generation;
+		if(persist__chunk_journal_write_v6(journal_fptr, &journal_chunk)){
+			goto error;
+		}
+		if(fflush(journal_fptr)){
+			goto error;
+		}
+#ifndef WIN32
+		fsync(fileno(journal_fptr));
+#endif
+	}
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	persist__journal_error();
+	return MOSQ_ERR_UNKNOWN;
+}
+
+
+void persist__journal_close(void)
+{
+	if(journal_fptr){
+		fclose(journal_fptr);
+		journal_fptr = NULL;
+	}
+	journal_dirty = false;
+	journal_failed = false;
+}
+
+
+/* Called when a full save is made without the journal enabled. */
+void persist__journal_remove(void)
+{
+	char *filepath;
+
+	persist__journal_close();
+
+	filepath = persist__journal_filepath();
+	if(filepath){
+		(void)remove(filepath);
+		mosquitto__free(filepath);
+	}
+}
+
+
+uint64_t persist__journal_generation(void)
+{
+	return journal_generation;
+}
+
+
+bool persist__journal_active(void)
+{
+	return journal_fptr != NULL && journal_failed == false;
+}
+
+
+/* Start a new generation part way through the journal, for a background save.
+ * The records before the mark are in the file being saved, the ones after it
+ * are not. */
+int persist__journal_mark(uint64_t generation, long *offset)
+{
+	struct PF_journal journal_chunk;
+
+	if(persist__journal_active() == false){
+		return MOSQ_ERR_UNKNOWN;
+	}
+
+	*offset = ftell(journal_fptr);
+	if(*offset < 0){
+		goto error;
+	}
+	memset(&journal_chunk, 0, sizeof(struct PF_journal));
+	journal_chunk.generation = generation;
+	if(persist__chunk_journal_write_v6(journal_fptr, &journal_chunk)){
+		goto error;
+	}
+	if(fflush(journal_fptr)){
+		goto error;
+	}
+	journal_dirty = false;
+	journal_generation = generation;
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	persist__journal_error();
+	return MOSQ_ERR_UNKNOWN;
+}
+
+
+/* A background save has finished, so everything before the mark at offset is
+ * in the main file. Replace the journal with one that starts at the mark. */
+void persist__journal_compact(long offset)
+{
+	char *filepath = NULL, *newpath = NULL;
+	FILE *src = NULL, *dst = NULL;
+	char buf[4096];
+	size_t len;
+	uint32_t db_version_w = htonl(MOSQ_DB_VERSION);
+	uint32_t crc = 0;
+
+	if(persist__journal_active() == false){
+		return;
+	}
+	if(fflush(journal_fptr)){
+		persist__journal_error();
+		return;
+	}
+	journal_dirty = false;
+
+	filepath = persist__journal_filepath();
+	if(filepath == NULL){
+		return;
+	}
+	len = strlen(filepath) + 5;
+	newpath = mosquitto__malloc(len);
+	if(newpath == NULL){
+		goto error;
+	}
+	snprintf(newpath, len, "%s.new", filepath);
+
+#ifndef WIN32
+	/* See the note on hard links in persist__backup() */
+	if(unlink(newpath) != 0 && errno != ENOENT){
+		goto error;
+	}
+#endif
+	src = mosquitto__fopen(filepath, "rb", true);
+	dst = mosquitto__fopen(newpath, "wb", true);
+	if(src == NULL || dst == NULL || fseek(src, offset, SEEK_SET)){
+		goto error;
+	}
+
+	write_e(dst, magic, 15);
+	write_e(dst, &crc, sizeof(uint32_t));
+	write_e(dst, &db_version_w, sizeof(uint32_t));
+	/* The mark itself becomes the first chunk of the new journal */
+	while((len = fread(buf, 1, sizeof(buf), src)) > 0){
+		write_e(dst, buf, len);
+	}
+	if(ferror(src) || fflush(dst)){
+		goto error;
+	}
+#ifndef WIN32
+	fsync(fileno(dst));
+#endif
+	fclose(src);
+	src = NULL;
+	fclose(dst);
+	dst = NULL;
+
+	fclose(journal_fptr);
+	journal_fptr = NULL;
+#ifdef WIN32
+	remove(filepath);
+#endif
+	if(rename(newpath, filepath) != 0){
+		log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Unable to replace persistence journal: %s.", strerror(errno));
+	}
+	/* If the rename failed this carries on with the old journal, which is
+	 * still valid, just longer than it needs to be. */
+	journal_fptr = mosquitto__fopen(filepath, "ab", true);
+	if(journal_fptr == NULL){
+		persist__journal_error();
+	}
+	mosquitto__free(newpath);
+	mosquitto__free(filepath);
+	return;
+
+error:
+	log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Unable to compact persistence journal %s.", filepath);
+	if(src) fclose(src);
+	if(dst) fclose(dst);
+	if(newpath) remove(newpath);
+	mosquitto__free(newpath);
+	mosquitto__free(filepath);
+}
+
+
+/* Called once per main loop iteration, so records are handed to the OS
+ * before the broker waits for network activity. */
+void persist__journal_flush(void)
+{
+	if(journal_dirty && journal_fptr && journal_failed == false){
+		if(fflush(journal_fptr)){
+			persist__journal_error();
+		}
+		journal_dirty = false;
+	}
+}
+
+
+int persist__autosave(void)
+{
+	struct stat buf;
+	long journal_size;
+
+	if(db.config->persistence_journal == false || persist__journal_active() == false){
+		return persist__background_save();
+	}
+
+	journal_size = ftell(journal_fptr);
+	if(journal_size > JOURNAL_COMPACT_MIN
+			&& (stat(db.config->persistence_filepath, &buf) || journal_size > buf.st_size)){
+
+		return persist__background_save();
+	}
+
+	if(fflush(journal_fptr)){
+		persist__journal_error();
+		return persist__backup(false);
+	}
+	journal_dirty = false;
+#ifndef WIN32
+	fsync(fileno(journal_fptr));
+#endif
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static void persist__journal_msg_store(FILE *fptr, struct mosquitto_msg_store *stored)
+{
+	if(stored->journaled == false){
+		if(persist__msg_store_write(fptr, stored)){
+			persist__journal_error();
+			return;
+		}
+		stored->journaled = true;
+	}
+}
+
+
+void persist__journal_msg_store_remove(struct mosquitto_msg_store *stored)
+{
+	FILE *fptr;
+	struct PF_msg_store_del chunk;
+
+	if(stored->journaled == false) return;
+	fptr = persist__journal_fptr();
+	if(fptr == NULL) return;
+
+	memset(&chunk, 0, sizeof(struct PF_msg_store_del));
+	chunk.store_id = stored->db_id;
+	if(persist__chunk_msg_store_del_write_v6(fptr, &chunk)){
+		persist__journal_error();
+	}
+}
+
+
+void persist__journal_client(struct mosquitto *context)
+{
+	FILE *fptr;
+
+	if(persist__journal_context_persists(context) == false) return;
+	fptr = persist__journal_fptr();
+	if(fptr == NULL) return;
+
+	if(persist__client_write(fptr, context)){
+		persist__journal_error();
+	}
+}
+
+
+void persist__journal_client_remove(struct mosquitto *context)
+{
+	FILE *fptr;
+	struct P_client chunk;
+
+	if(persist__journal_context_persists(context) == false) return;
+	fptr = persist__journal_fptr();
+	if(fptr == NULL) return;
+
+	memset(&chunk, 0, sizeof(struct P_client));
+	chunk.F.id_len = (uint16_t)strlen(context->id);
+	chunk.client_id = context->id;
+	if(persist__chunk_client_del_write_v6(fptr, &chunk)){
+		persist__journal_error();
+	}
+}
+
+
+void persist__journal_client_msg(struct mosquitto *context, struct mosquitto_client_msg *cmsg)
+{
+	FILE *fptr;
+
+	if(cmsg->qos == 0 && cmsg->state != mosq_ms_queued) return;
+	if(persist__journal_context_persists(context) == false) return;
+	fptr = persist__journal_fptr();
+	if(fptr == NULL) return;
+
+	persist__journal_msg_store(fptr, cmsg->store);
+	if(persist__client_msg_write(fptr, context, cmsg)){
+		persist__journal_error();
+		return;
+	}
+	cmsg->journaled = true;
+}
+
+
+static void persist__journal_client_msg_change(struct mosquitto *context, struct mosquitto_client_msg *cmsg, bool remove)
+{
+	FILE *fptr;
+	struct P_client_msg chunk;
+	int rc;
+
+	if(cmsg->journaled == false || cmsg->store == NULL || context->id == NULL) return;
+	fptr = persist__journal_fptr();
+	if(fptr == NULL) return;
+
+	memset(&chunk, 0, sizeof(struct P_client_msg));
+	chunk.F.store_id = cmsg->store->db_id;
+	chunk.F.mid = cmsg->mid;
+	chunk.F.id_len = (uint16_t)strlen(context->id);
+	chunk.F.qos = cmsg->qos;
+	chunk.F.retain_dup = (uint8_t)((cmsg->retain&0x0F)<<4 | (cmsg->dup&0x0F));
+	chunk.F.direction = (uint8_t)cmsg->direction;
+	chunk.F.state = (uint8_t)cmsg->state;
+	chunk.client_id = context->id;
+
+	if(remove){
+		rc = persist__chunk_client_msg_del_write_v6(fptr, &chunk);
+	}else{
+		rc = persist__chunk_client_msg_update_write_v6(fptr, &chunk);
+	}
+	if(rc){
+		persist__journal_error();
+	}
+}
+
+
+void persist__journal_client_msg_update(struct mosquitto *context, struct mosquitto_client_msg *cmsg)
+{
+	persist__journal_client_msg_change(context, cmsg, false);
+}
+
+
+void persist__journal_client_msg_remove(struct mosquitto *context, struct mosquitto_client_msg *cmsg)
+{
+	persist__journal_client_msg_change(context, cmsg, true);
+}
+
+
+static void persist__journal_sub_change(struct mosquitto *context, const char *sub, uint8_t qos, uint32_t identifier, int options, bool remove)
+{
+	FILE *fptr;
+	struct P_sub chunk;
+	size_t slen;
+	int rc;
+
+	if(persist__journal_context_persists(context) == false) return;
+	slen = strlen(sub);
+	if(slen > UINT16_MAX) return;
+	fptr = persist__journal_fptr();
+	if(fptr == NULL) return;
+
+	memset(&chunk, 0, sizeof(struct P_sub));
+	chunk.F.identifier = identifier;
+	chunk.F.id_len = (uint16_t)strlen(context->id);
+	chunk.F.topic_len = (uint16_t)slen;
+	chunk.F.qos = qos;
+	chunk.F.options = (uint8_t)(options & (MQTT_SUB_OPT_NO_LOCAL | MQTT_SUB_OPT_RETAIN_AS_PUBLISHED));
+	chunk.client_id = context->id;
+	chunk.topic = (char *)sub;
+
+	if(remove){
+		rc = persist__chunk_sub_del_write_v6(fptr, &chunk);
+	}else{
+		rc = persist__chunk_sub_write_v6(fptr, &chunk);
+	}
+	if(rc){
+		persist__journal_error();
+	}
+}
+
+
+void persist__journal_sub(struct mosquitto *context, const char *sub, uint8_t qos, uint32_t identifier, int options)
+{
+	persist__journal_sub_change(context, sub, qos, identifier, options, false);
+}
+
+
+void persist__journal_sub_remove(struct mosquitto *context, const char *sub)
+{
+	persist__journal_sub_change(context, sub, 0, 0, 0, true);
+}
+
+
+/* An empty message clears the retained message for its topic, both here and
+ * when the journal is restored. */
+void persist__journal_retain(struct mosquitto_msg_store *stored)
+{
+	FILE *fptr;
+	struct P_retain chunk;
+
+	fptr = persist__journal_fptr();
+	if(fptr == NULL) return;
+
+	persist__journal_msg_store(fptr, stored);
+
+	memset(&chunk, 0, sizeof(struct P_retain));
+	chunk.F.store_id = stored->db_id;
+	if(persist__chunk_retain_write_v6(fptr, &chunk)){
+		persist__journal_error();
+	}
+}
+
+#endif
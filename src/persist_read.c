@@ -23,9 +23,14 @@ Contributors:
 #ifndef WIN32
 #include <arpa/inet.h>
 #endif
+#if !defined(WIN32) && !defined(__QNX__)
+#include <sys/mman.h>
+#  define WITH_PERSIST_MMAP
+#endif
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -40,6 +45,9 @@ Contributors:
 #include "util_mosq.h"
 
 uint32_t db_version;
+/* While the journal is being replayed, every message store in the load hash
+ * holds a reference so it can't be freed while the journal may refer to it. */
+static bool journal_replay = false;
 
 const unsigned char magic[15] = {0x00, 0xB5, 0x00, 'm','o','s','q','u','i','t','t','o',' ','d','b'};
 
@@ -128,7 +136,7 @@ static int persist__client_msg_restore(struct P_client_msg *chunk)
 		return 0;
 	}
 
-	cmsg = mosquitto__calloc(1, sizeof(struct mosquitto_client_msg));
+	cmsg = db__client_msg_alloc();
 	if(!cmsg){
 		log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
 		return MOSQ_ERR_NOMEM;
@@ -147,6 +155,7 @@ static int persist__client_msg_restore(struct P_client_msg *chunk)
 
 	cmsg->store = load->store;
 	db__msg_store_ref_inc(cmsg->store);
+	cmsg->journaled = true;
 
 	if(cmsg->direction == mosq_md_out){
 		msg_data = &context->msgs_out;
@@ -164,6 +173,9 @@ static int persist__client_msg_restore(struct P_client_msg *chunk)
 		}
 		db__msg_add_to_inflight_stats(msg_data, cmsg);
 	}
+	if(cmsg->store->message_expiry_time){
+		db__message_expiry_add(context, cmsg->store->message_expiry_time);
+	}
 
 	return MOSQ_ERR_SUCCESS;
 }
@@ -208,6 +220,8 @@ static int persist__client_chunk_restore(FILE *db_fptr)
 				}
 			}
 		}
+		/* The journal may update a client that has already been restored */
+		session_expiry__remove(context);
 		session_expiry__add_from_persistence(context, chunk.F.session_expiry_time);
 	}else{
 		rc = 1;
@@ -300,7 +314,7 @@ static int persist__msg_store_chunk_restore(FILE *db_fptr, uint32_t length)
 		message_expiry_interval = 0;
 	}
 
-	stored = mosquitto__calloc(1, sizeof(struct mosquitto_msg_store));
+	stored = db__msg_store_alloc();
 	if(stored == NULL){
 		mosquitto__free(load);
 		mosquitto__free(chunk.source.id);
@@ -329,8 +343,16 @@ static int persist__msg_store_chunk_restore(FILE *db_fptr, uint32_t length)
 
 	if(rc == MOSQ_ERR_SUCCESS){
 		stored->source_listener = chunk.source.listener;
+		stored->journaled = true;
+		if(stored->db_id > db.last_db_id){
+			/* Messages from the journal are newer than the main file */
+			db.last_db_id = stored->db_id;
+		}
 		load->db_id = stored->db_id;
 		load->store = stored;
+		if(journal_replay){
+			stored->ref_count++;
+		}
 
 		HASH_ADD(hh, db.msg_store_load, db_id, sizeof(dbid_t), load);
 		return MOSQ_ERR_SUCCESS;
@@ -396,6 +418,117 @@ static int persist__sub_chunk_restore(FILE *db_fptr)
 }
 
 
+static int persist__msg_store_del_chunk_restore(FILE *db_fptr)
+{
+	struct PF_msg_store_del chunk;
+	struct mosquitto_msg_store_load *load;
+
+	memset(&chunk, 0, sizeof(struct PF_msg_store_del));
+
+	if(persist__chunk_msg_store_del_read_v6(db_fptr, &chunk)){
+		return 1;
+	}
+
+	HASH_FIND(hh, db.msg_store_load, &chunk.store_id, sizeof(dbid_t), load);
+	if(load){
+		/* Nothing later in the journal can refer to this message. Anything
+		 * that still holds a reference will release it as normal. */
+		HASH_DELETE(hh, db.msg_store_load, load);
+		db__msg_store_ref_dec(&load->store);
+		mosquitto__free(load);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static int persist__client_del_chunk_restore(FILE *db_fptr)
+{
+	struct mosquitto *context;
+	struct P_client chunk;
+	int rc;
+
+	memset(&chunk, 0, sizeof(struct P_client));
+
+	rc = persist__chunk_client_read_v56(db_fptr, &chunk, db_version);
+	if(rc > 0){
+		return rc;
+	}else if(rc < 0){
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	HASH_FIND(hh_id, db.contexts_by_id, chunk.client_id, strlen(chunk.client_id), context);
+	if(context){
+		session_expiry__remove(context);
+		sub__clean_session(context);
+		db__messages_delete(context, true);
+		context__add_to_disused(context);
+	}
+
+	mosquitto__free(chunk.client_id);
+	mosquitto__free(chunk.username);
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static int persist__client_msg_change_chunk_restore(FILE *db_fptr, uint32_t length, bool remove)
+{
+	struct mosquitto *context;
+	struct P_client_msg chunk;
+	int rc;
+
+	memset(&chunk, 0, sizeof(struct P_client_msg));
+
+	rc = persist__chunk_client_msg_read_v56(db_fptr, &chunk, length);
+	if(rc){
+		return rc;
+	}
+
+	context = NULL;
+	if(chunk.client_id){
+		HASH_FIND(hh_id, db.contexts_by_id, chunk.client_id, strlen(chunk.client_id), context);
+	}
+	if(context){
+		if(remove){
+			db__message_remove_persisted(context, chunk.F.direction, chunk.F.mid, chunk.F.store_id);
+		}else{
+			db__message_update_persisted(context, chunk.F.direction, chunk.F.mid, chunk.F.store_id,
+					chunk.F.state, chunk.F.retain_dup&0x0F);
+		}
+	}
+
+	mosquitto__free(chunk.client_id);
+	mosquitto_property_free_all(&chunk.properties);
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static int persist__sub_del_chunk_restore(FILE *db_fptr)
+{
+	struct mosquitto *context;
+	struct P_sub chunk;
+	uint8_t reason;
+	int rc;
+
+	memset(&chunk, 0, sizeof(struct P_sub));
+
+	rc = persist__chunk_sub_read_v56(db_fptr, &chunk);
+	if(rc){
+		return rc;
+	}
+
+	if(chunk.client_id && chunk.topic){
+		HASH_FIND(hh_id, db.contexts_by_id, chunk.client_id, strlen(chunk.client_id), context);
+		if(context){
+			rc = sub__remove(context, chunk.topic, &reason);
+		}
+	}
+
+	mosquitto__free(chunk.client_id);
+	mosquitto__free(chunk.topic);
+	return rc;
+}
+
+
 int persist__chunk_header_read(FILE *db_fptr, uint32_t *chunk, uint32_t *length)
 {
 	if(db_version == 6 || db_version == 5){
@@ -406,9 +539,237 @@ int persist__chunk_header_read(FILE *db_fptr, uint32_t *chunk, uint32_t *length)
 }
 
 
+char *persist__journal_filepath(void)
+{
+	char *filepath;
+	size_t len;
+
+	len = strlen(db.config->persistence_filepath) + strlen(".journal") + 1;
+	filepath = mosquitto__malloc(len);
+	if(filepath){
+		snprintf(filepath, len, "%s.journal", db.config->persistence_filepath);
+	}
+	return filepath;
+}
+
+
+static int persist__journal_chunk_restore(FILE *db_fptr, uint32_t chunk, uint32_t length)
+{
+	switch(chunk){
+		case DB_CHUNK_MSG_STORE:
+			return persist__msg_store_chunk_restore(db_fptr, length);
+		case DB_CHUNK_MSG_STORE_DEL:
+			return persist__msg_store_del_chunk_restore(db_fptr);
+		case DB_CHUNK_CLIENT:
+			return persist__client_chunk_restore(db_fptr);
+		case DB_CHUNK_CLIENT_DEL:
+			return persist__client_del_chunk_restore(db_fptr);
+		case DB_CHUNK_CLIENT_MSG:
+			return persist__client_msg_chunk_restore(db_fptr, length);
+		case DB_CHUNK_CLIENT_MSG_UPDATE:
+			return persist__client_msg_change_chunk_restore(db_fptr, length, false);
+		case DB_CHUNK_CLIENT_MSG_DEL:
+			return persist__client_msg_change_chunk_restore(db_fptr, length, true);
+		case DB_CHUNK_SUB:
+			return persist__sub_chunk_restore(db_fptr);
+		case DB_CHUNK_SUB_DEL:
+			return persist__sub_del_chunk_restore(db_fptr);
+		case DB_CHUNK_RETAIN:
+			return persist__retain_chunk_restore(db_fptr);
+		default:
+			log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Unsupported chunk \"%d\" in persistence journal. Ignoring.", chunk);
+			if(fseek(db_fptr, length, SEEK_CUR)){
+				return 1;
+			}
+			return MOSQ_ERR_SUCCESS;
+	}
+}
+
+
+/* Replay the journal on top of the main file, if it belongs to it, then
+ * carry on writing to it. The last record may be incomplete if the broker
+ * stopped while writing it, in which case it is discarded. */
+static int persist__journal_restore(uint64_t generation)
+{
+	FILE *fptr;
+	char *filepath;
+	char header[15];
+	uint32_t crc;
+	uint32_t i32temp;
+	uint32_t chunk, length;
+	struct PF_journal journal_chunk;
+	struct mosquitto_msg_store_load *load, *load_tmp;
+	long pos = 0, end = 0;
+	unsigned long count = 0;
+	uint64_t latest = 0;
+	bool header_valid = false;
+	bool valid = false;
+	int rc = MOSQ_ERR_SUCCESS;
+
+	filepath = persist__journal_filepath();
+	if(filepath == NULL){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return MOSQ_ERR_NOMEM;
+	}
+
+	fptr = mosquitto__fopen(filepath, "rb", true);
+	if(fptr){
+		if(fread(&header, 1, 15, fptr) == 15 && !memcmp(header, magic, 15)
+				&& fread(&crc, sizeof(uint32_t), 1, fptr) == 1
+				&& fread(&i32temp, sizeof(uint32_t), 1, fptr) == 1
+				&& ntohl(i32temp) == MOSQ_DB_VERSION){
+
+			db_version = MOSQ_DB_VERSION;
+			if(persist__chunk_header_read(fptr, &chunk, &length) == MOSQ_ERR_SUCCESS
+					&& chunk == DB_CHUNK_JOURNAL
+					&& persist__chunk_journal_read_v6(fptr, &journal_chunk) == MOSQ_ERR_SUCCESS){
+
+				header_valid = true;
+				latest = journal_chunk.generation;
+				valid = (journal_chunk.generation == generation);
+			}
+		}
+
+		if(header_valid){
+			HASH_ITER(hh, db.msg_store_load, load, load_tmp){
+				load->store->ref_count++;
+			}
+			journal_replay = true;
+			while(1){
+				pos = ftell(fptr);
+				if(persist__chunk_header_read(fptr, &chunk, &length)){
+					break;
+				}
+				if(chunk == DB_CHUNK_JOURNAL){
+					/* A background save was started at this point. If it is
+					 * the save that was just restored, the records so far are
+					 * already in it. */
+					if(persist__chunk_journal_read_v6(fptr, &journal_chunk)){
+						break;
+					}
+					if(journal_chunk.generation == generation){
+						valid = true;
+					}
+					if(journal_chunk.generation > latest){
+						latest = journal_chunk.generation;
+					}
+				}else if(valid){
+					if(persist__journal_chunk_restore(fptr, chunk, length)){
+						break;
+					}
+					count++;
+				}else{
+					if(fseek(fptr, (long)length, SEEK_CUR)){
+						break;
+					}
+				}
+			}
+			journal_replay = false;
+			HASH_ITER(hh, db.msg_store_load, load, load_tmp){
+				load->store->ref_count--;
+			}
+			fseek(fptr, 0, SEEK_END);
+			end = ftell(fptr);
+			if(count){
+				/* Drop anything that the journal left unreferenced */
+				db__msg_store_compact();
+				log__printf(NULL, MOSQ_LOG_INFO, "Restored %lu records from persistence journal %s.", count, filepath);
+			}
+		}
+		if(valid == false){
+			log__printf(NULL, MOSQ_LOG_NOTICE, "Ignoring out of date persistence journal %s.", filepath);
+		}
+		fclose(fptr);
+
+		if(valid && end > pos){
+			log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Discarding incomplete record at the end of persistence journal %s.", filepath);
+#ifndef WIN32
+			if(truncate(filepath, pos)){
+				/* Start a new journal rather than append after the bad record */
+				valid = false;
+			}
+#else
+			valid = false;
+#endif
+			if(valid == false && db.config->persistence_journal){
+				log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Unable to truncate persistence journal, a full save will be made.");
+				mosquitto__free(filepath);
+				/* The full save starts a new journal from the next generation */
+				persist__journal_open(latest, true);
+				return persist__backup(false);
+			}
+		}
+	}
+
+	if(db.config->persistence_journal){
+		/* Carry on from the newest generation in the journal, so a generation
+		 * number is never used twice in the same journal. */
+		rc = persist__journal_open(valid?latest:generation, valid);
+	}
+	mosquitto__free(filepath);
+	return rc;
+}
+
+
+/* Open the database for reading. Where possible the file is mapped into memory
+ * and read through a memory stream, so reading the many small fields of each
+ * chunk never needs a system call. */
+static FILE *persist__db_open(const char *filepath, void **map, size_t *map_len)
+{
+	FILE *fptr;
+#ifdef WITH_PERSIST_MMAP
+	struct stat buf;
+	FILE *mfptr;
+	void *addr;
+#endif
+
+	*map = NULL;
+	*map_len = 0;
+
+	fptr = mosquitto__fopen(filepath, "rb", true);
+	if(fptr == NULL){
+		return NULL;
+	}
+
+#ifdef WITH_PERSIST_MMAP
+	if(fstat(fileno(fptr), &buf) == 0 && buf.st_size > 0 && (uintmax_t)buf.st_size <= SIZE_MAX){
+		addr = mmap(NULL, (size_t)buf.st_size, PROT_READ, MAP_PRIVATE, fileno(fptr), 0);
+		if(addr != MAP_FAILED){
+			posix_madvise(addr, (size_t)buf.st_size, POSIX_MADV_SEQUENTIAL);
+			mfptr = fmemopen(addr, (size_t)buf.st_size, "rb");
+			if(mfptr){
+				fclose(fptr);
+				*map = addr;
+				*map_len = (size_t)buf.st_size;
+				return mfptr;
+			}
+			munmap(addr, (size_t)buf.st_size);
+		}
+	}
+#endif
+	return fptr;
+}
+
+
+static void persist__db_close(FILE *fptr, void *map, size_t map_len)
+{
+	fclose(fptr);
+#ifdef WITH_PERSIST_MMAP
+	if(map){
+		munmap(map, map_len);
+	}
+#else
+	UNUSED(map);
+	UNUSED(map_len);
+#endif
+}
+
+
 int persist__restore(void)
 {
 	FILE *fptr;
+	void *map;
+	size_t map_len;
 	char header[15];
 	int rc = 0;
 	uint32_t crc;
@@ -418,6 +779,11 @@ int persist__restore(void)
 	char *err;
 	struct mosquitto_msg_store_load *load, *load_tmp;
 	struct PF_cfg cfg_chunk;
+	struct PF_journal journal_chunk;
+	uint64_t generation = 0;
+	uint64_t start;
+	unsigned long msg_count = 0, client_count = 0, client_msg_count = 0;
+	unsigned long sub_count = 0, retain_count = 0;
 
 	assert(db.config);
 
@@ -426,14 +792,19 @@ int persist__restore(void)
 	}
 
 	db.msg_store_load = NULL;
+	start = mosquitto_time_ms();
 
-	fptr = mosquitto__fopen(db.config->persistence_filepath, "rb", true);
-	if(fptr == NULL) return MOSQ_ERR_SUCCESS;
+	fptr = persist__db_open(db.config->persistence_filepath, &map, &map_len);
+	if(fptr == NULL){
+		rc = persist__journal_restore(0);
+		goto cleanup;
+	}
 	rlen = fread(&header, 1, 15, fptr);
 	if(rlen == 0){
-		fclose(fptr);
+		persist__db_close(fptr, map, map_len);
 		log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Persistence file is empty.");
-		return 0;
+		rc = persist__journal_restore(0);
+		goto cleanup;
 	}else if(rlen != 15){
 		goto error;
 	}
@@ -454,7 +825,7 @@ int persist__restore(void)
 			}else if(db_version == 2){
 				/* Addition of disconnect_t to client chunk in v3. */
 			}else{
-				fclose(fptr);
+				persist__db_close(fptr, map, map_len);
 				log__printf(NULL, MOSQ_LOG_ERR, "Error: Unsupported persistent database format version %d (need version %d).", db_version, MOSQ_DB_VERSION);
 				return 1;
 			}
@@ -465,19 +836,19 @@ int persist__restore(void)
 				case DB_CHUNK_CFG:
 					if(db_version == 6 || db_version == 5){
 						if(persist__chunk_cfg_read_v56(fptr, &cfg_chunk)){
-							fclose(fptr);
+							persist__db_close(fptr, map, map_len);
 							return 1;
 						}
 					}else{
 						if(persist__chunk_cfg_read_v234(fptr, &cfg_chunk)){
-							fclose(fptr);
+							persist__db_close(fptr, map, map_len);
 							return 1;
 						}
 					}
 					if(cfg_chunk.dbid_size != sizeof(dbid_t)){
 						log__printf(NULL, MOSQ_LOG_ERR, "Error: Incompatible database configuration (dbid size is %d bytes, expected %lu)",
 								cfg_chunk.dbid_size, (unsigned long)sizeof(dbid_t));
-						fclose(fptr);
+						persist__db_close(fptr, map, map_len);
 						return 1;
 					}
 					db.last_db_id = cfg_chunk.last_db_id;
@@ -485,37 +856,50 @@ int persist__restore(void)
 
 				case DB_CHUNK_MSG_STORE:
 					if(persist__msg_store_chunk_restore(fptr, length)){
-						fclose(fptr);
+						persist__db_close(fptr, map, map_len);
 						return 1;
 					}
+					msg_count++;
 					break;
 
 				case DB_CHUNK_CLIENT_MSG:
 					if(persist__client_msg_chunk_restore(fptr, length)){
-						fclose(fptr);
+						persist__db_close(fptr, map, map_len);
 						return 1;
 					}
+					client_msg_count++;
 					break;
 
 				case DB_CHUNK_RETAIN:
 					if(persist__retain_chunk_restore(fptr)){
-						fclose(fptr);
+						persist__db_close(fptr, map, map_len);
 						return 1;
 					}
+					retain_count++;
 					break;
 
 				case DB_CHUNK_SUB:
 					if(persist__sub_chunk_restore(fptr)){
-						fclose(fptr);
+						persist__db_close(fptr, map, map_len);
 						return 1;
 					}
+					sub_count++;
 					break;
 
 				case DB_CHUNK_CLIENT:
 					if(persist__client_chunk_restore(fptr)){
-						fclose(fptr);
+						persist__db_close(fptr, map, map_len);
+						return 1;
+					}
+					client_count++;
+					break;
+
+				case DB_CHUNK_JOURNAL:
+					if(persist__chunk_journal_read_v6(fptr, &journal_chunk)){
+						persist__db_close(fptr, map, map_len);
 						return 1;
 					}
+					generation = journal_chunk.generation;
 					break;
 
 				default:
@@ -529,8 +913,17 @@ int persist__restore(void)
 		rc = 1;
 	}
 
-	fclose(fptr);
+	persist__db_close(fptr, map, map_len);
+
+	if(rc == MOSQ_ERR_SUCCESS){
+		log__printf(NULL, MOSQ_LOG_INFO, "Restored %lu messages, %lu clients, %lu client messages, %lu subscriptions and %lu retained messages from %s in %lu ms.",
+				msg_count, client_count, client_msg_count, sub_count, retain_count,
+				db.config->persistence_filepath, (unsigned long)(mosquitto_time_ms() - start));
+
+		rc = persist__journal_restore(generation);
+	}
 
+cleanup:
 	HASH_ITER(hh, db.msg_store_load, load, load_tmp){
 		HASH_DELETE(hh, db.msg_store_load, load);
 		mosquitto__free(load);
@@ -539,7 +932,7 @@ int persist__restore(void)
 error:
 	err = strerror(errno);
 	log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", err);
-	if(fptr) fclose(fptr);
+	if(fptr) persist__db_close(fptr, map, map_len);
 	return 1;
 }
 
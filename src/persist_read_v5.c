@@ -275,4 +275,24 @@ error:
 	return 1;
 }
 
+
+int persist__chunk_journal_read_v6(FILE *db_fptr, struct PF_journal *chunk)
+{
+	if(fread(chunk, sizeof(struct PF_journal), 1, db_fptr) != 1){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+		return 1;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+int persist__chunk_msg_store_del_read_v6(FILE *db_fptr, struct PF_msg_store_del *chunk)
+{
+	if(fread(chunk, sizeof(struct PF_msg_store_del), 1, db_fptr) != 1){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+		return 1;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
 #endif
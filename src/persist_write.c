@@ -22,11 +22,17 @@ Contributors:
 
 #ifndef WIN32
 #include <arpa/inet.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <syslog.h>
+#include <unistd.h>
 #endif
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <time.h>
@@ -34,24 +40,43 @@ Contributors:
 #include "mosquitto_broker_internal.h"
 #include "memory_mosq.h"
 #include "persist.h"
+#include "sys_tree.h"
 #include "time_mosq.h"
 #include "misc_mosq.h"
 #include "util_mosq.h"
 
-static int persist__client_messages_save(FILE *db_fptr, struct mosquitto *context, struct mosquitto_client_msg *queue)
+int persist__client_msg_write(FILE *db_fptr, struct mosquitto *context, struct mosquitto_client_msg *cmsg)
 {
 	struct P_client_msg chunk;
+
+	memset(&chunk, 0, sizeof(struct P_client_msg));
+
+	chunk.F.store_id = cmsg->store->db_id;
+	chunk.F.mid = cmsg->mid;
+	chunk.F.id_len = (uint16_t)strlen(context->id);
+	chunk.F.qos = cmsg->qos;
+	chunk.F.retain_dup = (uint8_t)((cmsg->retain&0x0F)<<4 | (cmsg->dup&0x0F));
+	chunk.F.direction = (uint8_t)cmsg->direction;
+	chunk.F.state = (uint8_t)cmsg->state;
+	chunk.client_id = context->id;
+	chunk.properties = cmsg->properties;
+
+	return persist__chunk_client_msg_write_v6(db_fptr, &chunk);
+}
+
+
+static int persist__client_messages_save(FILE *db_fptr, struct mosquitto *context, struct mosquitto_client_msg *queue)
+{
 	struct mosquitto_client_msg *cmsg;
 	int rc;
 
-	assert(db_fptr);
 	assert(context);
 
 	cmsg = queue;
 	while(cmsg){
 		if(!strncmp(cmsg->store->topic, "$SYS", 4)
 				&& cmsg->store->ref_count <= 1
-				&& cmsg->store->dest_id_count == 0){
+				&& cmsg->store->dest_bits == NULL){
 
 			/* This $SYS message won't have been persisted, so we can't persist
 			 * this client message. */
@@ -59,22 +84,14 @@ static int persist__client_messages_save(FILE *db_fptr, struct mosquitto *contex
 			continue;
 		}
 
-		memset(&chunk, 0, sizeof(struct P_client_msg));
-
-		chunk.F.store_id = cmsg->store->db_id;
-		chunk.F.mid = cmsg->mid;
-		chunk.F.id_len = (uint16_t)strlen(context->id);
-		chunk.F.qos = cmsg->qos;
-		chunk.F.retain_dup = (uint8_t)((cmsg->retain&0x0F)<<4 | (cmsg->dup&0x0F));
-		chunk.F.direction = (uint8_t)cmsg->direction;
-		chunk.F.state = (uint8_t)cmsg->state;
-		chunk.client_id = context->id;
-		chunk.properties = cmsg->properties;
-
-		rc = persist__chunk_client_msg_write_v6(db_fptr, &chunk);
-		if(rc){
-			return rc;
+		if(db_fptr){
+			rc = persist__client_msg_write(db_fptr, context, cmsg);
+			if(rc){
+				return rc;
+			}
 		}
+		/* Removing this message must now be recorded in the journal. */
+		cmsg->journaled = true;
 
 		cmsg = cmsg->next;
 	}
@@ -83,14 +100,62 @@ static int persist__client_messages_save(FILE *db_fptr, struct mosquitto *contex
 }
 
 
-static int persist__message_store_save(FILE *db_fptr)
+int persist__msg_store_write(FILE *db_fptr, struct mosquitto_msg_store *stored)
 {
 	struct P_msg_store chunk;
+
+	memset(&chunk, 0, sizeof(struct P_msg_store));
+
+	if(!strncmp(stored->topic, "$SYS", 4)){
+		/* Don't save $SYS messages as retained otherwise they can give
+		 * misleading information when reloaded. They should still be saved
+		 * because a disconnected durable client may have them in their
+		 * queue. */
+		chunk.F.retain = 0;
+	}else{
+		chunk.F.retain = (uint8_t)stored->retain;
+	}
+
+	chunk.F.store_id = stored->db_id;
+	chunk.F.expiry_time = stored->message_expiry_time;
+	chunk.F.payloadlen = stored->payloadlen;
+	chunk.F.source_mid = stored->source_mid;
+	if(stored->source_id){
+		chunk.F.source_id_len = (uint16_t)strlen(stored->source_id);
+		chunk.source.id = stored->source_id;
+	}else{
+		chunk.F.source_id_len = 0;
+		chunk.source.id = NULL;
+	}
+	if(stored->source_username){
+		chunk.F.source_username_len = (uint16_t)strlen(stored->source_username);
+		chunk.source.username = stored->source_username;
+	}else{
+		chunk.F.source_username_len = 0;
+		chunk.source.username = NULL;
+	}
+
+	chunk.F.topic_len = (uint16_t)strlen(stored->topic);
+	chunk.topic = stored->topic;
+
+	if(stored->source_listener){
+		chunk.F.source_port = stored->source_listener->port;
+	}else{
+		chunk.F.source_port = 0;
+	}
+	chunk.F.qos = stored->qos;
+	chunk.payload = stored->payload;
+	chunk.properties = stored->properties;
+
+	return persist__chunk_message_store_write_v6(db_fptr, &chunk);
+}
+
+
+static int persist__message_store_save(FILE *db_fptr)
+{
 	struct mosquitto_msg_store *stored;
 	int rc;
 
-	assert(db_fptr);
-
 	stored = db.msg_store;
 	while(stored){
 		if(stored->ref_count < 1 || stored->topic == NULL){
@@ -98,75 +163,61 @@ static int persist__message_store_save(FILE *db_fptr)
 			continue;
 		}
 
-		memset(&chunk, 0, sizeof(struct P_msg_store));
+		if(!strncmp(stored->topic, "$SYS", 4)
+				&& stored->ref_count <= 1 && stored->dest_bits == NULL){
 
-		if(!strncmp(stored->topic, "$SYS", 4)){
-			if(stored->ref_count <= 1 && stored->dest_id_count == 0){
-				/* $SYS messages that are only retained shouldn't be persisted. */
-				stored = stored->next;
-				continue;
-			}
-			/* Don't save $SYS messages as retained otherwise they can give
-			 * misleading information when reloaded. They should still be saved
-			 * because a disconnected durable client may have them in their
-			 * queue. */
-			chunk.F.retain = 0;
-		}else{
-			chunk.F.retain = (uint8_t)stored->retain;
+			/* $SYS messages that are only retained shouldn't be persisted. */
+			stored = stored->next;
+			continue;
 		}
 
-		chunk.F.store_id = stored->db_id;
-		chunk.F.expiry_time = stored->message_expiry_time;
-		chunk.F.payloadlen = stored->payloadlen;
-		chunk.F.source_mid = stored->source_mid;
-		if(stored->source_id){
-			chunk.F.source_id_len = (uint16_t)strlen(stored->source_id);
-			chunk.source.id = stored->source_id;
-		}else{
-			chunk.F.source_id_len = 0;
-			chunk.source.id = NULL;
-		}
-		if(stored->source_username){
-			chunk.F.source_username_len = (uint16_t)strlen(stored->source_username);
-			chunk.source.username = stored->source_username;
-		}else{
-			chunk.F.source_username_len = 0;
-			chunk.source.username = NULL;
+		if(db_fptr){
+			rc = persist__msg_store_write(db_fptr, stored);
+			if(rc){
+				return rc;
+			}
 		}
+		/* Removing this message must now be recorded in the journal. */
+		stored->journaled = true;
+		stored = stored->next;
+	}
 
-		chunk.F.topic_len = (uint16_t)strlen(stored->topic);
-		chunk.topic = stored->topic;
+	return MOSQ_ERR_SUCCESS;
+}
 
-		if(stored->source_listener){
-			chunk.F.source_port = stored->source_listener->port;
-		}else{
-			chunk.F.source_port = 0;
-		}
-		chunk.F.qos = stored->qos;
-		chunk.payload = stored->payload;
-		chunk.properties = stored->properties;
+int persist__client_write(FILE *db_fptr, struct mosquitto *context)
+{
+	struct P_client chunk;
 
-		rc = persist__chunk_message_store_write_v6(db_fptr, &chunk);
-		if(rc){
-			return rc;
-		}
-		stored = stored->next;
+	memset(&chunk, 0, sizeof(struct P_client));
+
+	if(context->session_expiry_interval != 0 && context->session_expiry_interval != UINT32_MAX && context->session_expiry_time == 0){
+		chunk.F.session_expiry_time = context->session_expiry_interval + db.now_real_s;
+	}else{
+		chunk.F.session_expiry_time = context->session_expiry_time;
+	}
+	chunk.F.session_expiry_interval = context->session_expiry_interval;
+	chunk.F.last_mid = context->last_mid;
+	chunk.F.id_len = (uint16_t)strlen(context->id);
+	chunk.client_id = context->id;
+	if(context->username){
+		chunk.F.username_len = (uint16_t)strlen(context->username);
+		chunk.username = context->username;
+	}
+	if(context->listener){
+		chunk.F.listener_port = context->listener->port;
 	}
 
-	return MOSQ_ERR_SUCCESS;
+	return persist__chunk_client_write_v6(db_fptr, &chunk);
 }
 
+
 static int persist__client_save(FILE *db_fptr)
 {
 	struct mosquitto *context, *ctxt_tmp;
-	struct P_client chunk;
 	int rc;
 
-	assert(db_fptr);
-
 	HASH_ITER(hh_id, db.contexts_by_id, context, ctxt_tmp){
-		memset(&chunk, 0, sizeof(struct P_client));
-
 		if(context &&
 #ifdef WITH_BRIDGE
 				((!context->bridge && context->clean_start == false)
@@ -175,33 +226,18 @@ static int persist__client_save(FILE *db_fptr)
 				context->clean_start == false
 #endif
 				){
-			chunk.F.session_expiry_time = context->session_expiry_time;
-			if(context->session_expiry_interval != 0 && context->session_expiry_interval != UINT32_MAX && context->session_expiry_time == 0){
-				chunk.F.session_expiry_time = context->session_expiry_interval + db.now_real_s;
-			}else{
-				chunk.F.session_expiry_time = context->session_expiry_time;
-			}
-			chunk.F.session_expiry_interval = context->session_expiry_interval;
-			chunk.F.last_mid = context->last_mid;
-			chunk.F.id_len = (uint16_t)strlen(context->id);
-			chunk.client_id = context->id;
-			if(context->username){
-				chunk.F.username_len = (uint16_t)strlen(context->username);
-				chunk.username = context->username;
-			}
-			if(context->listener){
-				chunk.F.listener_port = context->listener->port;
-			}
 
-			if(chunk.F.id_len == 0){
+			if(strlen(context->id) == 0){
 				/* This should never happen, but in case we have a client with
 				 * zero length ID, don't persist them. */
 				continue;
 			}
 
-			rc = persist__chunk_client_write_v6(db_fptr, &chunk);
-			if(rc){
-				return rc;
+			if(db_fptr){
+				rc = persist__client_write(db_fptr, context);
+				if(rc){
+					return rc;
+				}
 			}
 
 			if(persist__client_messages_save(db_fptr, context, context->msgs_in.inflight)) return 1;
@@ -317,28 +353,28 @@ static int persist__retain_save_all(FILE *db_fptr)
 	return MOSQ_ERR_SUCCESS;
 }
 
-int persist__backup(bool shutdown)
+/* Write the whole database to <persistence_file>.new, then rename it over
+ * <persistence_file>. For a background save this runs in the child process,
+ * where nothing is logged and errors are only reported in the return value,
+ * which is an errno value or 0 on success. */
+static int persist__snapshot_write(bool shutdown, uint64_t generation, bool background)
 {
 	int rc = 0;
 	FILE *db_fptr = NULL;
 	uint32_t db_version_w = htonl(MOSQ_DB_VERSION);
 	uint32_t crc = 0;
-	char *err;
 	char *outfile = NULL;
 	size_t len;
 	struct PF_cfg cfg_chunk;
-
-	if(db.config == NULL) return MOSQ_ERR_INVAL;
-	if(db.config->persistence == false) return MOSQ_ERR_SUCCESS;
-	if(db.config->persistence_filepath == NULL) return MOSQ_ERR_INVAL;
-
-	log__printf(NULL, MOSQ_LOG_INFO, "Saving in-memory database to %s.", db.config->persistence_filepath);
+	struct PF_journal journal_chunk;
 
 	len = strlen(db.config->persistence_filepath)+5;
 	outfile = mosquitto__malloc(len+1);
 	if(!outfile){
-		log__printf(NULL, MOSQ_LOG_INFO, "Error saving in-memory database, out of memory.");
-		return MOSQ_ERR_NOMEM;
+		if(!background){
+			log__printf(NULL, MOSQ_LOG_INFO, "Error saving in-memory database, out of memory.");
+		}
+		return ENOMEM;
 	}
 	snprintf(outfile, len, "%s.new", db.config->persistence_filepath);
 	outfile[len] = '\0';
@@ -367,7 +403,9 @@ int persist__backup(bool shutdown)
 	if (rc != 0) {
 		rc = 0;
 		if (errno != ENOENT) {
-			log__printf(NULL, MOSQ_LOG_INFO, "Error saving in-memory database, unable to remove %s.", outfile);
+			if(!background){
+				log__printf(NULL, MOSQ_LOG_INFO, "Error saving in-memory database, unable to remove %s.", outfile);
+			}
 			goto error;
 		}
 	}
@@ -375,7 +413,9 @@ int persist__backup(bool shutdown)
 
 	db_fptr = mosquitto__fopen(outfile, "wb", true);
 	if(db_fptr == NULL){
-		log__printf(NULL, MOSQ_LOG_INFO, "Error saving in-memory database, unable to open %s for writing.", outfile);
+		if(!background){
+			log__printf(NULL, MOSQ_LOG_INFO, "Error saving in-memory database, unable to open %s for writing.", outfile);
+		}
 		goto error;
 	}
 
@@ -392,6 +432,15 @@ int persist__backup(bool shutdown)
 		goto error;
 	}
 
+	if(generation){
+		/* The journal that continues from this save has the same generation */
+		memset(&journal_chunk, 0, sizeof(struct PF_journal));
+		journal_chunk.generation = generation;
+		if(persist__chunk_journal_write_v6(db_fptr, &journal_chunk)){
+			goto error;
+		}
+	}
+
 	if(persist__message_store_save(db_fptr)){
 		goto error;
 	}
@@ -427,6 +476,7 @@ int persist__backup(bool shutdown)
 	fsync(fileno(db_fptr));
 #endif
 	fclose(db_fptr);
+	db_fptr = NULL;
 
 #ifdef WIN32
 	if(remove(db.config->persistence_filepath) != 0){
@@ -439,14 +489,253 @@ int persist__backup(bool shutdown)
 		goto error;
 	}
 	mosquitto__free(outfile);
-	outfile = NULL;
-	return rc;
+	return 0;
 error:
+	rc = errno;
+	if(rc == 0){
+		rc = EIO;
+	}
 	mosquitto__free(outfile);
-	err = strerror(errno);
-	log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", err);
 	if(db_fptr) fclose(db_fptr);
-	return 1;
+	return rc;
+}
+
+
+int persist__backup(bool shutdown)
+{
+	int rc = 0;
+	uint64_t start;
+	unsigned long elapsed;
+	uint64_t generation = 0;
+
+	if(db.config == NULL) return MOSQ_ERR_INVAL;
+	if(db.config->persistence == false) return MOSQ_ERR_SUCCESS;
+	if(db.config->persistence_filepath == NULL) return MOSQ_ERR_INVAL;
+
+	/* A background save would be writing to the same temporary file, and
+	 * this save supersedes it anyway. */
+	persist__background_stop();
+
+	log__printf(NULL, MOSQ_LOG_INFO, "Saving in-memory database to %s.", db.config->persistence_filepath);
+
+	start = mosquitto_time_ms();
+	if(db.config->persistence_journal){
+		/* The journal started after this save is only valid with this file */
+		generation = persist__journal_generation() + 1;
+	}
+
+	rc = persist__snapshot_write(shutdown, generation, false);
+	if(rc){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(rc));
+		G_PERSIST_SAVE_FAILURES_INC();
+		return 1;
+	}
+	/* A foreground save blocks for the whole time it takes */
+	elapsed = (unsigned long)(mosquitto_time_ms() - start);
+	G_PERSIST_SAVE_DURATION(elapsed);
+	G_PERSIST_SAVE_BLOCKED(elapsed);
+
+	/* Everything in the journal is now in the main file. */
+	if(db.config->persistence_journal){
+		rc = persist__journal_open(generation, false);
+		if(shutdown){
+			persist__journal_close();
+		}
+	}else{
+		persist__journal_remove();
+	}
+	return rc;
+}
+
+
+/* Background saves.
+ *
+ * With autosave_background enabled, the database is written by a child
+ * process created with fork(). The child has a copy-on-write view of memory as
+ * it was when it was created, so the main process can carry on serving clients
+ * while the file is written and fsynced. The main loop checks whether the
+ * child has finished with persist__background_check().
+ *
+ * If the journal is in use, a journal chunk with the generation of the new
+ * file is appended to the journal before the fork. When the new file is
+ * restored, only the records after that point are replayed. Once the save has
+ * completed, the records before that point are dropped from the journal.
+ */
+#ifndef WIN32
+static pid_t background_pid = 0;
+static uint64_t background_start = 0;
+static long background_journal_offset = -1;
+#endif
+
+#ifndef WIN32
+/* Close the network sockets, and the epoll or io_uring instance, that the
+ * background save child inherited from the broker. Otherwise a client that
+ * the broker disconnects during the save would not see its connection close,
+ * and a restarted broker could not bind its listeners, until the save ended.
+ * stdin, stdout and stderr are left alone, and syslog is closed so that it
+ * reconnects if it is used. */
+static void persist__close_inherited_fds(void)
+{
+	struct stat st;
+	int fd;
+#ifdef __linux__
+	DIR *dir;
+	struct dirent *de;
+	char path[64];
+	char target[64];
+	ssize_t len;
+#endif
+
+	closelog();
+
+#ifdef __linux__
+	dir = opendir("/proc/self/fd");
+	if(dir){
+		while((de = readdir(dir)) != NULL){
+			fd = atoi(de->d_name);
+			if(fd <= STDERR_FILENO || fd == dirfd(dir)){
+				continue;
+			}
+			if(fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode)){
+				close(fd);
+				continue;
+			}
+			snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+			len = readlink(path, target, sizeof(target)-1);
+			if(len > 0){
+				target[len] = '\0';
+				if(!strcmp(target, "anon_inode:[eventpoll]") || !strcmp(target, "anon_inode:[io_uring]")){
+					close(fd);
+				}
+			}
+		}
+		closedir(dir);
+		return;
+	}
+#endif
+	for(fd=STDERR_FILENO+1; fd<getdtablesize(); fd++){
+		if(fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode)){
+			close(fd);
+		}
+	}
+}
+#endif
+
+
+int persist__background_save(void)
+{
+#ifndef WIN32
+	pid_t pid;
+	uint64_t generation = 0;
+	long journal_offset = -1;
+	int rc;
+
+	if(db.config == NULL) return MOSQ_ERR_INVAL;
+	if(db.config->persistence == false) return MOSQ_ERR_SUCCESS;
+	if(db.config->persistence_filepath == NULL) return MOSQ_ERR_INVAL;
+
+	if(db.config->autosave_background == false){
+		return persist__backup(false);
+	}
+	if(db.config->persistence_journal && persist__journal_active() == false){
+		/* Changes made during the save would have nowhere to go */
+		return persist__backup(false);
+	}
+	if(background_pid > 0){
+		/* Still busy with the last one */
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	log__printf(NULL, MOSQ_LOG_INFO, "Saving in-memory database to %s in the background.", db.config->persistence_filepath);
+
+	background_start = mosquitto_time_ms();
+	if(db.config->persistence_journal){
+		generation = persist__journal_generation() + 1;
+		if(persist__journal_mark(generation, &journal_offset)){
+			return persist__backup(false);
+		}
+	}
+
+	pid = fork();
+	if(pid == 0){
+		persist__close_inherited_fds();
+		rc = persist__snapshot_write(false, generation, true);
+		/* The exit status is a MOSQ_ERR_* value, reported by persist__background_check() */
+		_exit(rc >= 0 && rc < 256 ? rc : MOSQ_ERR_UNKNOWN);
+	}else if(pid < 0){
+		log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Unable to start background save: %s.", strerror(errno));
+		return persist__backup(false);
+	}
+
+	background_pid = pid;
+	background_journal_offset = journal_offset;
+
+	/* Everything the child is writing is now persisted, so removing any of it
+	 * must be recorded in the journal. */
+	persist__message_store_save(NULL);
+	persist__client_save(NULL);
+
+	G_PERSIST_SAVE_BLOCKED((unsigned long)(mosquitto_time_ms() - background_start));
+	return MOSQ_ERR_SUCCESS;
+#else
+	return persist__backup(false);
+#endif
+}
+
+
+void persist__background_check(void)
+{
+#ifndef WIN32
+	pid_t rc;
+	int status;
+
+	if(background_pid <= 0){
+		return;
+	}
+
+	rc = waitpid(background_pid, &status, WNOHANG);
+	if(rc == 0){
+		/* Check again soon */
+		loop__update_next_event(100);
+		return;
+	}
+	background_pid = 0;
+
+	if(rc < 0 || WIFEXITED(status) == 0 || WEXITSTATUS(status) != 0){
+		if(rc > 0 && WIFEXITED(status)){
+			log__printf(NULL, MOSQ_LOG_ERR, "Error: Background save of in-memory database failed: %s.", mosquitto_strerror(WEXITSTATUS(status)));
+		}else{
+			log__printf(NULL, MOSQ_LOG_ERR, "Error: Background save of in-memory database did not complete.");
+		}
+		G_PERSIST_SAVE_FAILURES_INC();
+		return;
+	}
+
+	log__printf(NULL, MOSQ_LOG_INFO, "Saved in-memory database to %s.", db.config->persistence_filepath);
+	G_PERSIST_SAVE_DURATION((unsigned long)(mosquitto_time_ms() - background_start));
+
+	if(background_journal_offset >= 0){
+		persist__journal_compact(background_journal_offset);
+	}else if(db.config->persistence_journal == false){
+		persist__journal_remove();
+	}
+#endif
+}
+
+
+void persist__background_stop(void)
+{
+#ifndef WIN32
+	int status;
+
+	if(background_pid <= 0){
+		return;
+	}
+	kill(background_pid, SIGKILL);
+	while(waitpid(background_pid, &status, 0) < 0 && errno == EINTR){
+	}
+	background_pid = 0;
+#endif
 }
 
 
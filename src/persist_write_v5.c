@@ -54,7 +54,7 @@ error:
 }
 
 
-int persist__chunk_client_write_v6(FILE *db_fptr, struct P_client *chunk)
+static int persist__chunk_client_write(FILE *db_fptr, struct P_client *chunk, uint32_t chunk_type)
 {
 	struct PF_header header;
 	uint16_t id_len = chunk->F.id_len;
@@ -66,7 +66,7 @@ int persist__chunk_client_write_v6(FILE *db_fptr, struct P_client *chunk)
 	chunk->F.username_len = htons(chunk->F.username_len);
 	chunk->F.listener_port = htons(chunk->F.listener_port);
 
-	header.chunk = htonl(DB_CHUNK_CLIENT);
+	header.chunk = htonl(chunk_type);
 	header.length = htonl((uint32_t)sizeof(struct PF_client)+id_len+username_len);
 
 	write_e(db_fptr, &header, sizeof(struct PF_header));
@@ -84,7 +84,19 @@ error:
 }
 
 
-int persist__chunk_client_msg_write_v6(FILE *db_fptr, struct P_client_msg *chunk)
+int persist__chunk_client_write_v6(FILE *db_fptr, struct P_client *chunk)
+{
+	return persist__chunk_client_write(db_fptr, chunk, DB_CHUNK_CLIENT);
+}
+
+
+int persist__chunk_client_del_write_v6(FILE *db_fptr, struct P_client *chunk)
+{
+	return persist__chunk_client_write(db_fptr, chunk, DB_CHUNK_CLIENT_DEL);
+}
+
+
+static int persist__chunk_client_msg_write(FILE *db_fptr, struct P_client_msg *chunk, uint32_t chunk_type)
 {
 	struct PF_header header;
 	struct mosquitto__packet prop_packet;
@@ -100,7 +112,7 @@ int persist__chunk_client_msg_write_v6(FILE *db_fptr, struct P_client_msg *chunk
 	chunk->F.mid = htons(chunk->F.mid);
 	chunk->F.id_len = htons(chunk->F.id_len);
 
-	header.chunk = htonl(DB_CHUNK_CLIENT_MSG);
+	header.chunk = htonl(chunk_type);
 	header.length = htonl((uint32_t)sizeof(struct PF_client_msg) + id_len + proplen);
 
 	write_e(db_fptr, &header, sizeof(struct PF_header));
@@ -132,6 +144,24 @@ error:
 }
 
 
+int persist__chunk_client_msg_write_v6(FILE *db_fptr, struct P_client_msg *chunk)
+{
+	return persist__chunk_client_msg_write(db_fptr, chunk, DB_CHUNK_CLIENT_MSG);
+}
+
+
+int persist__chunk_client_msg_update_write_v6(FILE *db_fptr, struct P_client_msg *chunk)
+{
+	return persist__chunk_client_msg_write(db_fptr, chunk, DB_CHUNK_CLIENT_MSG_UPDATE);
+}
+
+
+int persist__chunk_client_msg_del_write_v6(FILE *db_fptr, struct P_client_msg *chunk)
+{
+	return persist__chunk_client_msg_write(db_fptr, chunk, DB_CHUNK_CLIENT_MSG_DEL);
+}
+
+
 int persist__chunk_message_store_write_v6(FILE *db_fptr, struct P_msg_store *chunk)
 {
 	struct PF_header header;
@@ -216,7 +246,7 @@ error:
 }
 
 
-int persist__chunk_sub_write_v6(FILE *db_fptr, struct P_sub *chunk)
+static int persist__chunk_sub_write(FILE *db_fptr, struct P_sub *chunk, uint32_t chunk_type)
 {
 	struct PF_header header;
 	uint16_t id_len = chunk->F.id_len;
@@ -226,7 +256,7 @@ int persist__chunk_sub_write_v6(FILE *db_fptr, struct P_sub *chunk)
 	chunk->F.id_len = htons(chunk->F.id_len);
 	chunk->F.topic_len = htons(chunk->F.topic_len);
 
-	header.chunk = htonl(DB_CHUNK_SUB);
+	header.chunk = htonl(chunk_type);
 	header.length = htonl((uint32_t)sizeof(struct PF_sub) +
 			id_len + topic_len);
 
@@ -240,4 +270,48 @@ error:
 	log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
 	return 1;
 }
+
+
+int persist__chunk_sub_write_v6(FILE *db_fptr, struct P_sub *chunk)
+{
+	return persist__chunk_sub_write(db_fptr, chunk, DB_CHUNK_SUB);
+}
+
+
+int persist__chunk_sub_del_write_v6(FILE *db_fptr, struct P_sub *chunk)
+{
+	return persist__chunk_sub_write(db_fptr, chunk, DB_CHUNK_SUB_DEL);
+}
+
+
+int persist__chunk_journal_write_v6(FILE *db_fptr, struct PF_journal *chunk)
+{
+	struct PF_header header;
+
+	header.chunk = htonl(DB_CHUNK_JOURNAL);
+	header.length = htonl(sizeof(struct PF_journal));
+	write_e(db_fptr, &header, sizeof(struct PF_header));
+	write_e(db_fptr, chunk, sizeof(struct PF_journal));
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+	return 1;
+}
+
+
+int persist__chunk_msg_store_del_write_v6(FILE *db_fptr, struct PF_msg_store_del *chunk)
+{
+	struct PF_header header;
+
+	header.chunk = htonl(DB_CHUNK_MSG_STORE_DEL);
+	header.length = htonl(sizeof(struct PF_msg_store_del));
+	write_e(db_fptr, &header, sizeof(struct PF_header));
+	write_e(db_fptr, chunk, sizeof(struct PF_msg_store_del));
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+	return 1;
+}
 #endif
@@ -201,6 +201,9 @@ void plugin__handle_tick(void)
 			DL_FOREACH(opts->plugin_callbacks.tick, cb_base){
 				cb_base->cb(MOSQ_EVT_TICK, &event_data, cb_base->userdata);
 			}
+			if(opts->plugin_callbacks.tick){
+				loop__update_next_event(100);
+			}
 		}
 	}else{
 		opts = &db.config->security_options;
@@ -209,6 +212,10 @@ void plugin__handle_tick(void)
 		DL_FOREACH(opts->plugin_callbacks.tick, cb_base){
 			cb_base->cb(MOSQ_EVT_TICK, &event_data, cb_base->userdata);
 		}
+		if(opts->plugin_callbacks.tick){
+			/* Plugins expect to be called regularly */
+			loop__update_next_event(100);
+		}
 	}
 }
 
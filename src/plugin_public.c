@@ -263,6 +263,7 @@ int mosquitto_set_username(struct mosquitto *client, const char *username)
 		return rc;
 	}else{
 		mosquitto__free(old);
+		acl__cache_flush(client);
 		return MOSQ_ERR_SUCCESS;
 	}
 }
@@ -297,6 +298,9 @@ static void check_subscription_acls(struct mosquitto *context)
 
 static void disconnect_client(struct mosquitto *context, bool with_will)
 {
+	/* Clients are kicked when their access changes */
+	acl__cache_flush(context);
+
 	if(context->protocol == mosq_p_mqtt5){
 		send__disconnect(context, MQTT_RC_ADMINISTRATIVE_ACTION, NULL);
 	}
@@ -29,7 +29,13 @@ Contributors:
 
 #include "utlist.h"
 
-static time_t next_expire_check = 0;
+void retain__clean_empty_hierarchy(struct mosquitto__retainhier *retainhier);
+
+/* With check_retain_source, the source of a retained message is checked as
+ * if it were a client publishing the message. Consecutive retained messages
+ * very often have the same source, so the last source is kept, along with
+ * its compiled pattern ACLs and cached ACL decisions. */
+static struct mosquitto retain_source;
 
 static struct mosquitto__retainhier *retain__add_hier_entry(struct mosquitto__retainhier *parent, struct mosquitto__retainhier **sibling, const char *topic, uint16_t len)
 {
@@ -60,6 +66,51 @@ static struct mosquitto__retainhier *retain__add_hier_entry(struct mosquitto__re
 }
 
 
+/* Retained messages with an expiry interval each have a timer, so they are
+ * removed when they expire without having to search the whole tree for
+ * them. */
+static void retain__expiry_timer(struct mosquitto__timer *timer)
+{
+	struct mosquitto__retainhier *retainhier = timer->userdata;
+
+	mosquitto__free(retainhier->expiry_timer);
+	retainhier->expiry_timer = NULL;
+
+	if(retainhier->retained){
+		db__msg_store_ref_dec(&retainhier->retained);
+		retainhier->retained = NULL;
+#ifdef WITH_SYS_TREE
+		db.retained_count--;
+#endif
+		retain__clean_empty_hierarchy(retainhier);
+	}
+}
+
+
+/* Add, move or remove the expiry timer to match the retained message. */
+static void retain__expiry_update(struct mosquitto__retainhier *retainhier)
+{
+	if(retainhier->retained && retainhier->retained->message_expiry_time > 0){
+		if(retainhier->expiry_timer == NULL){
+			retainhier->expiry_timer = mosquitto__calloc(1, sizeof(struct mosquitto__timer));
+			if(retainhier->expiry_timer == NULL){
+				/* The message will still be removed when it is next accessed */
+				return;
+			}
+			retainhier->expiry_timer->callback = retain__expiry_timer;
+			retainhier->expiry_timer->userdata = retainhier;
+		}
+		/* Timers fire once the clock has passed their time, retained
+		 * messages expire once it has reached theirs. */
+		timers__add(retainhier->expiry_timer, retainhier->retained->message_expiry_time - 1);
+	}else if(retainhier->expiry_timer){
+		timers__remove(retainhier->expiry_timer);
+		mosquitto__free(retainhier->expiry_timer);
+		retainhier->expiry_timer = NULL;
+	}
+}
+
+
 int retain__init(void)
 {
 	struct mosquitto__retainhier *retainhier;
@@ -79,7 +130,8 @@ void retain__clean_empty_hierarchy(struct mosquitto__retainhier *retainhier)
 	struct mosquitto__retainhier *parent;
 
 	while(retainhier){
-		if(retainhier->children || retainhier->retained || retainhier->parent == NULL){
+		if(retainhier->children || retainhier->retained || retainhier->parent == NULL
+				|| retainhier->cursor_count > 0){
 			/* Entry is being used */
 			return;
 		}else{
@@ -126,6 +178,7 @@ int retain__store(const char *topic, struct mosquitto_msg_store *stored, char **
 		/* Retained messages count as a persistence change, but only if
 		 * they aren't for $SYS. */
 		db.persistence_changes++;
+		persist__journal_retain(stored);
 	}
 #else
 	UNUSED(topic);
@@ -143,8 +196,10 @@ int retain__store(const char *topic, struct mosquitto_msg_store *stored, char **
 #ifdef WITH_SYS_TREE
 		db.retained_count++;
 #endif
+		retain__expiry_update(retainhier);
 	}else{
 		retainhier->retained = NULL;
+		retain__expiry_update(retainhier);
 		retain__clean_empty_hierarchy(retainhier);
 	}
 
@@ -152,6 +207,75 @@ int retain__store(const char *topic, struct mosquitto_msg_store *stored, char **
 }
 
 
+void retain__source_clear(void)
+{
+	acl__free_acls(&retain_source);
+	acl__cache_flush(&retain_source);
+	mosquitto__free(retain_source.id);
+	mosquitto__free(retain_source.username);
+	memset(&retain_source, 0, sizeof(struct mosquitto));
+}
+
+
+static bool retain__source_match(struct mosquitto_msg_store *retained)
+{
+	if(retain_source.id == NULL
+			|| retain_source.listener != retained->source_listener
+			|| strcmp(retain_source.id, retained->source_id)){
+
+		return false;
+	}
+	if(retain_source.username && retained->source_username){
+		return !strcmp(retain_source.username, retained->source_username);
+	}else{
+		return retain_source.username == retained->source_username;
+	}
+}
+
+
+/* Set up retain_source for the source of a retained message. */
+static int retain__source_set(struct mosquitto_msg_store *retained)
+{
+	int rc;
+
+	if(retain__source_match(retained)){
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	retain__source_clear();
+	retain_source.id = mosquitto__strdup(retained->source_id);
+	if(!retain_source.id){
+		return MOSQ_ERR_NOMEM;
+	}
+	if(retained->source_username){
+		retain_source.username = mosquitto__strdup(retained->source_username);
+		if(!retain_source.username){
+			retain__source_clear();
+			return MOSQ_ERR_NOMEM;
+		}
+	}
+	retain_source.listener = retained->source_listener;
+
+	rc = acl__find_acls(&retain_source);
+	if(rc){
+		retain__source_clear();
+	}
+	return rc;
+}
+
+
+static uint8_t retain__qos(struct mosquitto_msg_store *retained, uint8_t sub_qos)
+{
+	if (db.config->upgrade_outgoing_qos){
+		return sub_qos;
+	}else if(retained->qos > sub_qos){
+		return sub_qos;
+	}else{
+		return retained->qos;
+	}
+}
+
+
 static int retain__process(struct mosquitto__retainhier *branch, struct mosquitto *context, uint8_t sub_qos, uint32_t subscription_identifier)
 {
 	int rc = 0;
@@ -166,6 +290,7 @@ static int retain__process(struct mosquitto__retainhier *branch, struct mosquitt
 #ifdef WITH_SYS_TREE
 		db.retained_count--;
 #endif
+		retain__expiry_update(branch);
 		return MOSQ_ERR_SUCCESS;
 	}
 
@@ -181,17 +306,10 @@ static int retain__process(struct mosquitto__retainhier *branch, struct mosquitt
 
 	/* Check for original source access */
 	if(db.config->check_retain_source && retained->origin != mosq_mo_broker && retained->source_id){
-		struct mosquitto retain_ctxt;
-		memset(&retain_ctxt, 0, sizeof(struct mosquitto));
-
-		retain_ctxt.id = retained->source_id;
-		retain_ctxt.username = retained->source_username;
-		retain_ctxt.listener = retained->source_listener;
-
-		rc = acl__find_acls(&retain_ctxt);
+		rc = retain__source_set(retained);
 		if(rc) return rc;
 
-		rc = mosquitto_acl_check(&retain_ctxt, retained->topic, retained->payloadlen, retained->payload,
+		rc = mosquitto_acl_check(&retain_source, retained->topic, retained->payloadlen, retained->payload,
 				retained->qos, retained->retain, MOSQ_ACL_WRITE);
 		if(rc == MOSQ_ERR_ACL_DENIED){
 			return MOSQ_ERR_SUCCESS;
@@ -200,12 +318,7 @@ static int retain__process(struct mosquitto__retainhier *branch, struct mosquitt
 		}
 	}
 
-	if (db.config->upgrade_outgoing_qos){
-		qos = sub_qos;
-	} else {
-		qos = retained->qos;
-		if(qos > sub_qos) qos = sub_qos;
-	}
+	qos = retain__qos(retained, sub_qos);
 	if(qos > 0){
 		mid = mosquitto__mid_generate(context);
 	}else{
@@ -218,71 +331,318 @@ static int retain__process(struct mosquitto__retainhier *branch, struct mosquitt
 }
 
 
-static int retain__search(struct mosquitto__retainhier *retainhier, char **split_topics, struct mosquitto *context, const char *sub, uint8_t sub_qos, uint32_t subscription_identifier, int level)
+/* Retained messages for a new subscription are delivered by a cursor that
+ * walks the part of the retain tree that matches the subscription. Each pass
+ * delivers at most retain_delivery_batch_size messages, and only while the
+ * client can take more messages in flight, so a subscription that matches a
+ * very large number of retained messages neither holds up the other clients
+ * nor overflows the client's queue. The first pass is made straight away, the
+ * rest are made from the main loop.
+ *
+ * A client has a list of cursors, in the order the subscriptions were made.
+ * Only the first cursor for each client is active, and is also in
+ * db.retain_cursors.
+ *
+ * The cursor holds the path from the top of the tree to its current entry,
+ * and those entries are not removed from the tree while it is in use, so it
+ * can carry on where it left off after the tree has changed.
+ */
+struct mosquitto__retain_cursor{
+	struct mosquitto__retain_cursor *next, *prev;
+	struct mosquitto__retain_cursor *ctx_next, *ctx_prev;
+	struct mosquitto *context;
+	char *sub;
+	char *local_sub;
+	char **split_topics;
+	struct mosquitto__retainhier *root;
+	struct mosquitto__retainhier **path;
+	dbid_t last_db_id;
+	uint32_t subscription_identifier;
+	int topic_count;
+	int hash_level;
+	int path_size;
+	int depth;
+	uint8_t sub_qos;
+	bool descend;
+	bool pending;
+};
+
+enum retain_cursor_result{
+	retain_cursor_done = 0,
+	retain_cursor_more = 1,
+	retain_cursor_blocked = 2,
+};
+
+
+/* Subscription topic level that an entry at `level` must match. */
+static const char *retain__cursor_token(struct mosquitto__retain_cursor *cursor, int level)
 {
-	struct mosquitto__retainhier *branch, *branch_tmp;
-	int flag = 0;
-
-	if(!strcmp(split_topics[0], "#") && split_topics[1] == NULL){
-		HASH_ITER(hh, retainhier->children, branch, branch_tmp){
-			/* Set flag to indicate that we should check for retained messages
-			 * on "foo" when we are subscribing to e.g. "foo/#" and then exit
-			 * this function and return to an earlier retain__search().
-			 */
-			flag = -1;
-			if(branch->retained){
-				retain__process(branch, context, sub_qos, subscription_identifier);
-			}
-			if(branch->children){
-				retain__search(branch, split_topics, context, sub, sub_qos, subscription_identifier, level+1);
-			}
-		}
+	if(cursor->hash_level >= 0 && level >= cursor->hash_level){
+		return "#";
+	}else if(level < cursor->topic_count){
+		return cursor->split_topics[level];
+	}else{
+		return NULL;
+	}
+}
+
+
+static bool retain__cursor_wildcard(struct mosquitto__retain_cursor *cursor, int level)
+{
+	const char *token = retain__cursor_token(cursor, level);
+
+	return token && (!strcmp(token, "+") || !strcmp(token, "#"));
+}
+
+
+static struct mosquitto__retainhier *retain__cursor_first(struct mosquitto__retain_cursor *cursor, struct mosquitto__retainhier *parent, int level)
+{
+	struct mosquitto__retainhier *branch;
+	const char *token;
+
+	token = retain__cursor_token(cursor, level);
+	if(token == NULL){
+		return NULL;
+	}else if(retain__cursor_wildcard(cursor, level)){
+		return parent->children;
 	}else{
-		if(!strcmp(split_topics[0], "+")){
-			HASH_ITER(hh, retainhier->children, branch, branch_tmp){
-				if(split_topics[1] != NULL){
-					if(retain__search(branch, &(split_topics[1]), context, sub, sub_qos, subscription_identifier, level+1) == -1
-							|| (split_topics[1] != NULL && !strcmp(split_topics[1], "#") && level>0)){
-
-						if(branch->retained){
-							retain__process(branch, context, sub_qos, subscription_identifier);
-						}
-					}
+		HASH_FIND(hh, parent->children, token, strlen(token), branch);
+		return branch;
+	}
+}
+
+
+static int retain__cursor_push(struct mosquitto__retain_cursor *cursor, struct mosquitto__retainhier *branch)
+{
+	struct mosquitto__retainhier **path;
+
+	if(cursor->depth+1 == cursor->path_size){
+		path = mosquitto__realloc(cursor->path, (size_t)(cursor->path_size+8)*sizeof(struct mosquitto__retainhier *));
+		if(path == NULL){
+			return MOSQ_ERR_NOMEM;
+		}
+		cursor->path = path;
+		cursor->path_size += 8;
+	}
+	cursor->depth++;
+	cursor->path[cursor->depth] = branch;
+	branch->cursor_count++;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static void retain__cursor_pop(struct mosquitto__retain_cursor *cursor)
+{
+	struct mosquitto__retainhier *branch;
+
+	branch = cursor->path[cursor->depth];
+	cursor->depth--;
+	branch->cursor_count--;
+	retain__clean_empty_hierarchy(branch);
+}
+
+
+/* Move the cursor on to the next entry that could match the subscription,
+ * depth first. Returns NULL once the walk is complete. */
+static struct mosquitto__retainhier *retain__cursor_next(struct mosquitto__retain_cursor *cursor)
+{
+	struct mosquitto__retainhier *branch;
+
+	if(cursor->descend){
+		if(cursor->depth < 0){
+			branch = retain__cursor_first(cursor, cursor->root, 0);
+		}else{
+			branch = retain__cursor_first(cursor, cursor->path[cursor->depth], cursor->depth+1);
+		}
+		if(branch){
+			return retain__cursor_push(cursor, branch)?NULL:branch;
+		}
+	}
+
+	while(cursor->depth >= 0){
+		branch = NULL;
+		if(retain__cursor_wildcard(cursor, cursor->depth)){
+			branch = cursor->path[cursor->depth]->hh.next;
+		}
+		retain__cursor_pop(cursor);
+		if(branch){
+			return retain__cursor_push(cursor, branch)?NULL:branch;
+		}
+	}
+	return NULL;
+}
+
+
+static bool retain__cursor_ready(struct mosquitto__retain_cursor *cursor, struct mosquitto_msg_store *retained, int delivered)
+{
+	struct mosquitto *context = cursor->context;
+
+	if(db.config->retain_delivery_batch_size == 0){
+		return true;
+	}
+	if(context->sock == INVALID_SOCKET || context->state != mosq_cs_active){
+		return false;
+	}
+	/* Wait for the messages that have already been delivered to be written */
+	if(context->out_packet_count + delivered >= db.config->retain_delivery_batch_size){
+		return false;
+	}
+	return db__ready_for_flight(context, mosq_md_out, retain__qos(retained, cursor->sub_qos));
+}
+
+
+static int retain__cursor_step(struct mosquitto__retain_cursor *cursor, int *delivered)
+{
+	struct mosquitto__retainhier *branch;
+	const char *token;
+	int count = 0;
+
+	while(db.config->retain_delivery_batch_size == 0 || count < db.config->retain_delivery_batch_size){
+		if(cursor->root == NULL){
+			return retain_cursor_done;
+		}
+		if(cursor->pending == false){
+			branch = retain__cursor_next(cursor);
+			if(branch == NULL){
+				cursor->root = NULL;
+				return retain_cursor_done;
+			}
+			count++;
+
+			token = retain__cursor_token(cursor, cursor->depth);
+			if(!strcmp(token, "#")){
+				cursor->pending = true;
+				cursor->descend = true;
+			}else{
+				token = retain__cursor_token(cursor, cursor->depth+1);
+				if(token == NULL){
+					cursor->pending = true;
+					cursor->descend = false;
 				}else{
-					if(branch->retained){
-						retain__process(branch, context, sub_qos, subscription_identifier);
-					}
+					/* "foo/#" also matches "foo" */
+					cursor->pending = !strcmp(token, "#");
+					cursor->descend = true;
 				}
 			}
-		}else{
-			HASH_FIND(hh, retainhier->children, split_topics[0], strlen(split_topics[0]), branch);
-			if(branch){
-				if(split_topics[1] != NULL){
-					if(retain__search(branch, &(split_topics[1]), context, sub, sub_qos, subscription_identifier, level+1) == -1
-							|| (split_topics[1] != NULL && !strcmp(split_topics[1], "#") && level>0)){
-
-						if(branch->retained){
-							retain__process(branch, context, sub_qos, subscription_identifier);
-						}
-					}
-				}else{
-					if(branch->retained){
-						retain__process(branch, context, sub_qos, subscription_identifier);
-					}
+		}
+
+		if(cursor->pending){
+			branch = cursor->path[cursor->depth];
+			/* Messages retained after the subscription was made have been
+			 * delivered to it already. */
+			if(branch->retained && branch->retained->db_id <= cursor->last_db_id){
+				if(!retain__cursor_ready(cursor, branch->retained, *delivered)){
+					return retain_cursor_blocked;
 				}
+				retain__process(branch, cursor->context, cursor->sub_qos, cursor->subscription_identifier);
+				(*delivered)++;
+				count++;
 			}
+			cursor->pending = false;
 		}
 	}
-	return flag;
+	return retain_cursor_more;
+}
+
+
+static void retain__cursor_free(struct mosquitto__retain_cursor *cursor)
+{
+	while(cursor->depth >= 0){
+		retain__cursor_pop(cursor);
+	}
+	mosquitto__free(cursor->path);
+	mosquitto__free(cursor->split_topics);
+	mosquitto__free(cursor->local_sub);
+	mosquitto__free(cursor->sub);
+	mosquitto__free(cursor);
+}
+
+
+/* Remove and free a cursor, making the next cursor for its client active. */
+static void retain__cursor_remove(struct mosquitto__retain_cursor *cursor)
+{
+	struct mosquitto *context = cursor->context;
+
+	if(context->retain_cursors == cursor){
+		DL_DELETE(db.retain_cursors, cursor);
+		if(cursor->ctx_next){
+			DL_APPEND(db.retain_cursors, cursor->ctx_next);
+			loop__update_next_event(0);
+		}
+	}
+	DL_DELETE2(context->retain_cursors, cursor, ctx_prev, ctx_next);
+	retain__cursor_free(cursor);
+}
+
+
+void retain__cursors_process(void)
+{
+	struct mosquitto__retain_cursor *cursor, *cursor_tmp;
+	struct mosquitto *context;
+	int delivered;
+	int rc;
+
+	DL_FOREACH_SAFE(db.retain_cursors, cursor, cursor_tmp){
+		context = cursor->context;
+		delivered = 0;
+		rc = retain__cursor_step(cursor, &delivered);
+		if(rc == retain_cursor_done){
+			retain__cursor_remove(cursor);
+		}else if(rc == retain_cursor_more){
+			loop__update_next_event(0);
+		}
+		if(delivered > 0){
+			rc = db__message_write_inflight_out_latest(context);
+			if(rc){
+				do_disconnect(context, rc);
+			}
+		}
+	}
+}
+
+
+void retain__cursors_remove(struct mosquitto *context, const char *sub)
+{
+	struct mosquitto__retain_cursor *cursor, *cursor_tmp;
+
+	DL_FOREACH_SAFE2(context->retain_cursors, cursor, cursor_tmp, ctx_next){
+		if(!strcmp(cursor->sub, sub)){
+			retain__cursor_remove(cursor);
+		}
+	}
+}
+
+
+/* Used when a client takes over an existing session. */
+void retain__cursors_move(struct mosquitto *from, struct mosquitto *to)
+{
+	struct mosquitto__retain_cursor *cursor;
+
+	DL_FOREACH2(from->retain_cursors, cursor, ctx_next){
+		cursor->context = to;
+	}
+	to->retain_cursors = from->retain_cursors;
+	from->retain_cursors = NULL;
+}
+
+
+void retain__cursors_free(struct mosquitto *context)
+{
+	struct mosquitto__retain_cursor *cursor, *cursor_tmp;
+
+	DL_FOREACH_SAFE2(context->retain_cursors, cursor, cursor_tmp, ctx_next){
+		retain__cursor_remove(cursor);
+	}
 }
 
 
 int retain__queue(struct mosquitto *context, const char *sub, uint8_t sub_qos, uint32_t subscription_identifier)
 {
-	struct mosquitto__retainhier *retainhier;
-	char *local_sub;
-	char **split_topics;
+	struct mosquitto__retain_cursor *cursor;
+	int delivered = 0;
 	int rc;
+	int i;
 
 	assert(context);
 	assert(sub);
@@ -291,16 +651,51 @@ int retain__queue(struct mosquitto *context, const char *sub, uint8_t sub_qos, u
 		return MOSQ_ERR_SUCCESS;
 	}
 
-	rc = sub__topic_tokenise(sub, &local_sub, &split_topics, NULL);
-	if(rc) return rc;
+	/* Subscribing again starts the delivery again */
+	retain__cursors_remove(context, sub);
 
-	HASH_FIND(hh, db.retains, split_topics[0], strlen(split_topics[0]), retainhier);
+	cursor = mosquitto__calloc(1, sizeof(struct mosquitto__retain_cursor));
+	if(cursor == NULL){
+		return MOSQ_ERR_NOMEM;
+	}
+	cursor->sub = mosquitto__strdup(sub);
+	if(cursor->sub == NULL){
+		mosquitto__free(cursor);
+		return MOSQ_ERR_NOMEM;
+	}
+	rc = sub__topic_tokenise(sub, &cursor->local_sub, &cursor->split_topics, NULL);
+	if(rc){
+		mosquitto__free(cursor->sub);
+		mosquitto__free(cursor);
+		return rc;
+	}
 
-	if(retainhier){
-		retain__search(retainhier, split_topics, context, sub, sub_qos, subscription_identifier, 0);
+	cursor->hash_level = -1;
+	for(i=0; cursor->split_topics[i]; i++){
+		if(!strcmp(cursor->split_topics[i], "#")){
+			cursor->hash_level = i;
+		}
 	}
-	mosquitto__free(local_sub);
-	mosquitto__free(split_topics);
+	cursor->topic_count = i;
+	HASH_FIND(hh, db.retains, cursor->split_topics[0], strlen(cursor->split_topics[0]), cursor->root);
+
+	cursor->context = context;
+	cursor->sub_qos = sub_qos;
+	cursor->subscription_identifier = subscription_identifier;
+	cursor->last_db_id = db.last_db_id;
+	cursor->depth = -1;
+	cursor->descend = true;
+
+	if(context->retain_cursors == NULL){
+		/* Nothing else is being delivered to this client, so start now. The
+		 * messages are written out by the caller. */
+		if(retain__cursor_step(cursor, &delivered) == retain_cursor_done){
+			retain__cursor_free(cursor);
+			return MOSQ_ERR_SUCCESS;
+		}
+		DL_APPEND(db.retain_cursors, cursor);
+	}
+	DL_APPEND2(context->retain_cursors, cursor, ctx_prev, ctx_next);
 
 	return MOSQ_ERR_SUCCESS;
 }
@@ -314,6 +709,7 @@ void retain__clean(struct mosquitto__retainhier **retainhier)
 		if(peer->retained){
 			db__msg_store_ref_dec(&peer->retained);
 		}
+		retain__expiry_update(peer);
 		retain__clean(&peer->children);
 		mosquitto__free(peer->topic);
 
@@ -321,33 +717,3 @@ void retain__clean(struct mosquitto__retainhier **retainhier)
 		mosquitto__free(peer);
 	}
 }
-
-static void retain__expire_search(struct mosquitto__retainhier *retainhier)
-{
-	struct mosquitto__retainhier *branch, *branch_tmp;
-
-	HASH_ITER(hh, retainhier->children, branch, branch_tmp){
-		if(branch->children){
-			retain__expire_search(branch);
-		}
-		if(branch->retained){
-			if(branch->retained->message_expiry_time > 0 && db.now_real_s >= branch->retained->message_expiry_time){
-				db__msg_store_ref_dec(&branch->retained);
-				branch->retained = NULL;
-#ifdef WITH_SYS_TREE
-				db.retained_count--;
-#endif
-				retain__clean_empty_hierarchy(retainhier);
-			}
-		}
-	}
-}
-
-
-void retain__expire(void)
-{
-	if(db.config->retain_expiry_interval > 0 && db.now_s > next_expire_check){
-		retain__expire_search(db.retains);
-		next_expire_check = db.now_s + db.config->retain_expiry_interval;
-	}
-}
@@ -587,6 +587,9 @@ int mosquitto_security_cleanup(bool reload)
 	int i;
 	int rc;
 
+	acl__cache_flush_all();
+	retain__source_clear();
+
 	rc = security__cleanup_single(&db.config->security_options, reload);
 	if(rc != MOSQ_ERR_SUCCESS) return rc;
 
@@ -676,7 +679,9 @@ static int acl__check_dollar(const char *topic, int access)
 }
 
 
-int mosquitto_acl_check(struct mosquitto *context, const char *topic, uint32_t payloadlen, void* payload, uint8_t qos, bool retain, int access)
+/* If read_verdict is not NULL, the check is for a subscription and is set to
+ * the verdict for reads from the topics matching it, if one is known. */
+static int acl__check(struct mosquitto *context, const char *topic, uint32_t payloadlen, void* payload, uint8_t qos, bool retain, int access, uint8_t *read_verdict)
 {
 	int rc;
 	int i;
@@ -684,6 +689,8 @@ int mosquitto_acl_check(struct mosquitto *context, const char *topic, uint32_t p
 	struct mosquitto_acl_msg msg;
 	struct mosquitto__callback *cb_base;
 	struct mosquitto_evt_acl_check event_data;
+	bool cacheable = true;
+	bool find_verdict = (read_verdict != NULL);
 
 	if(!context->id){
 		return MOSQ_ERR_ACL_DENIED;
@@ -710,6 +717,11 @@ int mosquitto_acl_check(struct mosquitto *context, const char *topic, uint32_t p
 		opts = &db.config->security_options;
 	}
 
+	if(find_verdict == false && acl__cache_lookup(context, topic, access, &rc)){
+		return rc;
+	}
+	rc = MOSQ_ERR_SUCCESS;
+
 	memset(&msg, 0, sizeof(msg));
 	msg.topic = topic;
 	msg.payloadlen = payloadlen;
@@ -730,13 +742,34 @@ int mosquitto_acl_check(struct mosquitto *context, const char *topic, uint32_t p
 		event_data.retain = retain;
 		event_data.properties = NULL;
 		rc = cb_base->cb(MOSQ_EVT_ACL_CHECK, &event_data, cb_base->userdata);
+		/* A plugin that defers has still made a decision */
+		cacheable = cacheable && event_data.cacheable;
+
+		/* Reads are decided by the first plugin that doesn't defer them, in
+		 * the same way as this check. */
+		if(find_verdict){
+			if(event_data.read_verdict == MOSQ_ACL_VERDICT_ALLOW
+					|| event_data.read_verdict == MOSQ_ACL_VERDICT_DENY){
+
+				*read_verdict = event_data.read_verdict;
+				find_verdict = false;
+			}else if(event_data.read_verdict != MOSQ_ACL_VERDICT_DEFER){
+				find_verdict = false;
+			}
+		}
 		if(rc != MOSQ_ERR_PLUGIN_DEFER){
+			if(cacheable){
+				acl__cache_add(context, topic, access, rc);
+			}
 			return rc;
 		}
 	}
 
 	for(i=0; i<opts->auth_plugin_config_count; i++){
 		if(opts->auth_plugin_configs[i].plugin.version < 5){
+			/* Older plugins are given the whole message, so their results
+			 * are never cached. */
+			cacheable = false;
 			rc = acl__check_single(&opts->auth_plugin_configs[i], context, &msg, access);
 			if(rc != MOSQ_ERR_PLUGIN_DEFER){
 				return rc;
@@ -749,9 +782,25 @@ int mosquitto_acl_check(struct mosquitto *context, const char *topic, uint32_t p
 	if(rc == MOSQ_ERR_PLUGIN_DEFER){
 		rc = MOSQ_ERR_ACL_DENIED;
 	}
+	if(cacheable){
+		acl__cache_add(context, topic, access, rc);
+	}
 	return rc;
 }
 
+
+int mosquitto_acl_check(struct mosquitto *context, const char *topic, uint32_t payloadlen, void* payload, uint8_t qos, bool retain, int access)
+{
+	return acl__check(context, topic, payloadlen, payload, qos, retain, access, NULL);
+}
+
+
+int acl__check_subscribe(struct mosquitto *context, const char *sub, uint8_t qos, uint8_t *read_verdict)
+{
+	*read_verdict = MOSQ_ACL_VERDICT_UNKNOWN;
+	return acl__check(context, sub, 0, NULL, qos, false, MOSQ_ACL_SUBSCRIBE, read_verdict);
+}
+
 int mosquitto_unpwd_check(struct mosquitto *context)
 {
 	int rc;
@@ -39,6 +39,7 @@ static int pw__digest(const char *password, const unsigned char *salt, unsigned
 #endif
 static int mosquitto_unpwd_check_default(int event, void *event_data, void *userdata);
 static int mosquitto_acl_check_default(int event, void *event_data, void *userdata);
+static int acl__compile_patterns(struct mosquitto *context, struct mosquitto__security_options *security_opts);
 
 
 
@@ -202,6 +203,293 @@ int mosquitto_security_cleanup_default(bool reload)
 }
 
 
+static void acl__trie_free(struct mosquitto__acl_trie **root)
+{
+	struct mosquitto__acl_trie *node, *node_tmp;
+
+	HASH_ITER(hh, *root, node, node_tmp){
+		HASH_DELETE(hh, *root, node);
+		acl__trie_free(&node->children);
+		mosquitto__free(node->topic);
+		mosquitto__free(node);
+	}
+}
+
+
+static int acl__trie_add(struct mosquitto__acl_trie **root, const char *topic, int access)
+{
+	struct mosquitto__acl_trie **children = root;
+	struct mosquitto__acl_trie *node = NULL;
+	const char *start, *end;
+	size_t len;
+
+	start = topic;
+	while(1){
+		end = strchr(start, '/');
+		if(end){
+			len = (size_t)(end - start);
+		}else{
+			len = strlen(start);
+		}
+		if(len > UINT16_MAX){
+			return MOSQ_ERR_INVAL;
+		}
+
+		HASH_FIND(hh, *children, start, len, node);
+		if(node == NULL){
+			node = mosquitto__calloc(1, sizeof(struct mosquitto__acl_trie));
+			if(!node){
+				return MOSQ_ERR_NOMEM;
+			}
+			node->topic = mosquitto__malloc(len+1);
+			if(!node->topic){
+				mosquitto__free(node);
+				return MOSQ_ERR_NOMEM;
+			}
+			memcpy(node->topic, start, len);
+			node->topic[len] = '\0';
+			node->topic_len = (uint16_t)len;
+			HASH_ADD_KEYPTR(hh, *children, node->topic, node->topic_len, node);
+		}
+		if(end == NULL){
+			break;
+		}
+		children = &node->children;
+		start = end+1;
+	}
+
+	if(access == MOSQ_ACL_NONE){
+		node->deny = true;
+	}else{
+		node->access |= access;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static void acl__trie_merge(struct mosquitto__acl_trie *node, bool *deny, int *access)
+{
+	if(node->deny){
+		*deny = true;
+	}
+	*access |= node->access;
+}
+
+
+/* Find all of the ACLs in `children` and below that match the topic from
+ * `topic` onwards. Whether any of them deny access, and the access allowed
+ * by the rest, are added to `deny` and `access`. */
+static void acl__trie_search(struct mosquitto__acl_trie *children, const char *topic, bool first, bool *deny, int *access)
+{
+	struct mosquitto__acl_trie *node, *match[2];
+	const char *end;
+	size_t len;
+	int i;
+
+	end = strchr(topic, '/');
+	if(end){
+		len = (size_t)(end - topic);
+	}else{
+		len = strlen(topic);
+	}
+
+	match[0] = NULL;
+	/* Wildcards at the start of an ACL do not match topics starting with $ */
+	if(!first || topic[0] != '$'){
+		HASH_FIND(hh, children, "#", 1, node);
+		if(node){
+			acl__trie_merge(node, deny, access);
+		}
+		HASH_FIND(hh, children, "+", 1, match[0]);
+	}
+	HASH_FIND(hh, children, topic, len, match[1]);
+
+	for(i=0; i<2; i++){
+		if(match[i] == NULL) continue;
+
+		if(end){
+			if(match[i]->children){
+				acl__trie_search(match[i]->children, end+1, false, deny, access);
+			}
+		}else{
+			acl__trie_merge(match[i], deny, access);
+			/* "foo/#" also matches "foo" */
+			HASH_FIND(hh, match[i]->children, "#", 1, node);
+			if(node){
+				acl__trie_merge(node, deny, access);
+			}
+		}
+	}
+}
+
+
+static bool acl__trie_node_match(struct mosquitto__acl_trie *node, bool deny)
+{
+	if(deny){
+		return node->deny;
+	}else{
+		return (node->access & MOSQ_ACL_READ) != 0;
+	}
+}
+
+
+/* Is there a deny ACL, or an ACL allowing reads, at or below this node? */
+static bool acl__trie_any(struct mosquitto__acl_trie *node, bool deny)
+{
+	struct mosquitto__acl_trie *child, *child_tmp;
+
+	if(acl__trie_node_match(node, deny)) return true;
+
+	HASH_ITER(hh, node->children, child, child_tmp){
+		if(acl__trie_any(child, deny)) return true;
+	}
+	return false;
+}
+
+
+/* Is every topic matched by the subscription from `sub` onwards matched by a
+ * single deny ACL, or ACL allowing reads, in `children` and below? */
+static bool acl__trie_covers(struct mosquitto__acl_trie *children, const char *sub, bool first, bool deny)
+{
+	struct mosquitto__acl_trie *node, *match[2];
+	const char *end;
+	size_t len;
+	bool dollar;
+	int i;
+
+	end = strchr(sub, '/');
+	if(end){
+		len = (size_t)(end - sub);
+	}else{
+		len = strlen(sub);
+	}
+	/* Wildcards at the start of an ACL do not match topics starting with $ */
+	dollar = first && sub[0] == '$';
+
+	if(!dollar){
+		HASH_FIND(hh, children, "#", 1, node);
+		if(node && acl__trie_node_match(node, deny)) return true;
+	}
+	if(len == 1 && sub[0] == '#'){
+		/* Only "#" in the ACL covers "#" in the subscription */
+		return false;
+	}
+
+	match[0] = NULL;
+	match[1] = NULL;
+	if(!dollar){
+		HASH_FIND(hh, children, "+", 1, match[0]);
+	}
+	if(len != 1 || sub[0] != '+'){
+		HASH_FIND(hh, children, sub, len, match[1]);
+	}
+
+	for(i=0; i<2; i++){
+		if(match[i] == NULL) continue;
+
+		if(end){
+			if(acl__trie_covers(match[i]->children, end+1, false, deny)) return true;
+		}else{
+			if(acl__trie_node_match(match[i], deny)) return true;
+			/* "foo/#" also matches "foo" */
+			HASH_FIND(hh, match[i]->children, "#", 1, node);
+			if(node && acl__trie_node_match(node, deny)) return true;
+		}
+	}
+	return false;
+}
+
+
+static bool acl__trie_intersects(struct mosquitto__acl_trie *children, const char *sub, bool first, bool deny);
+
+/* The subscription level before `end` matches this node, is there a topic
+ * matched by both the rest of the subscription and an ACL below here? */
+static bool acl__trie_intersects_node(struct mosquitto__acl_trie *node, const char *end, bool deny)
+{
+	struct mosquitto__acl_trie *hash;
+
+	if(end == NULL){
+		if(acl__trie_node_match(node, deny)) return true;
+		/* "foo/#" also matches "foo" */
+		HASH_FIND(hh, node->children, "#", 1, hash);
+		return hash && acl__trie_node_match(hash, deny);
+	}
+
+	/* "foo/#" in the subscription also matches "foo" */
+	if(!strcmp(end+1, "#") && acl__trie_node_match(node, deny)) return true;
+
+	return acl__trie_intersects(node->children, end+1, false, deny);
+}
+
+
+/* Is there any topic matched by both the subscription from `sub` onwards and
+ * a deny ACL, or ACL allowing reads, in `children` and below? */
+static bool acl__trie_intersects(struct mosquitto__acl_trie *children, const char *sub, bool first, bool deny)
+{
+	struct mosquitto__acl_trie *node, *node_tmp;
+	const char *end;
+	size_t len;
+	bool dollar;
+
+	end = strchr(sub, '/');
+	if(end){
+		len = (size_t)(end - sub);
+	}else{
+		len = strlen(sub);
+	}
+	dollar = first && sub[0] == '$';
+
+	if(len == 1 && sub[0] == '#'){
+		/* Matches every ACL from here on, other than those for $ topics */
+		HASH_ITER(hh, children, node, node_tmp){
+			if(first && node->topic[0] == '$') continue;
+			if(acl__trie_any(node, deny)) return true;
+		}
+		return false;
+	}
+
+	if(!dollar){
+		HASH_FIND(hh, children, "#", 1, node);
+		if(node && acl__trie_node_match(node, deny)) return true;
+	}
+
+	if(len == 1 && sub[0] == '+'){
+		HASH_ITER(hh, children, node, node_tmp){
+			if(node->topic_len == 1 && node->topic[0] == '#') continue;
+			if(first && node->topic[0] == '$') continue;
+			if(acl__trie_intersects_node(node, end, deny)) return true;
+		}
+	}else{
+		if(!dollar){
+			HASH_FIND(hh, children, "+", 1, node);
+			if(node && acl__trie_intersects_node(node, end, deny)) return true;
+		}
+		HASH_FIND(hh, children, sub, len, node);
+		if(node && acl__trie_intersects_node(node, end, deny)) return true;
+	}
+	return false;
+}
+
+
+/* Work out the result of a read check against one trie, for every topic
+ * matching a subscription. Returns MOSQ_ACL_VERDICT_DEFER if no ACL in the
+ * trie matches any of the topics, so the check would carry on. */
+static uint8_t acl__trie_verdict(struct mosquitto__acl_trie *trie, const char *sub)
+{
+	if(acl__trie_covers(trie, sub, true, true)){
+		return MOSQ_ACL_VERDICT_DENY;
+	}else if(acl__trie_intersects(trie, sub, true, true)){
+		return MOSQ_ACL_VERDICT_UNKNOWN;
+	}else if(acl__trie_covers(trie, sub, true, false)){
+		return MOSQ_ACL_VERDICT_ALLOW;
+	}else if(acl__trie_intersects(trie, sub, true, false)){
+		return MOSQ_ACL_VERDICT_UNKNOWN;
+	}else{
+		return MOSQ_ACL_VERDICT_DEFER;
+	}
+}
+
+
 static int add__acl(struct mosquitto__security_options *security_opts, const char *user, const char *topic, int access)
 {
 	struct mosquitto__acl_user *acl_user=NULL, *user_tail;
@@ -250,13 +538,18 @@ static int add__acl(struct mosquitto__security_options *security_opts, const cha
 		}
 		acl_user->next = NULL;
 		acl_user->acl = NULL;
+		acl_user->acl_trie = NULL;
 	}
 
 	acl = mosquitto__malloc(sizeof(struct mosquitto__acl));
-	if(!acl){
+	if(!acl || acl__trie_add(&acl_user->acl_trie, topic, access)){
+		mosquitto__free(acl);
 		mosquitto__free(local_topic);
-		mosquitto__free(acl_user->username);
-		mosquitto__free(acl_user);
+		if(new_user){
+			acl__trie_free(&acl_user->acl_trie);
+			mosquitto__free(acl_user->username);
+			mosquitto__free(acl_user);
+		}
 		return MOSQ_ERR_NOMEM;
 	}
 	acl->access = access;
@@ -365,22 +658,167 @@ static int add__acl_pattern(struct mosquitto__security_options *security_opts, c
 	return MOSQ_ERR_SUCCESS;
 }
 
-static int mosquitto_acl_check_default(int event, void *event_data, void *userdata)
+/* Substitute the client id and username into a pattern ACL. */
+static char *acl__pattern_substitute(struct mosquitto__acl *acl, const char *id, const char *username)
 {
-	struct mosquitto_evt_acl_check *ed = event_data;
 	char *local_acl;
-	struct mosquitto__acl *acl_root;
-	bool result;
 	size_t i;
 	size_t len, tlen, clen, ulen;
 	char *s;
+
+	tlen = strlen(acl->topic);
+	clen = strlen(id);
+
+	if(username){
+		ulen = strlen(username);
+		len = tlen + (size_t)acl->ccount*(clen-2) + (size_t)acl->ucount*(ulen-2);
+	}else{
+		ulen = 0;
+		len = tlen + (size_t)acl->ccount*(clen-2);
+	}
+	local_acl = mosquitto__malloc(len+1);
+	if(!local_acl) return NULL;
+	s = local_acl;
+	for(i=0; i<tlen; i++){
+		if(i<tlen-1 && acl->topic[i] == '%'){
+			if(acl->topic[i+1] == 'c'){
+				i++;
+				strncpy(s, id, clen);
+				s+=clen;
+				continue;
+			}else if(username && acl->topic[i+1] == 'u'){
+				i++;
+				strncpy(s, username, ulen);
+				s+=ulen;
+				continue;
+			}
+		}
+		s[0] = acl->topic[i];
+		s++;
+	}
+	local_acl[len] = '\0';
+
+	return local_acl;
+}
+
+
+/* Compile the pattern ACLs, with the client id and username substituted,
+ * into a trie for this client. */
+static int acl__compile_patterns(struct mosquitto *context, struct mosquitto__security_options *security_opts)
+{
+	struct mosquitto__acl *acl_root;
+	char *local_acl;
+	int rc;
+
+	acl__free_acls(context);
+	if(!context->id) return MOSQ_ERR_SUCCESS;
+
+	for(acl_root=security_opts->acl_patterns; acl_root; acl_root=acl_root->next){
+		if(acl_root->ucount && !context->username){
+			continue;
+		}
+
+		local_acl = acl__pattern_substitute(acl_root, context->id, context->username);
+		if(!local_acl){
+			acl__trie_free(&context->acl_patterns);
+			return MOSQ_ERR_NOMEM;
+		}
+		rc = acl__trie_add(&context->acl_patterns, local_acl, acl_root->access);
+		mosquitto__free(local_acl);
+		if(rc){
+			acl__trie_free(&context->acl_patterns);
+			return rc;
+		}
+	}
+	/* No patterns apply to this client if the trie is empty, which must not
+	 * be taken as needing to compile them again. */
+	context->acl_patterns_compiled = true;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Work out whether a read check would give the same result for every topic
+ * matching a subscription, following the same steps as
+ * mosquitto_acl_check_default(). */
+static uint8_t acl__read_verdict(struct mosquitto *context, const char *sub)
+{
 	struct mosquitto__security_options *security_opts = NULL;
+	uint8_t verdict;
+
+	if(db.config->per_listener_settings){
+		if(!context->listener) return MOSQ_ACL_VERDICT_DENY;
+		security_opts = &context->listener->security_options;
+	}else{
+		security_opts = &db.config->security_options;
+	}
+	if(!security_opts->acl_file && !security_opts->acl_list && !security_opts->acl_patterns){
+		return MOSQ_ACL_VERDICT_DEFER;
+	}
+
+	if(!context->acl_list && !security_opts->acl_patterns) return MOSQ_ACL_VERDICT_DENY;
+
+	/* Shared subscriptions receive messages for the topics matching the
+	 * filter after the share name. */
+	if(!strncmp(sub, "$share/", strlen("$share/"))){
+		sub = strchr(sub + strlen("$share/"), '/');
+		if(sub == NULL) return MOSQ_ACL_VERDICT_UNKNOWN;
+		sub++;
+	}
+
+	if(context->acl_list && context->acl_list->acl_trie){
+		verdict = acl__trie_verdict(context->acl_list->acl_trie, sub);
+		if(verdict != MOSQ_ACL_VERDICT_DEFER){
+			return verdict;
+		}
+	}
+
+	if(security_opts->acl_patterns){
+		if(context->username && strpbrk(context->username, "+#")){
+			return MOSQ_ACL_VERDICT_DENY;
+		}
+		if(context->id && strpbrk(context->id, "+#")){
+			return MOSQ_ACL_VERDICT_DENY;
+		}
+	}
+
+	if(!context->id) return MOSQ_ACL_VERDICT_DENY;
+	if(!security_opts->acl_patterns) return MOSQ_ACL_VERDICT_DENY;
+
+	if(!context->acl_patterns_compiled){
+		if(acl__compile_patterns(context, security_opts)){
+			return MOSQ_ACL_VERDICT_UNKNOWN;
+		}
+	}
+
+	verdict = acl__trie_verdict(context->acl_patterns, sub);
+	if(verdict == MOSQ_ACL_VERDICT_DEFER){
+		return MOSQ_ACL_VERDICT_DENY;
+	}
+	return verdict;
+}
+
+
+static int mosquitto_acl_check_default(int event, void *event_data, void *userdata)
+{
+	struct mosquitto_evt_acl_check *ed = event_data;
+	struct mosquitto__security_options *security_opts = NULL;
+	bool deny;
+	int access;
+	int rc;
 
 	UNUSED(event);
 	UNUSED(userdata);
 
+	/* The result only depends on the client, topic and access */
+	ed->cacheable = true;
+
 	if(ed->client->bridge) return MOSQ_ERR_SUCCESS;
-	if(ed->access == MOSQ_ACL_SUBSCRIBE || ed->access == MOSQ_ACL_UNSUBSCRIBE) return MOSQ_ERR_SUCCESS; /* FIXME - implement ACL subscription strings. */
+	if(ed->access == MOSQ_ACL_SUBSCRIBE){
+		ed->read_verdict = acl__read_verdict(ed->client, ed->topic);
+		return MOSQ_ERR_SUCCESS; /* FIXME - implement ACL subscription strings. */
+	}
+	if(ed->access == MOSQ_ACL_UNSUBSCRIBE) return MOSQ_ERR_SUCCESS; /* FIXME - implement ACL subscription strings. */
 
 	if(db.config->per_listener_settings){
 		if(!ed->client->listener) return MOSQ_ERR_ACL_DENIED;
@@ -394,38 +832,23 @@ static int mosquitto_acl_check_default(int event, void *event_data, void *userda
 
 	if(!ed->client->acl_list && !security_opts->acl_patterns) return MOSQ_ERR_ACL_DENIED;
 
-	if(ed->client->acl_list){
-		acl_root = ed->client->acl_list->acl;
-	}else{
-		acl_root = NULL;
-	}
-
-	/* Loop through all ACLs for this client. ACL denials are iterated over first. */
-	while(acl_root){
-		/* Loop through the topic looking for matches to this ACL. */
-
-		/* If subscription starts with $, acl_root->topic must also start with $. */
-		if(ed->topic[0] == '$' && acl_root->topic[0] != '$'){
-			acl_root = acl_root->next;
-			continue;
+	/* Check all ACLs for this client. An ACL that denies access to the topic
+	 * takes precedence over any that allow it. */
+	if(ed->client->acl_list && ed->client->acl_list->acl_trie){
+		deny = false;
+		access = MOSQ_ACL_NONE;
+		acl__trie_search(ed->client->acl_list->acl_trie, ed->topic, true, &deny, &access);
+		if(deny){
+			/* Access was explicitly denied for this topic. */
+			return MOSQ_ERR_ACL_DENIED;
 		}
-		mosquitto_topic_matches_sub(acl_root->topic, ed->topic, &result);
-		if(result){
-			if(acl_root->access == MOSQ_ACL_NONE){
-				/* Access was explicitly denied for this topic. */
-				return MOSQ_ERR_ACL_DENIED;
-			}
-			if(ed->access & acl_root->access){
-				/* And access is allowed. */
-				return MOSQ_ERR_SUCCESS;
-			}
+		if(ed->access & access){
+			/* And access is allowed. */
+			return MOSQ_ERR_SUCCESS;
 		}
-		acl_root = acl_root->next;
 	}
 
-	acl_root = security_opts->acl_patterns;
-
-	if(acl_root){
+	if(security_opts->acl_patterns){
 		/* We are using pattern based acls. Check whether the username or
 		 * client id contains a + or # and if so deny access.
 		 *
@@ -444,61 +867,27 @@ static int mosquitto_acl_check_default(int event, void *event_data, void *userda
 		}
 	}
 
-	/* Loop through all pattern ACLs. ACL denial patterns are iterated over first. */
+	/* Check all pattern ACLs. These are normally compiled for the client by
+	 * acl__find_acls(), but are compiled here if that has not happened since
+	 * the client was restored from persistence or the ACLs were reloaded. */
 	if(!ed->client->id) return MOSQ_ERR_ACL_DENIED;
-	clen = strlen(ed->client->id);
-
-	while(acl_root){
-		tlen = strlen(acl_root->topic);
-
-		if(acl_root->ucount && !ed->client->username){
-			acl_root = acl_root->next;
-			continue;
-		}
-
-		if(ed->client->username){
-			ulen = strlen(ed->client->username);
-			len = tlen + (size_t)acl_root->ccount*(clen-2) + (size_t)acl_root->ucount*(ulen-2);
-		}else{
-			ulen = 0;
-			len = tlen + (size_t)acl_root->ccount*(clen-2);
-		}
-		local_acl = mosquitto__malloc(len+1);
-		if(!local_acl) return MOSQ_ERR_NOMEM;
-		s = local_acl;
-		for(i=0; i<tlen; i++){
-			if(i<tlen-1 && acl_root->topic[i] == '%'){
-				if(acl_root->topic[i+1] == 'c'){
-					i++;
-					strncpy(s, ed->client->id, clen);
-					s+=clen;
-					continue;
-				}else if(ed->client->username && acl_root->topic[i+1] == 'u'){
-					i++;
-					strncpy(s, ed->client->username, ulen);
-					s+=ulen;
-					continue;
-				}
-			}
-			s[0] = acl_root->topic[i];
-			s++;
-		}
-		local_acl[len] = '\0';
+	if(!security_opts->acl_patterns) return MOSQ_ERR_ACL_DENIED;
 
-		mosquitto_topic_matches_sub(local_acl, ed->topic, &result);
-		mosquitto__free(local_acl);
-		if(result){
-			if(acl_root->access == MOSQ_ACL_NONE){
-				/* Access was explicitly denied for this topic pattern. */
-				return MOSQ_ERR_ACL_DENIED;
-			}
-			if(ed->access & acl_root->access){
-				/* And access is allowed. */
-				return MOSQ_ERR_SUCCESS;
-			}
-		}
+	if(!ed->client->acl_patterns_compiled){
+		rc = acl__compile_patterns(ed->client, security_opts);
+		if(rc) return rc;
+	}
 
-		acl_root = acl_root->next;
+	deny = false;
+	access = MOSQ_ACL_NONE;
+	acl__trie_search(ed->client->acl_patterns, ed->topic, true, &deny, &access);
+	if(deny){
+		/* Access was explicitly denied for this topic pattern. */
+		return MOSQ_ERR_ACL_DENIED;
+	}
+	if(ed->access & access){
+		/* And access is allowed. */
+		return MOSQ_ERR_SUCCESS;
 	}
 
 	return MOSQ_ERR_ACL_DENIED;
@@ -659,6 +1048,7 @@ static void acl__cleanup_single(struct mosquitto__security_options *security_opt
 		user_tail = security_opts->acl_list->next;
 
 		free__acl(security_opts->acl_list->acl);
+		acl__trie_free(&security_opts->acl_list->acl_trie);
 		mosquitto__free(security_opts->acl_list->username);
 		mosquitto__free(security_opts->acl_list);
 
@@ -687,6 +1077,7 @@ static int acl__cleanup(bool reload)
 	 */
 	HASH_ITER(hh_id, db.contexts_by_id, context, ctxt_tmp){
 		context->acl_list = NULL;
+		acl__free_acls(context);
 	}
 
 	if(db.config->per_listener_settings){
@@ -716,6 +1107,7 @@ int acl__find_acls(struct mosquitto *context)
 		security_opts = &db.config->security_options;
 	}
 
+	context->acl_list = NULL;
 	if(security_opts->acl_list){
 		acl_tail = security_opts->acl_list;
 		while(acl_tail){
@@ -732,11 +1124,21 @@ int acl__find_acls(struct mosquitto *context)
 			}
 			acl_tail = acl_tail->next;
 		}
+	}
+
+	if(security_opts->acl_patterns){
+		return acl__compile_patterns(context, security_opts);
 	}else{
-		context->acl_list = NULL;
+		acl__free_acls(context);
+		return MOSQ_ERR_SUCCESS;
 	}
+}
 
-	return MOSQ_ERR_SUCCESS;
+
+void acl__free_acls(struct mosquitto *context)
+{
+	acl__trie_free(&context->acl_patterns);
+	context->acl_patterns_compiled = false;
 }
 
 
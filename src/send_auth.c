@@ -57,11 +57,11 @@ int send__auth(struct mosquitto *context, uint8_t reason_code, const void *auth_
 
 	if(packet__check_oversize(context, remaining_length)){
 		mosquitto_property_free_all(&properties);
-		mosquitto__free(packet);
+		packet__free(packet);
 		return MOSQ_ERR_OVERSIZE_PACKET;
 	}
 
-	packet = mosquitto__calloc(1, sizeof(struct mosquitto__packet));
+	packet = packet__new();
 	if(!packet) return MOSQ_ERR_NOMEM;
 
 	packet->command = CMD_AUTH;
@@ -70,7 +70,7 @@ int send__auth(struct mosquitto *context, uint8_t reason_code, const void *auth_
 	rc = packet__alloc(packet);
 	if(rc){
 		mosquitto_property_free_all(&properties);
-		mosquitto__free(packet);
+		packet__free(packet);
 		return rc;
 	}
 	packet__write_byte(packet, reason_code);
@@ -20,29 +20,12 @@ Contributors:
 
 #include <math.h>
 #include <stdio.h>
-#include <utlist.h>
 
 #include "mosquitto_broker_internal.h"
 #include "memory_mosq.h"
 #include "sys_tree.h"
 #include "time_mosq.h"
 
-static struct session_expiry_list *expiry_list = NULL;
-static time_t last_check = 0;
-
-
-static int session_expiry__cmp(struct session_expiry_list *i1, struct session_expiry_list *i2)
-{
-	if(i1->context->session_expiry_time == i2->context->session_expiry_time){
-		return 0;
-	}else if(i1->context->session_expiry_time > i2->context->session_expiry_time){
-		return 1;
-	}else{
-		return -1;
-	}
-}
-
-
 static void set_session_expiry_time(struct mosquitto *context)
 {
 	context->session_expiry_time = db.now_real_s;
@@ -63,10 +46,35 @@ static void set_session_expiry_time(struct mosquitto *context)
 }
 
 
-int session_expiry__add(struct mosquitto *context)
+static void session_expiry__expire(struct mosquitto__timer *timer)
+{
+	struct mosquitto *context = timer->userdata;
+
+	if(context->id){
+		log__printf(NULL, MOSQ_LOG_NOTICE, "Expiring client %s due to timeout.", context->id);
+	}
+	G_CLIENTS_EXPIRED_INC();
+
+	/* Session has now expired, so clear interval */
+	context->session_expiry_interval = 0;
+	/* Session has expired, so will delay should be cleared. */
+	context->will_delay_interval = 0;
+	will_delay__remove(context);
+	context__send_will(context);
+	context__add_to_disused(context);
+}
+
+
+static void session_expiry__schedule(struct mosquitto *context)
 {
-	struct session_expiry_list *item;
+	context->session_expiry_timer.callback = session_expiry__expire;
+	context->session_expiry_timer.userdata = context;
+	timers__add(&context->session_expiry_timer, context->session_expiry_time);
+}
+
 
+int session_expiry__add(struct mosquitto *context)
+{
 	if(db.config->persistent_client_expiration == 0){
 		if(context->session_expiry_interval == UINT32_MAX){
 			/* There isn't a global expiry set, and the client has asked to
@@ -75,14 +83,8 @@ int session_expiry__add(struct mosquitto *context)
 		}
 	}
 
-	item = mosquitto__calloc(1, sizeof(struct session_expiry_list));
-	if(!item) return MOSQ_ERR_NOMEM;
-
-	item->context = context;
-	set_session_expiry_time(item->context);
-	context->expiry_list_item = item;
-
-	DL_INSERT_INORDER(expiry_list, item, session_expiry__cmp);
+	set_session_expiry_time(context);
+	session_expiry__schedule(context);
 
 	return MOSQ_ERR_SUCCESS;
 }
@@ -90,8 +92,6 @@ int session_expiry__add(struct mosquitto *context)
 
 int session_expiry__add_from_persistence(struct mosquitto *context, time_t expiry_time)
 {
-	struct session_expiry_list *item;
-
 	if(db.config->persistent_client_expiration == 0){
 		if(context->session_expiry_interval == UINT32_MAX){
 			/* There isn't a global expiry set, and the client has asked to
@@ -100,79 +100,41 @@ int session_expiry__add_from_persistence(struct mosquitto *context, time_t expir
 		}
 	}
 
-	item = mosquitto__calloc(1, sizeof(struct session_expiry_list));
-	if(!item) return MOSQ_ERR_NOMEM;
-
-	item->context = context;
 	if(expiry_time){
-		item->context->session_expiry_time = expiry_time;
+		context->session_expiry_time = expiry_time;
 	}else{
-		set_session_expiry_time(item->context);
-
+		set_session_expiry_time(context);
 	}
-	context->expiry_list_item = item;
-
-	DL_INSERT_INORDER(expiry_list, item, session_expiry__cmp);
+	session_expiry__schedule(context);
 
 	return MOSQ_ERR_SUCCESS;
 }
 
 
-void session_expiry__remove(struct mosquitto *context)
+bool session_expiry__is_pending(struct mosquitto *context)
 {
-	if(context->expiry_list_item){
-		DL_DELETE(expiry_list, context->expiry_list_item);
-		mosquitto__free(context->expiry_list_item);
-		context->expiry_list_item = NULL;
-	}
+	return context->session_expiry_timer.next != NULL;
 }
 
 
-/* Call on broker shutdown only */
-void session_expiry__remove_all(void)
+void session_expiry__remove(struct mosquitto *context)
 {
-	struct session_expiry_list *item, *tmp;
-	struct mosquitto *context;
-
-	DL_FOREACH_SAFE(expiry_list, item, tmp){
-		context = item->context;
-		session_expiry__remove(context);
-		context->session_expiry_interval = 0;
-		context->will_delay_interval = 0;
-		will_delay__remove(context);
-		context__disconnect(context);
-	}
+	timers__remove(&context->session_expiry_timer);
 }
 
-void session_expiry__check(void)
-{
-	struct session_expiry_list *item, *tmp;
-	struct mosquitto *context;
-
-	if(db.now_real_s <= last_check) return;
 
-	last_check = db.now_real_s;
-
-	DL_FOREACH_SAFE(expiry_list, item, tmp){
-		if(item->context->session_expiry_time < db.now_real_s){
+/* Call on broker shutdown only */
+void session_expiry__remove_all(void)
+{
+	struct mosquitto *context, *ctxt_tmp;
 
-			context = item->context;
+	HASH_ITER(hh_id, db.contexts_by_id, context, ctxt_tmp){
+		if(session_expiry__is_pending(context)){
 			session_expiry__remove(context);
-
-			if(context->id){
-				log__printf(NULL, MOSQ_LOG_NOTICE, "Expiring client %s due to timeout.", context->id);
-			}
-			G_CLIENTS_EXPIRED_INC();
-
-			/* Session has now expired, so clear interval */
 			context->session_expiry_interval = 0;
-			/* Session has expired, so will delay should be cleared. */
 			context->will_delay_interval = 0;
 			will_delay__remove(context);
-			context__send_will(context);
-			context__add_to_disused(context);
-		}else{
-			return;
+			context__disconnect(context);
 		}
 	}
 }
@@ -60,6 +60,20 @@ Contributors:
 
 #include "utlist.h"
 
+/* Number of topic levels that can be searched without allocating memory. */
+#define SUB_LEVELS_STATIC 32
+
+struct sub__topic_level {
+	const char *topic;
+	size_t len;
+	unsigned hashv;
+};
+
+static int sub__search(struct mosquitto__subhier *subhier, const struct sub__topic_level *levels, int level_count, const char *source_id, const char *topic, uint8_t qos, int retain, struct mosquitto_msg_store *stored);
+
+/* Nesting level of sub__messages_queue() calls. */
+static int queue_depth = 0;
+
 static int subs__send(struct mosquitto__subleaf *leaf, const char *topic, uint8_t qos, int retain, struct mosquitto_msg_store *stored)
 {
 	bool client_retain;
@@ -68,8 +82,19 @@ static int subs__send(struct mosquitto__subleaf *leaf, const char *topic, uint8_
 	mosquitto_property *properties = NULL;
 	int rc2;
 
-	/* Check for ACL topic access. */
-	rc2 = mosquitto_acl_check(leaf->context, topic, stored->payloadlen, stored->payload, stored->qos, stored->retain, MOSQ_ACL_READ);
+	/* Check for ACL topic access, unless the result for all topics matching
+	 * this subscription was found when it was made. */
+	if(leaf->read_verdict != MOSQ_ACL_VERDICT_UNKNOWN
+			&& leaf->acl_generation == leaf->context->acl_generation){
+
+		if(leaf->read_verdict == MOSQ_ACL_VERDICT_ALLOW){
+			rc2 = MOSQ_ERR_SUCCESS;
+		}else{
+			rc2 = MOSQ_ERR_ACL_DENIED;
+		}
+	}else{
+		rc2 = mosquitto_acl_check(leaf->context, topic, stored->payloadlen, stored->payload, stored->qos, stored->retain, MOSQ_ACL_READ);
+	}
 	if(rc2 == MOSQ_ERR_ACL_DENIED){
 		return MOSQ_ERR_SUCCESS;
 	}else if(rc2 == MOSQ_ERR_SUCCESS){
@@ -154,29 +179,52 @@ static int subs__process(struct mosquitto__subhier *hier, const char *source_id,
 }
 
 
-static int sub__add_leaf(struct mosquitto *context, uint8_t qos, uint32_t identifier, int options, struct mosquitto__subleaf **head, struct mosquitto__subleaf **newleaf)
+/* A client usually has far fewer subscriptions than a popular filter has
+ * subscribers, so whether the client is already subscribed is decided from the
+ * client's own list rather than by searching all of the leaves. This keeps
+ * restoring or adding many subscribers to the same filter linear. */
+static bool sub__context_is_subscribed(struct mosquitto *context, struct mosquitto__subhier *subhier, struct mosquitto__subshared *shared)
+{
+	int i;
+
+	for(i=0; i<context->sub_count; i++){
+		if(context->subs[i] && context->subs[i]->hier == subhier && context->subs[i]->shared == shared){
+			return true;
+		}
+	}
+	return false;
+}
+
+
+static int sub__add_leaf(struct mosquitto *context, uint8_t qos, uint32_t identifier, int options, uint8_t read_verdict, struct mosquitto__subleaf **head, struct mosquitto__subleaf **newleaf, bool subscribed)
 {
 	struct mosquitto__subleaf *leaf;
 
 	*newleaf = NULL;
-	leaf = *head;
 
-	while(leaf){
-		if(leaf->context && leaf->context->id && !strcmp(leaf->context->id, context->id)){
-			/* Client making a second subscription to same topic. Only
-			 * need to update QoS. Return MOSQ_ERR_SUB_EXISTS to
-			 * indicate this to the calling function. */
-			leaf->qos = qos;
-			leaf->identifier = identifier;
-			return MOSQ_ERR_SUB_EXISTS;
+	if(subscribed){
+		leaf = *head;
+		while(leaf){
+			if(leaf->context && leaf->context->id && !strcmp(leaf->context->id, context->id)){
+				/* Client making a second subscription to same topic. Only
+				 * need to update QoS. Return MOSQ_ERR_SUB_EXISTS to
+				 * indicate this to the calling function. */
+				leaf->qos = qos;
+				leaf->identifier = identifier;
+				leaf->read_verdict = read_verdict;
+				leaf->acl_generation = context->acl_generation;
+				return MOSQ_ERR_SUB_EXISTS;
+			}
+			leaf = leaf->next;
 		}
-		leaf = leaf->next;
 	}
 	leaf = mosquitto__calloc(1, sizeof(struct mosquitto__subleaf));
 	if(!leaf) return MOSQ_ERR_NOMEM;
 	leaf->context = context;
 	leaf->qos = qos;
 	leaf->identifier = identifier;
+	leaf->read_verdict = read_verdict;
+	leaf->acl_generation = context->acl_generation;
 	leaf->no_local = ((options & MQTT_SUB_OPT_NO_LOCAL) != 0);
 	leaf->retain_as_published = ((options & MQTT_SUB_OPT_RETAIN_AS_PUBLISHED) != 0);
 
@@ -199,7 +247,7 @@ static void sub__remove_shared_leaf(struct mosquitto__subhier *subhier, struct m
 }
 
 
-static int sub__add_shared(struct mosquitto *context, const char *sub, uint8_t qos, uint32_t identifier, int options, struct mosquitto__subhier *subhier, const char *sharename)
+static int sub__add_shared(struct mosquitto *context, const char *sub, uint8_t qos, uint32_t identifier, int options, uint8_t read_verdict, struct mosquitto__subhier *subhier, const char *sharename)
 {
 	struct mosquitto__subleaf *newleaf;
 	struct mosquitto__subshared *shared = NULL;
@@ -226,7 +274,8 @@ static int sub__add_shared(struct mosquitto *context, const char *sub, uint8_t q
 		HASH_ADD_KEYPTR(hh, subhier->shared, shared->name, slen, shared);
 	}
 
-	rc = sub__add_leaf(context, qos, identifier, options, &shared->subs, &newleaf);
+	rc = sub__add_leaf(context, qos, identifier, options, read_verdict, &shared->subs, &newleaf,
+			sub__context_is_subscribed(context, subhier, shared));
 	if(rc > 0){
 		if(shared->subs == NULL){
 			HASH_DELETE(hh, subhier->shared, shared);
@@ -239,7 +288,10 @@ static int sub__add_shared(struct mosquitto *context, const char *sub, uint8_t q
 	if(rc != MOSQ_ERR_SUB_EXISTS){
 		slen = strlen(sub);
 		csub = mosquitto__calloc(1, sizeof(struct mosquitto__client_sub) + slen + 1);
-		if(csub == NULL) return MOSQ_ERR_NOMEM;
+		if(csub == NULL){
+			sub__remove_shared_leaf(subhier, shared, newleaf);
+			return MOSQ_ERR_NOMEM;
+		}
 		memcpy(csub->topic_filter, sub, slen);
 		csub->hier = subhier;
 		csub->shared = shared;
@@ -254,7 +306,6 @@ static int sub__add_shared(struct mosquitto *context, const char *sub, uint8_t q
 			subs = mosquitto__realloc(context->subs, sizeof(struct mosquitto__client_sub *)*(size_t)(context->sub_count + 1));
 			if(!subs){
 				sub__remove_shared_leaf(subhier, shared, newleaf);
-				mosquitto__free(newleaf);
 				mosquitto__free(csub);
 				return MOSQ_ERR_NOMEM;
 			}
@@ -277,7 +328,7 @@ static int sub__add_shared(struct mosquitto *context, const char *sub, uint8_t q
 }
 
 
-static int sub__add_normal(struct mosquitto *context, const char *sub, uint8_t qos, uint32_t identifier, int options, struct mosquitto__subhier *subhier)
+static int sub__add_normal(struct mosquitto *context, const char *sub, uint8_t qos, uint32_t identifier, int options, uint8_t read_verdict, struct mosquitto__subhier *subhier)
 {
 	struct mosquitto__subleaf *newleaf = NULL;
 	struct mosquitto__client_sub **subs;
@@ -286,7 +337,8 @@ static int sub__add_normal(struct mosquitto *context, const char *sub, uint8_t q
 	int rc;
 	size_t slen;
 
-	rc = sub__add_leaf(context, qos, identifier, options, &subhier->subs, &newleaf);
+	rc = sub__add_leaf(context, qos, identifier, options, read_verdict, &subhier->subs, &newleaf,
+			sub__context_is_subscribed(context, subhier, NULL));
 	if(rc > 0){
 		return rc;
 	}
@@ -294,7 +346,11 @@ static int sub__add_normal(struct mosquitto *context, const char *sub, uint8_t q
 	if(rc != MOSQ_ERR_SUB_EXISTS){
 		slen = strlen(sub);
 		csub = mosquitto__calloc(1, sizeof(struct mosquitto__client_sub) + slen + 1);
-		if(csub == NULL) return MOSQ_ERR_NOMEM;
+		if(csub == NULL){
+			DL_DELETE(subhier->subs, newleaf);
+			mosquitto__free(newleaf);
+			return MOSQ_ERR_NOMEM;
+		}
 		memcpy(csub->topic_filter, sub, slen);
 		csub->hier = subhier;
 		csub->shared = NULL;
@@ -332,11 +388,12 @@ static int sub__add_normal(struct mosquitto *context, const char *sub, uint8_t q
 }
 
 
-static int sub__add_context(struct mosquitto *context, const char *topic_filter, uint8_t qos, uint32_t identifier, int options, struct mosquitto__subhier *subhier, char *const *const topics, const char *sharename)
+static int sub__add_context(struct mosquitto *context, const char *topic_filter, uint8_t qos, uint32_t identifier, int options, uint8_t read_verdict, struct mosquitto__subhier *subhier, char *const *const topics, const char *sharename)
 {
 	struct mosquitto__subhier *branch;
 	int topic_index = 0;
 	size_t topiclen;
+	bool created = false;
 
 	/* Find leaf node */
 	while(topics && topics[topic_index] != NULL){
@@ -349,17 +406,22 @@ static int sub__add_context(struct mosquitto *context, const char *topic_filter,
 			/* Not found */
 			branch = sub__add_hier_entry(subhier, &subhier->children, topics[topic_index], (uint16_t)topiclen);
 			if(!branch) return MOSQ_ERR_NOMEM;
+			created = true;
 		}
 		subhier = branch;
 		topic_index++;
 	}
+	if(created){
+		/* Cached results for topics matching this filter are now incomplete */
+		sub__cache_hier_add(subhier);
+	}
 
 	/* Add add our context */
 	if(context && context->id){
 		if(sharename){
-			return sub__add_shared(context, topic_filter, qos, identifier, options, subhier, sharename);
+			return sub__add_shared(context, topic_filter, qos, identifier, options, read_verdict, subhier, sharename);
 		}else{
-			return sub__add_normal(context, topic_filter, qos, identifier, options, subhier);
+			return sub__add_normal(context, topic_filter, qos, identifier, options, read_verdict, subhier);
 		}
 	}else{
 		return MOSQ_ERR_SUCCESS;
@@ -451,6 +513,19 @@ static int sub__remove_shared(struct mosquitto *context, struct mosquitto__subhi
 }
 
 
+static void sub__remove_hier_entry(struct mosquitto__subhier *parent, struct mosquitto__subhier *child)
+{
+	sub__cache_hier_remove(child);
+	if(parent->child_plus == child){
+		parent->child_plus = NULL;
+	}else if(parent->child_hash == child){
+		parent->child_hash = NULL;
+	}
+	HASH_DELETE(hh, parent->children, child);
+	mosquitto__free(child);
+}
+
+
 static int sub__remove_recurse(struct mosquitto *context, struct mosquitto__subhier *subhier, char **topics, uint8_t *reason, const char *sharename)
 {
 	struct mosquitto__subhier *branch;
@@ -467,71 +542,68 @@ static int sub__remove_recurse(struct mosquitto *context, struct mosquitto__subh
 	if(branch){
 		sub__remove_recurse(context, branch, &(topics[1]), reason, sharename);
 		if(!branch->children && !branch->subs && !branch->shared){
-			HASH_DELETE(hh, subhier->children, branch);
-			mosquitto__free(branch->topic);
-			mosquitto__free(branch);
+			sub__remove_hier_entry(subhier, branch);
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static int sub__search_branch(struct mosquitto__subhier *branch, const struct sub__topic_level *levels, int level_count, const char *source_id, const char *topic, uint8_t qos, int retain, struct mosquitto_msg_store *stored, bool *have_subscribers)
+{
+	int rc;
+
+	rc = sub__search(branch, &levels[1], level_count-1, source_id, topic, qos, retain, stored);
+	if(rc == MOSQ_ERR_SUCCESS){
+		*have_subscribers = true;
+	}else if(rc != MOSQ_ERR_NO_SUBSCRIBERS){
+		return rc;
+	}
+	if(level_count == 1){ /* End of list */
+		sub__cache_record(branch);
+		rc = subs__process(branch, source_id, topic, qos, retain, stored);
+		if(rc == MOSQ_ERR_SUCCESS){
+			*have_subscribers = true;
+		}else if(rc != MOSQ_ERR_NO_SUBSCRIBERS){
+			return rc;
 		}
 	}
 	return MOSQ_ERR_SUCCESS;
 }
 
 
-static int sub__search(struct mosquitto__subhier *subhier, char **split_topics, const char *source_id, const char *topic, uint8_t qos, int retain, struct mosquitto_msg_store *stored)
+static int sub__search(struct mosquitto__subhier *subhier, const struct sub__topic_level *levels, int level_count, const char *source_id, const char *topic, uint8_t qos, int retain, struct mosquitto_msg_store *stored)
 {
 	/* FIXME - need to take into account source_id if the client is a bridge */
 	struct mosquitto__subhier *branch;
 	int rc;
 	bool have_subscribers = false;
 
-	if(split_topics && split_topics[0]){
+	if(level_count > 0 && subhier->children){
 		/* Check for literal match */
-		HASH_FIND(hh, subhier->children, split_topics[0], strlen(split_topics[0]), branch);
+		HASH_FIND_BYHASHVALUE(hh, subhier->children, levels[0].topic, levels[0].len, levels[0].hashv, branch);
 
 		if(branch){
-			rc = sub__search(branch, &(split_topics[1]), source_id, topic, qos, retain, stored);
-			if(rc == MOSQ_ERR_SUCCESS){
-				have_subscribers = true;
-			}else if(rc != MOSQ_ERR_NO_SUBSCRIBERS){
-				return rc;
-			}
-			if(split_topics[1] == NULL){ /* End of list */
-				rc = subs__process(branch, source_id, topic, qos, retain, stored);
-				if(rc == MOSQ_ERR_SUCCESS){
-					have_subscribers = true;
-				}else if(rc != MOSQ_ERR_NO_SUBSCRIBERS){
-					return rc;
-				}
-			}
+			rc = sub__search_branch(branch, levels, level_count, source_id, topic, qos, retain, stored, &have_subscribers);
+			if(rc) return rc;
 		}
 
 		/* Check for + match */
-		HASH_FIND(hh, subhier->children, "+", 1, branch);
-
+		branch = subhier->child_plus;
 		if(branch){
-			rc = sub__search(branch, &(split_topics[1]), source_id, topic, qos, retain, stored);
-			if(rc == MOSQ_ERR_SUCCESS){
-				have_subscribers = true;
-			}else if(rc != MOSQ_ERR_NO_SUBSCRIBERS){
-				return rc;
-			}
-			if(split_topics[1] == NULL){ /* End of list */
-				rc = subs__process(branch, source_id, topic, qos, retain, stored);
-				if(rc == MOSQ_ERR_SUCCESS){
-					have_subscribers = true;
-				}else if(rc != MOSQ_ERR_NO_SUBSCRIBERS){
-					return rc;
-				}
-			}
+			rc = sub__search_branch(branch, levels, level_count, source_id, topic, qos, retain, stored, &have_subscribers);
+			if(rc) return rc;
 		}
 	}
 
 	/* Check for # match */
-	HASH_FIND(hh, subhier->children, "#", 1, branch);
+	branch = subhier->child_hash;
 	if(branch && !branch->children){
 		/* The topic matches due to a # wildcard - process the
 		 * subscriptions but *don't* return. Although this branch has ended
 		 * there may still be other subscriptions to deal with.
 		 */
+		sub__cache_record(branch);
 		rc = subs__process(branch, source_id, topic, qos, retain, stored);
 		if(rc == MOSQ_ERR_SUCCESS){
 			have_subscribers = true;
@@ -548,34 +620,86 @@ static int sub__search(struct mosquitto__subhier *subhier, char **split_topics,
 }
 
 
+/* Split a topic into levels, without copying it. This gives the same levels as
+ * sub__topic_tokenise(), including the leading empty level for topics that do
+ * not start with '$', and precomputes the hash of each level so it is only
+ * calculated once no matter how many branches of the tree are searched. */
+static int sub__topic_levels(const char *topic, struct sub__topic_level *levels, int max_levels)
+{
+	const char *c;
+	int count = 0;
+
+	if(topic[0] != '$'){
+		levels[0].topic = "";
+		levels[0].len = 0;
+		HASH_VALUE(levels[0].topic, 0, levels[0].hashv);
+		count++;
+	}
+
+	while(1){
+		if(count == max_levels){
+			return -1;
+		}
+		c = strchr(topic, '/');
+		levels[count].topic = topic;
+		if(c){
+			levels[count].len = (size_t)(c - topic);
+		}else{
+			levels[count].len = strlen(topic);
+		}
+		HASH_VALUE(levels[count].topic, levels[count].len, levels[count].hashv);
+		count++;
+		if(!c){
+			break;
+		}
+		topic = c+1;
+	}
+	return count;
+}
+
+
 struct mosquitto__subhier *sub__add_hier_entry(struct mosquitto__subhier *parent, struct mosquitto__subhier **sibling, const char *topic, uint16_t len)
 {
 	struct mosquitto__subhier *child;
 
 	assert(sibling);
 
-	child = mosquitto__calloc(1, sizeof(struct mosquitto__subhier));
+	/* The topic is stored inline, so the node and its key share a cache line
+	 * for short topic levels. */
+	child = mosquitto__calloc(1, sizeof(struct mosquitto__subhier) + len + 1);
 	if(!child){
 		log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
 		return NULL;
 	}
 	child->parent = parent;
 	child->topic_len = len;
-	child->topic = mosquitto__strdup(topic);
-	if(!child->topic){
-		child->topic_len = 0;
-		mosquitto__free(child);
-		log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-		return NULL;
-	}
+	memcpy(child->topic, topic, len);
+	child->topic[len] = '\0';
 
 	HASH_ADD_KEYPTR(hh, *sibling, child->topic, child->topic_len, child);
 
+	if(parent && len == 1){
+		if(topic[0] == '+'){
+			parent->child_plus = child;
+		}else if(topic[0] == '#'){
+			parent->child_hash = child;
+		}
+	}
+
 	return child;
 }
 
 
+
 int sub__add(struct mosquitto *context, const char *sub, uint8_t qos, uint32_t identifier, int options)
+{
+	return sub__add_with_verdict(context, sub, qos, identifier, options, MOSQ_ACL_VERDICT_UNKNOWN);
+}
+
+
+/* As sub__add(), with the verdict for read access found when the
+ * subscription was checked by acl__check_subscribe(). */
+int sub__add_with_verdict(struct mosquitto *context, const char *sub, uint8_t qos, uint32_t identifier, int options, uint8_t read_verdict)
 {
 	int rc = 0;
 	struct mosquitto__subhier *subhier;
@@ -619,11 +743,16 @@ int sub__add(struct mosquitto *context, const char *sub, uint8_t qos, uint32_t i
 			}
 		}
 	}
-	rc = sub__add_context(context, sub, qos, identifier, options, subhier, topics, sharename);
+	rc = sub__add_context(context, sub, qos, identifier, options, read_verdict, subhier, topics, sharename);
 
 	mosquitto__free(local_sub);
 	mosquitto__free(topics);
 
+#ifdef WITH_PERSISTENCE
+	if(rc == MOSQ_ERR_SUCCESS || rc == MOSQ_ERR_SUB_EXISTS){
+		persist__journal_sub(context, sub, qos, identifier, options);
+	}
+#endif
 	return rc;
 }
 
@@ -648,6 +777,11 @@ int sub__remove(struct mosquitto *context, const char *sub, uint8_t *reason)
 	if(subhier){
 		*reason = MQTT_RC_NO_SUBSCRIPTION_EXISTED;
 		rc = sub__remove_recurse(context, subhier, topics, reason, sharename);
+#ifdef WITH_PERSISTENCE
+		if(rc == MOSQ_ERR_SUCCESS && *reason == 0){
+			persist__journal_sub_remove(context, sub);
+		}
+#endif
 	}
 
 	mosquitto__free(local_sub);
@@ -661,12 +795,49 @@ int sub__messages_queue(const char *source_id, const char *topic, uint8_t qos, i
 	int rc = MOSQ_ERR_SUCCESS, rc2;
 	int rc_normal = MOSQ_ERR_NO_SUBSCRIBERS, rc_shared = MOSQ_ERR_NO_SUBSCRIBERS;
 	struct mosquitto__subhier *subhier;
+	struct mosquitto__subhier **hiers = NULL;
+	struct sub__topic_level levels_static[SUB_LEVELS_STATIC];
+	struct sub__topic_level *levels = levels_static;
+	int level_count;
+	int hier_count = 0, i;
 	char **split_topics = NULL;
 	char *local_topic = NULL;
+	const char *c;
+	size_t topic_len;
+	bool cache_hit;
 
 	assert(topic);
 
-	if(sub__topic_tokenise(topic, &local_topic, &split_topics, NULL)) return 1;
+	if(topic[0] == '\0') return 1;
+
+	topic_len = strlen(topic);
+	queue_depth++;
+	if(queue_depth > 1){
+		/* A message published while delivering another, for example a log
+		 * message sent to $SYS/broker/log. The cache may be in use by the
+		 * outer delivery, so leave it alone. */
+		sub__cache_record_end(topic, topic_len, false);
+		cache_hit = false;
+	}else{
+		cache_hit = sub__cache_lookup(topic, topic_len, &hiers, &hier_count);
+	}
+	if(cache_hit == false){
+		level_count = sub__topic_levels(topic, levels, SUB_LEVELS_STATIC);
+		if(level_count < 0){
+			/* Very deep topic, count the levels and try again. */
+			level_count = 2;
+			for(c=topic; *c; c++){
+				if(*c == '/') level_count++;
+			}
+			levels = mosquitto__malloc(sizeof(struct sub__topic_level)*(size_t)level_count);
+			if(!levels){
+				sub__cache_record_end(topic, topic_len, false);
+				queue_depth--;
+				return MOSQ_ERR_NOMEM;
+			}
+			level_count = sub__topic_levels(topic, levels, level_count);
+		}
+	}
 
 	/* Protect this message until we have sent it to all
 	clients - this is required because websockets client calls
@@ -674,22 +845,37 @@ int sub__messages_queue(const char *source_id, const char *topic, uint8_t qos, i
 	*/
 	db__msg_store_ref_inc(*stored);
 
-	HASH_FIND(hh, db.normal_subs, split_topics[0], strlen(split_topics[0]), subhier);
-	if(subhier){
-		rc_normal = sub__search(subhier, split_topics, source_id, topic, qos, retain, *stored);
-		if(rc_normal > 0){
-			rc = rc_normal;
-			goto end;
+	if(cache_hit){
+		/* Cache hit, only the subscribers of the matching nodes need
+		 * processing. */
+		for(i=0; i<hier_count; i++){
+			rc2 = subs__process(hiers[i], source_id, topic, qos, retain, *stored);
+			if(rc2 == MOSQ_ERR_SUCCESS){
+				rc_normal = MOSQ_ERR_SUCCESS;
+			}else if(rc2 != MOSQ_ERR_NO_SUBSCRIBERS){
+				rc = rc2;
+				goto end;
+			}
+		}
+	}else{
+		HASH_FIND_BYHASHVALUE(hh, db.normal_subs, levels[0].topic, levels[0].len, levels[0].hashv, subhier);
+		if(subhier){
+			rc_normal = sub__search(subhier, levels, level_count, source_id, topic, qos, retain, *stored);
+			if(rc_normal > 0){
+				rc = rc_normal;
+				goto end;
+			}
 		}
-	}
 
-	HASH_FIND(hh, db.shared_subs, split_topics[0], strlen(split_topics[0]), subhier);
-	if(subhier){
-		rc_shared = sub__search(subhier, split_topics, source_id, topic, qos, retain, *stored);
-		if(rc_shared > 0){
-			rc = rc_shared;
-			goto end;
+		HASH_FIND_BYHASHVALUE(hh, db.shared_subs, levels[0].topic, levels[0].len, levels[0].hashv, subhier);
+		if(subhier){
+			rc_shared = sub__search(subhier, levels, level_count, source_id, topic, qos, retain, *stored);
+			if(rc_shared > 0){
+				rc = rc_shared;
+				goto end;
+			}
 		}
+		sub__cache_record_end(topic, topic_len, true);
 	}
 
 	if(rc_normal == MOSQ_ERR_NO_SUBSCRIBERS && rc_shared == MOSQ_ERR_NO_SUBSCRIBERS){
@@ -697,11 +883,21 @@ int sub__messages_queue(const char *source_id, const char *topic, uint8_t qos, i
 	}
 
 	if(retain){
+		if(sub__topic_tokenise(topic, &local_topic, &split_topics, NULL)){
+			rc = 1;
+			goto end;
+		}
 		rc2 = retain__store(topic, *stored, split_topics);
 		if(rc2) rc = rc2;
 	}
 
 end:
+	/* Does nothing unless a search failed part way through */
+	sub__cache_record_end(topic, topic_len, false);
+	queue_depth--;
+	if(levels != levels_static){
+		mosquitto__free(levels);
+	}
 	mosquitto__free(split_topics);
 	mosquitto__free(local_topic);
 	/* Remove our reference and free if needed. */
@@ -725,9 +921,7 @@ static struct mosquitto__subhier *tmp_remove_subs(struct mosquitto__subhier *sub
 	}
 
 	parent = sub->parent;
-	HASH_DELETE(hh, parent->children, sub);
-	mosquitto__free(sub->topic);
-	mosquitto__free(sub);
+	sub__remove_hier_entry(parent, sub);
 
 	if(parent->subs == NULL
 			&& parent->children == NULL
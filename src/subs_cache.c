@@ -0,0 +1,272 @@
+/*
+Copyright (c) 2026 Contributors to the Eclipse Foundation
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License 2.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   https://www.eclipse.org/legal/epl-2.0/
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+SPDX-License-Identifier: EPL-2.0 OR BSD-3-Clause
+
+Contributors:
+   Eclipse Mosquitto contributors - initial implementation and documentation.
+*/
+
+/* A note on the subscription match cache.
+ *
+ * Searching the subscription tree for a topic visits every branch that could
+ * match it, which is the bulk of the cost of routing a message when there are
+ * many wildcard subscriptions. Most brokers see the same topics published over
+ * and over, so the result of the search can be reused.
+ *
+ * The cache maps an exact topic to the list of tree nodes whose
+ * subscriptions matched it during the last search. The subscribers themselves
+ * are not cached, they are read from the nodes each time, so clients
+ * subscribing to or unsubscribing from a filter that already exists in the
+ * tree do not affect the cache at all. The cache only needs to change when the
+ * shape of the tree changes:
+ *
+ * - When a node is removed, every entry that refers to it is removed. Each
+ *   node keeps a list of the entries that refer to it, so this is cheap.
+ * - When a new node is added for a subscription, every entry whose topic
+ *   matches the new filter is removed. Literal filters need a single lookup,
+ *   filters with wildcards need a scan of the cache.
+ *
+ * The number of entries is limited by subscription_cache_size, with the least
+ * recently used entry being evicted when the cache is full.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "mosquitto_broker_internal.h"
+#include "memory_mosq.h"
+#include "sys_tree.h"
+
+#include "utlist.h"
+
+struct mosquitto__subcache_ref {
+	struct mosquitto__subcache_ref *prev, *next;
+	struct mosquitto__subcache *entry;
+};
+
+struct mosquitto__subcache {
+	UT_hash_handle hh;
+	struct mosquitto__subcache *prev, *next;
+	struct mosquitto__subhier **hiers;
+	char *topic;
+	int hier_count;
+	struct mosquitto__subcache_ref refs[];
+};
+
+static struct mosquitto__subcache *cache_by_topic = NULL;
+static struct mosquitto__subcache *cache_lru = NULL; /* Most recently used first */
+static int cache_count = 0;
+
+/* Nodes matched by the search in progress. */
+static struct mosquitto__subhier **record_hiers = NULL;
+static int record_count = 0;
+static int record_max = 0;
+static bool record_active = false;
+
+
+static void sub__cache_entry_free(struct mosquitto__subcache *entry)
+{
+	int i;
+
+	for(i=0; i<entry->hier_count; i++){
+		DL_DELETE(entry->hiers[i]->cache_refs, &entry->refs[i]);
+	}
+	HASH_DELETE(hh, cache_by_topic, entry);
+	DL_DELETE(cache_lru, entry);
+	cache_count--;
+	mosquitto__free(entry);
+}
+
+
+bool sub__cache_lookup(const char *topic, size_t topic_len, struct mosquitto__subhier ***hiers, int *hier_count)
+{
+	struct mosquitto__subcache *entry;
+
+	if(db.config->subscription_cache_size <= 0){
+		return false;
+	}
+
+	HASH_FIND(hh, cache_by_topic, topic, topic_len, entry);
+	if(entry == NULL){
+		G_SUB_CACHE_MISSES_INC();
+		/* Record the result of the search that follows */
+		record_count = 0;
+		record_active = true;
+		return false;
+	}
+	G_SUB_CACHE_HITS_INC();
+
+	if(entry != cache_lru){
+		DL_DELETE(cache_lru, entry);
+		DL_PREPEND(cache_lru, entry);
+	}
+	*hiers = entry->hiers;
+	*hier_count = entry->hier_count;
+	return true;
+}
+
+
+void sub__cache_record(struct mosquitto__subhier *hier)
+{
+	struct mosquitto__subhier **hiers;
+
+	if(record_active == false){
+		return;
+	}
+
+	if(record_count == record_max){
+		hiers = mosquitto__realloc(record_hiers, sizeof(struct mosquitto__subhier *)*(size_t)(record_max + 16));
+		if(hiers == NULL){
+			/* Don't cache an incomplete result */
+			record_active = false;
+			return;
+		}
+		record_hiers = hiers;
+		record_max += 16;
+	}
+	record_hiers[record_count] = hier;
+	record_count++;
+}
+
+
+void sub__cache_record_end(const char *topic, size_t topic_len, bool complete)
+{
+	struct mosquitto__subcache *entry;
+	int i;
+
+	if(record_active == false){
+		return;
+	}
+	record_active = false;
+	if(complete == false){
+		return;
+	}
+
+	if(cache_count >= db.config->subscription_cache_size){
+		/* The tail of the list is the least recently used entry */
+		sub__cache_entry_free(cache_lru->prev);
+	}
+
+	/* The entry, its node references and the topic share one allocation. */
+	entry = mosquitto__calloc(1, sizeof(struct mosquitto__subcache)
+			+ (sizeof(struct mosquitto__subcache_ref) + sizeof(struct mosquitto__subhier *))*(size_t)record_count
+			+ topic_len + 1);
+	if(entry == NULL){
+		return;
+	}
+	entry->hier_count = record_count;
+	entry->hiers = (struct mosquitto__subhier **)&entry->refs[record_count];
+	entry->topic = (char *)&entry->hiers[record_count];
+	memcpy(entry->topic, topic, topic_len);
+	entry->topic[topic_len] = '\0';
+
+	for(i=0; i<record_count; i++){
+		entry->hiers[i] = record_hiers[i];
+		entry->refs[i].entry = entry;
+		DL_APPEND(record_hiers[i]->cache_refs, &entry->refs[i]);
+	}
+
+	HASH_ADD_KEYPTR(hh, cache_by_topic, entry->topic, topic_len, entry);
+	DL_PREPEND(cache_lru, entry);
+	cache_count++;
+}
+
+
+/* A node is about to be freed, remove all entries that refer to it. */
+void sub__cache_hier_remove(struct mosquitto__subhier *hier)
+{
+	while(hier->cache_refs){
+		sub__cache_entry_free(hier->cache_refs->entry);
+	}
+}
+
+
+/* A new node has been added to the tree, remove all entries for topics that
+ * match its filter. */
+int sub__cache_hier_add(struct mosquitto__subhier *hier)
+{
+	struct mosquitto__subhier *h;
+	struct mosquitto__subcache *entry, *entry_tmp;
+	char *filter;
+	size_t len = 0, pos;
+	bool wildcard = false;
+	bool result;
+
+	if(cache_count == 0){
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	for(h=hier; h->parent; h=h->parent){
+		len += h->topic_len + 1U;
+		if(h->topic_len == 1 && (h->topic[0] == '+' || h->topic[0] == '#')){
+			wildcard = true;
+		}
+	}
+	if(len == 0){
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	filter = mosquitto__malloc(len + 1);
+	if(filter == NULL){
+		/* Can't tell what is affected, so everything must go */
+		sub__cache_clean();
+		return MOSQ_ERR_NOMEM;
+	}
+
+	/* Rebuild the filter from the node up to the root. The first level below
+	 * the root repeats the root key. For topics that don't start with '$' this
+	 * is the empty level added by sub__topic_tokenise(), and is not part of
+	 * the filter. */
+	pos = len;
+	filter[pos] = '\0';
+	for(h=hier; h->parent; h=h->parent){
+		if(h->parent->parent == NULL && h->parent->topic_len == 0){
+			break;
+		}
+		pos -= h->topic_len;
+		memcpy(&filter[pos], h->topic, h->topic_len);
+		pos--;
+		filter[pos] = '/';
+	}
+	pos++;
+
+	if(wildcard){
+		HASH_ITER(hh, cache_by_topic, entry, entry_tmp){
+			if(mosquitto_topic_matches_sub(&filter[pos], entry->topic, &result) || result){
+				sub__cache_entry_free(entry);
+			}
+		}
+	}else{
+		HASH_FIND(hh, cache_by_topic, &filter[pos], len - pos, entry);
+		if(entry){
+			sub__cache_entry_free(entry);
+		}
+	}
+	mosquitto__free(filter);
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+void sub__cache_clean(void)
+{
+	while(cache_lru){
+		sub__cache_entry_free(cache_lru);
+	}
+	mosquitto__free(record_hiers);
+	record_hiers = NULL;
+	record_count = 0;
+	record_max = 0;
+	record_active = false;
+}
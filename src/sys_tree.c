@@ -45,6 +45,17 @@ unsigned long g_msgs_dropped = 0;
 unsigned int g_clients_expired = 0;
 unsigned int g_socket_connections = 0;
 unsigned int g_connection_count = 0;
+unsigned long g_sub_cache_hits = 0;
+unsigned long g_sub_cache_misses = 0;
+unsigned long g_acl_cache_hits = 0;
+unsigned long g_acl_cache_misses = 0;
+unsigned long g_persist_save_duration = 0;
+unsigned long g_persist_save_blocked = 0;
+unsigned long g_persist_save_failures = 0;
+unsigned long g_accept_deferred = 0;
+unsigned long g_accept_latency = 0;
+unsigned long g_tls_handshakes_full = 0;
+unsigned long g_tls_handshakes_resumed = 0;
 
 void sys_tree__init(void)
 {
@@ -128,6 +139,138 @@ static void sys_tree__update_memory(char *buf)
 }
 #endif
 
+/* Pools are listed in the order they were first used, which doesn't change
+ * once the broker is running. */
+#define SYS_TREE_POOLS_MAX 16
+static void sys_tree__update_pools(char *buf)
+{
+	static unsigned long pool_used[SYS_TREE_POOLS_MAX];
+	static unsigned long pool_slabs[SYS_TREE_POOLS_MAX];
+	static int pool_count = 0;
+	struct mosquitto__pool *pool;
+	char topic[BUFLEN];
+	uint32_t len;
+	int i;
+
+	for(pool=mosquitto__pool_first(), i=0; pool && i<SYS_TREE_POOLS_MAX; pool=pool->next, i++){
+		if(i == pool_count){
+			pool_used[i] = ULONG_MAX;
+			pool_slabs[i] = ULONG_MAX;
+			pool_count++;
+		}
+		if(pool_used[i] != pool->used){
+			pool_used[i] = pool->used;
+			snprintf(topic, BUFLEN, "$SYS/broker/heap/pool/%s/used", pool->name);
+			len = (uint32_t)snprintf(buf, BUFLEN, "%lu", pool_used[i]);
+			db__messages_easy_queue(NULL, topic, SYS_TREE_QOS, len, buf, 1, 0, NULL);
+		}
+		if(pool_slabs[i] != pool->slab_count){
+			pool_slabs[i] = pool->slab_count;
+			snprintf(topic, BUFLEN, "$SYS/broker/heap/pool/%s/slabs", pool->name);
+			len = (uint32_t)snprintf(buf, BUFLEN, "%lu", pool_slabs[i]);
+			db__messages_easy_queue(NULL, topic, SYS_TREE_QOS, len, buf, 1, 0, NULL);
+		}
+	}
+}
+
+#ifdef WITH_PERSISTENCE
+static void sys_tree__update_persistence(char *buf)
+{
+	static unsigned long save_duration = ULONG_MAX;
+	static unsigned long save_blocked = ULONG_MAX;
+	static unsigned long save_failures = ULONG_MAX;
+	uint32_t len;
+
+	if(save_duration != g_persist_save_duration){
+		save_duration = g_persist_save_duration;
+		len = (uint32_t)snprintf(buf, BUFLEN, "%lu", save_duration);
+		db__messages_easy_queue(NULL, "$SYS/broker/persistence/save/duration", SYS_TREE_QOS, len, buf, 1, 0, NULL);
+	}
+	if(save_blocked != g_persist_save_blocked){
+		save_blocked = g_persist_save_blocked;
+		len = (uint32_t)snprintf(buf, BUFLEN, "%lu", save_blocked);
+		db__messages_easy_queue(NULL, "$SYS/broker/persistence/save/blocked", SYS_TREE_QOS, len, buf, 1, 0, NULL);
+	}
+	if(save_failures != g_persist_save_failures){
+		save_failures = g_persist_save_failures;
+		len = (uint32_t)snprintf(buf, BUFLEN, "%lu", save_failures);
+		db__messages_easy_queue(NULL, "$SYS/broker/persistence/save/failures", SYS_TREE_QOS, len, buf, 1, 0, NULL);
+	}
+}
+#endif
+
+static void sys_tree__update_accept(char *buf)
+{
+	static unsigned long accept_deferred = ULONG_MAX;
+	static unsigned long accept_latency = ULONG_MAX;
+#ifdef __linux__
+	static unsigned long accept_queued = ULONG_MAX;
+	static unsigned long accept_overflows = ULONG_MAX;
+	static unsigned long overflows_start = ULONG_MAX;
+	unsigned long value;
+	int i;
+#endif
+	uint32_t len;
+
+	if(accept_deferred != g_accept_deferred){
+		accept_deferred = g_accept_deferred;
+		len = (uint32_t)snprintf(buf, BUFLEN, "%lu", accept_deferred);
+		db__messages_easy_queue(NULL, "$SYS/broker/listeners/accept/deferred", SYS_TREE_QOS, len, buf, 1, 0, NULL);
+	}
+	/* The longest backlog since the last update */
+	if(accept_latency != g_accept_latency){
+		accept_latency = g_accept_latency;
+		len = (uint32_t)snprintf(buf, BUFLEN, "%lu", accept_latency);
+		db__messages_easy_queue(NULL, "$SYS/broker/listeners/accept/latency", SYS_TREE_QOS, len, buf, 1, 0, NULL);
+	}
+	g_accept_latency = 0;
+
+#ifdef __linux__
+	value = 0;
+	for(i=0; i<db.config->listener_count; i++){
+		value += net__socket_listen_queued(&db.config->listeners[i]);
+	}
+	if(accept_queued != value){
+		accept_queued = value;
+		len = (uint32_t)snprintf(buf, BUFLEN, "%lu", accept_queued);
+		db__messages_easy_queue(NULL, "$SYS/broker/listeners/accept/queued", SYS_TREE_QOS, len, buf, 1, 0, NULL);
+	}
+
+	/* Only the system wide count is available, so report the increase since
+	 * the broker started. */
+	value = net__socket_listen_overflows();
+	if(overflows_start == ULONG_MAX){
+		overflows_start = value;
+	}
+	value -= overflows_start;
+	if(accept_overflows != value){
+		accept_overflows = value;
+		len = (uint32_t)snprintf(buf, BUFLEN, "%lu", accept_overflows);
+		db__messages_easy_queue(NULL, "$SYS/broker/listeners/accept/overflows", SYS_TREE_QOS, len, buf, 1, 0, NULL);
+	}
+#endif
+}
+
+#ifdef WITH_TLS
+static void sys_tree__update_tls(char *buf)
+{
+	static unsigned long handshakes_full = ULONG_MAX;
+	static unsigned long handshakes_resumed = ULONG_MAX;
+	uint32_t len;
+
+	if(handshakes_full != g_tls_handshakes_full){
+		handshakes_full = g_tls_handshakes_full;
+		len = (uint32_t)snprintf(buf, BUFLEN, "%lu", handshakes_full);
+		db__messages_easy_queue(NULL, "$SYS/broker/tls/handshakes/full", SYS_TREE_QOS, len, buf, 1, 0, NULL);
+	}
+	if(handshakes_resumed != g_tls_handshakes_resumed){
+		handshakes_resumed = g_tls_handshakes_resumed;
+		len = (uint32_t)snprintf(buf, BUFLEN, "%lu", handshakes_resumed);
+		db__messages_easy_queue(NULL, "$SYS/broker/tls/handshakes/resumed", SYS_TREE_QOS, len, buf, 1, 0, NULL);
+	}
+}
+#endif
+
 static void calc_load(char *buf, const char *topic, bool initial, double exponent, double interval, double *current)
 {
 	double new_value;
@@ -173,6 +316,10 @@ void sys_tree__update(int interval, time_t start_time)
 	static int subscription_count = INT_MAX;
 	static int shared_subscription_count = INT_MAX;
 	static int retained_count = INT_MAX;
+	static unsigned long sub_cache_hits = ULONG_MAX;
+	static unsigned long sub_cache_misses = ULONG_MAX;
+	static unsigned long acl_cache_hits = ULONG_MAX;
+	static unsigned long acl_cache_misses = ULONG_MAX;
 
 	static double msgs_received_load1 = 0;
 	static double msgs_received_load5 = 0;
@@ -319,6 +466,16 @@ void sys_tree__update(int interval, time_t start_time)
 #ifdef REAL_WITH_MEMORY_TRACKING
 		sys_tree__update_memory(buf);
 #endif
+		sys_tree__update_pools(buf);
+		sys_tree__update_accept(buf);
+#ifdef WITH_TLS
+		sys_tree__update_tls(buf);
+#endif
+#ifdef WITH_PERSISTENCE
+		if(db.config->persistence){
+			sys_tree__update_persistence(buf);
+		}
+#endif
 
 		if(msgs_received != g_msgs_received){
 			msgs_received = g_msgs_received;
@@ -374,8 +531,39 @@ void sys_tree__update(int interval, time_t start_time)
 			db__messages_easy_queue(NULL, "$SYS/broker/publish/bytes/sent", SYS_TREE_QOS, len, buf, 1, 0, NULL);
 		}
 
+		if(db.config->subscription_cache_size > 0){
+			if(sub_cache_hits != g_sub_cache_hits){
+				sub_cache_hits = g_sub_cache_hits;
+				len = (uint32_t)snprintf(buf, BUFLEN, "%lu", sub_cache_hits);
+				db__messages_easy_queue(NULL, "$SYS/broker/subscriptions/cache/hits", SYS_TREE_QOS, len, buf, 1, 0, NULL);
+			}
+
+			if(sub_cache_misses != g_sub_cache_misses){
+				sub_cache_misses = g_sub_cache_misses;
+				len = (uint32_t)snprintf(buf, BUFLEN, "%lu", sub_cache_misses);
+				db__messages_easy_queue(NULL, "$SYS/broker/subscriptions/cache/misses", SYS_TREE_QOS, len, buf, 1, 0, NULL);
+			}
+		}
+
+		if(db.config->acl_cache_size > 0){
+			if(acl_cache_hits != g_acl_cache_hits){
+				acl_cache_hits = g_acl_cache_hits;
+				len = (uint32_t)snprintf(buf, BUFLEN, "%lu", acl_cache_hits);
+				db__messages_easy_queue(NULL, "$SYS/broker/acl/cache/hits", SYS_TREE_QOS, len, buf, 1, 0, NULL);
+			}
+
+			if(acl_cache_misses != g_acl_cache_misses){
+				acl_cache_misses = g_acl_cache_misses;
+				len = (uint32_t)snprintf(buf, BUFLEN, "%lu", acl_cache_misses);
+				db__messages_easy_queue(NULL, "$SYS/broker/acl/cache/misses", SYS_TREE_QOS, len, buf, 1, 0, NULL);
+			}
+		}
+
 		last_update = db.now_s;
 	}
+	if(interval){
+		loop__update_next_event_at(last_update + interval + 1);
+	}
 }
 
 #endif
@@ -32,6 +32,17 @@ extern unsigned long g_msgs_dropped;
 extern int g_clients_expired;
 extern unsigned int g_socket_connections;
 extern unsigned int g_connection_count;
+extern unsigned long g_sub_cache_hits;
+extern unsigned long g_sub_cache_misses;
+extern unsigned long g_acl_cache_hits;
+extern unsigned long g_acl_cache_misses;
+extern unsigned long g_persist_save_duration;
+extern unsigned long g_persist_save_blocked;
+extern unsigned long g_persist_save_failures;
+extern unsigned long g_accept_deferred;
+extern unsigned long g_accept_latency;
+extern unsigned long g_tls_handshakes_full;
+extern unsigned long g_tls_handshakes_resumed;
 
 #define G_BYTES_RECEIVED_INC(A) (g_bytes_received+=(uint64_t)(A))
 #define G_BYTES_SENT_INC(A) (g_bytes_sent+=(uint64_t)(A))
@@ -45,6 +56,17 @@ extern unsigned int g_connection_count;
 #define G_CLIENTS_EXPIRED_INC() (g_clients_expired++)
 #define G_SOCKET_CONNECTIONS_INC() (g_socket_connections++)
 #define G_CONNECTION_COUNT_INC() (g_connection_count++)
+#define G_SUB_CACHE_HITS_INC() (g_sub_cache_hits++)
+#define G_SUB_CACHE_MISSES_INC() (g_sub_cache_misses++)
+#define G_ACL_CACHE_HITS_INC() (g_acl_cache_hits++)
+#define G_ACL_CACHE_MISSES_INC() (g_acl_cache_misses++)
+#define G_PERSIST_SAVE_DURATION(A) (g_persist_save_duration=(A))
+#define G_PERSIST_SAVE_BLOCKED(A) (g_persist_save_blocked=(A))
+#define G_PERSIST_SAVE_FAILURES_INC() (g_persist_save_failures++)
+#define G_ACCEPT_DEFERRED_INC() (g_accept_deferred++)
+#define G_ACCEPT_LATENCY(A) do{ if((A) > g_accept_latency) g_accept_latency = (unsigned long)(A); }while(0)
+#define G_TLS_HANDSHAKES_FULL_INC() (g_tls_handshakes_full++)
+#define G_TLS_HANDSHAKES_RESUMED_INC() (g_tls_handshakes_resumed++)
 
 #else
 
@@ -60,6 +82,17 @@ extern unsigned int g_connection_count;
 #define G_CLIENTS_EXPIRED_INC()
 #define G_SOCKET_CONNECTIONS_INC()
 #define G_CONNECTION_COUNT_INC()
+#define G_SUB_CACHE_HITS_INC()
+#define G_SUB_CACHE_MISSES_INC()
+#define G_ACL_CACHE_HITS_INC()
+#define G_ACL_CACHE_MISSES_INC()
+#define G_PERSIST_SAVE_DURATION(A) ((void)(A))
+#define G_PERSIST_SAVE_BLOCKED(A) ((void)(A))
+#define G_PERSIST_SAVE_FAILURES_INC()
+#define G_ACCEPT_DEFERRED_INC()
+#define G_ACCEPT_LATENCY(A) ((void)(A))
+#define G_TLS_HANDSHAKES_FULL_INC()
+#define G_TLS_HANDSHAKES_RESUMED_INC()
 
 #endif
 
@@ -0,0 +1,300 @@
+/*
+Copyright (c) 2026 Contributors to the Eclipse Foundation
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License 2.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   https://www.eclipse.org/legal/epl-2.0/
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+SPDX-License-Identifier: EPL-2.0 OR BSD-3-Clause
+
+Contributors:
+   Eclipse Mosquitto contributors - initial implementation and documentation.
+*/
+
+#include "config.h"
+
+#include <time.h>
+
+#include "mosquitto_broker_internal.h"
+
+/* This is a hierarchical timing wheel, used for everything that needs to
+ * happen at a point in wall clock time: session expiry, will delay and
+ * message expiry. It works in whole seconds of db.now_real_s.
+ *
+ * There are TIMER_LEVELS levels, each with TIMER_SLOTS slots. A slot in level
+ * 0 covers one second, a slot in level 1 covers TIMER_SLOTS seconds, and so
+ * on, so the wheel covers 2^36 seconds in total, which is longer than the
+ * largest session expiry interval.
+ *
+ * A timer is added to the lowest level that can hold its expiry time, in a
+ * doubly linked list with a sentinel head so it can be removed without
+ * knowing which slot it is in. Adding and removing are both O(1).
+ *
+ * Each second the wheel moves to the next slot of level 0 and fires every
+ * timer in it. When level 0 wraps around, the timers in the next slot of
+ * level 1 are moved down to where they now belong, and so on for the higher
+ * levels. Each timer is moved at most TIMER_LEVELS-1 times.
+ *
+ * As with the lists that this replaces, a timer fires once the clock has
+ * passed its expiry second, that is when db.now_real_s > expiry.
+ */
+
+#define TIMER_LEVEL_BITS 6
+#define TIMER_SLOTS (1<<TIMER_LEVEL_BITS)
+#define TIMER_SLOT_MASK (TIMER_SLOTS-1)
+#define TIMER_LEVELS 6
+
+static struct mosquitto__timer wheel[TIMER_LEVELS][TIMER_SLOTS];
+static time_t wheel_time = 0; /* The next second to be processed */
+static unsigned long timer_count = 0;
+static bool wheel_init = false;
+
+
+static void timers__list_init(struct mosquitto__timer *head)
+{
+	head->next = head;
+	head->prev = head;
+}
+
+
+static void timers__list_append(struct mosquitto__timer *head, struct mosquitto__timer *timer)
+{
+	timer->next = head;
+	timer->prev = head->prev;
+	head->prev->next = timer;
+	head->prev = timer;
+}
+
+
+static void timers__list_unlink(struct mosquitto__timer *timer)
+{
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->next = NULL;
+	timer->prev = NULL;
+}
+
+
+void timers__init(void)
+{
+	int level, slot;
+
+	for(level=0; level<TIMER_LEVELS; level++){
+		for(slot=0; slot<TIMER_SLOTS; slot++){
+			timers__list_init(&wheel[level][slot]);
+		}
+	}
+	wheel_time = db.now_real_s;
+	timer_count = 0;
+	wheel_init = true;
+}
+
+
+static void timers__insert(struct mosquitto__timer *timer)
+{
+	time_t delta;
+	time_t expiry;
+	int level;
+
+	expiry = timer->expiry;
+	if(expiry < wheel_time){
+		/* Already due, fire it on the next tick */
+		expiry = wheel_time;
+	}
+	delta = expiry - wheel_time;
+
+	for(level=0; level<TIMER_LEVELS-1; level++){
+		if(delta < ((time_t)1 << (TIMER_LEVEL_BITS*(level+1)))){
+			break;
+		}
+	}
+	if(level == TIMER_LEVELS-1 && delta >= ((time_t)1 << (TIMER_LEVEL_BITS*TIMER_LEVELS))){
+		/* Beyond the end of the wheel. It will come back round to the top
+		 * level slot and be reinserted until it is in range. */
+		expiry = wheel_time + ((time_t)1 << (TIMER_LEVEL_BITS*TIMER_LEVELS)) - 1;
+	}
+
+	timers__list_append(&wheel[level][(expiry >> (TIMER_LEVEL_BITS*level)) & TIMER_SLOT_MASK], timer);
+}
+
+
+void timers__add(struct mosquitto__timer *timer, time_t expiry)
+{
+	if(!wheel_init){
+		timers__init();
+	}
+	if(timer->next){
+		timers__list_unlink(timer);
+	}else{
+		timer_count++;
+	}
+	timer->expiry = expiry;
+	timers__insert(timer);
+}
+
+
+void timers__remove(struct mosquitto__timer *timer)
+{
+	if(timer->next){
+		timers__list_unlink(timer);
+		timer_count--;
+	}
+}
+
+
+/* Move all of the timers in a higher level slot to where they now belong. */
+static int timers__cascade(int level, int slot)
+{
+	struct mosquitto__timer list;
+	struct mosquitto__timer *timer;
+
+	if(wheel[level][slot].next != &wheel[level][slot]){
+		/* Take the whole list, in case a timer goes back into the same slot */
+		list.next = wheel[level][slot].next;
+		list.prev = wheel[level][slot].prev;
+		list.next->prev = &list;
+		list.prev->next = &list;
+		timers__list_init(&wheel[level][slot]);
+
+		while(list.next != &list){
+			timer = list.next;
+			timers__list_unlink(timer);
+			timers__insert(timer);
+		}
+	}
+	return slot;
+}
+
+
+static void timers__tick(void)
+{
+	struct mosquitto__timer list;
+	struct mosquitto__timer *timer;
+	int slot;
+	int level;
+
+	slot = (int)(wheel_time & TIMER_SLOT_MASK);
+	if(slot == 0){
+		for(level=1; level<TIMER_LEVELS; level++){
+			if(timers__cascade(level, (int)((wheel_time >> (TIMER_LEVEL_BITS*level)) & TIMER_SLOT_MASK)) != 0){
+				break;
+			}
+		}
+	}
+
+	if(wheel[0][slot].next == &wheel[0][slot]){
+		wheel_time++;
+		return;
+	}
+
+	list.next = wheel[0][slot].next;
+	list.prev = wheel[0][slot].prev;
+	list.next->prev = &list;
+	list.prev->next = &list;
+	timers__list_init(&wheel[0][slot]);
+
+	/* Move on before firing, so timers added by the callbacks go into the
+	 * next slot rather than the one being emptied. */
+	wheel_time++;
+
+	while(list.next != &list){
+		timer = list.next;
+		timers__list_unlink(timer);
+		timer_count--;
+		timer->callback(timer);
+	}
+}
+
+
+void timers__check(void)
+{
+	int slot;
+
+	if(!wheel_init){
+		timers__init();
+	}
+
+	while(wheel_time < db.now_real_s){
+		if(timer_count == 0){
+			wheel_time = db.now_real_s;
+			break;
+		}
+		slot = (int)(wheel_time & TIMER_SLOT_MASK);
+		if(slot != 0 && wheel[0][slot].next == &wheel[0][slot]){
+			/* Skip empty level 0 slots, stopping at the next cascade. */
+			while(slot < TIMER_SLOTS && wheel_time < db.now_real_s
+					&& wheel[0][slot].next == &wheel[0][slot]){
+
+				slot++;
+				wheel_time++;
+			}
+		}else{
+			timers__tick();
+		}
+	}
+}
+
+
+/* Returns true if any timers are waiting in a level above 0. */
+static bool timers__upper_pending(void)
+{
+	int level, slot;
+
+	for(level=1; level<TIMER_LEVELS; level++){
+		for(slot=0; slot<TIMER_SLOTS; slot++){
+			if(wheel[level][slot].next != &wheel[level][slot]){
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+
+/* Tell the main loop when the wheel next needs to be checked. This is exact
+ * for timers due before the next cascade, otherwise it is the time of the
+ * next cascade, which may bring down a timer due before anything else in
+ * level 0. */
+void timers__update_next_event(void)
+{
+	struct timespec ts;
+	time_t next, cascade;
+	int64_t now_ms, next_ms;
+	int i, slot;
+
+	if(timer_count == 0){
+		return;
+	}
+
+	cascade = (wheel_time | TIMER_SLOT_MASK) + 1;
+	next = cascade;
+	for(i=0; i<TIMER_SLOTS; i++){
+		slot = (int)((wheel_time + i) & TIMER_SLOT_MASK);
+		if(wheel[0][slot].next != &wheel[0][slot]){
+			next = wheel_time + i;
+			break;
+		}
+	}
+	if(next > cascade && timers__upper_pending()){
+		next = cascade;
+	}
+
+	/* Fires once the clock has passed the expiry second */
+	next_ms = ((int64_t)next + 1)*1000;
+#ifdef WIN32
+	now_ms = (int64_t)time(NULL)*1000;
+	UNUSED(ts);
+#else
+	if(clock_gettime(CLOCK_REALTIME, &ts) == 0){
+		now_ms = (int64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+	}else{
+		now_ms = (int64_t)db.now_real_s*1000;
+	}
+#endif
+	loop__update_next_event((time_t)(next_ms - now_ms));
+}
@@ -0,0 +1,486 @@
+/*
+Copyright (c) 2026 Contributors to the Eclipse Foundation
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License 2.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   https://www.eclipse.org/legal/epl-2.0/
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+SPDX-License-Identifier: EPL-2.0 OR BSD-3-Clause
+
+Contributors:
+   Eclipse Mosquitto contributors - initial implementation and documentation.
+*/
+
+#include "config.h"
+
+#if defined(WITH_EPOLL) && defined(WITH_TLS)
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include "mosquitto_broker_internal.h"
+#include "memory_mosq.h"
+#include "packet_mosq.h"
+#include "sys_tree.h"
+#include "time_mosq.h"
+#include "tls_mosq.h"
+
+#include "utlist.h"
+
+/* TLS handshake threads
+ *
+ * With `tls_handshake_threads` set to a value greater than zero, new TLS
+ * connections are not added to the main loop straight after they have been
+ * accepted. Instead they are passed to one of the handshake threads, which
+ * carries out the TLS handshake, including verifying the client certificate
+ * and checking the CRL. Each thread waits for its own connections with its
+ * own epoll instance, so a thread can work on many handshakes at once and a
+ * slow client does not hold up anybody else.
+ *
+ * Once the handshake is complete, or has failed, the connection is put on a
+ * list for the main loop, which is woken with an eventfd. The main loop then
+ * adds the connection to the mux and carries on with it exactly as if it had
+ * carried out the handshake itself, or logs the error and closes it.
+ *
+ * Whilst a connection belongs to a handshake thread it is not in the mux,
+ * the keepalive list or db.contexts_by_sock, so nothing that walks the
+ * connected clients - such as a plugin kicking every client - can find it.
+ * It has no client id yet, so it is not in db.contexts_by_id either. The
+ * keepalive time for a new connection applies to the handshake as well, so a
+ * client that stalls is closed by the thread when that runs out.
+ *
+ * The handshake threads never touch any other broker state. The certificates
+ * and session ticket keys that they read are only changed by the main loop
+ * whilst it holds the reload lock. Listeners that use TLS-PSK always have
+ * their handshakes carried out by the main loop, because the PSK callback
+ * asks the plugins for the key.
+ */
+
+#define TLS_HANDSHAKE_MAX_EVENTS 100
+#define TLS_HANDSHAKE_MAX_ERRORS 4
+
+struct mosquitto__tls_handshake{
+	struct mosquitto__tls_handshake *next, *prev;
+	struct mosquitto *context;
+	time_t deadline;
+	uint32_t events;
+	int rc;
+	int error_count;
+	unsigned long errors[TLS_HANDSHAKE_MAX_ERRORS];
+};
+
+struct mosquitto__tls_handshake_thread{
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	struct mosquitto__tls_handshake *queue; /* Protected by mutex */
+	struct mosquitto__tls_handshake *active; /* Only used by the thread */
+	int epollfd;
+	int wakefd;
+	bool running; /* Protected by mutex */
+};
+
+static struct mosquitto__tls_handshake_thread *hs_threads = NULL;
+static int hs_thread_count = 0;
+static int hs_next_thread = 0;
+
+static pthread_rwlock_t hs_reload_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static pthread_mutex_t hs_done_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct mosquitto__tls_handshake *hs_done = NULL;
+static int hs_done_fd = -1;
+static struct {
+	int ident; /* Must match the position of ident in struct mosquitto */
+} hs_done_ident = {id_tls_handshake};
+
+
+static void tls_handshake__wake(int fd)
+{
+	uint64_t val = 1;
+
+	while(write(fd, &val, sizeof(val)) < 0 && errno == EINTR){
+	}
+}
+
+
+static void tls_handshake__drain(int fd)
+{
+	uint64_t val;
+
+	while(read(fd, &val, sizeof(val)) < 0 && errno == EINTR){
+	}
+}
+
+
+/* Pass a finished handshake back to the main loop. */
+static void tls_handshake__finish(struct mosquitto__tls_handshake_thread *thread, struct mosquitto__tls_handshake *hs, int rc)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(struct epoll_event));
+	if(hs->events){
+		epoll_ctl(thread->epollfd, EPOLL_CTL_DEL, hs->context->sock, &ev);
+	}
+	DL_DELETE(thread->active, hs);
+	hs->rc = rc;
+
+	pthread_mutex_lock(&hs_done_mutex);
+	DL_APPEND(hs_done, hs);
+	pthread_mutex_unlock(&hs_done_mutex);
+	tls_handshake__wake(hs_done_fd);
+}
+
+
+static void tls_handshake__step(struct mosquitto__tls_handshake_thread *thread, struct mosquitto__tls_handshake *hs)
+{
+	struct epoll_event ev;
+	uint32_t events;
+	unsigned long e;
+	int rc;
+
+	pthread_rwlock_rdlock(&hs_reload_lock);
+	ERR_clear_error();
+	rc = SSL_accept(hs->context->ssl);
+	if(rc == 1){
+		pthread_rwlock_unlock(&hs_reload_lock);
+		tls_handshake__finish(thread, hs, MOSQ_ERR_SUCCESS);
+		return;
+	}
+
+	rc = SSL_get_error(hs->context->ssl, rc);
+	if(rc == SSL_ERROR_WANT_READ){
+		events = EPOLLIN;
+	}else if(rc == SSL_ERROR_WANT_WRITE){
+		events = EPOLLOUT;
+	}else{
+		while((e = ERR_get_error()) != 0){
+			if(hs->error_count < TLS_HANDSHAKE_MAX_ERRORS){
+				hs->errors[hs->error_count] = e;
+				hs->error_count++;
+			}
+		}
+		pthread_rwlock_unlock(&hs_reload_lock);
+		tls_handshake__finish(thread, hs, MOSQ_ERR_TLS);
+		return;
+	}
+	pthread_rwlock_unlock(&hs_reload_lock);
+
+	if(events != hs->events){
+		memset(&ev, 0, sizeof(struct epoll_event));
+		ev.events = events;
+		ev.data.ptr = hs;
+		if(epoll_ctl(thread->epollfd, hs->events?EPOLL_CTL_MOD:EPOLL_CTL_ADD, hs->context->sock, &ev) == -1){
+			tls_handshake__finish(thread, hs, MOSQ_ERR_ERRNO);
+			return;
+		}
+		hs->events = events;
+	}
+}
+
+
+static void *tls_handshake__main(void *arg)
+{
+	struct mosquitto__tls_handshake_thread *thread = arg;
+	struct epoll_event events[TLS_HANDSHAKE_MAX_EVENTS];
+	struct mosquitto__tls_handshake *hs, *hs_tmp, *queue;
+	time_t now;
+	int event_count;
+	int i;
+
+	while(1){
+		event_count = epoll_wait(thread->epollfd, events, TLS_HANDSHAKE_MAX_EVENTS, 1000);
+
+		pthread_mutex_lock(&thread->mutex);
+		if(!thread->running){
+			pthread_mutex_unlock(&thread->mutex);
+			break;
+		}
+		pthread_mutex_unlock(&thread->mutex);
+
+		for(i=0; i<event_count; i++){
+			hs = events[i].data.ptr;
+			if(hs == NULL){
+				/* New connections from the main loop */
+				tls_handshake__drain(thread->wakefd);
+
+				pthread_mutex_lock(&thread->mutex);
+				queue = thread->queue;
+				thread->queue = NULL;
+				pthread_mutex_unlock(&thread->mutex);
+
+				DL_FOREACH_SAFE(queue, hs, hs_tmp){
+					DL_DELETE(queue, hs);
+					DL_APPEND(thread->active, hs);
+					tls_handshake__step(thread, hs);
+				}
+			}else{
+				tls_handshake__step(thread, hs);
+			}
+		}
+
+		now = mosquitto_time();
+		DL_FOREACH_SAFE(thread->active, hs, hs_tmp){
+			if(hs->deadline <= now){
+				tls_handshake__finish(thread, hs, MOSQ_ERR_KEEPALIVE);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+
+static void tls_handshake__free(struct mosquitto__tls_handshake *hs)
+{
+	hs->context->tls_handshake = NULL;
+	context__cleanup(hs->context, true);
+	mosquitto__free(hs);
+}
+
+
+int tls_handshake__init(void)
+{
+	struct epoll_event ev;
+	sigset_t sigblock, origsig;
+	struct mosquitto__tls_handshake_thread *thread;
+	int i;
+	int rc;
+
+	if(db.config->tls_handshake_threads <= 0){
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	hs_threads = mosquitto__calloc((size_t)db.config->tls_handshake_threads, sizeof(struct mosquitto__tls_handshake_thread));
+	if(!hs_threads){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return MOSQ_ERR_NOMEM;
+	}
+
+	hs_done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(hs_done_fd == -1){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error creating TLS handshake event: %s", strerror(errno));
+		tls_handshake__cleanup();
+		return MOSQ_ERR_UNKNOWN;
+	}
+	memset(&ev, 0, sizeof(struct epoll_event));
+	ev.events = EPOLLIN;
+	ev.data.ptr = &hs_done_ident;
+	if(epoll_ctl(db.epollfd, EPOLL_CTL_ADD, hs_done_fd, &ev) == -1){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error in epoll registering: %s", strerror(errno));
+		tls_handshake__cleanup();
+		return MOSQ_ERR_UNKNOWN;
+	}
+
+	/* Signals must always be delivered to the main thread. */
+	sigfillset(&sigblock);
+	pthread_sigmask(SIG_SETMASK, &sigblock, &origsig);
+	for(i=0; i<db.config->tls_handshake_threads; i++){
+		thread = &hs_threads[i];
+		pthread_mutex_init(&thread->mutex, NULL);
+		thread->running = true;
+		thread->epollfd = epoll_create1(EPOLL_CLOEXEC);
+		thread->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		memset(&ev, 0, sizeof(struct epoll_event));
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if(thread->epollfd == -1 || thread->wakefd == -1
+				|| epoll_ctl(thread->epollfd, EPOLL_CTL_ADD, thread->wakefd, &ev) == -1){
+
+			log__printf(NULL, MOSQ_LOG_ERR, "Error starting TLS handshake thread: %s", strerror(errno));
+			rc = -1;
+		}else{
+			rc = pthread_create(&thread->thread, NULL, tls_handshake__main, thread);
+			if(rc){
+				log__printf(NULL, MOSQ_LOG_ERR, "Error starting TLS handshake thread: %s", strerror(rc));
+			}
+		}
+		if(rc){
+			if(thread->epollfd != -1) close(thread->epollfd);
+			if(thread->wakefd != -1) close(thread->wakefd);
+			pthread_mutex_destroy(&thread->mutex);
+			pthread_sigmask(SIG_SETMASK, &origsig, NULL);
+			tls_handshake__cleanup();
+			return MOSQ_ERR_UNKNOWN;
+		}
+		hs_thread_count++;
+	}
+	pthread_sigmask(SIG_SETMASK, &origsig, NULL);
+
+	log__printf(NULL, MOSQ_LOG_INFO, "Started %d TLS handshake thread%s.", hs_thread_count, hs_thread_count==1?"":"s");
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+void tls_handshake__cleanup(void)
+{
+	struct mosquitto__tls_handshake_thread *thread;
+	struct mosquitto__tls_handshake *hs, *hs_tmp;
+	int i;
+
+	for(i=0; i<hs_thread_count; i++){
+		thread = &hs_threads[i];
+		pthread_mutex_lock(&thread->mutex);
+		thread->running = false;
+		pthread_mutex_unlock(&thread->mutex);
+		tls_handshake__wake(thread->wakefd);
+	}
+	for(i=0; i<hs_thread_count; i++){
+		thread = &hs_threads[i];
+		pthread_join(thread->thread, NULL);
+
+		/* Connections still in progress are closed */
+		DL_FOREACH_SAFE(thread->queue, hs, hs_tmp){
+			DL_DELETE(thread->queue, hs);
+			tls_handshake__free(hs);
+		}
+		DL_FOREACH_SAFE(thread->active, hs, hs_tmp){
+			DL_DELETE(thread->active, hs);
+			tls_handshake__free(hs);
+		}
+		close(thread->epollfd);
+		close(thread->wakefd);
+		pthread_mutex_destroy(&thread->mutex);
+	}
+	hs_thread_count = 0;
+	hs_next_thread = 0;
+	mosquitto__free(hs_threads);
+	hs_threads = NULL;
+
+	DL_FOREACH_SAFE(hs_done, hs, hs_tmp){
+		DL_DELETE(hs_done, hs);
+		tls_handshake__free(hs);
+	}
+	if(hs_done_fd != -1){
+		close(hs_done_fd);
+		hs_done_fd = -1;
+	}
+}
+
+
+/* Pass a newly accepted TLS connection to a handshake thread. Returns true if
+ * the connection now belongs to the thread, or false if the handshake should
+ * be carried out by the main loop. */
+bool tls_handshake__start(struct mosquitto *context)
+{
+	struct mosquitto__tls_handshake_thread *thread;
+	struct mosquitto__tls_handshake *hs;
+
+	if(hs_thread_count == 0 || context->ssl == NULL){
+		return false;
+	}
+#ifdef FINAL_WITH_TLS_PSK
+	if(context->listener->psk_hint){
+		return false;
+	}
+#endif
+
+	hs = mosquitto__calloc(1, sizeof(struct mosquitto__tls_handshake));
+	if(!hs){
+		return false;
+	}
+	hs->context = context;
+	hs->deadline = context->last_msg_in + context->keepalive*3/2;
+	context->tls_handshake = hs;
+	HASH_DELETE(hh_sock, db.contexts_by_sock, context);
+
+	thread = &hs_threads[hs_next_thread];
+	hs_next_thread = (hs_next_thread + 1) % hs_thread_count;
+
+	pthread_mutex_lock(&thread->mutex);
+	DL_APPEND(thread->queue, hs);
+	pthread_mutex_unlock(&thread->mutex);
+	tls_handshake__wake(thread->wakefd);
+
+	return true;
+}
+
+
+/* Take back the connections whose handshakes have finished. Called by the main
+ * loop when the handshake threads wake it. */
+void tls_handshake__handle(void)
+{
+	struct mosquitto__tls_handshake *done, *hs, *hs_tmp;
+	struct mosquitto *context;
+	char ebuf[256];
+	int rc;
+	int i;
+
+	tls_handshake__drain(hs_done_fd);
+
+	pthread_mutex_lock(&hs_done_mutex);
+	done = hs_done;
+	hs_done = NULL;
+	pthread_mutex_unlock(&hs_done_mutex);
+
+	DL_FOREACH_SAFE(done, hs, hs_tmp){
+		DL_DELETE(done, hs);
+		context = hs->context;
+
+		if(hs->rc != MOSQ_ERR_SUCCESS){
+			if(db.config->connection_messages == true){
+				for(i=0; i<hs->error_count; i++){
+					log__printf(NULL, MOSQ_LOG_NOTICE,
+							"Client connection from %s failed: %s.",
+							context->address, ERR_error_string(hs->errors[i], ebuf));
+				}
+			}
+			tls_handshake__free(hs);
+			continue;
+		}
+
+		context->tls_handshake = NULL;
+		mosquitto__free(hs);
+		HASH_ADD(hh_sock, db.contexts_by_sock, sock, sizeof(context->sock), context);
+
+		if(SSL_session_reused(context->ssl)){
+			G_TLS_HANDSHAKES_RESUMED_INC();
+		}else{
+			G_TLS_HANDSHAKES_FULL_INC();
+		}
+		mux__add_in(context);
+		keepalive__add(context);
+
+		/* Anything the client sent straight after the handshake that has
+		 * already been read from the socket won't be reported by epoll. */
+		while(SSL_DATA_PENDING(context)){
+			rc = packet__read(context);
+			if(rc){
+				do_disconnect(context, rc);
+				break;
+			}
+		}
+	}
+}
+
+
+/* Stop the handshake threads from using the listener certificates and ticket
+ * keys whilst they are reloaded. */
+void tls_handshake__reload_lock(void)
+{
+	if(hs_thread_count > 0){
+		pthread_rwlock_wrlock(&hs_reload_lock);
+	}
+}
+
+
+void tls_handshake__reload_unlock(void)
+{
+	if(hs_thread_count > 0){
+		pthread_rwlock_unlock(&hs_reload_lock);
+	}
+}
+
+#endif
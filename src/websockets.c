@@ -36,6 +36,9 @@ Contributors:
 #ifndef WIN32
 #  include <sys/socket.h>
 #endif
+#ifdef WITH_EPOLL
+#  include <sys/epoll.h>
+#endif
 
 /* Be careful if changing these, if TX is not bigger than SERV then there can
  * be very large write performance penalties.
@@ -116,6 +119,230 @@ static void easy_address(int sock, struct mosquitto *mosq)
 	}
 }
 
+/* Set whilst lws is opening the listening sockets for a listener, so the
+ * sockets it adds can be told apart from those of clients. */
+static bool ws_listeners_opening = false;
+
+#if LWS_LIBRARY_VERSION_NUMBER == 3002000
+static void lws__sul_callback(struct lws_sorted_usec_list *l)
+{
+	UNUSED(l);
+}
+
+static struct lws_sorted_usec_list sul;
+#endif
+
+#ifdef WITH_EPOLL
+/* libwebsockets tells us which of its sockets to watch, and for what, with
+ * the ADD/DEL/CHANGE_MODE_POLL_FD callbacks, and we hand their events back to
+ * it with lws_service_fd(). Listening sockets are added to the mux at
+ * startup, and connections that have become MQTT clients are in the mux as
+ * their own context. Anything else, such as a connection that is still doing
+ * its HTTP upgrade or is fetching a file from http_dir, is watched through a
+ * struct mosquitto__ws_pollfd.
+ */
+struct mosquitto__ws_pollfd{
+	int ident; /* This *must* be the first element in the struct. */
+	mosq_sock_t sock;
+	uint32_t events;
+	struct lws_context *ws_context;
+	struct mosquitto__ws_pollfd *retired_next;
+	UT_hash_handle hh;
+};
+
+static struct mosquitto__ws_pollfd *ws_pollfds = NULL;
+static struct mosquitto__ws_pollfd *ws_pollfds_retired = NULL;
+static time_t ws_last_timeout_check = 0;
+static bool ws_service_pending = false;
+
+
+static void ws_pollfd__set(struct lws_context *ws_context, mosq_sock_t sock, int lws_events, bool create)
+{
+	struct mosquitto__ws_pollfd *ws_pollfd;
+	struct epoll_event ev;
+	int op = EPOLL_CTL_MOD;
+
+	HASH_FIND(hh, ws_pollfds, &sock, sizeof(sock), ws_pollfd);
+	if(ws_pollfd == NULL){
+		if(!create) return;
+
+		ws_pollfd = mosquitto__calloc(1, sizeof(struct mosquitto__ws_pollfd));
+		if(ws_pollfd == NULL) return;
+		ws_pollfd->ident = id_ws_pollfd;
+		ws_pollfd->sock = sock;
+		ws_pollfd->ws_context = ws_context;
+		HASH_ADD(hh, ws_pollfds, sock, sizeof(ws_pollfd->sock), ws_pollfd);
+		op = EPOLL_CTL_ADD;
+	}
+
+	memset(&ev, 0, sizeof(struct epoll_event));
+	if(lws_events & LWS_POLLIN) ev.events |= EPOLLIN;
+	if(lws_events & LWS_POLLOUT) ev.events |= EPOLLOUT;
+	ev.data.ptr = ws_pollfd;
+	if(epoll_ctl(db.epollfd, op, sock, &ev) == -1){
+		log__printf(NULL, MOSQ_LOG_DEBUG, "Error in epoll registering websockets socket: %s", strerror(errno));
+	}
+	ws_pollfd->events = ev.events;
+}
+
+
+/* Stop watching a socket, returning the events it was being watched for.
+ * Events for it may still be waiting to be handled by the mux, so it is only
+ * freed by websockets__service() or websockets__cleanup(). */
+static uint32_t ws_pollfd__remove(mosq_sock_t sock)
+{
+	struct mosquitto__ws_pollfd *ws_pollfd;
+	struct epoll_event ev;
+	uint32_t events;
+
+	HASH_FIND(hh, ws_pollfds, &sock, sizeof(sock), ws_pollfd);
+	if(ws_pollfd == NULL) return 0;
+
+	memset(&ev, 0, sizeof(struct epoll_event));
+	(void)epoll_ctl(db.epollfd, EPOLL_CTL_DEL, sock, &ev);
+	HASH_DELETE(hh, ws_pollfds, ws_pollfd);
+	events = ws_pollfd->events;
+
+	ws_pollfd->sock = INVALID_SOCKET;
+	ws_pollfd->retired_next = ws_pollfds_retired;
+	ws_pollfds_retired = ws_pollfd;
+	return events;
+}
+
+
+void websockets__pollfd_handle(struct mosquitto__ws_pollfd *ws_pollfd, uint32_t events)
+{
+	struct lws_pollfd wspoll;
+
+	if(ws_pollfd->sock == INVALID_SOCKET){
+		return;
+	}
+	wspoll.fd = ws_pollfd->sock;
+	wspoll.events = (int16_t)ws_pollfd->events;
+	wspoll.revents = (int16_t)events;
+	lws_service_fd(ws_pollfd->ws_context, &wspoll);
+}
+
+
+void websockets__listener_handle(struct mosquitto__listener_sock *listensock, uint32_t events)
+{
+	struct lws_pollfd wspoll;
+
+	wspoll.fd = listensock->sock;
+	wspoll.events = POLLIN;
+	wspoll.revents = (int16_t)events;
+	lws_service_fd(listensock->listener->ws_context, &wspoll);
+}
+#endif
+
+
+/* Carry out the servicing that lws needs outside of socket events, which is
+ * checking its timeouts. */
+static void ws__service_timeouts(struct lws_context *ws_context)
+{
+#if LWS_LIBRARY_VERSION_NUMBER > 3002000
+	lws_service(ws_context, -1);
+#elif LWS_LIBRARY_VERSION_NUMBER == 3002000
+	lws_sul_schedule(ws_context, 0, &sul, lws__sul_callback, 10);
+	lws_service(ws_context, 0);
+#else
+	lws_service(ws_context, 0);
+#endif
+}
+
+
+void websockets__update_next_event(void)
+{
+	int i;
+
+	for(i=0; i<db.config->listener_count; i++){
+		if(db.config->listeners[i].ws_context){
+#ifdef WITH_EPOLL
+			if(ws_service_pending){
+				/* lws has data left over from the last service */
+				loop__update_next_event(0);
+			}else{
+				/* Socket activity wakes the mux, so only timeouts need a timer. */
+				loop__update_next_event_at(ws_last_timeout_check + 1);
+			}
+#else
+			/* Websockets clients are serviced outside of mux__handle() */
+			loop__update_next_event(100);
+#endif
+			return;
+		}
+	}
+}
+
+
+void websockets__service(void)
+{
+	struct lws_context *ws_context;
+	int i;
+#ifdef WITH_EPOLL
+	struct mosquitto__ws_pollfd *ws_pollfd;
+	bool check_timeouts = (db.now_s != ws_last_timeout_check);
+#endif
+
+#ifdef WITH_EPOLL
+	ws_service_pending = false;
+#endif
+	for(i=0; i<db.config->listener_count; i++){
+		ws_context = db.config->listeners[i].ws_context;
+		if(ws_context == NULL){
+			continue;
+		}
+#ifdef WITH_EPOLL
+		/* Data that lws has already read from a socket, for example that
+		 * was buffered by TLS, won't produce another event. It is serviced
+		 * once per loop, so a busy client can't hold up everybody else, and
+		 * if there is still more the next wait doesn't block. */
+		if(lws_service_adjust_timeout(ws_context, 1, 0) == 0){
+			lws_service_tsi(ws_context, -1, 0);
+			if(lws_service_adjust_timeout(ws_context, 1, 0) == 0){
+				ws_service_pending = true;
+			}
+		}
+		if(check_timeouts){
+			ws__service_timeouts(ws_context);
+		}
+#else
+		ws__service_timeouts(ws_context);
+#endif
+	}
+
+#ifdef WITH_EPOLL
+	if(check_timeouts){
+		ws_last_timeout_check = db.now_s;
+	}
+	while(ws_pollfds_retired){
+		ws_pollfd = ws_pollfds_retired;
+		ws_pollfds_retired = ws_pollfd->retired_next;
+		mosquitto__free(ws_pollfd);
+	}
+#endif
+}
+
+
+#ifdef WITH_EPOLL
+/* Free the sockets left once the websockets contexts have been destroyed. */
+void websockets__cleanup(void)
+{
+	struct mosquitto__ws_pollfd *ws_pollfd, *ws_pollfd_tmp;
+
+	HASH_ITER(hh, ws_pollfds, ws_pollfd, ws_pollfd_tmp){
+		HASH_DELETE(hh, ws_pollfds, ws_pollfd);
+		mosquitto__free(ws_pollfd);
+	}
+	while(ws_pollfds_retired){
+		ws_pollfd = ws_pollfds_retired;
+		ws_pollfds_retired = ws_pollfd->retired_next;
+		mosquitto__free(ws_pollfd);
+	}
+}
+#endif
+
+
 static int callback_mqtt(
 		struct lws *wsi,
 		enum lws_callback_reasons reason,
@@ -134,6 +361,9 @@ static int callback_mqtt(
 	int rc;
 	uint8_t byte;
 	char ip_addr_buff[1024];
+#ifdef WITH_EPOLL
+	uint32_t events;
+#endif
 
 	switch (reason) {
 		case LWS_CALLBACK_ESTABLISHED:
@@ -181,7 +411,16 @@ static int callback_mqtt(
 			}
 			mosq->sock = lws_get_socket_fd(wsi);
 			HASH_ADD(hh_sock, db.contexts_by_sock, sock, sizeof(mosq->sock), mosq);
+#ifdef WITH_EPOLL
+			/* The socket is watched as a client from now on */
+			events = ws_pollfd__remove(mosq->sock);
 			mux__add_in(mosq);
+			if(events & EPOLLOUT){
+				mux__add_out(mosq);
+			}
+#else
+			mux__add_in(mosq);
+#endif
 			break;
 
 		case LWS_CALLBACK_CLOSED:
@@ -211,6 +450,7 @@ static int callback_mqtt(
 			if(!mosq){
 				return -1;
 			}
+			mosq->ws_want_write = false;
 
 			rc = db__message_write_inflight_out_latest(mosq);
 			if(rc) return -1;
@@ -283,7 +523,7 @@ static int callback_mqtt(
 				}
 
 				packet__cleanup(packet);
-				mosquitto__free(packet);
+				packet__free(packet);
 
 				mosq->next_msg_out = db.now_s + mosq->keepalive;
 			}
@@ -293,7 +533,8 @@ static int callback_mqtt(
 
 				return -1;
 			}
-			if(mosq->current_out_packet){
+			if(mosq->current_out_packet && !mosq->ws_want_write){
+				mosq->ws_want_write = true;
 				lws_callback_on_writable(mosq->wsi);
 			}
 			break;
@@ -615,15 +856,18 @@ static int callback_http(
 			if(mosq){
 				if(pollargs->events & LWS_POLLOUT){
 					mux__add_out(mosq);
-					mosq->ws_want_write = true;
 				}else{
 					mux__remove_out(mosq);
 				}
-			}else{
+			}else if(ws_listeners_opening){
 				if(pollargs->events & POLLIN){
 					/* Assume this is a new listener */
 					listeners__add_websockets(lws_get_context(wsi), pollargs->fd);
 				}
+			}else{
+#ifdef WITH_EPOLL
+				ws_pollfd__set(lws_get_context(wsi), pollargs->fd, pollargs->events, true);
+#endif
 			}
 			break;
 
@@ -631,6 +875,10 @@ static int callback_http(
 			HASH_FIND(hh_sock, db.contexts_by_sock, &pollargs->fd, sizeof(pollargs->fd), mosq);
 			if(mosq){
 				mux__delete(mosq);
+			}else{
+#ifdef WITH_EPOLL
+				(void)ws_pollfd__remove(pollargs->fd);
+#endif
 			}
 			break;
 
@@ -641,10 +889,13 @@ static int callback_http(
 					return 1;
 				}else if(pollargs->events & LWS_POLLOUT){
 					mux__add_out(mosq);
-					mosq->ws_want_write = true;
 				}else{
 					mux__remove_out(mosq);
 				}
+			}else{
+#ifdef WITH_EPOLL
+				ws_pollfd__set(lws_get_context(wsi), pollargs->fd, pollargs->events, false);
+#endif
 			}
 			break;
 
@@ -755,7 +1006,9 @@ void mosq_websockets_init(struct mosquitto__listener *listener, const struct mos
 
 	log__printf(NULL, MOSQ_LOG_INFO, "Opening websockets listen socket on port %d.", listener->port);
 	listener->ws_in_init = true;
+	ws_listeners_opening = true;
 	listener->ws_context = lws_create_context(&info);
+	ws_listeners_opening = false;
 	listener->ws_in_init = false;
 }
 
@@ -0,0 +1,57 @@
+#!/usr/bin/env python3
+
+# Test that a client connecting after the broker has been idle for a while is
+# not disconnected straight away for exceeding its keepalive, and that a
+# client that really does exceed its keepalive is still disconnected.
+
+from mosq_test_helper import *
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("listener %d\n" % (port))
+        f.write("allow_anonymous true\n")
+        f.write("max_keepalive 60\n")
+
+port = mosq_test.get_port()
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+write_config(conf_file, port)
+
+rc = 1
+
+connect_packet = mosq_test.gen_connect("keepalive-idle", keepalive=60)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+connect_short_packet = mosq_test.gen_connect("keepalive-short", keepalive=1)
+
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+try:
+    # Let the broker go idle for long enough that the keepalive check hasn't
+    # been run for some seconds
+    time.sleep(3)
+
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet, port=port)
+    mosq_test.do_ping(sock)
+
+    short_sock = mosq_test.do_client_connect(connect_short_packet, connack_packet, timeout=5, port=port)
+    # Keepalive of 1 second, so expect disconnection after 1.5 seconds
+    if short_sock.recv(10) != b"":
+        raise mosq_test.TestError
+    short_sock.close()
+
+    mosq_test.do_ping(sock)
+    sock.close()
+    rc = 0
+except mosq_test.TestError:
+    pass
+except socket.timeout:
+    print("keepalive not enforced")
+finally:
+    os.remove(conf_file)
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    if rc:
+        print(stde.decode('utf-8'))
+
+exit(rc)
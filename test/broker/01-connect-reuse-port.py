@@ -0,0 +1,63 @@
+#!/usr/bin/env python3
+
+# Test whether a listener with several SO_REUSEPORT sockets and a small accept
+# batch size accepts every waiting connection, and reports on its listen queues.
+
+from mosq_test_helper import *
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("listener %d\n" % (port))
+        f.write("allow_anonymous true\n")
+        f.write("reuse_port_sockets 4\n")
+        f.write("accept_batch_size 1\n")
+        f.write("sys_interval 3600\n")
+
+def do_test():
+    rc = 1
+    count = 50
+
+    port = mosq_test.get_port()
+    conf_file = os.path.basename(__file__).replace('.py', '.conf')
+    write_config(conf_file, port)
+
+    subscribe_packet = mosq_test.gen_subscribe(1, "$SYS/broker/listeners/accept/queued", 0)
+    suback_packet = mosq_test.gen_suback(1, 0)
+    publish_packet = mosq_test.gen_publish("$SYS/broker/listeners/accept/queued", qos=0, retain=True, payload="0")
+
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+    socks = []
+    try:
+        # Open all of the connections before any of them send CONNECT, so
+        # they are waiting in the listen queues together.
+        for i in range(0, count):
+            socks.append(socket.create_connection(("localhost", port)))
+
+        for i in range(0, count):
+            socks[i].settimeout(10)
+            socks[i].send(mosq_test.gen_connect("reuse-port-%d" % (i)))
+        for i in range(0, count):
+            mosq_test.expect_packet(socks[i], "connack", mosq_test.gen_connack(rc=0))
+
+        mosq_test.do_send_receive(socks[0], subscribe_packet, suback_packet, "suback")
+        mosq_test.expect_packet(socks[0], "publish", publish_packet)
+
+        for i in range(0, count):
+            mosq_test.do_ping(socks[i])
+            socks[i].close()
+
+        rc = 0
+    except mosq_test.TestError:
+        pass
+    finally:
+        os.remove(conf_file)
+        broker.terminate()
+        broker.wait()
+        (stdo, stde) = broker.communicate()
+        if rc:
+            print(stde.decode('utf-8'))
+            exit(rc)
+
+do_test()
+exit(0)
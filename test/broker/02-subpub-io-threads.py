@@ -0,0 +1,126 @@
+#!/usr/bin/env python3
+
+# Test QoS 0, 1 and 2 delivery, and disconnect handling, with the network
+# reads spread across io_threads. Enough clients are connected that they are
+# shared between the threads, and each one sends to the next so messages have
+# to cross between threads.
+
+from mosq_test_helper import *
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("listener %d\n" % (port))
+        f.write("allow_anonymous true\n")
+        f.write("io_threads 2\n")
+
+def do_test(proto_ver):
+    port = mosq_test.get_port()
+    conf_file = os.path.basename(__file__).replace('.py', '.conf')
+    write_config(conf_file, port)
+
+    rc = 1
+    client_count = 6
+    keepalive = 60
+
+    connack_packet = mosq_test.gen_connack(rc=0, proto_ver=proto_ver)
+    disconnect_packet = mosq_test.gen_disconnect(proto_ver=proto_ver)
+
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+    try:
+        socks = []
+        for i in range(client_count):
+            connect_packet = mosq_test.gen_connect("io-threads-%d" % (i), keepalive=keepalive, proto_ver=proto_ver)
+            sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=20, port=port)
+            subscribe_packet = mosq_test.gen_subscribe(1, "io-threads/%d" % (i), 2, proto_ver=proto_ver)
+            suback_packet = mosq_test.gen_suback(1, 2, proto_ver=proto_ver)
+            mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback %d" % (i))
+            socks.append(sock)
+
+        for qos in range(3):
+            # Every client publishes to the next one at once, some with
+            # payloads that don't fit in a single read
+            for i in range(client_count):
+                topic = "io-threads/%d" % ((i+1) % client_count)
+                payload = "%d-%d-" % (qos, i) + ("x"*4000 if i % 3 == 0 else "")
+                publish_packet = mosq_test.gen_publish(topic, qos=qos, mid=10+i, payload=payload, proto_ver=proto_ver)
+                socks[i].send(publish_packet)
+
+            if qos == 2:
+                # Messages are only sent on once they are released
+                for i in range(client_count):
+                    mosq_test.expect_packet(socks[i], "pubrec %d" % (i), mosq_test.gen_pubrec(10+i, proto_ver=proto_ver))
+                for i in range(client_count):
+                    socks[i].send(mosq_test.gen_pubrel(10+i, proto_ver=proto_ver))
+
+            # Each client gets the ack for its own message and the message
+            # from the previous client, in either order
+            for i in range(client_count):
+                src = (i-1) % client_count
+                topic = "io-threads/%d" % (i)
+                payload = "%d-%d-" % (qos, src) + ("x"*4000 if src % 3 == 0 else "")
+                # Outgoing mids start at 1 and are only used for QoS > 0
+                publish_packet = mosq_test.gen_publish(topic, qos=qos, mid=qos, payload=payload, proto_ver=proto_ver)
+
+                if qos == 0:
+                    mosq_test.expect_packet(socks[i], "publish %d" % (i), publish_packet)
+                elif qos == 1:
+                    puback_packet = mosq_test.gen_puback(10+i, proto_ver=proto_ver)
+                    mosq_test.receive_unordered(socks[i], puback_packet, publish_packet, "puback/publish %d" % (i))
+                    socks[i].send(mosq_test.gen_puback(qos, proto_ver=proto_ver))
+                else:
+                    pubcomp_packet = mosq_test.gen_pubcomp(10+i, proto_ver=proto_ver)
+                    mosq_test.receive_unordered(socks[i], pubcomp_packet, publish_packet, "pubcomp/publish %d" % (i))
+                    mosq_test.do_send_receive(socks[i], mosq_test.gen_pubrec(qos, proto_ver=proto_ver),
+                            mosq_test.gen_pubrel(qos, proto_ver=proto_ver), "pubrel %d" % (i))
+                    socks[i].send(mosq_test.gen_pubcomp(qos, proto_ver=proto_ver))
+
+        for sock in socks:
+            mosq_test.do_ping(sock)
+
+        # A client that drops its connection has its will sent
+        will_connect_packet = mosq_test.gen_connect("io-threads-will", keepalive=keepalive, will_topic="io-threads/0",
+                will_payload=b"will", proto_ver=proto_ver)
+        will_sock = mosq_test.do_client_connect(will_connect_packet, connack_packet, timeout=20, port=port)
+        will_sock.close()
+        mosq_test.expect_packet(socks[0], "will", mosq_test.gen_publish("io-threads/0", qos=0, payload="will", proto_ver=proto_ver))
+
+        # A client that doesn't start with CONNECT is disconnected
+        bad_sock = socket.create_connection(("localhost", port))
+        bad_sock.settimeout(10)
+        bad_sock.send(mosq_test.gen_publish("io-threads/0", qos=0, payload="bad", proto_ver=proto_ver))
+        if bad_sock.recv(10) != b"":
+            raise mosq_test.TestError
+        bad_sock.close()
+
+        # Clients that send DISCONNECT are closed by the broker
+        for sock in socks[1:]:
+            sock.send(disconnect_packet)
+            if sock.recv(10) != b"":
+                raise mosq_test.TestError
+            sock.close()
+
+        # Still able to connect, and the remaining client is unaffected
+        connect_packet = mosq_test.gen_connect("io-threads-1", keepalive=keepalive, proto_ver=proto_ver)
+        sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=20, port=port)
+        mosq_test.do_ping(sock)
+        sock.close()
+        mosq_test.do_ping(socks[0])
+        socks[0].close()
+
+        rc = 0
+    except mosq_test.TestError:
+        pass
+    finally:
+        os.remove(conf_file)
+        broker.terminate()
+        broker.wait()
+        (stdo, stde) = broker.communicate()
+        if rc:
+            print(stde.decode('utf-8'))
+            print("proto_ver=%d" % (proto_ver))
+            exit(rc)
+
+do_test(proto_ver=4)
+do_test(proto_ver=5)
+exit(0)
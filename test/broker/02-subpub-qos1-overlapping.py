@@ -0,0 +1,68 @@
+#!/usr/bin/env python3
+
+# Test whether MQTT v3.1.1 clients with overlapping subscriptions receive only
+# a single copy of a message. Enough clients are used that the ids used to
+# track which clients have received the message span more than one word.
+
+from mosq_test_helper import *
+
+def do_test():
+    rc = 1
+    keepalive = 60
+    client_count = 70
+    sockets = []
+
+    connack_packet = mosq_test.gen_connack(rc=0)
+
+    mid = 1
+    subscribe1_packet = mosq_test.gen_subscribe(mid, "subpub/#", 1)
+    suback1_packet = mosq_test.gen_suback(mid, 1)
+    mid = 2
+    subscribe2_packet = mosq_test.gen_subscribe(mid, "subpub/+/overlap", 1)
+    suback2_packet = mosq_test.gen_suback(mid, 1)
+
+    mid = 300
+    publish_packet = mosq_test.gen_publish("subpub/qos1/overlap", qos=1, mid=mid, payload="message")
+    puback_packet = mosq_test.gen_puback(mid)
+
+    mid = 1
+    publish_packet2 = mosq_test.gen_publish("subpub/qos1/overlap", qos=1, mid=mid, payload="message")
+
+    port = mosq_test.get_port()
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), port=port)
+
+    try:
+        for i in range(client_count):
+            connect_packet = mosq_test.gen_connect("subpub-overlap-%d" % (i), keepalive=keepalive)
+            sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=20, port=port)
+            mosq_test.do_send_receive(sock, subscribe1_packet, suback1_packet, "suback1")
+            mosq_test.do_send_receive(sock, subscribe2_packet, suback2_packet, "suback2")
+            sockets.append(sock)
+
+        connect_packet = mosq_test.gen_connect("subpub-overlap-pub", keepalive=keepalive)
+        pub_sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=20, port=port)
+        mosq_test.do_send_receive(pub_sock, publish_packet, puback_packet, "puback")
+
+        for sock in sockets:
+            mosq_test.expect_packet(sock, "publish", publish_packet2)
+            # A second copy of the message would arrive before the PINGRESP
+            mosq_test.do_ping(sock)
+
+        rc = 0
+
+        pub_sock.close()
+        for sock in sockets:
+            sock.close()
+    except mosq_test.TestError:
+        pass
+    finally:
+        broker.terminate()
+        broker.wait()
+        (stdo, stde) = broker.communicate()
+        if rc:
+            print(stde.decode('utf-8'))
+            exit(rc)
+
+
+do_test()
+exit(0)
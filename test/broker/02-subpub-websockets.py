@@ -0,0 +1,110 @@
+#!/usr/bin/env python3
+
+# Test connecting, publishing, receiving and disconnecting over websockets,
+# with a plain MQTT client on the other end of each message. A payload larger
+# than a single websockets write is included so the broker has to wait for
+# the socket to become writable part way through.
+
+from mosq_test_helper import *
+
+def write_config(filename, port1, port2):
+    with open(filename, 'w') as f:
+        f.write("listener %d\n" % (port1))
+        f.write("allow_anonymous true\n")
+        f.write("\n")
+        f.write("listener %d\n" % (port2))
+        f.write("protocol websockets\n")
+        f.write("allow_anonymous true\n")
+
+(port1, port2) = mosq_test.get_port(2)
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+write_config(conf_file, port1, port2)
+
+rc = 1
+keepalive = 60
+
+tcp_connect_packet = mosq_test.gen_connect("websockets-tcp", keepalive=keepalive)
+ws_connect_packet = mosq_test.gen_connect("websockets-ws", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+mid = 1
+tcp_subscribe_packet = mosq_test.gen_subscribe(mid, "websockets/in", 1)
+ws_subscribe_packet = mosq_test.gen_subscribe(mid, "websockets/out", 1)
+suback_packet = mosq_test.gen_suback(mid, 1)
+
+mid = 2
+ws_publish_packet = mosq_test.gen_publish("websockets/in", qos=1, mid=mid, payload="from websockets")
+ws_puback_packet = mosq_test.gen_puback(mid)
+tcp_publish_packet_recv = mosq_test.gen_publish("websockets/in", qos=1, mid=1, payload="from websockets")
+tcp_puback_packet_recv = mosq_test.gen_puback(1)
+
+mid = 3
+tcp_publish_packet = mosq_test.gen_publish("websockets/out", qos=1, mid=mid, payload="from tcp")
+tcp_puback_packet = mosq_test.gen_puback(mid)
+ws_publish_packet_recv = mosq_test.gen_publish("websockets/out", qos=1, mid=1, payload="from tcp")
+ws_puback_packet_recv = mosq_test.gen_puback(1)
+
+large_payload = "x"*200000
+tcp_publish_large_packet = mosq_test.gen_publish("websockets/out", qos=0, payload=large_payload)
+
+disconnect_packet = mosq_test.gen_disconnect()
+
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port1, expect_fail=True)
+if broker.poll() is not None:
+    (stdo, stde) = broker.communicate()
+    os.remove(conf_file)
+    if b"Websockets support not available" in stde:
+        print("Skipping, broker built without websockets support")
+        exit(0)
+    print(stde.decode('utf-8'))
+    exit(1)
+
+try:
+    tcp_sock = mosq_test.do_client_connect(tcp_connect_packet, connack_packet, timeout=20, port=port1)
+    mosq_test.do_send_receive(tcp_sock, tcp_subscribe_packet, suback_packet, "tcp suback")
+
+    ws_sock = mosq_test.do_client_connect_ws(ws_connect_packet, connack_packet, timeout=20, port=port2)
+    mosq_test.do_send_receive(ws_sock, ws_subscribe_packet, suback_packet, "ws suback")
+
+    # Websockets to TCP
+    mosq_test.do_send_receive(ws_sock, ws_publish_packet, ws_puback_packet, "ws puback")
+    mosq_test.expect_packet(tcp_sock, "tcp publish", tcp_publish_packet_recv)
+    tcp_sock.send(tcp_puback_packet_recv)
+
+    # TCP to websockets
+    mosq_test.do_send_receive(tcp_sock, tcp_publish_packet, tcp_puback_packet, "tcp puback")
+    mosq_test.expect_packet(ws_sock, "ws publish", ws_publish_packet_recv)
+    ws_sock.send(ws_puback_packet_recv)
+
+    # Large payload, then check the websockets client is still in step
+    tcp_sock.send(tcp_publish_large_packet)
+    mosq_test.expect_packet(ws_sock, "ws large publish", tcp_publish_large_packet)
+    mosq_test.do_ping(ws_sock)
+
+    # The broker closes the connection after a DISCONNECT
+    ws_sock.send(disconnect_packet)
+    if ws_sock.recv(10) != b"":
+        raise mosq_test.TestError
+    ws_sock.close()
+
+    # Connecting again works, and the TCP client is unaffected
+    ws_sock = mosq_test.do_client_connect_ws(ws_connect_packet, connack_packet, timeout=20, port=port2)
+    mosq_test.do_ping(ws_sock)
+    ws_sock.send(disconnect_packet)
+    ws_sock.close()
+
+    mosq_test.do_ping(tcp_sock)
+    tcp_sock.close()
+
+    rc = 0
+except mosq_test.TestError:
+    pass
+finally:
+    os.remove(conf_file)
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    if rc:
+        print(stde.decode('utf-8'))
+
+exit(rc)
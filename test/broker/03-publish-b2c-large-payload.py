@@ -0,0 +1,64 @@
+#!/usr/bin/env python3
+
+# Test whether a PUBLISH with a payload large enough to be sent directly from
+# the message store is delivered intact to several subscribers at different
+# QoS.
+
+from mosq_test_helper import *
+
+def do_test(proto_ver):
+    rc = 1
+    keepalive = 60
+    payload = "".join(chr(ord('a') + (i % 26)) for i in range(4000))
+
+    sub_sockets = []
+    sub_publish_packets = []
+
+    pub_connect_packet = mosq_test.gen_connect("pub-large-test", keepalive=keepalive, proto_ver=proto_ver)
+    connack_packet = mosq_test.gen_connack(rc=0, proto_ver=proto_ver)
+
+    mid = 19
+    publish_packet = mosq_test.gen_publish("pub/large/test", qos=1, mid=mid, payload=payload, proto_ver=proto_ver)
+    puback_packet = mosq_test.gen_puback(mid, proto_ver=proto_ver)
+
+    port = mosq_test.get_port()
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), port=port)
+
+    try:
+        for qos in range(3):
+            connect_packet = mosq_test.gen_connect("sub-large-test-%d" % (qos), keepalive=keepalive, proto_ver=proto_ver)
+            subscribe_packet = mosq_test.gen_subscribe(1, "pub/large/test", qos, proto_ver=proto_ver)
+            suback_packet = mosq_test.gen_suback(1, qos, proto_ver=proto_ver)
+
+            sock = mosq_test.do_client_connect(connect_packet, connack_packet, port=port)
+            mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback")
+            sub_sockets.append(sock)
+            # The message is published at QoS 1, so is never delivered at QoS 2
+            sub_publish_packets.append(mosq_test.gen_publish("pub/large/test", qos=min(qos, 1), mid=1, payload=payload, proto_ver=proto_ver))
+
+        pub_sock = mosq_test.do_client_connect(pub_connect_packet, connack_packet, port=port)
+        mosq_test.do_send_receive(pub_sock, publish_packet, puback_packet, "puback")
+
+        for i in range(3):
+            mosq_test.expect_packet(sub_sockets[i], "publish %d" % (i), sub_publish_packets[i])
+
+        rc = 0
+
+        pub_sock.close()
+        for sock in sub_sockets:
+            sock.close()
+    except mosq_test.TestError:
+        pass
+    finally:
+        broker.terminate()
+        broker.wait()
+        (stdo, stde) = broker.communicate()
+        if rc:
+            print(stde.decode('utf-8'))
+            print("proto_ver=%d" % (proto_ver))
+            exit(rc)
+
+
+do_test(proto_ver=4)
+do_test(proto_ver=5)
+exit(0)
@@ -0,0 +1,86 @@
+#!/usr/bin/env python3
+
+# Test whether a long queue of outgoing messages of mixed sizes, built up while
+# a subscriber isn't reading, is delivered intact. The subscriber has a small
+# receive buffer so the broker's writes stop part way through packets, and
+# some payloads are large enough to be sent directly from the message store.
+
+from mosq_test_helper import *
+
+def recv_all(sock, length):
+    data = b""
+    while len(data) < length:
+        d = sock.recv(length-len(data))
+        if len(d) == 0:
+            break
+        data += d
+    return data
+
+def do_test(proto_ver):
+    rc = 1
+    count = 300
+    sizes = [0, 1, 10, 200, 4000, 20000, 3, 70000]
+
+    pub_connect_packet = mosq_test.gen_connect("pub-queued-writes", proto_ver=proto_ver)
+    connack_packet = mosq_test.gen_connack(rc=0, proto_ver=proto_ver)
+
+    sub_sockets = []
+    publish_packets = b""
+    expected = b""
+    for i in range(0, count):
+        payload = "%d-" % (i) + "x"*sizes[i % len(sizes)]
+        packet = mosq_test.gen_publish("queued/writes", qos=0, payload=payload, proto_ver=proto_ver)
+        publish_packets += packet
+        expected += packet
+
+    port = mosq_test.get_port()
+    # Logging is off, there would be too much for the pipe to hold
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), port=port, nolog=True)
+
+    try:
+        for i in range(0, 2):
+            connect_packet = mosq_test.gen_connect("sub-queued-writes-%d" % (i), proto_ver=proto_ver)
+            subscribe_packet = mosq_test.gen_subscribe(1, "queued/writes", 0, proto_ver=proto_ver)
+            suback_packet = mosq_test.gen_suback(1, 0, proto_ver=proto_ver)
+
+            sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+            sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+            sock.settimeout(20)
+            sock.connect(("localhost", port))
+            mosq_test.do_send_receive(sock, connect_packet, connack_packet, "connack")
+            mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback")
+            sub_sockets.append(sock)
+
+        pub_sock = mosq_test.do_client_connect(pub_connect_packet, connack_packet, port=port)
+        pub_sock.sendall(publish_packets)
+        mosq_test.do_ping(pub_sock)
+
+        # Everything has been queued before the subscribers start reading
+        for i in range(0, 2):
+            received = recv_all(sub_sockets[i], len(expected))
+            if received != expected:
+                for j in range(0, min(len(received), len(expected))):
+                    if received[j] != expected[j]:
+                        break
+                print("Subscriber %d: received %d of %d bytes, first difference at %d" % (i, len(received), len(expected), j))
+                raise mosq_test.TestError
+            mosq_test.do_ping(sub_sockets[i])
+
+        rc = 0
+
+        pub_sock.close()
+        for sock in sub_sockets:
+            sock.close()
+    except mosq_test.TestError:
+        pass
+    finally:
+        broker.terminate()
+        broker.wait()
+        if rc:
+            print("proto_ver=%d" % (proto_ver))
+            exit(rc)
+
+
+do_test(proto_ver=4)
+do_test(proto_ver=5)
+exit(0)
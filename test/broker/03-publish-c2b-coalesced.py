@@ -0,0 +1,97 @@
+#!/usr/bin/env python3
+
+# Test whether the broker handles packets correctly however they are split
+# across reads: many packets in a single send, packets split at every possible
+# point, and a payload larger than the broker read buffer.
+
+from mosq_test_helper import *
+
+def do_test(proto_ver):
+    rc = 1
+    keepalive = 60
+    sub_connect_packet = mosq_test.gen_connect("coalesced-sub", keepalive=keepalive, proto_ver=proto_ver)
+    pub_connect_packet = mosq_test.gen_connect("coalesced-pub", keepalive=keepalive, proto_ver=proto_ver)
+    connack_packet = mosq_test.gen_connack(rc=0, proto_ver=proto_ver)
+
+    subscribe_packet = mosq_test.gen_subscribe(1, "coalesced/#", 1, proto_ver=proto_ver)
+    suback_packet = mosq_test.gen_suback(1, 1, proto_ver=proto_ver)
+
+    pingreq_packet = mosq_test.gen_pingreq()
+    pingresp_packet = mosq_test.gen_pingresp()
+
+    qos0_packets = []
+    for i in range(100):
+        qos0_packets.append(mosq_test.gen_publish("coalesced/qos0", qos=0, payload="%d" % (i), proto_ver=proto_ver))
+
+    qos1_packets = []
+    puback_packets = []
+    for i in range(10):
+        qos1_packets.append(mosq_test.gen_publish("coalesced/qos1", qos=1, mid=10+i, payload="%d" % (i), proto_ver=proto_ver))
+        puback_packets.append(mosq_test.gen_puback(10+i, proto_ver=proto_ver))
+
+    dribble_packet = mosq_test.gen_publish("coalesced/dribble", qos=0, payload="dribble", proto_ver=proto_ver)
+    large_packet = mosq_test.gen_publish("coalesced/large", qos=0, payload="x"*100000, proto_ver=proto_ver)
+
+    port = mosq_test.get_port()
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), port=port)
+
+    try:
+        # CONNECT and SUBSCRIBE together
+        sock = mosq_test.client_connect_only(port=port)
+        sock.send(sub_connect_packet + subscribe_packet)
+        mosq_test.expect_packet(sock, "connack", connack_packet)
+        mosq_test.expect_packet(sock, "suback", suback_packet)
+
+        # Everything from the publisher in one go
+        pub_sock = mosq_test.client_connect_only(port=port)
+        pub_sock.send(pub_connect_packet + b"".join(qos0_packets) + b"".join(qos1_packets) + pingreq_packet)
+        mosq_test.expect_packet(pub_sock, "connack", connack_packet)
+        for i in range(10):
+            mosq_test.expect_packet(pub_sock, "puback%d" % (i), puback_packets[i])
+        mosq_test.expect_packet(pub_sock, "pingresp", pingresp_packet)
+
+        for i in range(100):
+            mosq_test.expect_packet(sock, "qos0 publish%d" % (i), qos0_packets[i])
+        for i in range(10):
+            # The subscriber receives these at QoS 1 with its own message ids
+            publish_packet = mosq_test.gen_publish("coalesced/qos1", qos=1, mid=1+i, payload="%d" % (i), proto_ver=proto_ver)
+            mosq_test.expect_packet(sock, "qos1 publish%d" % (i), publish_packet)
+            sock.send(mosq_test.gen_puback(1+i, proto_ver=proto_ver))
+
+        # One byte at a time
+        for i in range(len(dribble_packet)):
+            pub_sock.send(dribble_packet[i:i+1])
+            time.sleep(0.01)
+        mosq_test.expect_packet(sock, "dribble", dribble_packet)
+
+        # A large packet in uneven pieces, with a PINGREQ straight after it
+        data = large_packet + pingreq_packet
+        pos = 0
+        for n in [1, 2, 5000, 10, 70000]:
+            pub_sock.send(data[pos:pos+n])
+            pos += n
+            time.sleep(0.05)
+        pub_sock.send(data[pos:])
+        mosq_test.expect_packet(pub_sock, "pingresp", pingresp_packet)
+        mosq_test.expect_packet(sock, "large", large_packet)
+
+        mosq_test.do_ping(sock)
+        rc = 0
+
+        pub_sock.close()
+        sock.close()
+    except mosq_test.TestError:
+        pass
+    finally:
+        broker.terminate()
+        broker.wait()
+        (stdo, stde) = broker.communicate()
+        if rc:
+            print(stde.decode('utf-8'))
+            print("proto_ver=%d" % (proto_ver))
+            exit(rc)
+
+
+do_test(proto_ver=4)
+do_test(proto_ver=5)
+exit(0)
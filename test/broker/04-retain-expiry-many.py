@@ -0,0 +1,98 @@
+#!/usr/bin/env python3
+
+# Test whether many retained messages with a message expiry interval are
+# removed once they expire, without removing retained messages that have no
+# expiry, that have been replaced by a message with no or a later expiry, or
+# disturbing anything for retained messages that have been cleared.
+# MQTT v5
+
+from mosq_test_helper import *
+
+def read_publish_topic(sock):
+    cmd = sock.recv(1)
+    if len(cmd) == 0:
+        raise mosq_test.TestError
+    rl, t = mosq_test.read_varint(sock, 0)
+    data = b""
+    while len(data) < rl:
+        d = sock.recv(rl-len(data))
+        if len(d) == 0:
+            raise mosq_test.TestError
+        data += d
+    if cmd[0] & 0xF0 != 0x30:
+        print("Expected PUBLISH, got %s" % (mosq_test.to_string(cmd + mosq_test.pack_remaining_length(rl) + data)))
+        raise mosq_test.TestError
+    tlen, = struct.unpack("!H", data[0:2])
+    return data[2:2+tlen].decode('utf-8')
+
+def do_test():
+    rc = 1
+    count = 100
+
+    connect_packet = mosq_test.gen_connect("retain-expiry-many", proto_ver=5)
+    connack_packet = mosq_test.gen_connack(rc=0, proto_ver=5)
+
+    subscribe_packet = mosq_test.gen_subscribe(1, "fleet/#", 0, proto_ver=5)
+    suback_packet = mosq_test.gen_suback(1, 0, proto_ver=5)
+
+    expiry_short = mqtt5_props.gen_uint32_prop(mqtt5_props.PROP_MESSAGE_EXPIRY_INTERVAL, 1)
+    expiry_long = mqtt5_props.gen_uint32_prop(mqtt5_props.PROP_MESSAGE_EXPIRY_INTERVAL, 60)
+
+    publish_packets = b""
+    expected = set()
+    for i in range(0, count):
+        for kind in ["expire", "keep", "replace", "extend", "clear"]:
+            topic = "fleet/%s/%d" % (kind, i)
+            if kind == "keep":
+                props = b""
+            else:
+                props = expiry_short
+            publish_packets += mosq_test.gen_publish(topic, qos=0, payload="first", retain=True, proto_ver=5, properties=props)
+    for i in range(0, count):
+        publish_packets += mosq_test.gen_publish("fleet/replace/%d" % (i), qos=0, payload="second", retain=True, proto_ver=5)
+        publish_packets += mosq_test.gen_publish("fleet/extend/%d" % (i), qos=0, payload="second", retain=True, proto_ver=5, properties=expiry_long)
+        publish_packets += mosq_test.gen_publish("fleet/clear/%d" % (i), qos=0, payload="", retain=True, proto_ver=5)
+        expected.add("fleet/keep/%d" % (i))
+        expected.add("fleet/replace/%d" % (i))
+        expected.add("fleet/extend/%d" % (i))
+
+    port = mosq_test.get_port()
+    # Logging is off, there would be too much for the pipe to hold
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), port=port, nolog=True)
+
+    try:
+        sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=20, port=port)
+        sock.sendall(publish_packets)
+        mosq_test.do_ping(sock)
+        sock.close()
+
+        # Long enough for the short expiry to have passed
+        time.sleep(3)
+
+        sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=20, port=port)
+        mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback")
+
+        received = set()
+        for i in range(0, len(expected)):
+            topic = read_publish_topic(sock)
+            if topic not in expected or topic in received:
+                print("Unexpected retained message on %s" % (topic))
+                raise mosq_test.TestError
+            received.add(topic)
+
+        # Nothing else arrives
+        time.sleep(0.5)
+        mosq_test.do_ping(sock)
+        sock.close()
+
+        rc = 0
+    except mosq_test.TestError:
+        pass
+    finally:
+        broker.terminate()
+        broker.wait()
+        if rc:
+            exit(rc)
+
+do_test()
+exit(0)
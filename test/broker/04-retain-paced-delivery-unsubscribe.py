@@ -0,0 +1,120 @@
+#!/usr/bin/env python3
+
+# Test whether unsubscribing part way through the delivery of retained messages
+# to a wildcard subscription that matches more of them than
+# retain_delivery_batch_size stops the rest from being delivered. Messages that
+# were already queued for the client may still arrive, but no more than that.
+
+from mosq_test_helper import *
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("listener %d\n" % (port))
+        f.write("allow_anonymous true\n")
+        f.write("max_inflight_messages 5\n")
+        f.write("max_queued_messages 10\n")
+        f.write("retain_delivery_batch_size 50\n")
+
+def read_packet(sock):
+    cmd = sock.recv(1)
+    if len(cmd) == 0:
+        raise mosq_test.TestError
+    rl, t = mosq_test.read_varint(sock, 0)
+    data = b""
+    while len(data) < rl:
+        d = sock.recv(rl-len(data))
+        if len(d) == 0:
+            raise mosq_test.TestError
+        data += d
+    return cmd + mosq_test.pack_remaining_length(rl) + data
+
+def do_test():
+    rc = 1
+    count = 2000
+    unsubscribe_at = 100
+    # At most a batch plus the messages inflight and queued can follow the
+    # unsubscribe
+    limit = unsubscribe_at + 50 + 5 + 10
+
+    port = mosq_test.get_port()
+    conf_file = os.path.basename(__file__).replace('.py', '.conf')
+    write_config(conf_file, port)
+
+    pub_connect_packet = mosq_test.gen_connect("retain-paced-pub")
+    sub_connect_packet = mosq_test.gen_connect("retain-paced-sub")
+    connack_packet = mosq_test.gen_connack(rc=0)
+
+    subscribe_packet = mosq_test.gen_subscribe(1, "fleet/#", 1)
+    suback_packet = mosq_test.gen_suback(1, 1)
+
+    unsubscribe_packet = mosq_test.gen_unsubscribe(2, "fleet/#")
+    unsuback_packet = mosq_test.gen_unsuback(2)
+
+    # Logging is off, there would be too much for the pipe to hold
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port, nolog=True)
+
+    try:
+        sock = mosq_test.do_client_connect(pub_connect_packet, connack_packet, port=port)
+        publish_packets = b""
+        for i in range(0, count):
+            publish_packets += mosq_test.gen_publish("fleet/%d" % (i), qos=1, mid=i+1, payload="%d" % (i), retain=True)
+        sock.sendall(publish_packets)
+        for i in range(0, count):
+            mosq_test.expect_packet(sock, "puback", mosq_test.gen_puback(mid=i+1))
+        sock.close()
+
+        sock = mosq_test.do_client_connect(sub_connect_packet, connack_packet, port=port)
+        mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback")
+
+        for i in range(0, unsubscribe_at):
+            publish_packet = mosq_test.gen_publish("fleet/%d" % (i), qos=1, mid=i+1, payload="%d" % (i), retain=True)
+            mosq_test.expect_packet(sock, "publish %d" % (i), publish_packet)
+            sock.send(mosq_test.gen_puback(mid=i+1))
+
+        sock.send(unsubscribe_packet)
+
+        # Keep acknowledging whatever is still to come, in order, until a
+        # ping round trip passes with no more messages arriving
+        received = unsubscribe_at
+        unsubscribed = False
+        idle = False
+        while idle == False:
+            time.sleep(0.5)
+            sock.send(mosq_test.gen_pingreq())
+            idle = True
+            while True:
+                packet = read_packet(sock)
+                if packet == mosq_test.gen_pingresp():
+                    break
+                elif packet == unsuback_packet:
+                    unsubscribed = True
+                else:
+                    i = received
+                    publish_packet = mosq_test.gen_publish("fleet/%d" % (i), qos=1, mid=i+1, payload="%d" % (i), retain=True)
+                    if mosq_test.packet_matches("publish %d" % (i), packet, publish_packet) == False:
+                        raise mosq_test.TestError
+                    sock.send(mosq_test.gen_puback(mid=i+1))
+                    received += 1
+                    idle = False
+                    if received > limit:
+                        print("Retained messages still delivered after unsubscribe")
+                        raise mosq_test.TestError
+
+        if unsubscribed == False:
+            print("No unsuback")
+            raise mosq_test.TestError
+
+        sock.close()
+
+        rc = 0
+    except mosq_test.TestError:
+        pass
+    finally:
+        os.remove(conf_file)
+        broker.terminate()
+        broker.wait()
+        if rc:
+            exit(rc)
+
+do_test()
+exit(0)
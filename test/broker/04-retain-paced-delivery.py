@@ -0,0 +1,73 @@
+#!/usr/bin/env python3
+
+# Test whether a wildcard subscription that matches many more retained messages
+# than the client can have in flight or queued receives all of them, and that
+# the broker carries on serving other clients while they are delivered.
+
+from mosq_test_helper import *
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("listener %d\n" % (port))
+        f.write("allow_anonymous true\n")
+        f.write("max_inflight_messages 5\n")
+        f.write("max_queued_messages 10\n")
+        f.write("retain_delivery_batch_size 50\n")
+
+def do_test():
+    rc = 1
+    count = 2000
+
+    port = mosq_test.get_port()
+    conf_file = os.path.basename(__file__).replace('.py', '.conf')
+    write_config(conf_file, port)
+
+    pub_connect_packet = mosq_test.gen_connect("retain-paced-pub")
+    sub_connect_packet = mosq_test.gen_connect("retain-paced-sub")
+    other_connect_packet = mosq_test.gen_connect("retain-paced-other")
+    connack_packet = mosq_test.gen_connack(rc=0)
+
+    subscribe_packet = mosq_test.gen_subscribe(1, "fleet/#", 1)
+    suback_packet = mosq_test.gen_suback(1, 1)
+
+    # Logging is off, there would be too much for the pipe to hold
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port, nolog=True)
+
+    try:
+        sock = mosq_test.do_client_connect(pub_connect_packet, connack_packet, port=port)
+        publish_packets = b""
+        for i in range(0, count):
+            publish_packets += mosq_test.gen_publish("fleet/%d" % (i), qos=1, mid=i+1, payload="%d" % (i), retain=True)
+        sock.sendall(publish_packets)
+        for i in range(0, count):
+            mosq_test.expect_packet(sock, "puback", mosq_test.gen_puback(mid=i+1))
+        sock.close()
+
+        sock = mosq_test.do_client_connect(sub_connect_packet, connack_packet, port=port)
+        mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback")
+
+        for i in range(0, count):
+            publish_packet = mosq_test.gen_publish("fleet/%d" % (i), qos=1, mid=i+1, payload="%d" % (i), retain=True)
+            mosq_test.expect_packet(sock, "publish %d" % (i), publish_packet)
+            sock.send(mosq_test.gen_puback(mid=i+1))
+
+            if i == count/2:
+                other_sock = mosq_test.do_client_connect(other_connect_packet, connack_packet, port=port)
+                mosq_test.do_ping(other_sock)
+                other_sock.close()
+
+        mosq_test.do_ping(sock)
+        sock.close()
+
+        rc = 0
+    except mosq_test.TestError:
+        pass
+    finally:
+        os.remove(conf_file)
+        broker.terminate()
+        broker.wait()
+        if rc:
+            exit(rc)
+
+do_test()
+exit(0)
@@ -0,0 +1,87 @@
+#!/usr/bin/env python3
+
+# Check that kicking all clients from a plugin whilst TLS handshakes are being
+# carried out by tls_handshake_threads leaves those connections alone, so they
+# are not freed whilst a handshake thread is still using them.
+
+from mosq_test_helper import *
+
+def write_config(filename, port1, port2):
+    with open(filename, 'w') as f:
+        f.write("tls_handshake_threads 1\n")
+        f.write("plugin c/plugin_kick.so\n")
+        f.write("listener %d\n" % (port2))
+        f.write("allow_anonymous true\n")
+        f.write("\n")
+        f.write("listener %d\n" % (port1))
+        f.write("allow_anonymous true\n")
+        f.write("cafile ../ssl/all-ca.crt\n")
+        f.write("certfile ../ssl/server.crt\n")
+        f.write("keyfile ../ssl/server.key\n")
+
+def tls_client(port, client_id):
+    context = ssl.create_default_context(ssl.Purpose.SERVER_AUTH, cafile="../ssl/test-root-ca.crt")
+    sock = socket.create_connection(("localhost", port))
+    ssock = context.wrap_socket(sock, server_hostname="localhost")
+    ssock.settimeout(5)
+    connect_packet = mosq_test.gen_connect(client_id)
+    connack_packet = mosq_test.gen_connack(rc=0)
+    mosq_test.do_send_receive(ssock, connect_packet, connack_packet, "connack %s" % (client_id))
+    return ssock
+
+def do_kick(port, topic):
+    sock = mosq_test.do_client_connect(mosq_test.gen_connect("kicker"), mosq_test.gen_connack(rc=0), port=port)
+    sock.send(mosq_test.gen_publish(topic, qos=0, payload="kick"))
+    # The kicking client is kicked as well
+    if sock.recv(10) != b"":
+        raise mosq_test.TestError
+    sock.close()
+
+(port1, port2) = mosq_test.get_port(2)
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+write_config(conf_file, port1, port2)
+
+rc = 1
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), port=port2, use_conf=True)
+
+try:
+    # Connections that stay with the handshake thread
+    stalled = []
+    for i in range(3):
+        stalled.append(socket.create_connection(("localhost", port1)))
+    time.sleep(0.5)
+
+    do_kick(port2, "kick/clientid")
+    do_kick(port2, "kick/username")
+
+    # The handshake thread still has the stalled connections
+    for s in stalled:
+        s.settimeout(0.5)
+        try:
+            if s.recv(10) == b"":
+                print("handshake connection kicked")
+                raise mosq_test.TestError
+        except socket.timeout:
+            pass
+
+    # The thread finishes with them normally
+    for s in stalled:
+        s.close()
+    client = tls_client(port1, "hs-after-kick")
+    mosq_test.do_ping(client)
+    client.close()
+
+    rc = 0
+except mosq_test.TestError:
+    pass
+finally:
+    os.remove(conf_file)
+    broker.terminate()
+    if broker.wait() != 0:
+        print("broker exited with %d" % (broker.returncode))
+        rc = 1
+    (stdo, stde) = broker.communicate()
+    if rc:
+        print(stde.decode('utf-8'))
+
+exit(rc)
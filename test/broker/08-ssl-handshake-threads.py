@@ -0,0 +1,120 @@
+#!/usr/bin/env python3
+
+# Check that TLS handshakes carried out by tls_handshake_threads work, that a
+# client which stalls during the handshake does not hold up other clients, that
+# client certificates are verified, and that handshakes are counted in $SYS.
+
+from mosq_test_helper import *
+
+def write_config(filename, port1, port2):
+    with open(filename, 'w') as f:
+        f.write("sys_interval 1\n")
+        f.write("tls_handshake_threads 2\n")
+        f.write("listener %d\n" % (port2))
+        f.write("allow_anonymous true\n")
+        f.write("\n")
+        f.write("listener %d\n" % (port1))
+        f.write("allow_anonymous true\n")
+        f.write("cafile ../ssl/all-ca.crt\n")
+        f.write("certfile ../ssl/server.crt\n")
+        f.write("keyfile ../ssl/server.key\n")
+        f.write("require_certificate true\n")
+
+def tls_client(port, client_id, certfile, keyfile):
+    context = ssl.create_default_context(ssl.Purpose.SERVER_AUTH, cafile="../ssl/test-root-ca.crt")
+    context.load_cert_chain(certfile=certfile, keyfile=keyfile)
+    sock = socket.create_connection(("localhost", port))
+    ssock = context.wrap_socket(sock, server_hostname="localhost")
+    ssock.settimeout(5)
+    connect_packet = mosq_test.gen_connect(client_id)
+    connack_packet = mosq_test.gen_connack(rc=0)
+    mosq_test.do_send_receive(ssock, connect_packet, connack_packet, "connack %s" % (client_id))
+    return ssock
+
+def read_sys_value(sock, topic):
+    # Retained QoS 0 publish, with a one byte remaining length
+    packet = sock.recv(2)
+    if len(packet) != 2 or packet[0] != 0x31:
+        raise mosq_test.TestError
+    packet = sock.recv(packet[1])
+    tlen = struct.unpack("!H", packet[0:2])[0]
+    if packet[2:2+tlen].decode('utf-8') != topic:
+        raise mosq_test.TestError
+    return int(packet[2+tlen:].decode('utf-8'))
+
+(port1, port2) = mosq_test.get_port(2)
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+write_config(conf_file, port1, port2)
+
+rc = 1
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), port=port2, use_conf=True)
+
+try:
+    # More stalled clients than there are handshake threads
+    stalled = []
+    for i in range(4):
+        stalled.append(socket.create_connection(("localhost", port1)))
+
+    # Clients complete their handshakes regardless
+    clients = []
+    for i in range(5):
+        clients.append(tls_client(port1, "hs-client-%d" % (i), "../ssl/client.crt", "../ssl/client.key"))
+
+    # Messages flow normally once the connection has been passed back
+    subscribe_packet = mosq_test.gen_subscribe(mid=1, topic="handshake/test", qos=0)
+    suback_packet = mosq_test.gen_suback(mid=1, qos=0)
+    mosq_test.do_send_receive(clients[0], subscribe_packet, suback_packet, "suback")
+    publish_packet = mosq_test.gen_publish(topic="handshake/test", qos=0, payload="message")
+    clients[1].send(publish_packet)
+    mosq_test.expect_packet(clients[0], "publish", publish_packet)
+
+    # Expired client certificates are rejected by the handshake thread
+    try:
+        sock = tls_client(port1, "hs-expired", "../ssl/client-expired.crt", "../ssl/client-expired.key")
+    except (ssl.SSLError, OSError, mosq_test.TestError):
+        sock = None
+    if sock is not None:
+        print("expired certificate accepted")
+        raise mosq_test.TestError
+
+    # Clients that send garbage are disconnected
+    sock = socket.create_connection(("localhost", port1))
+    sock.settimeout(5)
+    sock.send(b"not a tls handshake\r\n\r\n")
+    try:
+        while sock.recv(100) != b"":
+            pass
+    except ConnectionResetError:
+        pass
+    sock.close()
+
+    time.sleep(3)
+    sock = mosq_test.do_client_connect(mosq_test.gen_connect("sys-check"), mosq_test.gen_connack(rc=0), port=port2)
+    topic = "$SYS/broker/tls/handshakes/full"
+    mosq_test.do_send_receive(sock, mosq_test.gen_subscribe(mid=1, topic=topic, qos=0), mosq_test.gen_suback(mid=1, qos=0), "suback sys")
+    value = read_sys_value(sock, topic)
+    if value != len(clients):
+        print("%s %d, expected %d" % (topic, value, len(clients)))
+        raise mosq_test.TestError
+    sock.close()
+
+    for c in clients:
+        c.close()
+    for s in stalled:
+        s.close()
+
+    rc = 0
+except mosq_test.TestError:
+    pass
+finally:
+    os.remove(conf_file)
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    if rc == 0 and "certificate verify failed" not in stde.decode('utf-8'):
+        print("certificate failure not logged")
+        rc = 1
+    if rc:
+        print(stde.decode('utf-8'))
+
+exit(rc)
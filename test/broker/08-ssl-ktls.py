@@ -0,0 +1,86 @@
+#!/usr/bin/env python3
+
+# Check that messages are delivered correctly on a listener with tls_ktls
+# enabled, whether or not the kernel is able to take over the encryption, and
+# that falling back to OpenSSL is only logged once for the listener.
+
+from mosq_test_helper import *
+
+def write_config(filename, port1, port2):
+    with open(filename, 'w') as f:
+        f.write("listener %d\n" % (port2))
+        f.write("allow_anonymous true\n")
+        f.write("\n")
+        f.write("listener %d\n" % (port1))
+        f.write("allow_anonymous true\n")
+        f.write("cafile ../ssl/all-ca.crt\n")
+        f.write("certfile ../ssl/server.crt\n")
+        f.write("keyfile ../ssl/server.key\n")
+        f.write("tls_ktls true\n")
+
+def tls_client(port, client_id):
+    context = ssl.create_default_context(ssl.Purpose.SERVER_AUTH, cafile="../ssl/test-root-ca.crt")
+    sock = socket.create_connection(("localhost", port))
+    ssock = context.wrap_socket(sock, server_hostname="localhost")
+    ssock.settimeout(20)
+    connect_packet = mosq_test.gen_connect(client_id)
+    connack_packet = mosq_test.gen_connack(rc=0)
+    mosq_test.do_send_receive(ssock, connect_packet, connack_packet, "connack %s" % (client_id))
+    return ssock
+
+def expect_packet(sock, name, expected):
+    # TLS sockets return at most one record per recv()
+    packet = b""
+    while len(packet) < len(expected):
+        data = sock.recv(len(expected) - len(packet))
+        if len(data) == 0:
+            break
+        packet += data
+    if not mosq_test.packet_matches(name, packet, expected):
+        raise mosq_test.TestError
+
+(port1, port2) = mosq_test.get_port(2)
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+write_config(conf_file, port1, port2)
+
+rc = 1
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), port=port2, use_conf=True)
+
+try:
+    sub = tls_client(port1, "ktls-sub")
+    pub = tls_client(port1, "ktls-pub")
+
+    subscribe_packet = mosq_test.gen_subscribe(mid=1, topic="ktls/test", qos=0)
+    suback_packet = mosq_test.gen_suback(mid=1, qos=0)
+    mosq_test.do_send_receive(sub, subscribe_packet, suback_packet, "suback")
+
+    # Small messages, and large ones that may be sent straight from the
+    # message store, queued together so they are written in one go.
+    payloads = ["small", "x"*2000, "y"*100000, "small again", "z"*5000]
+    for payload in payloads:
+        publish_packet = mosq_test.gen_publish(topic="ktls/test", qos=0, payload=payload)
+        pub.send(publish_packet)
+    for i, payload in enumerate(payloads):
+        publish_packet = mosq_test.gen_publish(topic="ktls/test", qos=0, payload=payload)
+        expect_packet(sub, "publish %d" % (i), publish_packet)
+    mosq_test.do_ping(sub)
+    mosq_test.do_ping(pub)
+
+    sub.close()
+    pub.close()
+    rc = 0
+except mosq_test.TestError:
+    pass
+finally:
+    os.remove(conf_file)
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    log = stde.decode('utf-8')
+    if rc == 0 and log.count("kTLS is not available") > 1:
+        print("kTLS fallback logged more than once")
+        rc = 1
+    if rc:
+        print(log)
+
+exit(rc)
@@ -0,0 +1,135 @@
+#!/usr/bin/env python3
+
+# Check that TLS sessions can be resumed with session tickets, that tickets
+# made with keys from tls_ticket_key_file are still accepted after the broker
+# is restarted or the keys are rotated, and that full and resumed handshakes
+# are counted in $SYS.
+
+from mosq_test_helper import *
+import signal
+
+def write_config(filename, port1, port2):
+    with open(filename, 'w') as f:
+        f.write("sys_interval 1\n")
+        f.write("listener %d\n" % (port2))
+        f.write("allow_anonymous true\n")
+        f.write("\n")
+        f.write("listener %d\n" % (port1))
+        f.write("allow_anonymous true\n")
+        f.write("cafile ../ssl/all-ca.crt\n")
+        f.write("certfile ../ssl/server.crt\n")
+        f.write("keyfile ../ssl/server.key\n")
+        f.write("tls_ticket_key_file %s\n" % (filename.replace('.conf', '.key')))
+
+def write_keys(filename, old_keys=b""):
+    keys = os.urandom(80) + old_keys
+    with open(filename, 'wb') as f:
+        f.write(keys)
+    return keys
+
+def tls_connect(context, port, session=None):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    ssock = context.wrap_socket(sock, server_hostname="localhost", session=session)
+    ssock.settimeout(20)
+    ssock.connect(("localhost", port))
+    mosq_test.do_send_receive(ssock, connect_packet, connack_packet, "connack")
+    session = ssock.session
+    reused = ssock.session_reused
+    ssock.close()
+    return (session, reused)
+
+def read_sys_value(sock, topic):
+    # Retained QoS 0 publish, with a one byte remaining length
+    packet = sock.recv(2)
+    if len(packet) != 2 or packet[0] != 0x31:
+        raise mosq_test.TestError
+    packet = sock.recv(packet[1])
+    tlen = struct.unpack("!H", packet[0:2])[0]
+    if packet[2:2+tlen].decode('utf-8') != topic:
+        raise mosq_test.TestError
+    return int(packet[2+tlen:].decode('utf-8'))
+
+def check_sys(port, full, resumed):
+    sock = mosq_test.do_client_connect(mosq_test.gen_connect("sys-check"), connack_packet, port=port)
+    for (mid, topic, expected) in [(1, "$SYS/broker/tls/handshakes/full", full), (2, "$SYS/broker/tls/handshakes/resumed", resumed)]:
+        subscribe_packet = mosq_test.gen_subscribe(mid=mid, topic=topic, qos=0)
+        suback_packet = mosq_test.gen_suback(mid=mid, qos=0)
+        mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback %d" % (mid))
+        value = read_sys_value(sock, topic)
+        if value != expected:
+            print("%s %d, expected %d" % (topic, value, expected))
+            raise mosq_test.TestError
+    sock.close()
+
+(port1, port2) = mosq_test.get_port(2)
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+write_config(conf_file, port1, port2)
+key_file = os.path.basename(__file__).replace('.py', '.key')
+keys = write_keys(key_file)
+
+rc = 1
+connect_packet = mosq_test.gen_connect("session-resumption")
+connack_packet = mosq_test.gen_connack(rc=0)
+
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), port=port2, use_conf=True)
+
+try:
+    context = ssl.create_default_context(ssl.Purpose.SERVER_AUTH, cafile="../ssl/test-root-ca.crt")
+
+    (session, reused) = tls_connect(context, port1)
+    if reused or session is None:
+        raise mosq_test.TestError
+
+    (session, reused) = tls_connect(context, port1, session)
+    if not reused:
+        print("session not resumed")
+        raise mosq_test.TestError
+
+    time.sleep(3)
+    check_sys(port2, 1, 1)
+
+    # Tickets must still be accepted after a restart
+    broker.terminate()
+    broker.wait()
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), port=port2, use_conf=True)
+
+    (session, reused) = tls_connect(context, port1, session)
+    if not reused:
+        print("session not resumed after restart")
+        raise mosq_test.TestError
+
+    time.sleep(3)
+    check_sys(port2, 0, 1)
+
+    # Rotate keys, tickets made with the old key are still accepted
+    write_keys(key_file, keys)
+    broker.send_signal(signal.SIGHUP)
+    time.sleep(0.5)
+    (session, reused) = tls_connect(context, port1, session)
+    if not reused:
+        print("session not resumed after key rotation")
+        raise mosq_test.TestError
+
+    # Remove the old key, tickets made with it are no longer accepted
+    (old_session, reused) = tls_connect(context, port1)
+    write_keys(key_file)
+    broker.send_signal(signal.SIGHUP)
+    time.sleep(0.5)
+    (session, reused) = tls_connect(context, port1, old_session)
+    if reused:
+        print("session resumed with removed key")
+        raise mosq_test.TestError
+
+    rc = 0
+except mosq_test.TestError:
+    pass
+finally:
+    os.remove(conf_file)
+    os.remove(key_file)
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    if rc:
+        print(stde.decode('utf-8'))
+
+exit(rc)
@@ -0,0 +1,122 @@
+#!/usr/bin/env python3
+
+# Check that ACL decisions are cached when acl_cache_size is set, that the
+# cache is flushed when the ACLs are reloaded, and that cache use is reported
+# in $SYS.
+
+from mosq_test_helper import *
+import signal
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("port %d\n" % (port))
+        f.write("allow_anonymous true\n")
+        f.write("acl_file %s\n" % (filename.replace('.conf', '.acl')))
+        f.write("acl_cache_size 10\n")
+        f.write("sys_interval 1\n")
+
+def write_acl(filename, en):
+    with open(filename, 'w') as f:
+        f.write('topic read $SYS/#\n')
+        f.write('topic readwrite topic/two\n')
+        if en:
+            f.write('topic readwrite topic/one\n')
+
+def read_sys_value(sock, topic):
+    # Retained QoS 0 publish, with a one byte remaining length
+    packet = sock.recv(2)
+    if len(packet) != 2 or packet[0] != 0x31:
+        raise mosq_test.TestError
+    packet = sock.recv(packet[1])
+    tlen = struct.unpack("!H", packet[0:2])[0]
+    if packet[2:2+tlen].decode('utf-8') != topic:
+        raise mosq_test.TestError
+    return int(packet[2+tlen:].decode('utf-8'))
+
+keepalive = 60
+
+connect_packet = mosq_test.gen_connect("acl-cache", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+mid = 1
+subscribe_packet = mosq_test.gen_subscribe(mid=mid, topic="topic/#", qos=1)
+suback_packet = mosq_test.gen_suback(mid=mid, qos=1)
+
+connect_sys_packet = mosq_test.gen_connect("acl-cache-sys", keepalive=keepalive)
+mid = 1
+subscribe_hits_packet = mosq_test.gen_subscribe(mid=mid, topic="$SYS/broker/acl/cache/hits", qos=0)
+suback_hits_packet = mosq_test.gen_suback(mid=mid, qos=0)
+mid = 2
+subscribe_misses_packet = mosq_test.gen_subscribe(mid=mid, topic="$SYS/broker/acl/cache/misses", qos=0)
+suback_misses_packet = mosq_test.gen_suback(mid=mid, qos=0)
+
+rc = 1
+
+port = mosq_test.get_port()
+
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+write_config(conf_file, port)
+
+acl_file = os.path.basename(__file__).replace('.py', '.acl')
+write_acl(acl_file, True)
+
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+try:
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet, port=port)
+    mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback")
+
+    # The first message is checked by the plugins, the rest from the cache
+    for i in range(0, 3):
+        publish_s_packet = mosq_test.gen_publish(topic="topic/one", mid=10+i, qos=1, payload="message")
+        puback_s_packet = mosq_test.gen_puback(10+i)
+        publish_r_packet = mosq_test.gen_publish(topic="topic/one", mid=1+i, qos=1, payload="message")
+        sock.send(publish_s_packet)
+        mosq_test.receive_unordered(sock, puback_s_packet, publish_r_packet, "puback / publish %d" % (i))
+        sock.send(mosq_test.gen_puback(1+i))
+
+    # Reload ACLs with topic/one now disabled, the cached result must go
+    write_acl(acl_file, False)
+    broker.send_signal(signal.SIGHUP)
+    time.sleep(0.5)
+
+    publish_s_packet = mosq_test.gen_publish(topic="topic/one", mid=20, qos=1, payload="denied")
+    puback_s_packet = mosq_test.gen_puback(20)
+    mosq_test.do_send_receive(sock, publish_s_packet, puback_s_packet, "puback denied")
+
+    # topic/two is still allowed
+    publish_s_packet = mosq_test.gen_publish(topic="topic/two", mid=21, qos=1, payload="allowed")
+    puback_s_packet = mosq_test.gen_puback(21)
+    publish_r_packet = mosq_test.gen_publish(topic="topic/two", mid=4, qos=1, payload="allowed")
+    sock.send(publish_s_packet)
+    mosq_test.receive_unordered(sock, puback_s_packet, publish_r_packet, "puback / publish allowed")
+    sock.send(mosq_test.gen_puback(4))
+    mosq_test.do_ping(sock)
+    sock.close()
+
+    # Wait for the $SYS tree to be updated
+    time.sleep(3)
+    sock = mosq_test.do_client_connect(connect_sys_packet, connack_packet, port=port)
+    mosq_test.do_send_receive(sock, subscribe_hits_packet, suback_hits_packet, "suback hits")
+    hits = read_sys_value(sock, "$SYS/broker/acl/cache/hits")
+    mosq_test.do_send_receive(sock, subscribe_misses_packet, suback_misses_packet, "suback misses")
+    misses = read_sys_value(sock, "$SYS/broker/acl/cache/misses")
+    # The write and read checks for the second and third messages on topic/one
+    if hits < 4 or misses < 2:
+        print("hits %d misses %d" % (hits, misses))
+        raise mosq_test.TestError
+    sock.close()
+
+    rc = 0
+
+except mosq_test.TestError:
+    pass
+finally:
+    os.remove(conf_file)
+    os.remove(acl_file)
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    if rc:
+        print(stde.decode('utf-8'))
+        exit(rc)
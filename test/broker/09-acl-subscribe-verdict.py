@@ -0,0 +1,94 @@
+#!/usr/bin/env python3
+
+# Check that messages are delivered according to the ACLs when the read access
+# for a subscription is decided when it is made, and that this is undone when
+# the ACLs are reloaded.
+
+from mosq_test_helper import *
+import signal
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("port %d\n" % (port))
+        f.write("allow_anonymous true\n")
+        f.write("acl_file %s\n" % (filename.replace('.conf', '.acl')))
+
+def write_acl(filename, en):
+    with open(filename, 'w') as f:
+        f.write('topic write #\n')
+        f.write('topic read a/#\n')
+        f.write('topic deny a/secret/#\n')
+        if en:
+            f.write('topic read b/+\n')
+        f.write('pattern read c/%c/#\n')
+
+# (filter, [(topic, delivered)])
+checks = [
+    ("b/+", [("b/x", True), ("b/y", True), ("b/x/y", False)]),
+    ("a/#", [("a", True), ("a/x", True), ("a/secret/x", False), ("a/x/y", True)]),
+    ("d/#", [("d", False), ("d/x", False)]),
+    ("+/x", [("a/x", True), ("b/x", True), ("d/x", False)]),
+    ("c/verdict/#", [("c/verdict", True), ("c/verdict/x", True)]),
+    ("c/+/x", [("c/verdict/x", True), ("c/other/x", False)]),
+    ("$share/group/b/+", [("b/x", True)]),
+]
+
+def check_delivery(sock, deliveries):
+    for (topic, delivered) in deliveries:
+        sock.send(mosq_test.gen_publish(topic=topic, qos=0, payload="message"))
+    for (topic, delivered) in deliveries:
+        if delivered:
+            publish_packet = mosq_test.gen_publish(topic=topic, qos=0, payload="message")
+            mosq_test.expect_packet(sock, "publish %s" % (topic), publish_packet)
+    mosq_test.do_ping(sock)
+
+def do_test(port):
+    conf_file = os.path.basename(__file__).replace('.py', '.conf')
+    write_config(conf_file, port)
+
+    acl_file = os.path.basename(__file__).replace('.py', '.acl')
+    write_acl(acl_file, True)
+
+    rc = 1
+    connect_packet = mosq_test.gen_connect("verdict")
+    connack_packet = mosq_test.gen_connack(rc=0)
+
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+    try:
+        for (sub, deliveries) in checks:
+            sock = mosq_test.do_client_connect(connect_packet, connack_packet, port=port)
+            subscribe_packet = mosq_test.gen_subscribe(mid=1, topic=sub, qos=0)
+            suback_packet = mosq_test.gen_suback(mid=1, qos=0)
+            mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback %s" % (sub))
+            check_delivery(sock, deliveries)
+            sock.close()
+
+        # Reads from b/+ are no longer allowed after a reload
+        sock = mosq_test.do_client_connect(connect_packet, connack_packet, port=port)
+        subscribe_packet = mosq_test.gen_subscribe(mid=1, topic="b/+", qos=0)
+        suback_packet = mosq_test.gen_suback(mid=1, qos=0)
+        mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback reload")
+        check_delivery(sock, [("b/x", True)])
+
+        write_acl(acl_file, False)
+        broker.send_signal(signal.SIGHUP)
+        time.sleep(0.5)
+        check_delivery(sock, [("b/x", False)])
+        sock.close()
+
+        rc = 0
+    except mosq_test.TestError:
+        pass
+    finally:
+        os.remove(conf_file)
+        os.remove(acl_file)
+        broker.terminate()
+        broker.wait()
+        (stdo, stde) = broker.communicate()
+        if rc:
+            print(stde.decode('utf-8'))
+            exit(rc)
+
+port = mosq_test.get_port()
+do_test(port)
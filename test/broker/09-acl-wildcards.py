@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+
+# Check ACL wildcard matching and deny precedence, for both topic and pattern
+# ACLs.
+
+from mosq_test_helper import *
+
+def write_config(filename, port, per_listener):
+    with open(filename, 'w') as f:
+        f.write("per_listener_settings %s\n" % (per_listener))
+        f.write("port %d\n" % (port))
+        f.write("allow_anonymous true\n")
+        f.write("acl_file %s\n" % (filename.replace('.conf', '.acl')))
+
+def write_acl(filename):
+    with open(filename, 'w') as f:
+        f.write('topic readwrite a/+/c\n')
+        f.write('topic deny      b/+/secret\n')
+        f.write('topic readwrite b/#\n')
+        f.write('topic read      r/#\n')
+        f.write('topic write     r/#\n')
+        f.write('topic readwrite +/dollar\n')
+        f.write('pattern readwrite client/%c/#\n')
+        f.write('pattern deny      client/%c/private/#\n')
+
+# (topic, allowed)
+checks = [
+    ("a/b/c", True),
+    ("a/b/d", False),
+    ("a/b/c/d", False),
+    ("a/c", False),
+    ("b", True),
+    ("b/x/y/z", True),
+    ("b/x/secret", False),
+    ("b/x/secret/y", True),
+    ("r/x", True),
+    ("y/dollar", True),
+    ("$test/dollar", False),
+    ("client/acl-wildcards", True),
+    ("client/acl-wildcards/x", True),
+    ("client/acl-wildcards/private", False),
+    ("client/acl-wildcards/private/x", False),
+    ("client/other/x", False),
+]
+
+def do_test(port, per_listener):
+    conf_file = os.path.basename(__file__).replace('.py', '.conf')
+    write_config(conf_file, port, per_listener)
+
+    acl_file = os.path.basename(__file__).replace('.py', '.acl')
+    write_acl(acl_file)
+
+    rc = 1
+    keepalive = 60
+    connect_packet = mosq_test.gen_connect("acl-wildcards", keepalive=keepalive)
+    connack_packet = mosq_test.gen_connack(rc=0)
+
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+    try:
+        sock = mosq_test.do_client_connect(connect_packet, connack_packet, port=port)
+
+        mid = 1
+        recv_mid = 1
+        for (topic, allowed) in checks:
+            subscribe_packet = mosq_test.gen_subscribe(mid=mid, topic=topic, qos=1)
+            suback_packet = mosq_test.gen_suback(mid=mid, qos=1)
+            mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback %s" % (topic))
+            mid += 1
+
+            publish_packet = mosq_test.gen_publish(topic=topic, mid=mid, qos=1, payload="message")
+            puback_packet = mosq_test.gen_puback(mid)
+            sock.send(publish_packet)
+            if allowed:
+                publish_r_packet = mosq_test.gen_publish(topic=topic, mid=recv_mid, qos=1, payload="message")
+                mosq_test.receive_unordered(sock, puback_packet, publish_r_packet, "puback / publish %s" % (topic))
+                sock.send(mosq_test.gen_puback(recv_mid))
+                recv_mid += 1
+            else:
+                mosq_test.expect_packet(sock, "puback %s" % (topic), puback_packet)
+                mosq_test.do_ping(sock, "pingresp %s" % (topic))
+            mid += 1
+
+        sock.close()
+        rc = 0
+    except mosq_test.TestError:
+        pass
+    finally:
+        os.remove(conf_file)
+        os.remove(acl_file)
+        broker.terminate()
+        broker.wait()
+        (stdo, stde) = broker.communicate()
+        if rc:
+            print(stde.decode('utf-8'))
+            exit(rc)
+
+port = mosq_test.get_port()
+
+do_test(port, "true")
+do_test(port, "false")
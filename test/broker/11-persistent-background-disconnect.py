@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+
+# Test that a client the broker disconnects whilst a background save is in
+# progress sees its connection close straight away, rather than being held
+# open by the process carrying out the save.
+
+from mosq_test_helper import *
+import signal
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("listener %d\n" % (port))
+        f.write("allow_anonymous true\n")
+        f.write("persistence true\n")
+        f.write("persistence_file mosquitto-%d.db\n" % (port))
+        f.write("autosave_interval 3600\n")
+        f.write("autosave_background true\n")
+
+def remove_db(port):
+    for f in ['mosquitto-%d.db' % (port), 'mosquitto-%d.db.new' % (port)]:
+        if os.path.exists(f):
+            os.unlink(f)
+
+def find_child(pid):
+    for entry in os.listdir('/proc'):
+        if not entry.isdigit():
+            continue
+        try:
+            with open('/proc/%s/stat' % (entry), 'r') as f:
+                stat = f.read()
+        except OSError:
+            continue
+        # The command may contain spaces, so split after it
+        if int(stat.rsplit(')', 1)[1].split()[1]) == pid:
+            return int(entry)
+    return None
+
+port = mosq_test.get_port()
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+write_config(conf_file, port)
+remove_db(port)
+
+rc = 1
+child = None
+connack_packet = mosq_test.gen_connack(rc=0)
+
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+try:
+    # Enough retained data that the save takes long enough to be caught
+    pub_sock = mosq_test.do_client_connect(mosq_test.gen_connect("background-pub"), connack_packet, timeout=20, port=port)
+    payload = "x"*100000
+    for i in range(500):
+        pub_sock.send(mosq_test.gen_publish("background/%d" % (i), qos=0, retain=True, payload=payload))
+    mosq_test.do_ping(pub_sock)
+
+    sock = mosq_test.do_client_connect(mosq_test.gen_connect("background-client"), connack_packet, timeout=20, port=port)
+
+    # Start a save, and stop the process carrying it out
+    broker.send_signal(signal.SIGUSR1)
+    for i in range(5000):
+        child = find_child(broker.pid)
+        if child is not None:
+            os.kill(child, signal.SIGSTOP)
+            break
+        time.sleep(0.001)
+    if child is None or os.path.exists('mosquitto-%d.db' % (port)):
+        print("background save not caught")
+        raise mosq_test.TestError
+
+    # The broker closes the connection after a DISCONNECT
+    sock.settimeout(5)
+    sock.send(mosq_test.gen_disconnect())
+    try:
+        if sock.recv(10) != b"":
+            raise mosq_test.TestError
+    except socket.timeout:
+        print("connection held open by background save")
+        raise mosq_test.TestError
+    sock.close()
+
+    os.kill(child, signal.SIGCONT)
+    child = None
+    for i in range(100):
+        if os.path.exists('mosquitto-%d.db' % (port)):
+            break
+        time.sleep(0.1)
+    else:
+        raise mosq_test.TestError
+    mosq_test.do_ping(pub_sock)
+    pub_sock.close()
+
+    rc = 0
+except mosq_test.TestError:
+    pass
+finally:
+    if child is not None:
+        os.kill(child, signal.SIGCONT)
+    os.remove(conf_file)
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    remove_db(port)
+    if rc:
+        print(stde.decode('utf-8'))
+
+exit(rc)
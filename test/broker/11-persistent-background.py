@@ -0,0 +1,112 @@
+#!/usr/bin/env python3
+
+# Test whether a database saved in the background can be restored, both on its
+# own and with the persistence journal carrying the changes made after the
+# save was started.
+
+from mosq_test_helper import *
+import signal
+
+def write_config(filename, port, journal):
+    with open(filename, 'w') as f:
+        f.write("listener %d\n" % (port))
+        f.write("allow_anonymous true\n")
+        f.write("persistence true\n")
+        f.write("persistence_file mosquitto-%d.db\n" % (port))
+        f.write("autosave_interval 3600\n")
+        f.write("autosave_background true\n")
+        if journal:
+            f.write("persistence_journal true\n")
+
+def remove_db(port):
+    for f in ['mosquitto-%d.db' % (port), 'mosquitto-%d.db.journal' % (port)]:
+        if os.path.exists(f):
+            os.unlink(f)
+
+def wait_for_db(port):
+    for i in range(50):
+        if os.path.exists('mosquitto-%d.db' % (port)):
+            return
+        time.sleep(0.1)
+    raise mosq_test.TestError
+
+def do_test(journal):
+    port = mosq_test.get_port()
+    conf_file = os.path.basename(__file__).replace('.py', '.conf')
+    write_config(conf_file, port, journal)
+
+    rc = 1
+    keepalive = 60
+    sub_connect_packet = mosq_test.gen_connect("background-sub", keepalive=keepalive, clean_session=False)
+    connack_packet = mosq_test.gen_connack(rc=0)
+    connack_packet2 = mosq_test.gen_connack(rc=0, flags=1)  # session present
+
+    pub_connect_packet = mosq_test.gen_connect("background-pub", keepalive=keepalive)
+
+    subscribe_packet = mosq_test.gen_subscribe(1, "background/test", 1)
+    suback_packet = mosq_test.gen_suback(1, 1)
+
+    publish1_packet = mosq_test.gen_publish("background/test", qos=1, mid=10, payload="before")
+    puback1_packet = mosq_test.gen_puback(10)
+    publish2_packet = mosq_test.gen_publish("background/test", qos=1, mid=11, payload="after")
+    puback2_packet = mosq_test.gen_puback(11)
+
+    publish1_queued_packet = mosq_test.gen_publish("background/test", qos=1, mid=1, payload="before")
+    puback1_queued_packet = mosq_test.gen_puback(1)
+    publish2_queued_packet = mosq_test.gen_publish("background/test", qos=1, mid=2, payload="after")
+    puback2_queued_packet = mosq_test.gen_puback(2)
+
+    remove_db(port)
+
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+    try:
+        sock = mosq_test.do_client_connect(sub_connect_packet, connack_packet, timeout=20, port=port)
+        mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback")
+        sock.close()
+
+        pub_sock = mosq_test.do_client_connect(pub_connect_packet, connack_packet, timeout=20, port=port)
+        mosq_test.do_send_receive(pub_sock, publish1_packet, puback1_packet, "puback1")
+
+        # Save in the background, and wait for the file to appear
+        broker.send_signal(signal.SIGUSR1)
+        wait_for_db(port)
+        mosq_test.do_ping(pub_sock)
+
+        if journal:
+            # Only the journal knows about this one
+            mosq_test.do_send_receive(pub_sock, publish2_packet, puback2_packet, "puback2")
+            mosq_test.do_ping(pub_sock)
+        pub_sock.close()
+
+        broker.kill()
+        broker.wait()
+        broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+        sock = mosq_test.do_client_connect(sub_connect_packet, connack_packet2, timeout=20, port=port)
+        mosq_test.expect_packet(sock, "publish1", publish1_queued_packet)
+        sock.send(puback1_queued_packet)
+        if journal:
+            mosq_test.expect_packet(sock, "publish2", publish2_queued_packet)
+            sock.send(puback2_queued_packet)
+        mosq_test.do_ping(sock)
+        sock.close()
+
+        rc = 0
+    except mosq_test.TestError:
+        pass
+    finally:
+        os.remove(conf_file)
+        broker.terminate()
+        broker.wait()
+        (stdo, stde) = broker.communicate()
+        remove_db(port)
+        if rc:
+            print(stde.decode('utf-8'))
+            print("journal=%s" % (journal))
+            exit(rc)
+
+
+do_test(journal=False)
+do_test(journal=True)
+exit(0)
@@ -0,0 +1,120 @@
+#!/usr/bin/env python3
+
+# Test whether changes recorded in the persistence journal survive the broker
+# being killed before it has had a chance to save its database.
+
+from mosq_test_helper import *
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("port %d\n" % (port))
+        f.write("allow_anonymous true\n")
+        f.write("persistence true\n")
+        f.write("persistence_file mosquitto-%d.db\n" % (port))
+        f.write("persistence_journal true\n")
+        f.write("autosave_interval 3600\n")
+
+def remove_db(port):
+    for f in ['mosquitto-%d.db' % (port), 'mosquitto-%d.db.journal' % (port)]:
+        if os.path.exists(f):
+            os.unlink(f)
+
+def do_test(proto_ver):
+    port = mosq_test.get_port()
+    conf_file = os.path.basename(__file__).replace('.py', '.conf')
+    write_config(conf_file, port)
+
+    rc = 1
+    keepalive = 60
+    sub_connect_packet = mosq_test.gen_connect("journal-sub", keepalive=keepalive, clean_session=False, proto_ver=proto_ver, session_expiry=60)
+    connack_packet = mosq_test.gen_connack(rc=0, proto_ver=proto_ver)
+    connack_packet2 = mosq_test.gen_connack(rc=0, flags=1, proto_ver=proto_ver)  # session present
+
+    pub_connect_packet = mosq_test.gen_connect("journal-pub", keepalive=keepalive, proto_ver=proto_ver)
+
+    subscribe1_packet = mosq_test.gen_subscribe(1, "journal/qos1", 1, proto_ver=proto_ver)
+    suback1_packet = mosq_test.gen_suback(1, 1, proto_ver=proto_ver)
+    subscribe2_packet = mosq_test.gen_subscribe(2, "journal/gone", 1, proto_ver=proto_ver)
+    suback2_packet = mosq_test.gen_suback(2, 1, proto_ver=proto_ver)
+    unsubscribe_packet = mosq_test.gen_unsubscribe(3, "journal/gone", proto_ver=proto_ver)
+    unsuback_packet = mosq_test.gen_unsuback(3, proto_ver=proto_ver)
+    subscribe3_packet = mosq_test.gen_subscribe(4, "journal/retained", 0, proto_ver=proto_ver)
+    suback3_packet = mosq_test.gen_suback(4, 0, proto_ver=proto_ver)
+
+    retained_packet = mosq_test.gen_publish("journal/retained", qos=0, retain=True, payload="retained", proto_ver=proto_ver)
+    publish1_packet = mosq_test.gen_publish("journal/qos1", qos=1, mid=10, payload="queued", proto_ver=proto_ver)
+    puback1_packet = mosq_test.gen_puback(10, proto_ver=proto_ver)
+    publish2_packet = mosq_test.gen_publish("journal/gone", qos=1, mid=11, payload="gone", proto_ver=proto_ver)
+    if proto_ver == 5:
+        # Nobody is subscribed any more
+        puback2_packet = mosq_test.gen_puback(11, proto_ver=proto_ver, reason_code=mqtt5_rc.MQTT_RC_NO_MATCHING_SUBSCRIBERS)
+    else:
+        puback2_packet = mosq_test.gen_puback(11, proto_ver=proto_ver)
+
+    publish1_queued_packet = mosq_test.gen_publish("journal/qos1", qos=1, mid=1, payload="queued", proto_ver=proto_ver)
+    puback1_queued_packet = mosq_test.gen_puback(1, proto_ver=proto_ver)
+
+    remove_db(port)
+
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+    try:
+        sock = mosq_test.do_client_connect(sub_connect_packet, connack_packet, timeout=20, port=port)
+        mosq_test.do_send_receive(sock, subscribe1_packet, suback1_packet, "suback1")
+        mosq_test.do_send_receive(sock, subscribe2_packet, suback2_packet, "suback2")
+        mosq_test.do_send_receive(sock, unsubscribe_packet, unsuback_packet, "unsuback")
+        sock.close()
+
+        pub_sock = mosq_test.do_client_connect(pub_connect_packet, connack_packet, timeout=20, port=port)
+        pub_sock.send(retained_packet)
+        mosq_test.do_send_receive(pub_sock, publish1_packet, puback1_packet, "puback1")
+        mosq_test.do_send_receive(pub_sock, publish2_packet, puback2_packet, "puback2")
+        # Make sure the broker has been around its loop since the publishes
+        mosq_test.do_ping(pub_sock)
+        pub_sock.close()
+
+        # No chance to save anything
+        broker.kill()
+        broker.wait()
+        broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+        # The session, the queued message and the retained message must all
+        # have been restored, but not the removed subscription.
+        sock = mosq_test.do_client_connect(sub_connect_packet, connack_packet2, timeout=20, port=port)
+        mosq_test.expect_packet(sock, "publish1", publish1_queued_packet)
+        sock.send(puback1_queued_packet)
+        mosq_test.do_ping(sock)
+
+        pub_sock = mosq_test.do_client_connect(pub_connect_packet, connack_packet, timeout=20, port=port)
+        mosq_test.do_send_receive(pub_sock, subscribe3_packet, suback3_packet, "suback3")
+        mosq_test.expect_packet(pub_sock, "retained", retained_packet)
+        pub_sock.close()
+        sock.close()
+
+        broker.kill()
+        broker.wait()
+        broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+        # The acknowledged message must not be delivered again
+        sock = mosq_test.do_client_connect(sub_connect_packet, connack_packet2, timeout=20, port=port)
+        mosq_test.do_ping(sock)
+        sock.close()
+
+        rc = 0
+    except mosq_test.TestError:
+        pass
+    finally:
+        os.remove(conf_file)
+        broker.terminate()
+        broker.wait()
+        (stdo, stde) = broker.communicate()
+        remove_db(port)
+        if rc:
+            print(stde.decode('utf-8'))
+            print("proto_ver=%d" % (proto_ver))
+            exit(rc)
+
+
+do_test(proto_ver=4)
+do_test(proto_ver=5)
+exit(0)
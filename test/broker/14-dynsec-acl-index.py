@@ -0,0 +1,157 @@
+#!/usr/bin/env python3
+
+# Test that publishClientSend ACLs give the same results after the client's
+# roles, groups or role ACLs are changed, including role and ACL priorities
+# and a role with many ACLs. modifyRole doesn't disconnect clients, so the
+# change must apply to a client that is already connected.
+
+from mosq_test_helper import *
+import json
+import shutil
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("listener %d\n" % (port))
+        f.write("allow_anonymous false\n")
+        f.write("plugin ../../plugins/dynamic-security/mosquitto_dynamic_security.so\n")
+        f.write("plugin_opt_config_file %d/dynamic-security.json\n" % (port))
+
+def command_check(sock, command_payload, expected_response):
+    command_packet = mosq_test.gen_publish(topic="$CONTROL/dynamic-security/v1", qos=0, payload=json.dumps(command_payload))
+    sock.send(command_packet)
+    response = json.loads(mosq_test.read_publish(sock))
+    if response != expected_response:
+        print("Expected: %s" % (expected_response))
+        print("Received: %s" % (response))
+        raise ValueError(response)
+
+def commands(*args):
+    return ({"commands": [c for c in args]}, {"responses": [{"command": c["command"]} for c in args]})
+
+def publish_check(sock, topic, allowed):
+    mid = 1
+    publish_packet = mosq_test.gen_publish(topic, mid=mid, qos=1, payload="message", proto_ver=5)
+    if allowed:
+        puback_packet = mosq_test.gen_puback(mid, proto_ver=5, reason_code=mqtt5_rc.MQTT_RC_NO_MATCHING_SUBSCRIBERS)
+    else:
+        puback_packet = mosq_test.gen_puback(mid, proto_ver=5, reason_code=mqtt5_rc.MQTT_RC_NOT_AUTHORIZED)
+    mosq_test.do_send_receive(sock, publish_packet, puback_packet, "puback %s" % (topic))
+
+def connect_user(port):
+    connect_packet = mosq_test.gen_connect("cid", username="user_one", password="password", proto_ver=5)
+    connack_packet = mosq_test.gen_connack(rc=0, proto_ver=5)
+    return mosq_test.do_client_connect(connect_packet, connack_packet, timeout=5, port=port)
+
+def publish_checks(port, checks):
+    sock = connect_user(port)
+    for topic, allowed in checks:
+        publish_check(sock, topic, allowed)
+    sock.close()
+
+
+port = mosq_test.get_port()
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+write_config(conf_file, port)
+
+many_acls = [{"acltype": "publishClientSend", "topic": "many/%d" % (i), "allow": True} for i in range(0, 200)]
+
+setup_command = commands(
+    { "command": "createClient", "username": "user_one", "password": "password" },
+    { "command": "createRole", "rolename": "low", "acls": [
+        { "acltype": "publishClientSend", "topic": "index/#", "allow": True }] },
+    { "command": "createRole", "rolename": "high", "acls": [
+        { "acltype": "publishClientSend", "topic": "index/+/allow", "allow": True, "priority": 1 },
+        { "acltype": "publishClientSend", "topic": "index/+/+", "allow": False }] },
+    { "command": "createRole", "rolename": "many", "acls": many_acls },
+    { "command": "createRole", "rolename": "grouprole", "acls": [
+        { "acltype": "publishClientSend", "topic": "group/#", "allow": True }] },
+    { "command": "createGroup", "groupname": "mygroup" },
+    { "command": "addGroupRole", "groupname": "mygroup", "rolename": "grouprole" },
+    { "command": "addClientRole", "username": "user_one", "rolename": "low", "priority": 1 },
+    { "command": "addClientRole", "username": "user_one", "rolename": "high", "priority": 10 },
+    { "command": "addClientRole", "username": "user_one", "rolename": "many" })
+
+add_group_client_command = commands({ "command": "addGroupClient", "groupname": "mygroup", "username": "user_one" })
+remove_client_role_command = commands({ "command": "removeClientRole", "username": "user_one", "rolename": "high" })
+remove_group_role_command = commands({ "command": "removeGroupRole", "groupname": "mygroup", "rolename": "grouprole" })
+add_role_acl_command = commands({ "command": "addRoleACL", "rolename": "many", "acltype": "publishClientSend", "topic": "many/200", "allow": True })
+remove_role_acl_command = commands({ "command": "removeRoleACL", "rolename": "many", "acltype": "publishClientSend", "topic": "many/0" })
+modify_role_command = commands({ "command": "modifyRole", "rolename": "low", "acls": [
+    { "acltype": "publishClientSend", "topic": "index/#", "allow": False }] })
+
+rc = 1
+keepalive = 10
+connect_packet_admin = mosq_test.gen_connect("ctrl-test", keepalive=keepalive, username="admin", password="admin")
+connack_packet_admin = mosq_test.gen_connack(rc=0)
+
+mid = 2
+subscribe_packet_admin = mosq_test.gen_subscribe(mid, "$CONTROL/dynamic-security/#", 1)
+suback_packet_admin = mosq_test.gen_suback(mid, 1)
+
+try:
+    os.mkdir(str(port))
+    shutil.copyfile("dynamic-security-init.json", "%d/dynamic-security.json" % (port))
+except FileExistsError:
+    pass
+
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+try:
+    sock = mosq_test.do_client_connect(connect_packet_admin, connack_packet_admin, timeout=5, port=port)
+    mosq_test.do_send_receive(sock, subscribe_packet_admin, suback_packet_admin, "admin suback")
+
+    command_check(sock, *setup_command)
+
+    # The higher priority role wins, and within it the higher priority ACL
+    publish_checks(port, [
+        ("index/a/allow", True),
+        ("index/a/deny", False),
+        ("index/a", True),
+        ("index/a/b/c", True),
+        ("group/a", False),
+        ("many/0", True),
+        ("many/199", True),
+        ("many/200", False),
+        ("other", False)])
+
+    command_check(sock, *add_group_client_command)
+    publish_checks(port, [("group/a", True), ("index/a/deny", False)])
+
+    command_check(sock, *remove_client_role_command)
+    publish_checks(port, [("index/a/deny", True), ("index/a/allow", True)])
+
+    command_check(sock, *add_role_acl_command)
+    command_check(sock, *remove_role_acl_command)
+    publish_checks(port, [("many/0", False), ("many/200", True), ("many/100", True)])
+
+    command_check(sock, *remove_group_role_command)
+    publish_checks(port, [("group/a", False)])
+
+    # modifyRole applies to a client that is still connected
+    csock = connect_user(port)
+    publish_check(csock, "index/a/deny", True)
+    command_check(sock, *modify_role_command)
+    publish_check(csock, "index/a/deny", False)
+    publish_check(csock, "many/100", True)
+    csock.close()
+
+    rc = 0
+
+    sock.close()
+except mosq_test.TestError:
+    pass
+finally:
+    os.remove(conf_file)
+    try:
+        os.remove(f"{port}/dynamic-security.json")
+    except FileNotFoundError:
+        pass
+    os.rmdir(f"{port}")
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    if rc:
+        print(stde.decode('utf-8'))
+
+
+exit(rc)
@@ -0,0 +1,147 @@
+#!/usr/bin/env python3
+
+# Check that with plugin_opt_save_interval set, changes made by several
+# control messages are written to the config file together once the interval
+# has passed, that changes still pending are written when the broker stops, and
+# that an invalid save_interval is rejected.
+
+from mosq_test_helper import *
+import json
+import shutil
+
+save_interval = 2
+
+def write_config(filename, port, interval):
+    with open(filename, 'w') as f:
+        f.write("listener %d\n" % (port))
+        f.write("allow_anonymous true\n")
+        f.write("plugin ../../plugins/dynamic-security/mosquitto_dynamic_security.so\n")
+        f.write("plugin_opt_config_file %d/dynamic-security.json\n" % (port))
+        f.write("plugin_opt_save_interval %s\n" % (interval))
+
+def command_check(sock, command_payload, expected_response):
+    command_packet = mosq_test.gen_publish(topic="$CONTROL/dynamic-security/v1", qos=0, payload=json.dumps(command_payload))
+    sock.send(command_packet)
+    response = json.loads(mosq_test.read_publish(sock))
+    if response != expected_response:
+        print("Expected: %s" % (expected_response))
+        print("Received: %s" % (response))
+        raise ValueError(response)
+
+def config_stat(port):
+    st = os.stat(f"{port}/dynamic-security.json")
+    return (st.st_ino, st.st_mtime_ns, st.st_size)
+
+def config_clients(port):
+    with open(f"{port}/dynamic-security.json", 'r') as f:
+        config = json.load(f)
+    return sorted([c["username"] for c in config["clients"]])
+
+def add_client_command(username, correlation_data):
+    return {"commands": [{
+        "command": "createClient", "username": username,
+        "password": "password", "correlationData": correlation_data }]}
+
+def add_client_response(correlation_data):
+    return {'responses': [{'command': 'createClient', 'correlationData': correlation_data}]}
+
+
+port = mosq_test.get_port()
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+
+rc = 1
+keepalive = 10
+connect_packet = mosq_test.gen_connect("ctrl-test", keepalive=keepalive, username="admin", password="admin")
+connack_packet = mosq_test.gen_connack(rc=0)
+
+mid = 2
+subscribe_packet = mosq_test.gen_subscribe(mid, "$CONTROL/dynamic-security/#", 1)
+suback_packet = mosq_test.gen_suback(mid, 1)
+
+try:
+    os.mkdir(str(port))
+    shutil.copyfile("dynamic-security-init.json", "%d/dynamic-security.json" % (port))
+except FileExistsError:
+    pass
+
+broker = None
+stde = None
+try:
+    # An invalid interval must stop the broker from starting
+    for interval in ["2x", "x", "-1", "99999999999"]:
+        write_config(conf_file, port, interval)
+        broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port, expect_fail=True)
+        if broker.poll() is None:
+            print("Broker started with save_interval '%s'" % (interval))
+            raise mosq_test.TestError
+        (stdo, stde) = broker.communicate()
+    broker = None
+
+    write_config(conf_file, port, save_interval)
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+    initial_stat = config_stat(port)
+    initial_clients = config_clients(port)
+
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=5, port=port)
+    mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback")
+
+    # Several separate control messages, none of which should cause a write yet
+    command_check(sock, add_client_command("user_one", "1"), add_client_response("1"))
+    command_check(sock, add_client_command("user_two", "2"), add_client_response("2"))
+    command_check(sock, add_client_command("user_three", "3"), add_client_response("3"))
+    if config_stat(port) != initial_stat:
+        print("Config written before save_interval had passed")
+        raise mosq_test.TestError
+
+    # All of the changes are written together once the interval has passed
+    time.sleep(save_interval + 2)
+    saved_stat = config_stat(port)
+    if saved_stat == initial_stat:
+        print("Config not written after save_interval")
+        raise mosq_test.TestError
+    if config_clients(port) != sorted(initial_clients + ["user_one", "user_two", "user_three"]):
+        print("Saved config missing clients: %s" % (config_clients(port)))
+        raise mosq_test.TestError
+
+    # With nothing changed, the config is not written again
+    time.sleep(save_interval + 1)
+    if config_stat(port) != saved_stat:
+        print("Config written again with no changes")
+        raise mosq_test.TestError
+
+    # A change still pending when the broker stops is not lost
+    command_check(sock, add_client_command("user_four", "4"), add_client_response("4"))
+    if config_stat(port) != saved_stat:
+        print("Config written before save_interval had passed")
+        raise mosq_test.TestError
+    sock.close()
+
+    broker.terminate()
+    broker.wait(5)
+    (stdo, stde) = broker.communicate()
+    broker = None
+
+    if "user_four" not in config_clients(port):
+        print("Pending change not written at shutdown")
+        raise mosq_test.TestError
+
+    rc = 0
+except mosq_test.TestError:
+    pass
+finally:
+    os.remove(conf_file)
+    try:
+        os.remove(f"{port}/dynamic-security.json")
+    except FileNotFoundError:
+        pass
+    os.rmdir(f"{port}")
+    if broker is not None:
+        broker.terminate()
+        broker.wait()
+        (stdo, stde) = broker.communicate()
+    if rc and stde:
+        print(stde.decode('utf-8'))
+
+
+exit(rc)
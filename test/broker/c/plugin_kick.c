@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mosquitto.h>
+#include <mosquitto_broker.h>
+#include <mosquitto_plugin.h>
+
+static int handle_publish(int event, void *event_data, void *user_data);
+static int handle_tick(int event, void *event_data, void *user_data);
+
+static mosquitto_plugin_id_t *plg_id;
+static int kick_pending = 0;
+
+
+int mosquitto_plugin_version(int supported_version_count, const int *supported_versions)
+{
+	return 5;
+}
+
+int mosquitto_plugin_init(mosquitto_plugin_id_t *identifier, void **user_data, struct mosquitto_opt *auth_opts, int auth_opt_count)
+{
+	plg_id = identifier;
+
+	mosquitto_callback_register(plg_id, MOSQ_EVT_MESSAGE, handle_publish, NULL, NULL);
+	mosquitto_callback_register(plg_id, MOSQ_EVT_TICK, handle_tick, NULL, NULL);
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_plugin_cleanup(void *user_data, struct mosquitto_opt *auth_opts, int auth_opt_count)
+{
+	mosquitto_callback_unregister(plg_id, MOSQ_EVT_MESSAGE, handle_publish, NULL);
+	mosquitto_callback_unregister(plg_id, MOSQ_EVT_TICK, handle_tick, NULL);
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Kick everybody once the publish has been dealt with. */
+int handle_publish(int event, void *event_data, void *user_data)
+{
+	struct mosquitto_evt_message *ed = event_data;
+
+	if(!strcmp(ed->topic, "kick/clientid")){
+		kick_pending = 1;
+	}else if(!strcmp(ed->topic, "kick/username")){
+		kick_pending = 2;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+int handle_tick(int event, void *event_data, void *user_data)
+{
+	if(kick_pending == 1){
+		mosquitto_kick_client_by_clientid(NULL, false);
+	}else if(kick_pending == 2){
+		mosquitto_kick_client_by_username(NULL, false);
+	}
+	kick_pending = 0;
+	return MOSQ_ERR_SUCCESS;
+}
@@ -9,8 +9,10 @@ tests = [
     (1, './01-connect-575314.py'),
     (1, './01-connect-allow-anonymous.py'),
     (1, './01-connect-disconnect-v5.py'),
+    (1, './01-connect-keepalive-idle.py'),
     (1, './01-connect-max-connections.py'),
     (1, './01-connect-max-keepalive.py'),
+    (1, './01-connect-reuse-port.py'),
     (1, './01-connect-take-over.py'),
     (1, './01-connect-uname-no-password-denied.py'),
     (1, './01-connect-uname-or-anon.py'),
@@ -21,6 +23,7 @@ tests = [
 
     (1, './02-shared-qos0-v5.py'),
     (1, './02-subhier-crash.py'),
+    (1, './02-subpub-io-threads.py'),
     (1, './02-subpub-qos0-long-topic.py'),
     (1, './02-subpub-qos0-oversize-payload.py'),
     (1, './02-subpub-qos0-queued-bytes.py'),
@@ -34,6 +37,7 @@ tests = [
     (1, './02-subpub-qos1-message-expiry.py'),
     (1, './02-subpub-qos1-nolocal.py'),
     (1, './02-subpub-qos1-oversize-payload.py'),
+    (1, './02-subpub-qos1-overlapping.py'),
     (1, './02-subpub-qos1.py'),
     (1, './02-subpub-qos2-1322.py'),
     (1, './02-subpub-qos2-max-inflight-bytes.py'),
@@ -42,6 +46,7 @@ tests = [
     (1, './02-subpub-qos2-receive-maximum-2.py'),
     (1, './02-subpub-qos2.py'),
     (1, './02-subpub-recover-subscriptions.py'),
+    (2, './02-subpub-websockets.py'),
     (1, './02-subscribe-dollar-v5.py'),
     (1, './02-subscribe-invalid-utf8.py'),
     (1, './02-subscribe-long-topic.py'),
@@ -51,8 +56,11 @@ tests = [
     (1, './03-pattern-matching.py'),
     (1, './03-publish-b2c-disconnect-qos1.py'),
     (1, './03-publish-b2c-disconnect-qos2.py'),
+    (1, './03-publish-b2c-large-payload.py'),
     (1, './03-publish-b2c-qos1-len.py'),
     (1, './03-publish-b2c-qos2-len.py'),
+    (1, './03-publish-b2c-queued-writes.py'),
+    (1, './03-publish-c2b-coalesced.py'),
     (1, './03-publish-c2b-disconnect-qos2.py'),
     (1, './03-publish-c2b-qos2-len.py'),
     (1, './03-publish-dollar-v5.py'),
@@ -71,6 +79,9 @@ tests = [
     (1, './04-retain-check-source-persist.py'),
     (1, './04-retain-check-source.py'),
 	(1, './04-retain-clear-multiple.py'),
+    (1, './04-retain-expiry-many.py'),
+    (1, './04-retain-paced-delivery-unsubscribe.py'),
+    (1, './04-retain-paced-delivery.py'),
     (1, './04-retain-qos0-clear.py'),
     (1, './04-retain-qos0-fresh.py'),
     (1, './04-retain-qos0-repeated.py'),
@@ -133,13 +144,20 @@ tests = [
     (2, './08-ssl-connect-no-auth-wrong-ca.py'),
     (2, './08-ssl-connect-no-auth.py'),
     (2, './08-ssl-connect-no-identity.py'),
+    (2, './08-ssl-handshake-threads-kick.py'),
+    (2, './08-ssl-handshake-threads.py'),
     (1, './08-ssl-hup-disconnect.py'),
+    (2, './08-ssl-ktls.py'),
+    (2, './08-ssl-session-resumption.py'),
     (2, './08-tls-psk-pub.py'),
     (3, './08-tls-psk-bridge.py'),
 
     (1, './09-acl-access-variants.py'),
+    (1, './09-acl-cache.py'),
     (1, './09-acl-change.py'),
     (1, './09-acl-empty-file.py'),
+    (1, './09-acl-subscribe-verdict.py'),
+    (1, './09-acl-wildcards.py'),
     (1, './09-auth-bad-method.py'),
     (1, './09-extended-auth-change-username.py'),
     (1, './09-extended-auth-multistep-reauth.py'),
@@ -165,6 +183,9 @@ tests = [
     (2, './10-listener-mount-point.py'),
 
     (1, './11-message-expiry.py'),
+    (1, './11-persistent-background-disconnect.py'),
+    (1, './11-persistent-background.py'),
+    (1, './11-persistent-journal.py'),
     (1, './11-persistent-subscription.py'),
     (1, './11-persistent-subscription-v5.py'),
     (1, './11-persistent-subscription-no-local.py'),
@@ -185,6 +206,7 @@ tests = [
     (1, './13-malformed-subscribe-v5.py'),
     (1, './13-malformed-unsubscribe-v5.py'),
 
+    (1, './14-dynsec-acl-index.py'),
     (1, './14-dynsec-acl.py'),
     (1, './14-dynsec-anon-group.py'),
     (1, './14-dynsec-auth.py'),
@@ -200,6 +222,7 @@ tests = [
     (1, './14-dynsec-plugin-invalid.py'),
     (1, './14-dynsec-role.py'),
     (1, './14-dynsec-role-invalid.py'),
+    (1, './14-dynsec-save-interval.py'),
     ]
 
 ptest.run_tests(tests)
@@ -1,4 +1,6 @@
+import base64
 import errno
+import hashlib
 import os
 import socket
 import subprocess
@@ -175,6 +177,125 @@ def do_client_connect(connect_packet, connack_packet, hostname="localhost", port
     return do_send_receive(sock, connect_packet, connack_packet, connack_error)
 
 
+# A minimal websockets client, that carries MQTT in binary frames and can be
+# used in place of a socket with the functions above.
+class WebsocketSocket:
+    def __init__(self, sock):
+        self.sock = sock
+        self.buf = b''
+
+    def settimeout(self, timeout):
+        self.sock.settimeout(timeout)
+
+    def close(self):
+        self.sock.close()
+
+    def send(self, data):
+        length = len(data)
+        if length < 126:
+            header = struct.pack("!BB", 0x82, 0x80 | length)
+        elif length < 65536:
+            header = struct.pack("!BBH", 0x82, 0x80 | 126, length)
+        else:
+            header = struct.pack("!BBQ", 0x82, 0x80 | 127, length)
+        mask = os.urandom(4)
+        masked = bytes(b ^ mask[i % 4] for i, b in enumerate(data))
+        self.sock.sendall(header + mask + masked)
+        return length
+
+    def _recv_exact(self, count):
+        data = b''
+        while len(data) < count:
+            r = self.sock.recv(count - len(data))
+            if len(r) == 0:
+                return None
+            data += r
+        return data
+
+    # Returns the payload of the next data frame, or None once the connection
+    # is closed.
+    def _recv_frame(self):
+        while True:
+            header = self._recv_exact(2)
+            if header is None:
+                return None
+            opcode = header[0] & 0x0F
+            length = header[1] & 0x7F
+            if length == 126:
+                length = struct.unpack("!H", self._recv_exact(2))[0]
+            elif length == 127:
+                length = struct.unpack("!Q", self._recv_exact(8))[0]
+            if header[1] & 0x80:
+                mask = self._recv_exact(4)
+            else:
+                mask = None
+            payload = self._recv_exact(length)
+            if payload is None:
+                return None
+            if mask is not None:
+                payload = bytes(b ^ mask[i % 4] for i, b in enumerate(payload))
+
+            if opcode == 0x8:
+                return None
+            elif opcode == 0x9:
+                # Ping, answer with a masked pong
+                self.sock.sendall(struct.pack("!BB", 0x8A, 0x80 | len(payload)) + b'\0\0\0\0' + payload)
+            elif opcode in (0x0, 0x1, 0x2):
+                return payload
+
+    def recv(self, count):
+        while len(self.buf) < count:
+            payload = self._recv_frame()
+            if payload is None:
+                break
+            self.buf += payload
+        data = self.buf[:count]
+        self.buf = self.buf[count:]
+        return data
+
+
+def client_connect_only_ws(hostname="localhost", port=1888, timeout=10, path="/mqtt", protocol="mqtt"):
+    sock = client_connect_only(hostname, port, timeout)
+    key = base64.b64encode(os.urandom(16)).decode('utf-8')
+    request = "GET %s HTTP/1.1\r\n" % (path) \
+        + "Host: %s:%d\r\n" % (hostname, port) \
+        + "Upgrade: websocket\r\n" \
+        + "Connection: Upgrade\r\n" \
+        + "Sec-WebSocket-Key: %s\r\n" % (key) \
+        + "Sec-WebSocket-Protocol: %s\r\n" % (protocol) \
+        + "Sec-WebSocket-Version: 13\r\n\r\n"
+    sock.sendall(request.encode('utf-8'))
+
+    # Read a byte at a time, so nothing after the headers is consumed
+    response = b''
+    while not response.endswith(b'\r\n\r\n'):
+        r = sock.recv(1)
+        if len(r) == 0:
+            sock.close()
+            raise TestError("websockets handshake failed")
+        response += r
+
+    lines = response.decode('utf-8').split('\r\n')
+    headers = {}
+    for line in lines[1:]:
+        if ':' in line:
+            (name, value) = line.split(':', 1)
+            headers[name.strip().lower()] = value.strip()
+    accept = base64.b64encode(hashlib.sha1((key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11").encode('utf-8')).digest()).decode('utf-8')
+    if lines[0].split(' ')[1] != '101' or headers.get('sec-websocket-accept') != accept:
+        print("FAIL: websockets handshake failed: %s" % (lines[0]))
+        sock.close()
+        raise TestError("websockets handshake failed")
+
+    return WebsocketSocket(sock)
+
+
+def do_client_connect_ws(connect_packet, connack_packet, hostname="localhost", port=1888, timeout=10, connack_error="connack"):
+    sock = client_connect_only_ws(hostname, port, timeout)
+
+    return do_send_receive(sock, connect_packet, connack_packet, connack_error)
+
+
 def remaining_length(packet):
     l = min(5, len(packet))
     all_bytes = struct.unpack("!"+"B"*l, packet[:l])
@@ -29,11 +29,23 @@ int log__printf(struct mosquitto *mosq, unsigned int priority, const char *fmt,
 	return 0;
 }
 
+const char *mosquitto_strerror(int mosq_errno)
+{
+	UNUSED(mosq_errno);
+
+	return "error";
+}
+
 time_t mosquitto_time(void)
 {
 	return 123;
 }
 
+uint64_t mosquitto_time_ms(void)
+{
+	return 123000;
+}
+
 int net__socket_close(struct mosquitto *mosq)
 {
 	UNUSED(mosq);
@@ -68,6 +80,16 @@ int acl__find_acls(struct mosquitto *context)
 	return MOSQ_ERR_SUCCESS;
 }
 
+void acl__free_acls(struct mosquitto *context)
+{
+	UNUSED(context);
+}
+
+void acl__cache_flush(struct mosquitto *context)
+{
+	UNUSED(context);
+}
+
 
 int send__publish(struct mosquitto *mosq, uint16_t mid, const char *topic, uint32_t payloadlen, const void *payload, uint8_t qos, bool retain, bool dup, const mosquitto_property *cmsg_props, const mosquitto_property *store_props, uint32_t expiry_interval)
 {
@@ -86,6 +108,20 @@ int send__publish(struct mosquitto *mosq, uint16_t mid, const char *topic, uint3
 	return MOSQ_ERR_SUCCESS;
 }
 
+int send__publish_store(struct mosquitto *mosq, uint16_t mid, struct mosquitto_msg_store *stored, uint8_t qos, bool retain, bool dup, const mosquitto_property *cmsg_props, uint32_t expiry_interval)
+{
+	UNUSED(mosq);
+	UNUSED(mid);
+	UNUSED(stored);
+	UNUSED(qos);
+	UNUSED(retain);
+	UNUSED(dup);
+	UNUSED(cmsg_props);
+	UNUSED(expiry_interval);
+
+	return MOSQ_ERR_SUCCESS;
+}
+
 int send__pubcomp(struct mosquitto *mosq, uint16_t mid, const mosquitto_property *properties)
 {
 	UNUSED(mosq);
@@ -128,3 +164,35 @@ int session_expiry__add_from_persistence(struct mosquitto *context, time_t expir
 	UNUSED(expiry_time);
 	return 0;
 }
+
+void session_expiry__remove(struct mosquitto *context)
+{
+	UNUSED(context);
+}
+
+void context__add_to_disused(struct mosquitto *context)
+{
+	UNUSED(context);
+}
+
+void timers__add(struct mosquitto__timer *timer, time_t expiry)
+{
+	UNUSED(timer);
+	UNUSED(expiry);
+}
+
+void timers__remove(struct mosquitto__timer *timer)
+{
+	UNUSED(timer);
+}
+
+void loop__update_next_event(time_t new_ms)
+{
+	UNUSED(new_ms);
+}
+
+void do_disconnect(struct mosquitto *context, int reason)
+{
+	UNUSED(context);
+	UNUSED(reason);
+}
@@ -13,15 +13,13 @@
 #include "memory_mosq.h"
 
 struct mosquitto_db db;
+extern int acl_check_count;
 
 static void hier_quick_check(struct mosquitto__subhier **sub, struct mosquitto *context, const char *topic)
 {
 	if(sub != NULL){
 		CU_ASSERT_EQUAL((*sub)->topic_len, strlen(topic));
-		CU_ASSERT_PTR_NOT_NULL((*sub)->topic);
-		if((*sub)->topic){
-			CU_ASSERT_STRING_EQUAL((*sub)->topic, topic);
-		}
+		CU_ASSERT_STRING_EQUAL((*sub)->topic, topic);
 		if(context){
 			CU_ASSERT_PTR_NOT_NULL((*sub)->subs);
 			if((*sub)->subs){
@@ -79,6 +77,226 @@ static void TEST_sub_add_single(void)
 }
 
 
+static void TEST_sub_add_repeat(void)
+{
+	struct mosquitto__config config;
+	struct mosquitto__listener listener;
+	struct mosquitto context1, context2;
+	struct mosquitto__subhier *parent, *sub;
+	struct mosquitto__subleaf *leaf;
+	int rc;
+	int count;
+
+	memset(&db, 0, sizeof(struct mosquitto_db));
+	memset(&config, 0, sizeof(struct mosquitto__config));
+	memset(&listener, 0, sizeof(struct mosquitto__listener));
+	memset(&context1, 0, sizeof(struct mosquitto));
+	memset(&context2, 0, sizeof(struct mosquitto));
+
+	context1.id = "client1";
+	context1.protocol = mosq_p_mqtt5;
+	context2.id = "client2";
+	context2.protocol = mosq_p_mqtt5;
+
+	db.config = &config;
+	listener.port = 1883;
+	config.listeners = &listener;
+	config.listener_count = 1;
+
+	db__open(&config);
+
+	rc = sub__add(&context1, "a/b", 0, 0, 0);
+	CU_ASSERT_EQUAL(rc, MOSQ_ERR_SUCCESS);
+	rc = sub__add(&context2, "a/b", 1, 0, 0);
+	CU_ASSERT_EQUAL(rc, MOSQ_ERR_SUCCESS);
+	/* A subscription to a different filter doesn't count */
+	rc = sub__add(&context1, "a/c", 0, 0, 0);
+	CU_ASSERT_EQUAL(rc, MOSQ_ERR_SUCCESS);
+
+	/* Subscribing again only updates the existing subscription */
+	rc = sub__add(&context1, "a/b", 2, 0, 0);
+	CU_ASSERT_EQUAL(rc, MOSQ_ERR_SUB_EXISTS);
+	CU_ASSERT_EQUAL(context1.sub_count, 2);
+
+	sub = NULL;
+	HASH_FIND(hh, db.normal_subs, "", 0, parent);
+	if(parent){
+		HASH_FIND(hh, parent->children, "", 0, sub);
+	}
+	if(sub){
+		parent = sub;
+		HASH_FIND(hh, parent->children, "a", 1, sub);
+	}
+	if(sub){
+		parent = sub;
+		HASH_FIND(hh, parent->children, "b", 1, sub);
+	}
+	CU_ASSERT_PTR_NOT_NULL(sub);
+	if(sub){
+		count = 0;
+		for(leaf = sub->subs; leaf; leaf = leaf->next){
+			count++;
+			if(leaf->context == &context1){
+				CU_ASSERT_EQUAL(leaf->qos, 2);
+			}else{
+				CU_ASSERT_EQUAL(leaf->qos, 1);
+			}
+		}
+		CU_ASSERT_EQUAL(count, 2);
+	}
+
+	sub__clean_session(&context1);
+	sub__clean_session(&context2);
+	db__close();
+}
+
+
+static int search_count(const char *topic)
+{
+	struct mosquitto_msg_store stored;
+	struct mosquitto_msg_store *stored_ptr = &stored;
+
+	memset(&stored, 0, sizeof(struct mosquitto_msg_store));
+	stored.ref_count = 1;
+	acl_check_count = 0;
+
+	sub__messages_queue("source", topic, 0, 0, &stored_ptr);
+
+	return acl_check_count;
+}
+
+
+static void TEST_sub_search(void)
+{
+	struct mosquitto__config config;
+	struct mosquitto__listener listener;
+	struct mosquitto context[9];
+	const char *ids[9] = {"c0", "c1", "c2", "c3", "c4", "c5", "c6", "c7", "c8"};
+	const char *subs[9] = {"a/b/c", "a/+/c", "a/#", "#", "+/+/+", "a/b", "+", "$SYS/#", "a/b/c/#"};
+	uint8_t reason;
+	int i;
+	int rc;
+
+	memset(&db, 0, sizeof(struct mosquitto_db));
+	memset(&config, 0, sizeof(struct mosquitto__config));
+	memset(&listener, 0, sizeof(struct mosquitto__listener));
+	memset(context, 0, sizeof(context));
+
+	db.config = &config;
+	listener.port = 1883;
+	config.listeners = &listener;
+	config.listener_count = 1;
+
+	db__open(&config);
+
+	for(i=0; i<9; i++){
+		context[i].id = (char *)ids[i];
+		rc = sub__add(&context[i], subs[i], 0, 0, 0);
+		CU_ASSERT_EQUAL(rc, MOSQ_ERR_SUCCESS);
+	}
+
+	CU_ASSERT_EQUAL(search_count("a/b/c"), 6);
+	CU_ASSERT_EQUAL(search_count("a/b"), 3);
+	CU_ASSERT_EQUAL(search_count("a"), 3);
+	CU_ASSERT_EQUAL(search_count("a/"), 2);
+	CU_ASSERT_EQUAL(search_count("/b/c"), 2);
+	CU_ASSERT_EQUAL(search_count("x/y/z/w"), 1);
+	CU_ASSERT_EQUAL(search_count("$SYS/broker/uptime"), 1);
+	CU_ASSERT_EQUAL(search_count("$SYS"), 1);
+
+	/* Removing the wildcard subscriptions must also clear the wildcard
+	 * shortcuts in the tree. */
+	rc = sub__remove(&context[1], "a/+/c", &reason);
+	CU_ASSERT_EQUAL(rc, MOSQ_ERR_SUCCESS);
+	rc = sub__remove(&context[2], "a/#", &reason);
+	CU_ASSERT_EQUAL(rc, MOSQ_ERR_SUCCESS);
+	CU_ASSERT_EQUAL(search_count("a/b/c"), 4);
+	CU_ASSERT_EQUAL(search_count("a/x/c"), 2);
+
+	for(i=0; i<9; i++){
+		mosquitto__free(context[i].subs);
+	}
+	db__close();
+}
+
+
+static void TEST_sub_search_cache(void)
+{
+	struct mosquitto__config config;
+	struct mosquitto__listener listener;
+	struct mosquitto context[4];
+	const char *ids[4] = {"c0", "c1", "c2", "c3"};
+	uint8_t reason;
+	int i;
+	int rc;
+
+	memset(&db, 0, sizeof(struct mosquitto_db));
+	memset(&config, 0, sizeof(struct mosquitto__config));
+	memset(&listener, 0, sizeof(struct mosquitto__listener));
+	memset(context, 0, sizeof(context));
+
+	db.config = &config;
+	listener.port = 1883;
+	config.listeners = &listener;
+	config.listener_count = 1;
+	config.subscription_cache_size = 2;
+
+	db__open(&config);
+
+	for(i=0; i<4; i++){
+		context[i].id = (char *)ids[i];
+	}
+
+	rc = sub__add(&context[0], "a/b", 0, 0, 0);
+	CU_ASSERT_EQUAL(rc, MOSQ_ERR_SUCCESS);
+	CU_ASSERT_EQUAL(search_count("a/b"), 1);
+	CU_ASSERT_EQUAL(search_count("a/b"), 1);
+
+	/* Cached with no subscribers, then a matching filter is added */
+	CU_ASSERT_EQUAL(search_count("x/y"), 0);
+	rc = sub__add(&context[1], "x/+", 0, 0, 0);
+	CU_ASSERT_EQUAL(rc, MOSQ_ERR_SUCCESS);
+	CU_ASSERT_EQUAL(search_count("x/y"), 1);
+	rc = sub__add(&context[1], "+/y", 0, 0, 0);
+	CU_ASSERT_EQUAL(rc, MOSQ_ERR_SUCCESS);
+	CU_ASSERT_EQUAL(search_count("x/y"), 2);
+
+	rc = sub__add(&context[2], "a/#", 0, 0, 0);
+	CU_ASSERT_EQUAL(rc, MOSQ_ERR_SUCCESS);
+	CU_ASSERT_EQUAL(search_count("a/b"), 2);
+
+	/* Subscribing to an existing filter doesn't change the cached nodes */
+	rc = sub__add(&context[3], "a/b", 0, 0, 0);
+	CU_ASSERT_EQUAL(rc, MOSQ_ERR_SUCCESS);
+	CU_ASSERT_EQUAL(search_count("a/b"), 3);
+
+	/* Removing the last subscription removes the node */
+	rc = sub__remove(&context[0], "a/b", &reason);
+	CU_ASSERT_EQUAL(rc, MOSQ_ERR_SUCCESS);
+	CU_ASSERT_EQUAL(search_count("a/b"), 2);
+	sub__clean_session(&context[3]);
+	CU_ASSERT_EQUAL(search_count("a/b"), 1);
+
+	/* Evict entries from the cache */
+	CU_ASSERT_EQUAL(search_count("c"), 0);
+	CU_ASSERT_EQUAL(search_count("d"), 0);
+	CU_ASSERT_EQUAL(search_count("a/b"), 1);
+	CU_ASSERT_EQUAL(search_count("x/y"), 2);
+
+	rc = sub__add(&context[3], "$SYS/#", 0, 0, 0);
+	CU_ASSERT_EQUAL(rc, MOSQ_ERR_SUCCESS);
+	CU_ASSERT_EQUAL(search_count("$SYS/broker"), 1);
+	rc = sub__add(&context[3], "$SYS/broker", 0, 0, 0);
+	CU_ASSERT_EQUAL(rc, MOSQ_ERR_SUCCESS);
+	CU_ASSERT_EQUAL(search_count("$SYS/broker"), 2);
+
+	for(i=0; i<4; i++){
+		mosquitto__free(context[i].subs);
+	}
+	db__close();
+}
+
+
 /* ========================================================================
  * TEST SUITE SETUP
  * ======================================================================== */
@@ -106,6 +324,9 @@ int main(int argc, char *argv[])
 
 	if(0
 			|| !CU_add_test(test_suite, "Sub add single", TEST_sub_add_single)
+			|| !CU_add_test(test_suite, "Sub add repeat", TEST_sub_add_repeat)
+			|| !CU_add_test(test_suite, "Sub search", TEST_sub_search)
+			|| !CU_add_test(test_suite, "Sub search cache", TEST_sub_search_cache)
 			){
 
 		printf("Error adding Subs CUnit tests.\n");
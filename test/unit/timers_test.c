@@ -0,0 +1,274 @@
+/* Tests for the timer wheel used for session expiry, will delay and message
+ * expiry. */
+
+#include <CUnit/CUnit.h>
+#include <CUnit/Basic.h>
+
+#define WITH_BROKER
+
+#include "mosquitto_broker_internal.h"
+
+struct mosquitto_db db;
+
+static time_t last_next_event_ms = -1;
+
+struct test_timer{
+	struct mosquitto__timer timer;
+	time_t fired_at;
+	int fired_count;
+};
+
+
+void loop__update_next_event(time_t new_ms)
+{
+	last_next_event_ms = new_ms;
+}
+
+
+static void timer_cb(struct mosquitto__timer *timer)
+{
+	struct test_timer *t = timer->userdata;
+
+	t->fired_at = db.now_real_s;
+	t->fired_count++;
+}
+
+
+static void timer_setup(struct test_timer *t)
+{
+	memset(t, 0, sizeof(struct test_timer));
+	t->timer.callback = timer_cb;
+	t->timer.userdata = t;
+}
+
+
+/* Move the clock on a second at a time, checking the wheel each time. */
+static void advance(time_t seconds)
+{
+	time_t i;
+
+	for(i=0; i<seconds; i++){
+		db.now_real_s++;
+		timers__check();
+	}
+}
+
+
+static void TEST_single(void)
+{
+	struct test_timer t;
+
+	db.now_real_s = 1000000;
+	timers__init();
+
+	timer_setup(&t);
+	timers__add(&t.timer, db.now_real_s + 5);
+
+	/* Timers fire once the clock has passed the expiry second */
+	advance(5);
+	CU_ASSERT_EQUAL(t.fired_count, 0);
+	advance(1);
+	CU_ASSERT_EQUAL(t.fired_count, 1);
+	CU_ASSERT_EQUAL(t.fired_at, 1000006);
+	CU_ASSERT_PTR_NULL(t.timer.next);
+
+	advance(100);
+	CU_ASSERT_EQUAL(t.fired_count, 1);
+}
+
+
+static void TEST_levels(void)
+{
+	struct test_timer t[6];
+	time_t delays[6] = {0, 1, 63, 64, 4097, 300000};
+	time_t start;
+	int i;
+
+	db.now_real_s = 2000003;
+	timers__init();
+	start = db.now_real_s;
+
+	for(i=0; i<6; i++){
+		timer_setup(&t[i]);
+		timers__add(&t[i].timer, start + delays[i]);
+	}
+
+	advance(300001);
+	for(i=0; i<6; i++){
+		CU_ASSERT_EQUAL(t[i].fired_count, 1);
+		CU_ASSERT_EQUAL(t[i].fired_at, start + delays[i] + 1);
+	}
+}
+
+
+static void TEST_jump(void)
+{
+	struct test_timer t1, t2;
+
+	db.now_real_s = 3000000;
+	timers__init();
+
+	timer_setup(&t1);
+	timer_setup(&t2);
+	timers__add(&t1.timer, db.now_real_s + 10);
+	timers__add(&t2.timer, db.now_real_s + 100000);
+
+	/* The clock jumps forwards, everything that is due fires */
+	db.now_real_s += 1000;
+	timers__check();
+	CU_ASSERT_EQUAL(t1.fired_count, 1);
+	CU_ASSERT_EQUAL(t2.fired_count, 0);
+
+	db.now_real_s += 100000;
+	timers__check();
+	CU_ASSERT_EQUAL(t2.fired_count, 1);
+
+	/* A timer that is already due fires on the next check */
+	timer_setup(&t1);
+	timers__add(&t1.timer, db.now_real_s - 50);
+	CU_ASSERT_EQUAL(t1.fired_count, 0);
+	advance(1);
+	CU_ASSERT_EQUAL(t1.fired_count, 1);
+}
+
+
+static void TEST_remove_readd(void)
+{
+	struct test_timer t1, t2;
+
+	db.now_real_s = 4000000;
+	timers__init();
+
+	timer_setup(&t1);
+	timer_setup(&t2);
+	timers__add(&t1.timer, db.now_real_s + 10);
+	timers__add(&t2.timer, db.now_real_s + 10);
+
+	timers__remove(&t1.timer);
+	CU_ASSERT_PTR_NULL(t1.timer.next);
+	/* Removing twice is harmless */
+	timers__remove(&t1.timer);
+
+	/* Adding again moves the timer */
+	timers__add(&t2.timer, db.now_real_s + 5000);
+
+	advance(11);
+	CU_ASSERT_EQUAL(t1.fired_count, 0);
+	CU_ASSERT_EQUAL(t2.fired_count, 0);
+
+	timers__add(&t2.timer, db.now_real_s + 2);
+	advance(3);
+	CU_ASSERT_EQUAL(t2.fired_count, 1);
+
+	advance(6000);
+	CU_ASSERT_EQUAL(t1.fired_count, 0);
+	CU_ASSERT_EQUAL(t2.fired_count, 1);
+}
+
+
+static void TEST_next_event(void)
+{
+	struct test_timer t;
+
+	db.now_real_s = time(NULL);
+	timers__init();
+
+	last_next_event_ms = -1;
+	timers__update_next_event();
+	CU_ASSERT_EQUAL(last_next_event_ms, -1);
+
+	timer_setup(&t);
+	timers__add(&t.timer, db.now_real_s + 3);
+	timers__update_next_event();
+	CU_ASSERT(last_next_event_ms > 2000);
+	CU_ASSERT(last_next_event_ms <= 4000);
+
+	/* Far away timers only need the wheel checking at the next cascade */
+	timers__add(&t.timer, db.now_real_s + 100000);
+	timers__update_next_event();
+	CU_ASSERT(last_next_event_ms > 0);
+	CU_ASSERT(last_next_event_ms <= 65000);
+
+	timers__remove(&t.timer);
+}
+
+
+/* A timer in level 1 can be due before the first timer in level 0, once it
+ * has been cascaded down. */
+static void TEST_next_event_cascade(void)
+{
+	struct test_timer t1, t2;
+	time_t base, now;
+
+	now = time(NULL);
+	base = now - (now & 63);
+	db.now_real_s = base;
+	timers__init();
+
+	timer_setup(&t1);
+	timer_setup(&t2);
+	timers__add(&t1.timer, base + 70);
+	db.now_real_s = base + 60;
+	timers__check();
+	timers__add(&t2.timer, base + 120);
+
+	timers__update_next_event();
+	now = time(NULL);
+	CU_ASSERT(last_next_event_ms > (base + 63 - now)*1000);
+	CU_ASSERT(last_next_event_ms <= (base + 65 - now)*1000);
+
+	advance(11);
+	CU_ASSERT_EQUAL(t1.fired_count, 1);
+	CU_ASSERT_EQUAL(t1.fired_at, base + 71);
+	CU_ASSERT_EQUAL(t2.fired_count, 0);
+
+	timers__remove(&t2.timer);
+}
+
+
+/* ========================================================================
+ * TEST SUITE SETUP
+ * ======================================================================== */
+
+
+int main(int argc, char *argv[])
+{
+	CU_pSuite test_suite = NULL;
+	unsigned int fails;
+
+	UNUSED(argc);
+	UNUSED(argv);
+
+	if(CU_initialize_registry() != CUE_SUCCESS){
+		printf("Error initializing CUnit registry.\n");
+		return 1;
+	}
+
+	test_suite = CU_add_suite("Timers", NULL, NULL);
+	if(!test_suite){
+		printf("Error adding CUnit Timers test suite.\n");
+		CU_cleanup_registry();
+		return 1;
+	}
+
+	if(0
+			|| !CU_add_test(test_suite, "Single timer", TEST_single)
+			|| !CU_add_test(test_suite, "Wheel levels", TEST_levels)
+			|| !CU_add_test(test_suite, "Clock jump", TEST_jump)
+			|| !CU_add_test(test_suite, "Remove and re-add", TEST_remove_readd)
+			|| !CU_add_test(test_suite, "Next event", TEST_next_event)
+			|| !CU_add_test(test_suite, "Next event before cascade", TEST_next_event_cascade)
+			){
+
+		printf("Error adding Timers CUnit tests.\n");
+		CU_cleanup_registry();
+		return 1;
+	}
+
+	CU_basic_set_mode(CU_BRM_VERBOSE);
+	CU_basic_run_tests();
+	fails = CU_get_number_of_failures();
+	CU_cleanup_registry();
+
+	return (int)fails;
+}